@@ -0,0 +1,392 @@
+/**
+  ******************************************************************************
+  * @file    common/ee_core.h
+  * @brief   Record engine shared by the ports: search of the write cursor,
+  *          lookup of the last record of a variable, read of all the
+  *          variables, copy of the live records of a page to another one and
+  *          end of the committed transactions.
+  *
+  *          The functions are static and compiled into the eeprom.c of each
+  *          port, which includes this file after its private prototypes and
+  *          describes its records first with the EE_CORE_ macros below. They
+  *          expand to constants and plain reads, so each loop is built for
+  *          the record width of its port with no runtime branch:
+  *
+  *          EE_CORE_STATUS, EE_CORE_OK        status type and success code
+  *          EE_CORE_RECORD_TYPE               a whole record, as read
+  *          EE_CORE_VIRTADDRESS_TYPE          virtual address of a variable
+  *          EE_CORE_DATA_TYPE                 data of a variable
+  *          EE_CORE_HEADER_SIZE               bytes of the page header
+  *          EE_CORE_RECORD_SIZE               bytes of a record
+  *          EE_CORE_READ(Address)             record at Address
+  *          EE_CORE_READ_VIRTADDRESS(Address) virtual address of the record
+  *                                            at Address, read alone
+  *          EE_CORE_ERASED(Record)            record is an erased slot
+  *          EE_CORE_VIRTADDRESS(Record)       virtual address of a record
+  *          EE_CORE_DATA(Record)              data of a record
+  *          EE_CORE_VALID(Record)             record passes its check
+  *          EE_CORE_WRITE(VirtAddress, Data)  append a record to the page
+  *                                            receiving data
+  *
+  *          With EE_USE_BLOB the port gives EE_BlobCheck and EE_BlobCopy, with
+  *          EE_USE_SORTED_PAGE the record closing the sorted variables and
+  *          with EE_USE_TRANSACTION the transaction markers.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __EE_CORE_H
+#define __EE_CORE_H
+
+/* Private macro -------------------------------------------------------------*/
+/* Bitmaps of variables and blobs, one bit per item */
+#define EE_CORE_IS_SET(Bitmap, Item) (((Bitmap)[(Item) >> 5] & ((uint32_t)1 << ((Item) & 0x1F))) != 0)
+#define EE_CORE_SET(Bitmap, Item)    ((Bitmap)[(Item) >> 5] |= (uint32_t)1 << ((Item) & 0x1F))
+
+/* Private function prototypes -----------------------------------------------*/
+static uint32_t EE_CoreFindCursor(uint32_t PageAddress, uint32_t EndAddress);
+static uint8_t EE_CoreFindRecord(uint32_t PageAddress, uint32_t EndAddress, EE_CORE_VIRTADDRESS_TYPE VirtAddress,
+                                 EE_CORE_RECORD_TYPE *Record);
+#if defined(EE_USE_SORTED_PAGE) && (EE_USE_SORTED_PAGE == 1)
+static uint8_t EE_CoreSearchSorted(uint32_t First, uint32_t Last, EE_CORE_VIRTADDRESS_TYPE VirtAddress,
+                                   EE_CORE_RECORD_TYPE *Record);
+#endif
+static void EE_CoreReadRecords(uint32_t PageAddress, uint32_t EndAddress, EE_CORE_DATA_TYPE *Image,
+                               uint8_t *PresentBitmap);
+static void EE_CoreMarkRecords(uint32_t PageAddress, uint32_t *Address, uint32_t EndAddress, uint32_t *Budget,
+                               uint32_t *Copied);
+static EE_CORE_STATUS EE_CoreCopyRecords(uint32_t PageAddress, uint32_t *Address, uint32_t *Budget, uint32_t *Copied);
+#if defined(EE_USE_TRANSACTION) && (EE_USE_TRANSACTION == 1)
+static uint32_t EE_CoreTxnCommittedEnd(uint32_t PageAddress, uint32_t EndAddress);
+#endif
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Find the first free slot of a page. A page is only appended to, so
+  *   its erased slots form its tail and a binary search finds the first one.
+  * @param  PageAddress: page address
+  * @param  EndAddress: address right after the last slot of the page
+  * @retval Address of the first erased slot, EndAddress if the page is full
+  */
+static uint32_t EE_CoreFindCursor(uint32_t PageAddress, uint32_t EndAddress)
+{
+  uint32_t first = PageAddress + EE_CORE_HEADER_SIZE;
+  uint32_t last = EndAddress;
+  uint32_t middle;
+
+  /* Slots below first are written, slots from last on are erased */
+  while (first < last)
+  {
+    middle = first + (((last - first) / (2 * EE_CORE_RECORD_SIZE)) * EE_CORE_RECORD_SIZE);
+    if (EE_CORE_ERASED(EE_CORE_READ(middle)))
+    {
+      last = middle;
+    }
+    else
+    {
+      first = middle + EE_CORE_RECORD_SIZE;
+    }
+  }
+
+  return first;
+}
+
+/**
+  * @brief  Find the last valid record of a variable in a page, from the end of
+  *   its records down. With EE_USE_SORTED_PAGE, the variables below the record
+  *   closing the ones a transfer copied in order are searched by bisection.
+  * @param  PageAddress: page address
+  * @param  EndAddress: address right after the last record to look at
+  * @param  VirtAddress: Variable virtual address
+  * @param  Record: record found
+  * @retval 1 if a record was found, 0 otherwise
+  */
+static uint8_t EE_CoreFindRecord(uint32_t PageAddress, uint32_t EndAddress, EE_CORE_VIRTADDRESS_TYPE VirtAddress,
+                                 EE_CORE_RECORD_TYPE *Record)
+{
+  EE_CORE_RECORD_TYPE record;
+  EE_CORE_VIRTADDRESS_TYPE virtaddress;
+  uint32_t first = PageAddress + EE_CORE_HEADER_SIZE;
+  uint32_t address = EndAddress - EE_CORE_RECORD_SIZE;
+#if defined(EE_USE_SORTED_PAGE) && (EE_USE_SORTED_PAGE == 1)
+  uint32_t nbsorted;
+#endif
+
+  for (; address >= first; address -= EE_CORE_RECORD_SIZE)
+  {
+    virtaddress = EE_CORE_READ_VIRTADDRESS(address);
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* An erased slot holds no virtual address in use, a damaged record is
+       passed over for the previous one */
+    if (virtaddress == VirtAddress)
+    {
+      record = EE_CORE_READ(address);
+      if (EE_CORE_VALID(record))
+      {
+        *Record = record;
+        return 1;
+      }
+    }
+#if defined(EE_USE_SORTED_PAGE) && (EE_USE_SORTED_PAGE == 1)
+    /* The records below are the sorted variables, each one once */
+    else if (virtaddress == EE_SORTED_VIRTADDRESS)
+    {
+      record = EE_CORE_READ(address);
+      nbsorted = (uint32_t)EE_CORE_DATA(record);
+      if (EE_CORE_VALID(record) && (nbsorted <= ((address - first) / EE_CORE_RECORD_SIZE)))
+      {
+        return EE_CoreSearchSorted(address - (nbsorted * EE_CORE_RECORD_SIZE), address, VirtAddress, Record);
+      }
+    }
+#endif
+  }
+
+  return 0;
+}
+
+#if defined(EE_USE_SORTED_PAGE) && (EE_USE_SORTED_PAGE == 1)
+/**
+  * @brief  Search by bisection the record of a variable among sorted records.
+  * @param  First: address of the first sorted record
+  * @param  Last: address right after the last sorted record
+  * @param  VirtAddress: Variable virtual address
+  * @param  Record: record found
+  * @retval 1 if a valid record was found, 0 otherwise
+  */
+static uint8_t EE_CoreSearchSorted(uint32_t First, uint32_t Last, EE_CORE_VIRTADDRESS_TYPE VirtAddress,
+                                   EE_CORE_RECORD_TYPE *Record)
+{
+  EE_CORE_RECORD_TYPE record;
+  uint32_t middle;
+
+  while (First < Last)
+  {
+    middle = First + (((Last - First) / (2 * EE_CORE_RECORD_SIZE)) * EE_CORE_RECORD_SIZE);
+    record = EE_CORE_READ(middle);
+    EE_STATS_COUNT(WordsScanned, 1);
+    if (EE_CORE_VIRTADDRESS(record) == VirtAddress)
+    {
+      if (!EE_CORE_VALID(record))
+      {
+        return 0;
+      }
+      *Record = record;
+      return 1;
+    }
+    if (EE_CORE_VIRTADDRESS(record) < VirtAddress)
+    {
+      First = middle + EE_CORE_RECORD_SIZE;
+    }
+    else
+    {
+      Last = middle;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+/**
+  * @brief  Read the records of a page into an image of the variables, from the
+  *   oldest record to the newest one.
+  * @param  PageAddress: page address
+  * @param  EndAddress: address right after the last record to read
+  * @param  Image: RAM image of NB_OF_VAR variables
+  * @param  PresentBitmap: bit n set when variable n is read, or NULL
+  * @retval None
+  */
+static void EE_CoreReadRecords(uint32_t PageAddress, uint32_t EndAddress, EE_CORE_DATA_TYPE *Image,
+                               uint8_t *PresentBitmap)
+{
+  EE_CORE_RECORD_TYPE record;
+  uint32_t address, varidx;
+
+  /* Newer records overwrite older ones in the image */
+  for (address = PageAddress + EE_CORE_HEADER_SIZE; address < EndAddress; address += EE_CORE_RECORD_SIZE)
+  {
+    record = EE_CORE_READ(address);
+    /* Page is written in order: the first erased slot ends the records */
+    if (EE_CORE_ERASED(record))
+    {
+      break;
+    }
+    varidx = (uint32_t)EE_CORE_VIRTADDRESS(record);
+    if ((varidx < NB_OF_VAR) && EE_CORE_VALID(record))
+    {
+      Image[varidx] = EE_CORE_DATA(record);
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[varidx >> 3] |= (uint8_t)(1 << (varidx & 0x07));
+      }
+    }
+  }
+}
+
+/**
+  * @brief  Mark the variables and the blobs a page holds in the bitmap of a
+  *   copy, walking its records from the oldest one on. Blobs follow the
+  *   variables in the bitmap.
+  * @param  PageAddress: page address
+  * @param  Address: record to start from, updated to the next one to examine,
+  *   set to EndAddress once the first erased slot is met
+  * @param  EndAddress: address right after the last record to examine
+  * @param  Budget: number of records that may be examined, decremented, or
+  *   NULL for no limit
+  * @param  Copied: bitmap of the items the page receiving data holds
+  * @retval None
+  */
+static void EE_CoreMarkRecords(uint32_t PageAddress, uint32_t *Address, uint32_t EndAddress, uint32_t *Budget,
+                               uint32_t *Copied)
+{
+  EE_CORE_RECORD_TYPE record;
+  uint32_t varidx;
+#if defined(EE_USE_BLOB) && (EE_USE_BLOB == 1)
+  uint16_t size = 0;
+#else
+  (void)PageAddress;
+#endif
+
+  while ((*Address < EndAddress) && ((Budget == NULL) || (*Budget > 0)))
+  {
+    record = EE_CORE_READ(*Address);
+    /* Page is written in order: the first erased slot ends the records */
+    if (EE_CORE_ERASED(record))
+    {
+      *Address = EndAddress;
+      break;
+    }
+    varidx = (uint32_t)EE_CORE_VIRTADDRESS(record);
+    if ((varidx < NB_OF_VAR) && EE_CORE_VALID(record))
+    {
+      EE_CORE_SET(Copied, varidx);
+    }
+#if defined(EE_USE_BLOB) && (EE_USE_BLOB == 1)
+    else if (EE_IS_BLOB_VIRTADDRESS(varidx) && (EE_BlobCheck(PageAddress, *Address, NULL, 0, &size) != 0))
+    {
+      EE_CORE_SET(Copied, NB_OF_VAR + varidx - EE_BLOB_VIRTADDRESS);
+    }
+#endif
+    *Address += EE_CORE_RECORD_SIZE;
+    if (Budget != NULL)
+    {
+      (*Budget)--;
+    }
+  }
+}
+
+/**
+  * @brief  Copy to the page receiving data the last update of the variables
+  *   and blobs of a page the bitmap does not mark, walking its records from
+  *   the newest one down to the oldest one, and mark them.
+  * @param  PageAddress: page address
+  * @param  Address: record to start from, updated to the next one to examine,
+  *   below the first record of the page once they are all examined
+  * @param  Budget: number of records that may be examined, decremented, or
+  *   NULL for no limit
+  * @param  Copied: bitmap of the items the page receiving data holds
+  * @retval EE_CORE_OK on success, the status of the failed copy otherwise
+  */
+static EE_CORE_STATUS EE_CoreCopyRecords(uint32_t PageAddress, uint32_t *Address, uint32_t *Budget, uint32_t *Copied)
+{
+  EE_CORE_RECORD_TYPE record;
+  EE_CORE_STATUS status;
+  uint32_t varidx;
+#if defined(EE_USE_BLOB) && (EE_USE_BLOB == 1)
+  uint16_t size = 0;
+#endif
+
+  while ((*Address >= (PageAddress + EE_CORE_HEADER_SIZE)) && ((Budget == NULL) || (*Budget > 0)))
+  {
+    record = EE_CORE_READ(*Address);
+    varidx = (uint32_t)EE_CORE_VIRTADDRESS(record);
+    /* Erased slots, addresses out of range and damaged records are skipped */
+    if (!EE_CORE_ERASED(record) && (varidx < NB_OF_VAR) && !EE_CORE_IS_SET(Copied, varidx) && EE_CORE_VALID(record))
+    {
+      status = EE_CORE_WRITE((EE_CORE_VIRTADDRESS_TYPE)varidx, EE_CORE_DATA(record));
+      if (status != EE_CORE_OK)
+      {
+        return status;
+      }
+      EE_CORE_SET(Copied, varidx);
+    }
+#if defined(EE_USE_BLOB) && (EE_USE_BLOB == 1)
+    /* A blob is copied as a unit from its last complete copy */
+    else if (!EE_CORE_ERASED(record) && EE_IS_BLOB_VIRTADDRESS(varidx)
+             && !EE_CORE_IS_SET(Copied, NB_OF_VAR + varidx - EE_BLOB_VIRTADDRESS)
+             && (EE_BlobCheck(PageAddress, *Address, NULL, 0, &size) != 0))
+    {
+      status = EE_BlobCopy(*Address, size);
+      if (status != EE_CORE_OK)
+      {
+        return status;
+      }
+      EE_CORE_SET(Copied, NB_OF_VAR + varidx - EE_BLOB_VIRTADDRESS);
+    }
+#endif
+    *Address -= EE_CORE_RECORD_SIZE;
+    if (Budget != NULL)
+    {
+      (*Budget)--;
+    }
+  }
+
+  return EE_CORE_OK;
+}
+
+#if defined(EE_USE_TRANSACTION) && (EE_USE_TRANSACTION == 1)
+/**
+  * @brief  Find the end of the committed records of a page. Transactions are
+  *   written back to back at the end of the page, so only the last one can be
+  *   open: walking back from the first free slot, a begin marker met before
+  *   any commit marker starts records that are not committed. A record cut
+  *   while its virtual address was programmed can look like a marker, so the
+  *   walk goes on past a begin marker and a commit marker only counts when it
+  *   closes the begin marker of a transaction of the same size.
+  * @param  PageAddress: page address
+  * @param  EndAddress: first free slot of the page
+  * @retval Address following the last committed record
+  */
+static uint32_t EE_CoreTxnCommittedEnd(uint32_t PageAddress, uint32_t EndAddress)
+{
+  EE_CORE_RECORD_TYPE record;
+  uint32_t first = PageAddress + EE_CORE_HEADER_SIZE;
+  uint32_t address = EndAddress, beginaddress = EndAddress;
+  uint32_t nbvar, count = 0;
+
+  /* A transaction spans at most EE_TXN_MAX_RECORDS records and its markers */
+  while ((address > first) && (count < (EE_TXN_MAX_RECORDS + 2)))
+  {
+    address -= EE_CORE_RECORD_SIZE;
+    record = EE_CORE_READ(address);
+    /* Both markers hold the number of records of the transaction */
+    nbvar = (uint32_t)EE_CORE_DATA(record);
+    if (EE_CORE_VIRTADDRESS(record) == EE_TXN_COMMIT_VIRTADDRESS)
+    {
+      if ((nbvar <= EE_TXN_MAX_RECORDS) && ((address - first) >= ((nbvar + 1) * EE_CORE_RECORD_SIZE)))
+      {
+        record = EE_CORE_READ(address - ((nbvar + 1) * EE_CORE_RECORD_SIZE));
+        if ((EE_CORE_VIRTADDRESS(record) == EE_TXN_BEGIN_VIRTADDRESS) && ((uint32_t)EE_CORE_DATA(record) == nbvar))
+        {
+          break;
+        }
+      }
+    }
+    else if (EE_CORE_VIRTADDRESS(record) == EE_TXN_BEGIN_VIRTADDRESS)
+    {
+      /* An open transaction is followed by at most its records and a cut
+         commit marker: a longer tail was written after a damaged record */
+      if ((nbvar <= EE_TXN_MAX_RECORDS) && ((EndAddress - address) <= ((nbvar + 2) * EE_CORE_RECORD_SIZE)))
+      {
+        beginaddress = address;
+      }
+    }
+    count++;
+  }
+
+  return beginaddress;
+}
+#endif
+
+#endif /* __EE_CORE_H */
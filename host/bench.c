@@ -0,0 +1,188 @@
+/**
+  ******************************************************************************
+  * @file    host/bench.c
+  * @brief   Benchmark of one port against the Flash model: writes random
+  *          values to random variables, reads them back, and reports reads
+  *          and writes per second, the latency of the writes that had to
+  *          transfer or collect a page, and the program and erase counts.
+  *          The write rate counts the simulated Flash time and the host CPU
+  *          time, the read rate only the host CPU time: reads do not go
+  *          through the HAL. Runs are deterministic for a given seed.
+  *
+  *          usage: bench_<port> [-n writes] [-r reads] [-v variables]
+  *                              [-s seed] [-p program_ns] [-e erase_ns]
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ee_host.h"
+
+/* Private define ------------------------------------------------------------*/
+/* A write that erased, or programmed more than this, moved or collected a page */
+#define BENCH_TRANSFER_PROGRAMS ((uint32_t)4)
+
+/* Private variables ---------------------------------------------------------*/
+static SIM_DataType aModel[NB_OF_VAR];
+static uint8_t aWritten[NB_OF_VAR];
+static uint32_t ulSeed = 1;
+
+/* Private function prototypes -----------------------------------------------*/
+static uint32_t BENCH_Random(void);
+static uint64_t BENCH_HostTime(void);
+
+/**
+  * @brief  Run the benchmark.
+  * @param  argc: number of arguments
+  * @param  argv: arguments
+  * @retval 0 if every call succeeded and every variable read back its value
+  */
+int main(int argc, char **argv)
+{
+  uint32_t nbwrite = 20000, nbread = 200000, nbvar = 200, idx = 0, varidx = 0;
+  uint32_t programtime = 0, erasetime = 0, nbtransfer = 0, nbbad = 0;
+  uint64_t start = 0, hoststart = 0, writehost = 0, readhost = 0, inittime = 0;
+  uint64_t flashtime = 0, transfertime = 0, maxtransfer = 0, calltime = 0;
+  SIM_CountersTypeDef before, after, total;
+  SIM_DataType data = 0;
+  SIM_StatusType status = SIM_EE_OK;
+  int opt = 0;
+
+  SIM_GetLatency(&programtime, &erasetime);
+  while ((opt = getopt(argc, argv, "n:r:v:s:p:e:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': nbwrite = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'r': nbread = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'v': nbvar = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 's': ulSeed = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'p': programtime = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'e': erasetime = (uint32_t)strtoul(optarg, NULL, 0); break;
+    default:
+      fprintf(stderr, "usage: %s [-n writes] [-r reads] [-v variables] [-s seed] [-p program_ns] [-e erase_ns]\n", argv[0]);
+      return 2;
+    }
+  }
+  if ((nbvar == 0) || (nbvar > NB_OF_VAR) || (ulSeed == 0))
+  {
+    fprintf(stderr, "%s: 1 to %u variables and a seed other than 0\n", SIM_PORT, (unsigned)NB_OF_VAR);
+    return 2;
+  }
+
+  SIM_Init();
+  SIM_SetLatency(programtime, erasetime);
+  HAL_FLASH_Unlock();
+
+  /* Format at first boot */
+  start = SIM_GetTime();
+  status = EE_Init();
+  inittime = SIM_GetTime() - start;
+  if (status != SIM_EE_OK)
+  {
+    fprintf(stderr, "%s: EE_Init failed (%d)\n", SIM_PORT, (int)status);
+    return 1;
+  }
+
+  /* Writes */
+  SIM_ResetCounters();
+  for (idx = 0; idx < nbwrite; idx++)
+  {
+    varidx = BENCH_Random() % nbvar;
+    data = (SIM_DataType)BENCH_Random();
+    SIM_GetCounters(&before);
+    hoststart = BENCH_HostTime();
+    status = EE_WriteVariable((SIM_AddressType)varidx, data);
+    writehost += BENCH_HostTime() - hoststart;
+    SIM_GetCounters(&after);
+    if (status != SIM_EE_OK)
+    {
+      fprintf(stderr, "%s: EE_WriteVariable failed (%d) at write %u\n", SIM_PORT, (int)status, (unsigned)idx);
+      return 1;
+    }
+    aModel[varidx] = data;
+    aWritten[varidx] = 1;
+    calltime = after.FlashTime - before.FlashTime;
+    if ((after.Erases != before.Erases) || ((after.Programs - before.Programs) > BENCH_TRANSFER_PROGRAMS))
+    {
+      nbtransfer++;
+      transfertime += calltime;
+      if (calltime > maxtransfer)
+      {
+        maxtransfer = calltime;
+      }
+    }
+  }
+  SIM_GetCounters(&total);
+  flashtime = total.FlashTime;
+
+  /* Boot again so that the reads also go through the state EE_Init rebuilds */
+  status = EE_Init();
+  if (status != SIM_EE_OK)
+  {
+    fprintf(stderr, "%s: EE_Init failed (%d)\n", SIM_PORT, (int)status);
+    return 1;
+  }
+
+  /* Reads, timed as a whole: a read takes about as long as the clock call */
+  hoststart = BENCH_HostTime();
+  for (idx = 0; idx < nbread; idx++)
+  {
+    varidx = BENCH_Random() % nbvar;
+    status = EE_ReadVariable((SIM_AddressType)varidx, &data);
+    if (((status == SIM_EE_OK) && (data != aModel[varidx])) || ((status != SIM_EE_OK) && (aWritten[varidx] != 0)))
+    {
+      nbbad++;
+    }
+  }
+  readhost = BENCH_HostTime() - hoststart;
+
+  printf("%s: %u variables, %u writes, %u reads, program %.1f us, erase %.1f ms\n", SIM_PORT,
+         (unsigned)nbvar, (unsigned)nbwrite, (unsigned)nbread, programtime / 1000.0, erasetime / 1000000.0);
+  printf("  init       %.2f ms\n", inittime / 1000000.0);
+  printf("  writes     %.0f /s, flash %.1f us and cpu %.2f us per write\n",
+         (nbwrite * 1e9) / (double)(flashtime + writehost + 1),
+         flashtime / 1000.0 / (nbwrite ? nbwrite : 1), writehost / 1000.0 / (nbwrite ? nbwrite : 1));
+  printf("  transfers  %u, mean %.2f ms, max %.2f ms\n", (unsigned)nbtransfer,
+         nbtransfer ? (transfertime / 1000000.0 / nbtransfer) : 0.0, maxtransfer / 1000000.0);
+  printf("  reads      %.0f /s, cpu %.3f us per read\n",
+         (nbread * 1e9) / (double)(readhost + 1), readhost / 1000.0 / (nbread ? nbread : 1));
+  printf("  flash      %u programs, %u erases, most erased page %u\n",
+         (unsigned)total.Programs, (unsigned)total.Erases, (unsigned)SIM_GetMaxEraseCount());
+  if (nbbad != 0)
+  {
+    printf("  FAILED     %u reads did not return the last value written\n", (unsigned)nbbad);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  * @brief  xorshift32 generator, the same sequence on every host.
+  * @param  None
+  * @retval Next random number
+  */
+static uint32_t BENCH_Random(void)
+{
+  ulSeed ^= ulSeed << 13;
+  ulSeed ^= ulSeed >> 17;
+  ulSeed ^= ulSeed << 5;
+  return ulSeed;
+}
+
+/**
+  * @brief  Host CPU time of the process.
+  * @param  None
+  * @retval Time in ns
+  */
+static uint64_t BENCH_HostTime(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,53 @@
+/**
+  ******************************************************************************
+  * @file    host/ee_host.h
+  * @brief   Types and return codes of the port under test, for the host
+  *          programs: stm32f103 and stm32f4 store 16-bit variables and return
+  *          0 on success, stm32g031 and stm32l431 store 32-bit variables and
+  *          return EE_Status. Both keep the virtual address of a record in
+  *          its second half-word.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __EE_HOST_H
+#define __EE_HOST_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "flash_sim.h"
+#if defined(SIM_FAMILY_F1)
+#include "stm32f1xx_hal.h"
+#elif defined(SIM_FAMILY_F4)
+#include "stm32f4xx_hal.h"
+#elif defined(SIM_FAMILY_G0)
+#include "stm32g0xx_hal.h"
+#else
+#include "stm32l4xx_hal.h"
+#endif
+#include "eeprom.h"
+
+/* Exported types ------------------------------------------------------------*/
+#if defined(SIM_FAMILY_G0) || defined(SIM_FAMILY_L4)
+typedef EE_VIRTUALADDRESS_TYPE SIM_AddressType;
+typedef EE_DATA_STORED_TYPE SIM_DataType;
+typedef EE_Status SIM_StatusType;
+#define SIM_EE_OK             EE_OK
+/* Record: CRC, virtual address, then data */
+#define SIM_RECORD_SIZE       ((uint32_t)8)
+#define SIM_RECORD_DATA       ((uint32_t)4)
+#else
+typedef uint16_t SIM_AddressType;
+typedef uint16_t SIM_DataType;
+typedef uint16_t SIM_StatusType;
+#define SIM_EE_OK             ((uint16_t)0)
+/* Record: data, then virtual address */
+#define SIM_RECORD_SIZE       ((uint32_t)4)
+#define SIM_RECORD_DATA       ((uint32_t)0)
+#endif
+#define SIM_RECORD_VIRTADDRESS ((uint32_t)2)
+
+#ifndef SIM_PORT
+#define SIM_PORT              "port"
+#endif
+
+#endif /* __EE_HOST_H */
@@ -0,0 +1,589 @@
+/**
+  ******************************************************************************
+  * @file    host/flash_sim.c
+  * @brief   Flash model standing in for the STM32 HAL Flash driver on a host.
+  *          The Flash is a RAM area mapped at its target address. Programming
+  *          only clears bits, an erase sets a whole page (sector on stm32f4)
+  *          back to 0xFF, stm32f1 refuses to program a half-word that is
+  *          neither erased nor all zeros and stm32g0/stm32l4 do the same for a
+  *          double word. Each operation is counted and advances a simulated
+  *          clock, which also drives DWT->CYCCNT, SysTick and HAL_GetTick.
+  *          A power cut can be armed: the operation it falls on is left half
+  *          done and the process ends. The Flash is shared with the children
+  *          of the process, so a power loss test boots each time in a new
+  *          child, with the RAM of the library as it is after a reset.
+  *          Build with one of SIM_FAMILY_F1, SIM_FAMILY_F4, SIM_FAMILY_G0 or
+  *          SIM_FAMILY_L4 defined.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "flash_sim.h"
+#if defined(SIM_FAMILY_F1)
+#include "stm32f1xx_hal.h"
+#elif defined(SIM_FAMILY_F4)
+#include "stm32f4xx_hal.h"
+#elif defined(SIM_FAMILY_G0)
+#include "stm32g0xx_hal.h"
+#elif defined(SIM_FAMILY_L4)
+#include "stm32l4xx_hal.h"
+#else
+#error "Define SIM_FAMILY_F1, SIM_FAMILY_F4, SIM_FAMILY_G0 or SIM_FAMILY_L4"
+#endif
+
+/* Private define ------------------------------------------------------------*/
+/* Typical times of the datasheets, in ns: one program operation of the width
+   the port uses, and the erase of the smallest page or sector */
+#if defined(SIM_FAMILY_F1)
+#define SIM_PROGRAM_TIME      ((uint32_t)52500)     /* Half-word */
+#define SIM_ERASE_TIME        ((uint32_t)20000000)  /* 1 KB page */
+#define SIM_CPU_MHZ           ((uint32_t)72)
+#define SIM_ERASE_UNIT        ((uint32_t)0x400)
+#elif defined(SIM_FAMILY_F4)
+#define SIM_PROGRAM_TIME      ((uint32_t)16000)     /* Word, x32 parallelism */
+#define SIM_ERASE_TIME        ((uint32_t)250000000) /* 16 KB sector */
+#define SIM_CPU_MHZ           ((uint32_t)84)
+#define SIM_ERASE_UNIT        ((uint32_t)0x4000)
+#elif defined(SIM_FAMILY_G0)
+#define SIM_PROGRAM_TIME      ((uint32_t)85000)     /* Double word */
+#define SIM_ERASE_TIME        ((uint32_t)22020000)  /* 2 KB page */
+#define SIM_CPU_MHZ           ((uint32_t)64)
+#define SIM_ERASE_UNIT        ((uint32_t)0x800)
+#else
+#define SIM_PROGRAM_TIME      ((uint32_t)81690)     /* Double word */
+#define SIM_ERASE_TIME        ((uint32_t)22020000)  /* 2 KB page */
+#define SIM_CPU_MHZ           ((uint32_t)80)
+#define SIM_ERASE_UNIT        ((uint32_t)0x800)
+#endif
+
+/* Private variables ---------------------------------------------------------*/
+static FLASH_TypeDef xFlash = { FLASH_CR_LOCK, 0 };
+static CRC_TypeDef xCrc;
+static SysTick_Type xSysTick = { 0, (SIM_CPU_MHZ * 1000) - 1, (SIM_CPU_MHZ * 1000) - 1, 0 };
+static DWT_Type xDwt;
+static CoreDebug_Type xCoreDebug;
+static SCB_Type xScb;
+
+FLASH_TypeDef *FLASH = &xFlash;
+CRC_TypeDef *CRC = &xCrc;
+SysTick_Type *SysTick = &xSysTick;
+DWT_Type *DWT = &xDwt;
+CoreDebug_Type *CoreDebug = &xCoreDebug;
+SCB_Type *SCB = &xScb;
+volatile uint32_t ulSimPrimask = 0;
+
+static uint32_t ulProgramTime = SIM_PROGRAM_TIME;
+static uint32_t ulEraseTime = SIM_ERASE_TIME;
+static SIM_CountersTypeDef xCounters;
+static uint64_t ullTime = 0;
+static uint32_t aulEraseCount[SIM_FLASH_SIZE / SIM_ERASE_UNIT];
+
+/* Program started by HAL_FLASH_Program_IT and not yet completed by the IRQ */
+static uint8_t ucIrqEnabled = 1;
+static uint8_t ucItPending = 0;
+static uint32_t ulItAddress = 0;
+static HAL_StatusTypeDef xItStatus = HAL_OK;
+
+/* Power cut: operations left before it, and the state of its generator */
+static uint32_t ulCutCountdown = 0;
+static uint32_t ulCutRandom = 1;
+/* Last power cut, shared with the parent of the process it ended */
+static SIM_PowerCutTypeDef *pLastCut = NULL;
+
+/* Private function prototypes -----------------------------------------------*/
+static void SIM_Advance(uint64_t Time);
+static void SIM_Fail(const char *Reason, uint32_t Address);
+static HAL_StatusTypeDef SIM_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+static void SIM_Erase(uint32_t Address, uint32_t Size, uint32_t EraseTime);
+static void SIM_PowerCut(uint8_t *Area, uint32_t Size, uint64_t Data, uint8_t Erase);
+
+/* Exported functions --------------------------------------------------------*/
+
+/**
+  * @brief  Map the Flash model at SIM_FLASH_BASE, erased, and clear the
+  *   counters. Can be called again to start over from an erased Flash.
+  * @param  None
+  * @retval None
+  */
+void SIM_Init(void)
+{
+  static uint8_t *flash = NULL;
+
+  if (flash == NULL)
+  {
+#ifdef MAP_FIXED_NOREPLACE
+    flash = mmap((void *)(uintptr_t)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+#else
+    flash = mmap((void *)(uintptr_t)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+#endif
+    if (flash != (uint8_t *)(uintptr_t)SIM_FLASH_BASE)
+    {
+      fprintf(stderr, "flash_sim: cannot map the Flash at 0x%08lx\n", (unsigned long)SIM_FLASH_BASE);
+      exit(1);
+    }
+    pLastCut = mmap(NULL, sizeof(SIM_PowerCutTypeDef), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pLastCut == MAP_FAILED)
+    {
+      fprintf(stderr, "flash_sim: out of memory\n");
+      exit(1);
+    }
+  }
+  memset(flash, 0xFF, SIM_FLASH_SIZE);
+  memset(pLastCut, 0, sizeof(SIM_PowerCutTypeDef));
+  memset(aulEraseCount, 0, sizeof(aulEraseCount));
+  xFlash.CR = FLASH_CR_LOCK;
+  ucItPending = 0;
+  ulCutCountdown = 0;
+  SIM_ResetCounters();
+}
+
+/**
+  * @brief  Set the time of a program operation and of the erase of the
+  *   smallest page or sector, in ns. Larger stm32f4 sectors take longer in
+  *   proportion of their typical times.
+  * @param  ProgramTime: program time
+  * @param  EraseTime: erase time
+  * @retval None
+  */
+void SIM_SetLatency(uint32_t ProgramTime, uint32_t EraseTime)
+{
+  ulProgramTime = ProgramTime;
+  ulEraseTime = EraseTime;
+}
+
+/**
+  * @brief  Get the times set by SIM_SetLatency, or the typical times of the
+  *   family by default.
+  * @param  ProgramTime: program time in ns
+  * @param  EraseTime: erase time in ns
+  * @retval None
+  */
+void SIM_GetLatency(uint32_t *ProgramTime, uint32_t *EraseTime)
+{
+  *ProgramTime = ulProgramTime;
+  *EraseTime = ulEraseTime;
+}
+
+/**
+  * @brief  Get the operation counters.
+  * @param  Counters: counters since SIM_Init or SIM_ResetCounters
+  * @retval None
+  */
+void SIM_GetCounters(SIM_CountersTypeDef *Counters)
+{
+  *Counters = xCounters;
+}
+
+/**
+  * @brief  Clear the operation counters. The simulated clock goes on.
+  * @param  None
+  * @retval None
+  */
+void SIM_ResetCounters(void)
+{
+  memset(&xCounters, 0, sizeof(xCounters));
+}
+
+/**
+  * @brief  Get the simulated time: the time of every Flash operation so far.
+  * @param  None
+  * @retval Time in ns
+  */
+uint64_t SIM_GetTime(void)
+{
+  return ullTime;
+}
+
+/**
+  * @brief  Get the number of erases of the page or sector holding an address.
+  * @param  Address: Flash address
+  * @retval Erase count since SIM_Init
+  */
+uint32_t SIM_GetEraseCount(uint32_t Address)
+{
+  if ((Address < SIM_FLASH_BASE) || (Address >= (SIM_FLASH_BASE + SIM_FLASH_SIZE)))
+  {
+    return 0;
+  }
+  return aulEraseCount[(Address - SIM_FLASH_BASE) / SIM_ERASE_UNIT];
+}
+
+/**
+  * @brief  Get the number of erases of the most erased page or sector.
+  * @param  None
+  * @retval Erase count since SIM_Init
+  */
+uint32_t SIM_GetMaxEraseCount(void)
+{
+  uint32_t unit = 0, maxcount = 0;
+
+  for (unit = 0; unit < (SIM_FLASH_SIZE / SIM_ERASE_UNIT); unit++)
+  {
+    maxcount = (aulEraseCount[unit] > maxcount) ? aulEraseCount[unit] : maxcount;
+  }
+  return maxcount;
+}
+
+/**
+  * @brief  Tell whether the Flash interrupt would be taken now: a program
+  *   started by HAL_FLASH_Program_IT is done, the interrupt is enabled in the
+  *   NVIC and not masked by PRIMASK. The caller then runs its
+  *   FLASH_IRQHandler, which calls HAL_FLASH_IRQHandler.
+  * @param  None
+  * @retval 1 if the interrupt is pending and can be taken, 0 otherwise
+  */
+uint8_t SIM_IRQPending(void)
+{
+  return (uint8_t)((ucItPending != 0) && (ucIrqEnabled != 0) && (ulSimPrimask == 0));
+}
+
+/**
+  * @brief  Arm a power cut on a program or erase operation. The operation is
+  *   left half done: a program clears only some of the bits it clears, an
+  *   erase sets only some bits back to 1. The process then ends with the
+  *   exit status SIM_POWER_CUT_EXIT.
+  * @param  Operation: rank of the operation from now on, 1 for the next one,
+  *   0 to disarm
+  * @param  Seed: seed of the bits the operation leaves, not 0
+  * @retval None
+  */
+void SIM_SetPowerCut(uint32_t Operation, uint32_t Seed)
+{
+  ulCutCountdown = Operation;
+  ulCutRandom = (Seed != 0) ? Seed : 1;
+  if (Operation != 0)
+  {
+    memset(pLastCut, 0, sizeof(SIM_PowerCutTypeDef));
+  }
+}
+
+/**
+  * @brief  Get the operation the last power cut fell on, in this process or
+  *   in a child of it, since the cut was armed.
+  * @param  Cut: operation and what it left
+  * @retval 1 if the power was cut, 0 otherwise
+  */
+uint8_t SIM_GetPowerCut(SIM_PowerCutTypeDef *Cut)
+{
+  *Cut = *pLastCut;
+  return (pLastCut->Size != 0) ? 1 : 0;
+}
+
+/* HAL and CMSIS stand-ins ---------------------------------------------------*/
+
+void __disable_irq(void)
+{
+  ulSimPrimask = 1;
+}
+
+void __enable_irq(void)
+{
+  ulSimPrimask = 0;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  (void)IRQn;
+  ucIrqEnabled = 1;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  (void)IRQn;
+  ucIrqEnabled = 0;
+}
+
+uint32_t HAL_GetTick(void)
+{
+  return (uint32_t)(ullTime / 1000000);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+  xFlash.CR &= ~FLASH_CR_LOCK;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+  xFlash.CR |= FLASH_CR_LOCK;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  if (ucItPending != 0)
+  {
+    SIM_Fail("program while an interrupt driven program is not completed", Address);
+  }
+  return SIM_Program(TypeProgram, Address, Data);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program_IT(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  if (ucItPending != 0)
+  {
+    return HAL_BUSY;
+  }
+  xItStatus = SIM_Program(TypeProgram, Address, Data);
+  ulItAddress = Address;
+  ucItPending = 1;
+  return HAL_OK;
+}
+
+void HAL_FLASH_IRQHandler(void)
+{
+  if (ucItPending == 0)
+  {
+    return;
+  }
+  ucItPending = 0;
+  if (xItStatus == HAL_OK)
+  {
+    HAL_FLASH_EndOfOperationCallback(ulItAddress);
+  }
+  else
+  {
+    HAL_FLASH_OperationErrorCallback(ulItAddress);
+  }
+}
+
+__weak void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+  (void)ReturnValue;
+}
+
+__weak void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+  (void)ReturnValue;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+  uint32_t idx = 0;
+#if defined(SIM_FAMILY_F4)
+  static const uint32_t sectorbase[] = { 0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+                                         0x08010000, 0x08020000, 0x08040000, 0x08060000, 0x08080000 };
+  uint32_t sectorsize = 0;
+#endif
+
+  if (ucItPending != 0)
+  {
+    SIM_Fail("erase while an interrupt driven program is not completed", 0);
+  }
+  *PageError = 0xFFFFFFFF;
+#if defined(SIM_FAMILY_F1)
+  for (idx = 0; idx < pEraseInit->NbPages; idx++)
+  {
+    SIM_Erase(pEraseInit->PageAddress + (idx * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE, ulEraseTime);
+  }
+#elif defined(SIM_FAMILY_F4)
+  for (idx = pEraseInit->Sector; idx < (pEraseInit->Sector + pEraseInit->NbSectors); idx++)
+  {
+    if (idx >= ((sizeof(sectorbase) / sizeof(sectorbase[0])) - 1))
+    {
+      SIM_Fail("erase of a sector out of the Flash", 0);
+    }
+    /* Typical times: 16 KB 250 ms, 64 KB 550 ms, 128 KB 1 s */
+    sectorsize = sectorbase[idx + 1] - sectorbase[idx];
+    SIM_Erase(sectorbase[idx], sectorsize,
+              (sectorsize == 0x4000) ? ulEraseTime : ((sectorsize == 0x10000) ? ((ulEraseTime / 10) * 22) : (ulEraseTime * 4)));
+  }
+#else
+  for (idx = 0; idx < pEraseInit->NbPages; idx++)
+  {
+    SIM_Erase(FLASH_BASE + ((pEraseInit->Page + idx) * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE, ulEraseTime);
+  }
+#endif
+  return HAL_OK;
+}
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Advance the simulated clock, with the cycle counter and SysTick.
+  * @param  Time: time in ns
+  * @retval None
+  */
+static void SIM_Advance(uint64_t Time)
+{
+  uint64_t cycles = (Time * SIM_CPU_MHZ) / 1000;
+  uint64_t period = (uint64_t)(xSysTick.LOAD & SysTick_LOAD_RELOAD_Msk) + 1;
+  uint64_t elapsed = (period - 1 - xSysTick.VAL) + cycles;
+
+  ullTime += Time;
+  xDwt.CYCCNT += (uint32_t)cycles;
+  xSysTick.VAL = (uint32_t)(period - 1 - (elapsed % period));
+  if (elapsed >= period)
+  {
+    xSysTick.CTRL |= SysTick_CTRL_COUNTFLAG_Msk;
+  }
+}
+
+/**
+  * @brief  Stop on a call the library must never make.
+  * @param  Reason: what was wrong
+  * @param  Address: Flash address of the call
+  * @retval None
+  */
+static void SIM_Fail(const char *Reason, uint32_t Address)
+{
+  fprintf(stderr, "flash_sim: %s at 0x%08lx\n", Reason, (unsigned long)Address);
+  abort();
+}
+
+/**
+  * @brief  Program the Flash with the rules of the family.
+  * @param  TypeProgram: width of the program operation
+  * @param  Address: Flash address
+  * @param  Data: data to program
+  * @retval HAL_OK, or HAL_ERROR if the Flash refuses the operation
+  */
+static HAL_StatusTypeDef SIM_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  uint8_t *flash = (uint8_t *)(uintptr_t)Address;
+  uint32_t size = 0, unit = 0, idx = 0;
+#if !defined(SIM_FAMILY_F4)
+  uint32_t byte = 0;
+  uint8_t erased = 1, zero = 1;
+#endif
+
+#if defined(SIM_FAMILY_F1)
+  /* Wider operations are programmed a half-word at a time */
+  size = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 2 : ((TypeProgram == FLASH_TYPEPROGRAM_WORD) ? 4 : 8);
+  unit = 2;
+#elif defined(SIM_FAMILY_F4)
+  size = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 2 : 4;
+  unit = size;
+#else
+  (void)TypeProgram;
+  size = 8;
+  unit = 8;
+#endif
+
+  if ((xFlash.CR & FLASH_CR_LOCK) != 0)
+  {
+    SIM_Fail("program while the Flash is locked", Address);
+  }
+  if ((Address < SIM_FLASH_BASE) || ((Address + size) > (SIM_FLASH_BASE + SIM_FLASH_SIZE)) || ((Address % size) != 0))
+  {
+    SIM_Fail("program out of the Flash or not aligned", Address);
+  }
+
+  SIM_PowerCut(flash, size, Data, 0);
+  xCounters.Programs++;
+  xCounters.FlashTime += (uint64_t)ulProgramTime * (size / unit);
+  SIM_Advance((uint64_t)ulProgramTime * (size / unit));
+
+#if !defined(SIM_FAMILY_F4)
+  /* A unit neither erased nor programmed to zero is refused as a whole */
+  for (idx = 0; idx < size; idx += unit)
+  {
+    erased = 1;
+    zero = 1;
+    for (byte = idx; byte < (idx + unit); byte++)
+    {
+      if (flash[byte] != 0xFF)
+      {
+        erased = 0;
+      }
+      if ((uint8_t)(Data >> (8 * byte)) != 0)
+      {
+        zero = 0;
+      }
+    }
+    if ((erased == 0) && (zero == 0))
+    {
+      return HAL_ERROR;
+    }
+  }
+#else
+  (void)unit;
+#endif
+
+  for (idx = 0; idx < size; idx++)
+  {
+    flash[idx] &= (uint8_t)(Data >> (8 * idx));
+  }
+  return HAL_OK;
+}
+
+/**
+  * @brief  Erase an area of the Flash back to 0xFF.
+  * @param  Address: start of a page or sector
+  * @param  Size: size of the page or sector
+  * @param  EraseTime: erase time in ns
+  * @retval None
+  */
+static void SIM_Erase(uint32_t Address, uint32_t Size, uint32_t EraseTime)
+{
+  uint32_t unit = 0;
+
+  if ((xFlash.CR & FLASH_CR_LOCK) != 0)
+  {
+    SIM_Fail("erase while the Flash is locked", Address);
+  }
+  if ((Address < SIM_FLASH_BASE) || ((Address + Size) > (SIM_FLASH_BASE + SIM_FLASH_SIZE)))
+  {
+    SIM_Fail("erase out of the Flash", Address);
+  }
+
+  SIM_PowerCut((uint8_t *)(uintptr_t)Address, Size, 0, 1);
+  xCounters.Erases++;
+  xCounters.FlashTime += EraseTime;
+  SIM_Advance(EraseTime);
+  memset((void *)(uintptr_t)Address, 0xFF, Size);
+  for (unit = 0; unit < Size; unit += SIM_ERASE_UNIT)
+  {
+    aulEraseCount[(Address + unit - SIM_FLASH_BASE) / SIM_ERASE_UNIT]++;
+  }
+}
+
+/**
+  * @brief  Cut the power if the operation starting is the one armed by
+  *   SIM_SetPowerCut.
+  * @param  Area: Flash area of the operation
+  * @param  Size: size of the area
+  * @param  Data: data a program operation writes
+  * @param  Erase: 1 for an erase operation, 0 for a program operation
+  * @retval None, the process ends on a power cut
+  */
+static void SIM_PowerCut(uint8_t *Area, uint32_t Size, uint64_t Data, uint8_t Erase)
+{
+  uint32_t idx = 0;
+
+  if ((ulCutCountdown == 0) || (--ulCutCountdown != 0))
+  {
+    return;
+  }
+  for (idx = 0; idx < Size; idx++)
+  {
+    ulCutRandom ^= ulCutRandom << 13;
+    ulCutRandom ^= ulCutRandom >> 17;
+    ulCutRandom ^= ulCutRandom << 5;
+    if (Erase != 0)
+    {
+      Area[idx] |= (uint8_t)ulCutRandom;
+    }
+    else
+    {
+      Area[idx] &= (uint8_t)(Data >> (8 * idx)) | (uint8_t)ulCutRandom;
+    }
+    if (idx < sizeof(pLastCut->Left))
+    {
+      pLastCut->Left[idx] = Area[idx];
+    }
+  }
+  pLastCut->Address = (uint32_t)(uintptr_t)Area;
+  pLastCut->Erase = Erase;
+  pLastCut->Size = Size;
+  _exit(SIM_POWER_CUT_EXIT);
+}
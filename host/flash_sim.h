@@ -0,0 +1,55 @@
+/**
+  ******************************************************************************
+  * @file    host/flash_sim.h
+  * @brief   Flash model standing in for the STM32 HAL Flash driver on a host:
+  *          NOR semantics of each family, operation counts and latencies.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FLASH_SIM_H
+#define __FLASH_SIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+/* The model is mapped where the Flash of the target is: the ports keep Flash
+   addresses in uint32_t and read them through plain pointers */
+#define SIM_FLASH_BASE        ((uint32_t)0x08000000)
+#define SIM_FLASH_SIZE        ((uint32_t)0x80000)
+
+/* Exit status of a process whose power SIM_SetPowerCut cut */
+#define SIM_POWER_CUT_EXIT    75
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t Programs;      /* Program operations (HAL_FLASH_Program and _IT) */
+  uint32_t Erases;        /* Pages, or sectors on stm32f4, erased */
+  uint64_t FlashTime;     /* Time spent in the operations above, in ns */
+} SIM_CountersTypeDef;
+
+/* Operation a power cut fell on, as it left the Flash */
+typedef struct
+{
+  uint32_t Address;       /* First byte of the operation */
+  uint32_t Size;          /* Bytes the operation covers */
+  uint8_t Erase;          /* 1 for an erase, 0 for a program */
+  uint8_t Left[8];        /* First bytes of the area after the cut */
+} SIM_PowerCutTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void SIM_Init(void);
+void SIM_SetLatency(uint32_t ProgramTime, uint32_t EraseTime);
+void SIM_GetLatency(uint32_t *ProgramTime, uint32_t *EraseTime);
+void SIM_GetCounters(SIM_CountersTypeDef *Counters);
+void SIM_ResetCounters(void);
+uint64_t SIM_GetTime(void);
+uint32_t SIM_GetEraseCount(uint32_t Address);
+uint32_t SIM_GetMaxEraseCount(void);
+uint8_t SIM_IRQPending(void);
+void SIM_SetPowerCut(uint32_t Operation, uint32_t Seed);
+uint8_t SIM_GetPowerCut(SIM_PowerCutTypeDef *Cut);
+
+#endif /* __FLASH_SIM_H */
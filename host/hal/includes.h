@@ -0,0 +1,2 @@
+/* stm32f103/eeprom.c includes the project header of the board: nothing is
+   needed from it on a host */
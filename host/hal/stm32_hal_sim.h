@@ -0,0 +1,124 @@
+/**
+  ******************************************************************************
+  * @file    host/hal/stm32_hal_sim.h
+  * @brief   Part of the STM32 HAL and CMSIS the EEPROM emulation ports use,
+  *          for a host build against the Flash model of host/flash_sim.c.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32_HAL_SIM_H
+#define __STM32_HAL_SIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stddef.h>
+
+/* Exported types ------------------------------------------------------------*/
+typedef enum
+{
+  HAL_OK      = 0x00U,
+  HAL_ERROR   = 0x01U,
+  HAL_BUSY    = 0x02U,
+  HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+  FLASH_IRQn = 4
+} IRQn_Type;
+
+typedef struct
+{
+  volatile uint32_t CR;
+  volatile uint32_t SR;
+} FLASH_TypeDef;
+
+typedef struct
+{
+  volatile uint32_t DR;
+  volatile uint32_t IDR;
+  volatile uint32_t CR;
+  uint32_t RESERVED;
+  volatile uint32_t INIT;
+  volatile uint32_t POL;
+} CRC_TypeDef;
+
+typedef struct
+{
+  volatile uint32_t CTRL;
+  volatile uint32_t LOAD;
+  volatile uint32_t VAL;
+  volatile uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct
+{
+  volatile uint32_t CTRL;
+  volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+  volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct
+{
+  volatile uint32_t ICSR;
+} SCB_Type;
+
+/* Exported constants --------------------------------------------------------*/
+#define __IO                          volatile
+#define __weak                        __attribute__((weak))
+
+#define FLASH_CR_LOCK                 (1UL << 31)
+#define CRC_CR_RESET                  (1UL << 0)
+#define CRC_CR_POLYSIZE_0             (1UL << 3)
+#define SysTick_LOAD_RELOAD_Msk       (0xFFFFFFUL)
+#define SysTick_CTRL_COUNTFLAG_Msk    (1UL << 16)
+#define DWT_CTRL_CYCCNTENA_Msk        (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk    (1UL << 24)
+#define SCB_ICSR_PENDSTSET_Msk        (1UL << 26)
+
+/* Exported macro ------------------------------------------------------------*/
+#define assert_param(expr)            ((void)0U)
+#define UNUSED(X)                     ((void)(X))
+#define READ_BIT(REG, BIT)            ((REG) & (BIT))
+#define __HAL_RCC_CRC_CLK_ENABLE()    do { } while (0)
+
+/* Exported variables --------------------------------------------------------*/
+extern FLASH_TypeDef *FLASH;
+extern CRC_TypeDef *CRC;
+extern SysTick_Type *SysTick;
+extern DWT_Type *DWT;
+extern CoreDebug_Type *CoreDebug;
+extern SCB_Type *SCB;
+extern volatile uint32_t ulSimPrimask;
+
+/* Exported functions ------------------------------------------------------- */
+static inline uint32_t __get_PRIMASK(void)
+{
+  return ulSimPrimask;
+}
+
+static inline void __set_PRIMASK(uint32_t priMask)
+{
+  ulSimPrimask = priMask;
+}
+
+void __disable_irq(void);
+void __enable_irq(void);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn);
+uint32_t HAL_GetTick(void);
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASH_Program_IT(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+void HAL_FLASH_IRQHandler(void);
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+
+#endif /* __STM32_HAL_SIM_H */
@@ -0,0 +1,36 @@
+/**
+  ******************************************************************************
+  * @file    host/hal/stm32f1xx_hal.h
+  * @brief   STM32F1 part of the stand-in HAL: 1 KB pages programmed by
+  *          half-word, word or double word.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32F1xx_HAL_H
+#define __STM32F1xx_HAL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32_hal_sim.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t TypeErase;
+  uint32_t Banks;
+  uint32_t PageAddress;
+  uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+#define __CORTEX_M                    (3U)
+#define FLASH_PAGE_SIZE               0x400U
+#define FLASH_TYPEERASE_PAGES         0x00U
+#define FLASH_TYPEPROGRAM_HALFWORD    0x01U
+#define FLASH_TYPEPROGRAM_WORD        0x02U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD  0x03U
+
+/* Exported functions ------------------------------------------------------- */
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+
+#endif /* __STM32F1xx_HAL_H */
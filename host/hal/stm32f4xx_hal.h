@@ -0,0 +1,49 @@
+/**
+  ******************************************************************************
+  * @file    host/hal/stm32f4xx_hal.h
+  * @brief   STM32F4 part of the stand-in HAL: sectors of 16, 64 and 128 KB
+  *          programmed by byte, half-word or word.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32_hal_sim.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t TypeErase;
+  uint32_t Banks;
+  uint32_t Sector;
+  uint32_t NbSectors;
+  uint32_t VoltageRange;
+} FLASH_EraseInitTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+#define __CORTEX_M                    (4U)
+#define FLASH_TYPEERASE_SECTORS       0x00U
+#define FLASH_TYPEPROGRAM_HALFWORD    0x01U
+#define FLASH_TYPEPROGRAM_WORD        0x02U
+#define FLASH_VOLTAGE_RANGE_3         0x02U
+#define TYPEERASE_SECTORS             FLASH_TYPEERASE_SECTORS
+#define TYPEPROGRAM_HALFWORD          FLASH_TYPEPROGRAM_HALFWORD
+#define TYPEPROGRAM_WORD              FLASH_TYPEPROGRAM_WORD
+#define VOLTAGE_RANGE_3               FLASH_VOLTAGE_RANGE_3
+
+#define FLASH_SECTOR_0                0U
+#define FLASH_SECTOR_1                1U
+#define FLASH_SECTOR_2                2U
+#define FLASH_SECTOR_3                3U
+#define FLASH_SECTOR_4                4U
+#define FLASH_SECTOR_5                5U
+#define FLASH_SECTOR_6                6U
+#define FLASH_SECTOR_7                7U
+
+/* Exported functions ------------------------------------------------------- */
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError);
+
+#endif /* __STM32F4xx_HAL_H */
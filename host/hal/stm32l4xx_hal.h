@@ -0,0 +1,37 @@
+/**
+  ******************************************************************************
+  * @file    host/hal/stm32l4xx_hal.h
+  * @brief   STM32L4 part of the stand-in HAL: 2 KB pages programmed by
+  *          double word only.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32L4xx_HAL_H
+#define __STM32L4xx_HAL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32_hal_sim.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t TypeErase;
+  uint32_t Banks;
+  uint32_t Page;
+  uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+#define __CORTEX_M                    (4U)
+#define FLASH_BASE                    (0x08000000UL)
+#define FLASH_PAGE_SIZE               0x800U
+#define FLASH_BANK_SIZE               (0x40000UL)
+#define FLASH_BANK_1                  0x01U
+#define FLASH_TYPEERASE_PAGES         0x00U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD  0x01U
+
+/* Exported functions ------------------------------------------------------- */
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+
+#endif /* __STM32L4xx_HAL_H */
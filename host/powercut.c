@@ -0,0 +1,687 @@
+/**
+  ******************************************************************************
+  * @file    host/powercut.c
+  * @brief   Power loss test of one port against the Flash model. Each scenario
+  *          writes until a chosen write moves or collects a page, then replays
+  *          the last writes before it and a few after it, cutting the power on
+  *          each program and erase operation in turn, the boot included. The
+  *          cut operation is left half done. After the cut the device boots
+  *          once more with a second cut at a random point of EE_Init, to hit
+  *          the recovery itself, then boots without a cut and reads every
+  *          variable:
+  *          - the writes that returned before the cut read their value,
+  *          - the write in progress reads its old or its new value, all the
+  *            old or all the new ones for a transaction,
+  *          - every other variable reads the value it had.
+  *          A few writes then follow, and a last boot reads them back. Each
+  *          boot runs in a new child process, so that the library starts with
+  *          its RAM as after a reset. Runs are deterministic for a given seed.
+  *
+  *          usage: powercut_<port> [-c scenarios] [-v variables] [-s seed]
+  *                                 [-n nested_percent]
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "ee_host.h"
+
+/* Private define ------------------------------------------------------------*/
+#if defined(EE_USE_TRANSACTION) && (EE_USE_TRANSACTION == 1)
+#define PC_HAVE_TRANSACTION
+#endif
+
+/* A write that erased, or programmed more than this, moved or collected a page */
+#define PC_TRANSFER_PROGRAMS  ((uint32_t)4)
+#define PC_MAX_OPS            ((uint32_t)20000)
+#define PC_MAX_OP_VARS        ((uint32_t)4)
+#define PC_WINDOW_BEFORE      ((uint32_t)8)
+#define PC_WINDOW_AFTER       ((uint32_t)24)
+#define PC_POST_WRITES        ((uint32_t)6)
+#define PC_MAX_REPORTS        ((uint32_t)10)
+/* Write in progress while the boot runs, before the first write of the window */
+#define PC_IN_BOOT            ((uint32_t)0xFFFFFFFF)
+
+/* Private typedef -----------------------------------------------------------*/
+typedef enum
+{
+  PC_WRITE,
+  PC_BATCH,
+  PC_TRANSACTION
+} PC_OpKindTypeDef;
+
+typedef struct
+{
+  PC_OpKindTypeDef Kind;
+  uint16_t NbVar;
+  SIM_AddressType VirtAddress[PC_MAX_OP_VARS];
+  SIM_DataType Data[PC_MAX_OP_VARS];
+} PC_OpTypeDef;
+
+/* Contents of a variable: its value, and whether it was ever written */
+typedef struct
+{
+  SIM_DataType Value[NB_OF_VAR];
+  uint8_t Present[NB_OF_VAR];
+} PC_ImageTypeDef;
+
+/* What the children report to the parent, in memory they share */
+typedef struct
+{
+  uint32_t Op;
+  uint32_t Target;
+  uint32_t Operations;
+  uint32_t InitPrograms;
+  uint32_t InitErases;
+  uint64_t InitTime;
+  PC_ImageTypeDef Recovered;
+  PC_ImageTypeDef Final;
+} PC_SharedTypeDef;
+
+/* Private variables ---------------------------------------------------------*/
+static PC_OpTypeDef aOps[PC_MAX_OPS];
+static PC_OpTypeDef aPost[PC_POST_WRITES];
+static PC_SharedTypeDef *pShared = NULL;
+static uint8_t *pSnapshot = NULL;
+static uint32_t ulSeed = 1;
+static uint32_t ulNbVar = 100;
+static uint32_t ulWindowStart = 0;
+static uint32_t ulWindowEnd = 0;
+static uint32_t ulHeavy = 0;
+static uint32_t ulLostVar = 0;
+/* Operations the power cuts of a boot fell on */
+static SIM_PowerCutTypeDef aCut[2];
+static uint32_t ulNbCut = 0;
+
+/* Private function prototypes -----------------------------------------------*/
+static uint32_t PC_Random(void);
+static void PC_NewOp(PC_OpTypeDef *Op, uint8_t Single);
+static void PC_ApplyModel(PC_ImageTypeDef *Image, const PC_OpTypeDef *Op);
+static SIM_StatusType PC_Apply(const PC_OpTypeDef *Op);
+static void PC_ReadAll(PC_ImageTypeDef *Image);
+static int PC_Boot(void (*Run)(void), uint32_t Cut, uint32_t CutSeed);
+static void PC_RunRecord(void);
+static void PC_RunPrefix(void);
+static void PC_RunWindow(void);
+static void PC_RunInit(void);
+static void PC_RunCheck(void);
+static uint8_t PC_IsTorn(uint32_t VirtAddress, SIM_DataType Data);
+static uint32_t PC_Check(const PC_ImageTypeDef *Before, const PC_OpTypeDef *Op, PC_ImageTypeDef *Expected,
+                         uint32_t *NbTorn);
+
+/**
+  * @brief  Run the power loss test.
+  * @param  argc: number of arguments
+  * @param  argv: arguments
+  * @retval 0 if every boot recovered the data
+  */
+int main(int argc, char **argv)
+{
+  uint32_t nbscenario = 20, nested = 50, scenario = 0, idx = 0, cut = 0, nbop = 0;
+  uint32_t nbcut = 0, nbnested = 0, nbfail = 0, maxinitops = 0, maxprograms = 0, maxerases = 0;
+  uint32_t nbtorn = 0, torn = 0;
+  uint64_t inittime = 0, maxinittime = 0;
+  PC_ImageTypeDef start, before, expected;
+  uint32_t failures = 0;
+  int status = 0, opt = 0;
+
+  while ((opt = getopt(argc, argv, "c:v:s:n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c': nbscenario = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'v': ulNbVar = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 's': ulSeed = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'n': nested = (uint32_t)strtoul(optarg, NULL, 0); break;
+    default:
+      fprintf(stderr, "usage: %s [-c scenarios] [-v variables] [-s seed] [-n nested_percent]\n", argv[0]);
+      return 2;
+    }
+  }
+  if ((ulNbVar < PC_MAX_OP_VARS) || (ulNbVar > NB_OF_VAR) || (ulSeed == 0))
+  {
+    fprintf(stderr, "%s: %u to %u variables and a seed other than 0\n", SIM_PORT,
+            (unsigned)PC_MAX_OP_VARS, (unsigned)NB_OF_VAR);
+    return 2;
+  }
+
+  pShared = mmap(NULL, sizeof(PC_SharedTypeDef), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  pSnapshot = malloc(SIM_FLASH_SIZE);
+  if ((pShared == MAP_FAILED) || (pSnapshot == NULL))
+  {
+    fprintf(stderr, "%s: out of memory\n", SIM_PORT);
+    return 1;
+  }
+
+  for (scenario = 0; scenario < nbscenario; scenario++)
+  {
+    /* Writes, and the first or second one to move or collect a page */
+    for (idx = 0; idx < PC_MAX_OPS; idx++)
+    {
+      PC_NewOp(&aOps[idx], 0);
+    }
+    ulHeavy = 1 + (PC_Random() % 2);
+    SIM_Init();
+    pShared->Target = PC_IN_BOOT;
+    if ((PC_Boot(PC_RunRecord, 0, 0) != 0) || (pShared->Target == PC_IN_BOOT))
+    {
+      fprintf(stderr, "%s: scenario %u: no page transfer in %u writes\n", SIM_PORT,
+              (unsigned)scenario, (unsigned)PC_MAX_OPS);
+      return 1;
+    }
+    ulWindowStart = (pShared->Target > PC_WINDOW_BEFORE) ? (pShared->Target - PC_WINDOW_BEFORE) : 0;
+    ulWindowEnd = pShared->Target + 1 + PC_WINDOW_AFTER;
+
+    /* Flash as the window starts, and the image it holds */
+    SIM_Init();
+    if (PC_Boot(PC_RunPrefix, 0, 0) != 0)
+    {
+      fprintf(stderr, "%s: scenario %u: write failed\n", SIM_PORT, (unsigned)scenario);
+      return 1;
+    }
+    memcpy(pSnapshot, (void *)(uintptr_t)SIM_FLASH_BASE, SIM_FLASH_SIZE);
+    memset(&start, 0, sizeof(start));
+    for (idx = 0; idx < ulWindowStart; idx++)
+    {
+      PC_ApplyModel(&start, &aOps[idx]);
+    }
+
+    /* Operations of the window, boot included */
+    if (PC_Boot(PC_RunWindow, 0, 0) != 0)
+    {
+      fprintf(stderr, "%s: scenario %u: write failed\n", SIM_PORT, (unsigned)scenario);
+      return 1;
+    }
+    nbop = pShared->Operations;
+
+    for (cut = 1; cut <= nbop; cut++)
+    {
+      memcpy((void *)(uintptr_t)SIM_FLASH_BASE, pSnapshot, SIM_FLASH_SIZE);
+      for (idx = 0; idx < PC_POST_WRITES; idx++)
+      {
+        PC_NewOp(&aPost[idx], 1);
+      }
+      pShared->Op = PC_IN_BOOT;
+      status = PC_Boot(PC_RunWindow, cut, PC_Random());
+      nbcut++;
+      ulNbCut = SIM_GetPowerCut(&aCut[0]);
+      if (status == SIM_POWER_CUT_EXIT)
+      {
+        if ((PC_Random() % 100) < nested)
+        {
+          if (PC_Boot(PC_RunInit, 1 + (PC_Random() % (maxinitops + 2)), PC_Random()) == SIM_POWER_CUT_EXIT)
+          {
+            nbnested++;
+            ulNbCut += SIM_GetPowerCut(&aCut[ulNbCut]);
+          }
+        }
+        status = PC_Boot(PC_RunCheck, 0, 0);
+      }
+      if (status != 0)
+      {
+        failures++;
+        if (failures <= PC_MAX_REPORTS)
+        {
+          printf("  scenario %u cut %u: boot failed (%d)\n", (unsigned)scenario, (unsigned)cut, status);
+        }
+        continue;
+      }
+
+      before = start;
+      for (idx = ulWindowStart; (idx < ulWindowEnd) && (idx < pShared->Op); idx++)
+      {
+        PC_ApplyModel(&before, &aOps[idx]);
+      }
+      nbfail = PC_Check(&before, (pShared->Op < ulWindowEnd) ? &aOps[pShared->Op] : NULL, &expected, &torn);
+      if (torn != 0)
+      {
+        nbtorn++;
+      }
+      if (nbfail == 0)
+      {
+        for (idx = 0; idx < PC_POST_WRITES; idx++)
+        {
+          PC_ApplyModel(&expected, &aPost[idx]);
+        }
+        if ((memcmp(expected.Present, pShared->Final.Present, sizeof(expected.Present)) != 0) ||
+            (memcmp(expected.Value, pShared->Final.Value, sizeof(expected.Value)) != 0))
+        {
+          nbfail++;
+        }
+      }
+      if (nbfail != 0)
+      {
+        failures++;
+        if (failures <= PC_MAX_REPORTS)
+        {
+          printf("  scenario %u cut %u/%u in write %d: %u variables lost, variable %u reads %lx (%u), was %lx (%u)\n",
+                 (unsigned)scenario, (unsigned)cut, (unsigned)nbop,
+                 (pShared->Op == PC_IN_BOOT) ? -1 : (int)(pShared->Op - ulWindowStart), (unsigned)nbfail,
+                 (unsigned)ulLostVar, (unsigned long)pShared->Recovered.Value[ulLostVar],
+                 (unsigned)pShared->Recovered.Present[ulLostVar], (unsigned long)before.Value[ulLostVar],
+                 (unsigned)before.Present[ulLostVar]);
+        }
+      }
+
+      inittime += pShared->InitTime;
+      if (pShared->InitTime > maxinittime)
+      {
+        maxinittime = pShared->InitTime;
+      }
+      if ((pShared->InitPrograms + pShared->InitErases) > maxinitops)
+      {
+        maxinitops = pShared->InitPrograms + pShared->InitErases;
+      }
+      if (pShared->InitPrograms > maxprograms)
+      {
+        maxprograms = pShared->InitPrograms;
+      }
+      if (pShared->InitErases > maxerases)
+      {
+        maxerases = pShared->InitErases;
+      }
+    }
+  }
+
+  printf("%s: %u scenarios, %u power cuts, %u of them also in the recovery, %u variables\n", SIM_PORT,
+         (unsigned)nbscenario, (unsigned)nbcut, (unsigned)nbnested, (unsigned)ulNbVar);
+  printf("  recovery   mean %.2f ms, max %.2f ms, at most %u programs and %u erases\n",
+         inittime / 1000000.0 / (nbcut ? nbcut : 1), maxinittime / 1000000.0,
+         (unsigned)maxprograms, (unsigned)maxerases);
+  if (nbtorn != 0)
+  {
+    printf("  torn       %u boots read a record the cut left half programmed as another variable:\n"
+           "             the record format of the port has no check\n", (unsigned)nbtorn);
+  }
+  if (failures != 0)
+  {
+    printf("  FAILED     %u boots did not recover the data\n", (unsigned)failures);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  * @brief  xorshift32 generator, the same sequence on every host.
+  * @param  None
+  * @retval Next random number
+  */
+static uint32_t PC_Random(void)
+{
+  ulSeed ^= ulSeed << 13;
+  ulSeed ^= ulSeed >> 17;
+  ulSeed ^= ulSeed << 5;
+  return ulSeed;
+}
+
+/**
+  * @brief  Draw a write: mostly single variables, sometimes a batch or a
+  *   transaction of distinct variables.
+  * @param  Op: write drawn
+  * @param  Single: 1 for a single variable
+  * @retval None
+  */
+static void PC_NewOp(PC_OpTypeDef *Op, uint8_t Single)
+{
+  uint32_t draw = PC_Random() % 10, idx = 0, other = 0;
+
+  Op->Kind = PC_WRITE;
+  Op->NbVar = 1;
+  if ((Single == 0) && (draw == 0))
+  {
+    Op->Kind = PC_BATCH;
+  }
+#ifdef PC_HAVE_TRANSACTION
+  if ((Single == 0) && (draw == 1))
+  {
+    Op->Kind = PC_TRANSACTION;
+  }
+#endif
+  if (Op->Kind != PC_WRITE)
+  {
+    Op->NbVar = (uint16_t)(2 + (PC_Random() % (PC_MAX_OP_VARS - 1)));
+  }
+  for (idx = 0; idx < Op->NbVar; idx++)
+  {
+    Op->VirtAddress[idx] = (SIM_AddressType)(PC_Random() % ulNbVar);
+    for (other = 0; other < idx; other++)
+    {
+      if (Op->VirtAddress[other] == Op->VirtAddress[idx])
+      {
+        Op->VirtAddress[idx] = (SIM_AddressType)((Op->VirtAddress[idx] + 1) % ulNbVar);
+        other = (uint32_t)-1;
+      }
+    }
+    Op->Data[idx] = (SIM_DataType)PC_Random();
+  }
+}
+
+/**
+  * @brief  Apply a write to an image.
+  * @param  Image: image to update
+  * @param  Op: write
+  * @retval None
+  */
+static void PC_ApplyModel(PC_ImageTypeDef *Image, const PC_OpTypeDef *Op)
+{
+  uint32_t idx = 0;
+
+  for (idx = 0; idx < Op->NbVar; idx++)
+  {
+    Image->Value[Op->VirtAddress[idx]] = Op->Data[idx];
+    Image->Present[Op->VirtAddress[idx]] = 1;
+  }
+}
+
+/**
+  * @brief  Perform a write.
+  * @param  Op: write
+  * @retval Status of the library
+  */
+static SIM_StatusType PC_Apply(const PC_OpTypeDef *Op)
+{
+  if (Op->Kind == PC_BATCH)
+  {
+    return EE_WriteBatch(Op->VirtAddress, Op->Data, Op->NbVar);
+  }
+#ifdef PC_HAVE_TRANSACTION
+  if (Op->Kind == PC_TRANSACTION)
+  {
+    return EE_WriteTransaction(Op->VirtAddress, Op->Data, Op->NbVar);
+  }
+#endif
+  return EE_WriteVariable(Op->VirtAddress[0], Op->Data[0]);
+}
+
+/**
+  * @brief  Read every variable of the test.
+  * @param  Image: values read
+  * @retval None
+  */
+static void PC_ReadAll(PC_ImageTypeDef *Image)
+{
+  uint32_t idx = 0;
+
+  memset(Image, 0, sizeof(*Image));
+  for (idx = 0; idx < ulNbVar; idx++)
+  {
+    Image->Present[idx] = (EE_ReadVariable((SIM_AddressType)idx, &Image->Value[idx]) == SIM_EE_OK) ? 1 : 0;
+    if (Image->Present[idx] == 0)
+    {
+      Image->Value[idx] = 0;
+    }
+  }
+}
+
+/**
+  * @brief  Boot the device in a child process.
+  * @param  Run: what the device does once powered
+  * @param  Cut: operation to cut the power on, 0 for none
+  * @param  CutSeed: seed of the bits the cut operation leaves
+  * @retval Exit status of the child: 0 if it ran to the end,
+  *   SIM_POWER_CUT_EXIT if the power was cut, another value if it failed
+  */
+static int PC_Boot(void (*Run)(void), uint32_t Cut, uint32_t CutSeed)
+{
+  pid_t pid = 0;
+  int status = 0;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0)
+  {
+    return -1;
+  }
+  if (pid == 0)
+  {
+    SIM_ResetCounters();
+    SIM_SetPowerCut(Cut, CutSeed);
+    HAL_FLASH_Unlock();
+    Run();
+    _exit(0);
+  }
+  if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status))
+  {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+/**
+  * @brief  Child: write until the write that moves or collects a page for
+  *   the chosen time, and report its rank.
+  * @param  None
+  * @retval None
+  */
+static void PC_RunRecord(void)
+{
+  SIM_CountersTypeDef before, after;
+  uint32_t idx = 0, nbheavy = 0;
+
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+  for (idx = 0; idx < PC_MAX_OPS; idx++)
+  {
+    SIM_GetCounters(&before);
+    if (PC_Apply(&aOps[idx]) != SIM_EE_OK)
+    {
+      _exit(1);
+    }
+    SIM_GetCounters(&after);
+    if ((after.Erases != before.Erases) || ((after.Programs - before.Programs) > PC_TRANSFER_PROGRAMS))
+    {
+      if (++nbheavy == ulHeavy)
+      {
+        pShared->Target = idx;
+        return;
+      }
+    }
+  }
+}
+
+/**
+  * @brief  Child: the writes before the window.
+  * @param  None
+  * @retval None
+  */
+static void PC_RunPrefix(void)
+{
+  uint32_t idx = 0;
+
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+  for (idx = 0; idx < ulWindowStart; idx++)
+  {
+    if (PC_Apply(&aOps[idx]) != SIM_EE_OK)
+    {
+      _exit(1);
+    }
+  }
+}
+
+/**
+  * @brief  Child: boot and the writes of the window, reporting the write in
+  *   progress and the operations done.
+  * @param  None
+  * @retval None
+  */
+static void PC_RunWindow(void)
+{
+  SIM_CountersTypeDef counters;
+  uint32_t idx = 0;
+
+  pShared->Op = PC_IN_BOOT;
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+  for (idx = ulWindowStart; idx < ulWindowEnd; idx++)
+  {
+    pShared->Op = idx;
+    if (PC_Apply(&aOps[idx]) != SIM_EE_OK)
+    {
+      _exit(1);
+    }
+  }
+  pShared->Op = ulWindowEnd;
+  SIM_GetCounters(&counters);
+  pShared->Operations = counters.Programs + counters.Erases;
+}
+
+/**
+  * @brief  Child: a boot only, to be cut in the recovery.
+  * @param  None
+  * @retval None
+  */
+static void PC_RunInit(void)
+{
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+}
+
+/**
+  * @brief  Child: boot, read every variable, write a few, boot again and read
+  *   them all back.
+  * @param  None
+  * @retval None
+  */
+static void PC_RunCheck(void)
+{
+  SIM_CountersTypeDef counters;
+  uint32_t idx = 0;
+
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+  SIM_GetCounters(&counters);
+  pShared->InitPrograms = counters.Programs;
+  pShared->InitErases = counters.Erases;
+  pShared->InitTime = counters.FlashTime;
+  PC_ReadAll(&pShared->Recovered);
+  for (idx = 0; idx < PC_POST_WRITES; idx++)
+  {
+    if (PC_Apply(&aPost[idx]) != SIM_EE_OK)
+    {
+      _exit(1);
+    }
+  }
+  if (EE_Init() != SIM_EE_OK)
+  {
+    _exit(1);
+  }
+  PC_ReadAll(&pShared->Final);
+}
+
+/**
+  * @brief  Tell whether a value read is the one of a record a power cut left
+  *   half programmed, its virtual address damaged into the one of another
+  *   variable. Without a check in the record nothing tells it from a record
+  *   of that variable.
+  * @param  VirtAddress: variable read
+  * @param  Data: value read
+  * @retval 1 if a cut program left this record, 0 otherwise
+  */
+static uint8_t PC_IsTorn(uint32_t VirtAddress, SIM_DataType Data)
+{
+  SIM_DataType left = 0;
+  uint32_t idx = 0;
+
+  for (idx = 0; idx < ulNbCut; idx++)
+  {
+    if ((aCut[idx].Erase != 0) || (aCut[idx].Size < SIM_RECORD_SIZE))
+    {
+      continue;
+    }
+    memcpy(&left, &aCut[idx].Left[SIM_RECORD_DATA], sizeof(left));
+    if ((aCut[idx].Left[SIM_RECORD_VIRTADDRESS] == (uint8_t)VirtAddress) &&
+        (aCut[idx].Left[SIM_RECORD_VIRTADDRESS + 1] == (uint8_t)(VirtAddress >> 8)) && (left == Data))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  * @brief  Check the variables read after the cut.
+  * @param  Before: image before the write in progress
+  * @param  Op: write in progress, NULL if none
+  * @param  Expected: image the library holds, the write in progress resolved
+  *   as read
+  * @param  NbTorn: variables that read a record a cut left half programmed
+  * @retval Number of variables that do not read a value they may hold
+  */
+static uint32_t PC_Check(const PC_ImageTypeDef *Before, const PC_OpTypeDef *Op, PC_ImageTypeDef *Expected,
+                         uint32_t *NbTorn)
+{
+  const PC_ImageTypeDef *read = &pShared->Recovered;
+  uint32_t idx = 0, var = 0, nbfail = 0, nbnew = 0;
+
+  *Expected = *Before;
+  *NbTorn = 0;
+  for (var = 0; var < ulNbVar; var++)
+  {
+    if ((read->Present[var] == Before->Present[var]) && (read->Value[var] == Before->Value[var]))
+    {
+      continue;
+    }
+    for (idx = 0; (Op != NULL) && (idx < Op->NbVar); idx++)
+    {
+      if (Op->VirtAddress[idx] == var)
+      {
+        break;
+      }
+    }
+    if ((Op != NULL) && (idx < Op->NbVar) && (read->Present[var] != 0) && (read->Value[var] == Op->Data[idx]))
+    {
+      Expected->Value[var] = read->Value[var];
+      Expected->Present[var] = 1;
+      continue;
+    }
+    if ((read->Present[var] != 0) && PC_IsTorn(var, read->Value[var]))
+    {
+      Expected->Value[var] = read->Value[var];
+      Expected->Present[var] = 1;
+      (*NbTorn)++;
+      continue;
+    }
+    if (nbfail++ == 0)
+    {
+      ulLostVar = var;
+    }
+  }
+
+  /* A transaction lands as a whole or not at all */
+  if ((nbfail == 0) && (Op != NULL) && (Op->Kind == PC_TRANSACTION))
+  {
+    for (idx = 0; idx < Op->NbVar; idx++)
+    {
+      var = Op->VirtAddress[idx];
+      if ((read->Present[var] != 0) && (read->Value[var] == Op->Data[idx]))
+      {
+        nbnew++;
+      }
+    }
+    for (idx = 0; idx < Op->NbVar; idx++)
+    {
+      var = Op->VirtAddress[idx];
+      if ((nbnew != 0) && (nbnew != Op->NbVar) && ((read->Present[var] == 0) || (read->Value[var] != Op->Data[idx])))
+      {
+        nbfail++;
+      }
+    }
+  }
+  return nbfail;
+}
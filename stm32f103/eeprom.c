@@ -44,14 +44,234 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+/* Record geometry: a page starts with its status and sequence half-words, then
+   holds word records, the data half-word followed by the virtual address. The
+   loops below only step through records and reach their fields with these,
+   the fields being read through EE_FLASHRead */
+#define EE_HEADER_SIZE        ((uint32_t)4)
+#define EE_RECORD_SIZE        ((uint32_t)4)
+#define EE_RECORD_VIRTADDRESS_OFFSET ((uint32_t)2)
+#define EE_RECORD_VALUE(VirtAddress, Data) (((uint32_t)(VirtAddress) << 16) | (Data))
+
+/* Records as the shared engine of ee_core.h sees them: a whole record is read
+   at once, its fields are taken from the word */
+#define EE_CORE_STATUS        uint16_t
+#define EE_CORE_OK            HAL_OK
+#define EE_CORE_RECORD_TYPE   uint32_t
+#define EE_CORE_VIRTADDRESS_TYPE uint16_t
+#define EE_CORE_DATA_TYPE     uint16_t
+#define EE_CORE_HEADER_SIZE   EE_HEADER_SIZE
+#define EE_CORE_RECORD_SIZE   EE_RECORD_SIZE
+#define EE_CORE_READ(Address) EE_RecordRead(Address)
+#define EE_CORE_READ_VIRTADDRESS(Address) EE_RecordVirtAddress(Address)
+#define EE_CORE_ERASED(Record) ((Record) == 0xFFFFFFFF)
+#define EE_CORE_VIRTADDRESS(Record) ((uint16_t)((Record) >> (8 * EE_RECORD_VIRTADDRESS_OFFSET)))
+#define EE_CORE_DATA(Record)  ((uint16_t)(Record))
+#define EE_CORE_VALID(Record) 1
+#define EE_CORE_WRITE(VirtAddress, Data) EE_VerifyPageFullWriteVariable((VirtAddress), (Data))
+
+/* Index of a record in the emulation area, as kept by the RAM index, and back */
+#define EE_RECORD_INDEX(Address) ((uint16_t)(((Address) - EEPROM_START_ADDRESS) / EE_RECORD_SIZE))
+#define EE_RECORD_ADDRESS(Index) (EEPROM_START_ADDRESS + ((uint32_t)(Index) * EE_RECORD_SIZE))
+
+/* Virtual address given to EE_PageTransfer when no variable has to be written */
+#define EE_NO_VIRTADDRESS     ((uint16_t)0xFFFF)
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Page kept by EE_FindValidPage when the headers have to be read again */
+#define EE_PAGE_CACHE_EMPTY   ((uint16_t)0xffff)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Bytes of a blob a data record holds, and records a blob of Size bytes takes:
+   its data records, its CRC record and its header record */
+#define EE_BLOB_BYTES_PER_RECORD 2
+#define EE_BLOB_NB_SLOTS(Size) ((uint16_t)((((Size) + EE_BLOB_BYTES_PER_RECORD - 1) / EE_BLOB_BYTES_PER_RECORD) + 2))
+#define EE_IS_BLOB_VIRTADDRESS(VirtAddress) (((VirtAddress) >= EE_BLOB_VIRTADDRESS) && ((VirtAddress) < (EE_BLOB_VIRTADDRESS + NB_OF_BLOB)))
+
+/* Entries of the collection bitmap, the variables then the blobs, and slots
+   the collection may still have to copy to the newest page: the blobs only
+   count for the size of their last complete copy */
+#define EE_NB_OF_ITEMS        (NB_OF_VAR + NB_OF_BLOB)
+#define EE_GC_COPY_SLOTS      ((uint32_t)NB_OF_VAR + EE_BlobSlots())
+
+/* Slots of the blobs not counted since they last changed */
+#define EE_BLOB_SLOTS_UNKNOWN ((uint16_t)0xFFFF)
+#else
+#define EE_NB_OF_ITEMS        NB_OF_VAR
+#define EE_GC_COPY_SLOTS      ((uint32_t)NB_OF_VAR)
+#endif
+
+/* Steps of the collection of an old page */
+#define EE_GC_IDLE            ((uint8_t)0x00)
+#define EE_GC_MARK            ((uint8_t)0x01)
+#define EE_GC_COPY            ((uint8_t)0x02)
+#define EE_GC_ERASE           ((uint8_t)0x03)
+
+/* Budget given to EE_GcStep to run the collection to its end */
+#define EE_GC_NO_BUDGET       ((uint32_t)0xFFFFFFFF)
+
+#if (EE_USE_IT == 1)
+#if (EE_USE_WRITE_CURSOR == 0)
+#error "EE_USE_IT needs EE_USE_WRITE_CURSOR"
+#endif
+
+/* States of the queued writes */
+#define EE_IT_IDLE            ((uint8_t)0x00)    /* No write is queued */
+#define EE_IT_BUSY            ((uint8_t)0x01)    /* First queued write is programmed under interrupt */
+#define EE_IT_STALLED         ((uint8_t)0x02)    /* First queued write is left to EE_ProcessIT */
+
+/* Result of the Flash operation given by the HAL callbacks */
+#define EE_IT_PENDING         ((uint8_t)0x00)
+#define EE_IT_DONE            ((uint8_t)0x01)
+#define EE_IT_FAILED          ((uint8_t)0x02)
+#endif
+
 /* Private macro -------------------------------------------------------------*/
+/* Page sequence numbers run from 1 to 0xFFFE: 0xFFFF is an erased header and
+   0x0000 a page being erased */
+#define EE_SEQ_NEXT(Seq)      ((uint16_t)(((Seq) >= 0xFFFE) ? 1 : ((Seq) + 1)))
+#define EE_SEQ_PREV(Seq)      ((uint16_t)(((Seq) <= 1) ? 0xFFFE : ((Seq) - 1)))
+#define EE_SEQ_NEWER(Seq, Ref) ((int16_t)(uint16_t)((Seq) - (Ref)) > 0)
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Drop the page kept by EE_FindValidPage, done before a header is programmed
+   or a page erased */
+#define EE_PAGE_CACHE_RESET() (usHeadPage = EE_PAGE_CACHE_EMPTY)
+#else
+#define EE_PAGE_CACHE_RESET()
+#endif
+
+#if (EE_USE_IT == 1)
+/* Only the Flash interrupt is masked while the queue is updated */
+#define EE_IT_LOCK()          HAL_NVIC_DisableIRQ(FLASH_IRQn)
+#define EE_IT_UNLOCK()        HAL_NVIC_EnableIRQ(FLASH_IRQn)
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* The cache is updated with the interrupts masked, EE_Flush may be called from
+   the PVD interrupt */
+#define EE_CACHE_LOCK(Primask)   do { (Primask) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define EE_CACHE_UNLOCK(Primask) __set_PRIMASK(Primask)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Move the blobs read in place by EE_GetBlob to a new generation, done before
+   a blob is written or a page erased. Their slots are counted again */
+#define EE_BLOB_INVALIDATE()  do { ulBlobGeneration++; usBlobSlots = EE_BLOB_SLOTS_UNKNOWN; } while (0)
+#else
+#define EE_BLOB_INVALIDATE()
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Statistics updates, compiled out without EE_USE_STATS */
+#define EE_STATS_COUNT(Counter, Nb) (xStats.Counter += (uint32_t)(Nb))
+#define EE_STATS_TIME(Timing, Start) EE_StatsTime(&xStats.Timing, EE_CycleCount() - (Start))
+#else
+#define EE_STATS_COUNT(Counter, Nb)
+#define EE_STATS_TIME(Timing, Start)
+#endif
 /* Private variables ---------------------------------------------------------*/
 
-/* Global variable used to store variable value in read sequence */
-static uint16_t DataVar = 0;
+#if (EE_USE_WRITE_CURSOR == 1)
+/* Page the write cursor belongs to and address of its first free slot,
+   0xffffffff when the cursor has to be searched again */
 static uint16_t usValidpage = 0xffff;
 static uint32_t ulAddress = 0xffffffff;
-#define USE_ADDR_OPTIMIZATION 0
+#endif
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Newest page of the ring as found from the headers after the last header
+   change */
+static uint16_t usHeadPage = EE_PAGE_CACHE_EMPTY;
+#endif
+
+#if (EE_USE_RAM_INDEX == 1)
+/* The slots of the ring must fit the 16-bit index: fails to build, with an
+   array of negative size, when EE_NB_PAGES * PAGE_SIZE is over 256 Kbytes.
+   PAGE_SIZE holds a cast, so #if cannot test it */
+typedef uint8_t EE_RamIndexTooSmall[(((uint32_t)EE_NB_PAGES * PAGE_SIZE / EE_RECORD_SIZE) <= 0x10000) ? 1 : -1];
+
+/* Slot (4-byte unit counted from EEPROM_START_ADDRESS) of the latest record of
+   each variable in the ring, 0 when the variable has no record (slot 0 is
+   Page0 header) */
+static uint16_t ausVarIndex[NB_OF_VAR];
+static uint8_t ucVarIndexValid = 0;
+#if (EE_USE_BLOB == 1)
+/* Slot of the header record of the last complete copy of each blob */
+static uint16_t ausBlobIndex[NB_OF_BLOB];
+#endif
+#endif
+
+/* Collection of an old page: step, page collected, page being marked and
+   address reached in it, and variables a newer page holds */
+static uint8_t ucGcState = EE_GC_IDLE;
+static uint16_t usGcPage = 0xffff;
+static uint16_t usGcMarkPage = 0xffff;
+static uint32_t ulGcAddress = 0xffffffff;
+static uint32_t ulGcEndAddress = 0xffffffff;
+static uint32_t aulGcCopied[(EE_NB_OF_ITEMS + 31) / 32];
+#if (EE_USE_ERASE_COUNT == 1)
+/* Erase count of the page collected, read before its erase */
+static uint16_t usGcEraseCount = 0;
+#endif
+
+/* Set while a batch keeps the Flash unlocked across EE_FLASHWrite calls */
+static uint8_t ucFlashUnlocked = 0;
+
+#if (EE_USE_BLOB == 1)
+/* Generation of the pointers given by EE_GetBlob */
+static uint32_t ulBlobGeneration = 0;
+/* Slots the last complete copies of the blobs take */
+static uint16_t usBlobSlots = EE_BLOB_SLOTS_UNKNOWN;
+#endif
+
+#if (EE_USE_TRANSACTION == 1)
+/* ucTxnOpen is set while the records of a transaction are programmed,
+   ucTxnTorn while the write page ends with a transaction never committed */
+static uint8_t ucTxnOpen = 0;
+static uint8_t ucTxnTorn = 0;
+#endif
+
+#if (EE_USE_IT == 1)
+/* Writes queued by EE_WriteVariableIT, the first one is the one programmed */
+static uint16_t ausItVirtAddress[EE_IT_QUEUE_SIZE];
+static uint16_t ausItData[EE_IT_QUEUE_SIZE];
+static volatile uint16_t usItFirst = 0;
+static volatile uint16_t usItCount = 0;
+static volatile uint8_t ucItState = EE_IT_IDLE;
+static volatile uint8_t ucItResult = EE_IT_PENDING;
+/* Set when the queue unlocked the Flash, EE_ProcessIT locks it back once empty */
+static uint8_t ucItUnlocked = 0;
+
+/* Time usEE_Read and usEE_Write kept the interrupts masked, in core clock
+   cycles: last call and longest call */
+static uint32_t ulIrqMaskedLast = 0;
+static uint32_t ulIrqMaskedMax = 0;
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Counters and timings returned by EE_GetStats */
+static EE_StatsTypeDef xStats;
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/* Records programmed and pages erased since the measure of the write rate
+   started, and HAL tick it started at */
+static uint32_t ulWearRecords = 0;
+static uint32_t ulWearErases = 0;
+static uint32_t ulWearStart = 0;
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* Writes kept by EE_WriteVariableCached, one entry per variable, and HAL tick
+   of the oldest one */
+static uint16_t ausCacheVirtAddress[EE_CACHE_SIZE];
+static uint16_t ausCacheData[EE_CACHE_SIZE];
+static volatile uint16_t usCacheCount = 0;
+static uint32_t ulCacheStart = 0;
+#endif
+
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 // extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
@@ -59,9 +279,73 @@ static uint32_t ulAddress = 0xffffffff;
 /* Private functions ---------------------------------------------------------*/
 static HAL_StatusTypeDef EE_Format(void);
 static uint16_t EE_FindValidPage(uint8_t Operation);
+static uint16_t EE_ReadValidPage(void);
 static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
+static void EE_GcStart(uint16_t Page);
+static uint16_t EE_GcStep(uint32_t Budget);
+static uint32_t EE_GcPageEnd(uint16_t Page);
+static uint16_t EE_GcReserve(uint16_t NbSlot, uint8_t Atomic);
+static uint16_t EE_GetPageSeq(uint16_t Page);
+static uint16_t EE_FindSeqPage(uint16_t Seq);
+static uint16_t EE_OlderPage(uint16_t Page);
+static uint16_t EE_NewerPage(uint16_t Page);
+static uint16_t EE_FindTailPage(void);
+static uint16_t EE_FindErasedPage(uint16_t Page);
+static uint16_t EE_ErasePage(uint16_t Page);
+#if (EE_USE_ERASE_COUNT == 1)
+static uint8_t EE_ReadEraseCount(uint16_t Page, uint16_t *Count);
+static uint16_t EE_GetEraseCount(uint16_t Page);
+static uint16_t EE_WriteEraseCount(uint16_t Page, uint16_t Count);
+#endif
+static uint16_t EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data);
+static uint16_t EE_WriteRecords(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                                const uint16_t *Data, uint16_t NbVar, uint8_t Atomic);
+static uint32_t EE_GetWriteCursor(uint16_t Page);
+static uint32_t EE_FindWriteCursor(uint16_t Page);
+#if (EE_USE_TRANSACTION == 1)
+static uint32_t EE_TxnCommittedEnd(uint16_t Page);
+static uint16_t EE_TxnRecover(void);
+#endif
+#if (EE_USE_RAM_INDEX == 1)
+static void EE_IndexBuild(void);
+#endif
+#if (EE_USE_IT == 1)
+static void EE_ITStart(void);
+static void EE_ITUnlockFlash(void);
+static void EE_ITLockFlash(void);
+static uint8_t EE_ITFindQueued(uint16_t VirtAddress, uint16_t *Data);
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+static uint16_t EE_CacheFind(uint16_t VirtAddress);
+static void EE_CacheDrop(const uint16_t *VirtAddress, uint16_t FirstVirtAddress, uint16_t NbVar);
+#endif
+static uint16_t EE_ReadStored(uint16_t VirtAddress, uint16_t *Data);
+#if (EE_USE_BLOB == 1)
+static uint16_t EE_BlobFind(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size, uint32_t *Header);
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size);
+static uint16_t EE_BlobCopy(uint32_t Address, uint16_t Size);
+static uint16_t EE_BlobSlots(void);
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+static uint8_t EE_IsUnchanged(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                              const uint16_t *Data, uint16_t VarIdx);
+#endif
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+static uint32_t EE_IrqMaskStart(void);
+static void EE_IrqMaskEnd(uint32_t Start);
+#endif
+#if (EE_USE_STATS == 1)
+static uint32_t EE_CycleCount(void);
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed);
+#endif
+static uint32_t EE_RecordRead(uint32_t Address);
+static uint16_t EE_RecordVirtAddress(uint32_t Address);
+
+/* Record engine shared by the ports */
+#include "ee_core.h"
 
 #include "STMFlash.h"
 #include "includes.h"
@@ -69,6 +353,12 @@ static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
 uint16_t EE_FlashErase(uint32_t addr, size_t size)
 {
   uint16_t Result = 0;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+  EE_STATS_COUNT(Erases, size / FLASH_PAGE_SIZE);
+  EE_BLOB_INVALIDATE();
 #if 1
   Result = ucSTMFlashErase(addr, size);
 #else
@@ -82,6 +372,10 @@ uint16_t EE_FlashErase(uint32_t addr, size_t size)
     Result = 1;
   }
 #endif
+  if (Result == 0)
+  {
+    EE_STATS_TIME(Erase, statsstart);
+  }
   return Result;
 }
 
@@ -89,9 +383,23 @@ uint16_t EE_FLASHWrite(uint32_t addr, uint8_t *pData, size_t size)
 {
   uint16_t Result = 0;
 #if 1
-  HAL_FLASH_Unlock();
-  Result = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr, *(uint16_t *)pData);
-  HAL_FLASH_Lock();
+  if (ucFlashUnlocked == 0)
+  {
+    HAL_FLASH_Unlock();
+  }
+  if (size == 4)
+  {
+    /* A whole record: one call, the low half-word is programmed first */
+    Result = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr, *(uint32_t *)pData);
+  }
+  else
+  {
+    Result = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr, *(uint16_t *)pData);
+  }
+  if (ucFlashUnlocked == 0)
+  {
+    HAL_FLASH_Lock();
+  }
 #else
   sfud_err sfud_result = SFUD_SUCCESS;
   const sfud_flash *flash = sfud_get_device_table() + SFUD_MX25_DEVICE_INDEX;
@@ -118,10 +426,11 @@ uint16_t EE_FLASHRead(uint32_t addr, uint8_t *pData, size_t size)
   else if (size == 4)
   {
     uint32_t ulData = (*(__IO uint32_t *)addr);
+    /* Bytes in memory order, as for the half-word */
     *pData = ulData & 0x00ff;
-    *(pData + 1) = (ulData >> 24) & 0x00ff;
+    *(pData + 1) = (ulData >> 8) & 0x00ff;
     *(pData + 2) = (ulData >> 16) & 0x00ff;
-    *(pData + 3) = (ulData >> 8) & 0x00ff;
+    *(pData + 3) = (ulData >> 24) & 0x00ff;
   }
 #else
   sfud_err sfud_result = SFUD_SUCCESS;
@@ -136,6 +445,76 @@ uint16_t EE_FLASHRead(uint32_t addr, uint8_t *pData, size_t size)
 #endif
   return Result;
 }
+/* Reads the record at Address as one word, its bytes in memory order */
+static uint32_t EE_RecordRead(uint32_t Address)
+{
+  uint32_t record = 0xFFFFFFFF;
+
+  EE_FLASHRead(Address, (uint8_t *)&record, 4);
+  return record;
+}
+/* Reads only the virtual address of the record at Address */
+static uint16_t EE_RecordVirtAddress(uint32_t Address)
+{
+  uint16_t virtaddress = 0xFFFF;
+
+  EE_FLASHRead(Address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&virtaddress, 2);
+  return virtaddress;
+}
+/* Returns 1 if the size bytes from addr, a word aligned area, are all erased */
+uint16_t EE_FLASHBlank(uint32_t addr, size_t size)
+{
+#if 1
+  const __IO uint32_t *pWord = (const __IO uint32_t *)addr;
+  size_t nbword = size / 4;
+
+  /* Four words per test: an erased area ANDs to all ones */
+  while (nbword >= 4)
+  {
+    if ((pWord[0] & pWord[1] & pWord[2] & pWord[3]) != 0xFFFFFFFF)
+    {
+      return 0;
+    }
+    pWord += 4;
+    nbword -= 4;
+  }
+  while (nbword > 0)
+  {
+    if (*pWord != 0xFFFFFFFF)
+    {
+      return 0;
+    }
+    pWord++;
+    nbword--;
+  }
+#else
+  sfud_err sfud_result = SFUD_SUCCESS;
+  const sfud_flash *flash = sfud_get_device_table() + SFUD_MX25_DEVICE_INDEX;
+  uint32_t aulData[16];
+  size_t chunk, idx;
+
+  /* Read in chunks, then test them word by word */
+  while (size > 0)
+  {
+    chunk = (size < sizeof(aulData)) ? size : sizeof(aulData);
+    sfud_result = sfud_read(flash, addr, chunk, (uint8_t *)aulData);
+    if (sfud_result != SFUD_SUCCESS)
+    {
+      return 0;
+    }
+    for (idx = 0; idx < chunk / 4; idx++)
+    {
+      if (aulData[idx] != 0xFFFFFFFF)
+      {
+        return 0;
+      }
+    }
+    addr += chunk;
+    size -= chunk;
+  }
+#endif
+  return 1;
+}
 
 /**
   * @brief  Restore the pages to a known good state in case of page's status
@@ -146,290 +525,238 @@ uint16_t EE_FLASHRead(uint32_t addr, uint8_t *pData, size_t size)
   */
 uint16_t EE_Init(void)
 {
-  uint16_t pagestatus0 = 6, pagestatus1 = 6;
-  uint16_t varidx = 0;
-  uint16_t eepromstatus = 0, readstatus = 0;
-  int16_t x = -1;
+  uint16_t page = 0, pagestatus = 6, pageseq = 0;
+  uint16_t legacypage = NO_VALID_PAGE, receivepage = NO_VALID_PAGE, validpage = NO_VALID_PAGE;
+  uint16_t headpage = NO_VALID_PAGE, chain = 0, headchain = 0;
+  uint16_t eepromstatus = 0, WData = 0;
+  uint32_t chainmask = 0;
   HAL_StatusTypeDef flashstatus;
-  uint32_t page_error = 0;
-  FLASH_EraseInitTypeDef s_eraseinit;
 
-  /* Get Page0 status */
-  EE_FLASHRead(PAGE0_BASE_ADDRESS, (uint8_t *)&pagestatus0, 2);
-  /* Get Page1 status */
-  EE_FLASHRead(PAGE1_BASE_ADDRESS, (uint8_t *)&pagestatus1, 2);
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
 
-  /* Fill EraseInit structure*/
-  s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = PAGE0_ID;
-  s_eraseinit.NbPages = 1;
+#if (EE_USE_RAM_INDEX == 1)
+  /* The index is rebuilt once the pages are repaired */
+  ucVarIndexValid = 0;
+#endif
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The cursor is searched again once the pages are repaired */
+  ulAddress = 0xffffffff;
+#endif
+  /* So is the newest page */
+  EE_PAGE_CACHE_RESET();
+  EE_BLOB_INVALIDATE();
+  /* No batch, transaction or collection is in progress */
+  ucFlashUnlocked = 0;
+#if (EE_USE_TRANSACTION == 1)
+  ucTxnOpen = 0;
+#endif
+  ucGcState = EE_GC_IDLE;
+#if (EE_USE_ERASE_COUNT == 1)
+  EE_ResetWear();
+#endif
 
-  /* Check for invalid header states and repair if necessary */
-  switch (pagestatus0)
+  /* Look for the pages of the two-page layout: a valid page without sequence
+     number, and a page receiving data from it */
+  for (page = 0; page < EE_NB_PAGES; page++)
   {
-  case ERASED:
-    if (pagestatus1 == VALID_PAGE) /* Page0 erased, Page1 valid */
+    EE_FLASHRead(EE_PAGE_ADDRESS(page), (uint8_t *)&pagestatus, 2);
+    EE_FLASHRead(EE_PAGE_ADDRESS(page) + 2, (uint8_t *)&pageseq, 2);
+    if ((pagestatus == VALID_PAGE) && (pageseq == 0xFFFF))
     {
-      /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-      {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-        /* If erase operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-      }
+      /* Two valid pages is an invalid state: both are dropped */
+      legacypage = (legacypage == NO_VALID_PAGE) ? page : EE_NB_PAGES;
     }
-    else if (pagestatus1 == RECEIVE_DATA) /* Page0 erased, Page1 receive */
+    else if (pagestatus == RECEIVE_DATA)
     {
-      /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-      {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-        /* If erase operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-      }
-      /* Mark Page1 as valid */
-      uint16_t WData = VALID_PAGE;
-      flashstatus = EE_FLASHWrite(PAGE1_BASE_ADDRESS, (uint8_t *)&WData, 2);
+      receivepage = (receivepage == NO_VALID_PAGE) ? page : EE_NB_PAGES;
+    }
+    else if (EE_GetPageSeq(page) != 0)
+    {
+      validpage = page;
+    }
+  }
+
+  /* The valid page of the two-page layout becomes the first page of the ring */
+  if ((legacypage < EE_NB_PAGES) && (validpage == NO_VALID_PAGE))
+  {
+    WData = 1;
+    EE_PAGE_CACHE_RESET();
+    flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(legacypage) + 2, (uint8_t *)&WData, 2);
+    /* If program operation was failed, a Flash error code is returned */
+    if (flashstatus != HAL_OK)
+    {
+      return flashstatus;
+    }
+  }
+
+  /* A page receiving data holds the newest records: it becomes the newest page */
+  if (receivepage < EE_NB_PAGES)
+  {
+    headpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    EE_FLASHRead(EE_PAGE_ADDRESS(receivepage) + 2, (uint8_t *)&pageseq, 2);
+    if (pageseq == 0xFFFF)
+    {
+      WData = (headpage == NO_VALID_PAGE) ? 1 : EE_SEQ_NEXT(EE_GetPageSeq(headpage));
+      EE_PAGE_CACHE_RESET();
+      flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(receivepage) + 2, (uint8_t *)&WData, 2);
       /* If program operation was failed, a Flash error code is returned */
       if (flashstatus != HAL_OK)
       {
         return flashstatus;
       }
     }
-    else /* First EEPROM access (Page0&1 are erased) or invalid state -> format EEPROM */
+    WData = VALID_PAGE;
+    EE_PAGE_CACHE_RESET();
+    flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(receivepage), (uint8_t *)&WData, 2);
+    /* If program operation was failed, a Flash error code is returned */
+    if (flashstatus != HAL_OK)
     {
-      /* Erase both Page0 and Page1 and set Page0 as valid page */
-      flashstatus = EE_Format();
-      /* If erase/program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
-      }
+      return flashstatus;
     }
-    break;
+  }
 
-  case RECEIVE_DATA:
-    if (pagestatus1 == VALID_PAGE) /* Page0 receive, Page1 valid */
+  /* Keep the longest run of consecutive sequence numbers ending at a newest page */
+  headpage = NO_VALID_PAGE;
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    if ((EE_GetPageSeq(page) != 0) && (EE_NewerPage(page) == NO_VALID_PAGE))
     {
-      /* Transfer data from Page1 to Page0 */
-      for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+      chain = 0;
+      for (validpage = page; (validpage != NO_VALID_PAGE) && (chain < EE_NB_PAGES); validpage = EE_OlderPage(validpage))
       {
-        uint16_t RData;
-        EE_FLASHRead(PAGE0_BASE_ADDRESS + 6, (uint8_t *)&RData, 2);
-        if (RData == varidx)
-        {
-          x = varidx;
-        }
-        if (varidx != x)
-        {
-          /* Read the last variables' updates */
-          readstatus = EE_ReadVariable(varidx, &DataVar);
-          /* In case variable corresponding to the virtual address was found */
-          if (readstatus != 0x1)
-          {
-            /* Transfer the variable to the Page0 */
-            eepromstatus = EE_VerifyPageFullWriteVariable(varidx, DataVar);
-            /* If program operation was failed, a Flash error code is returned */
-            if (eepromstatus != HAL_OK)
-            {
-              return eepromstatus;
-            }
-          }
-        }
-      }
-      /* Mark Page0 as valid */
-      uint16_t WData = VALID_PAGE;
-      flashstatus = EE_FLASHWrite(PAGE0_BASE_ADDRESS, (uint8_t *)&WData, 2);
-      /* If program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
+        chain++;
       }
-      s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-      s_eraseinit.PageAddress = PAGE1_ID;
-      s_eraseinit.NbPages = 1;
-      /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      if (chain > headchain)
       {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-        /* If erase operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
+        headpage = page;
+        headchain = chain;
       }
     }
-    else if (pagestatus1 == ERASED) /* Page0 receive, Page1 erased */
+  }
+  for (validpage = headpage, chain = 0; (validpage != NO_VALID_PAGE) && (chain < headchain); validpage = EE_OlderPage(validpage), chain++)
+  {
+    chainmask |= (uint32_t)1 << validpage;
+  }
+
+  /* Any other page is erased: half erased pages, pages being opened or being
+     dropped by a compaction, invalid states */
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    if ((chainmask & ((uint32_t)1 << page)) == 0)
     {
-      s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-      s_eraseinit.PageAddress = PAGE1_ID;
-      s_eraseinit.NbPages = 1;
-      /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      EE_FLASHRead(EE_PAGE_ADDRESS(page) + 2, (uint8_t *)&pageseq, 2);
+      EE_FLASHRead(EE_PAGE_ADDRESS(page), (uint8_t *)&pagestatus, 2);
+      if ((pagestatus != ERASED) || (pageseq != 0xFFFF) || !EE_VerifyPageFullyErased(EE_PAGE_ADDRESS(page)))
       {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
+        flashstatus = EE_ErasePage(page);
         /* If erase operation was failed, a Flash error code is returned */
         if (flashstatus != HAL_OK)
         {
           return flashstatus;
         }
       }
-      /* Mark Page0 as valid */
-      uint16_t WData = VALID_PAGE;
-      flashstatus = EE_FLASHWrite(PAGE0_BASE_ADDRESS, (uint8_t *)&WData, 2);
-      /* If program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
-      }
     }
-    else /* Invalid state -> format eeprom */
+  }
+
+  if (headpage == NO_VALID_PAGE)
+  {
+    /* First EEPROM access or invalid state -> format EEPROM */
+    flashstatus = EE_Format();
+    /* If erase/program operation was failed, a Flash error code is returned */
+    if (flashstatus != HAL_OK)
     {
-      /* Erase both Page0 and Page1 and set Page0 as valid page */
-      flashstatus = EE_Format();
-      /* If erase/program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
-      }
+      return flashstatus;
     }
-    break;
-
-  case VALID_PAGE:
-    if (pagestatus1 == VALID_PAGE) /* Invalid state -> format eeprom */
+  }
+  else
+  {
+#if (EE_USE_TRANSACTION == 1)
+    /* Drop the records of a transaction a power loss did not let commit
+       before anything is appended behind them. A transaction only begins
+       with an erased page left to move to or no copy left to append. */
+    if (EE_TxnCommittedEnd(headpage) != EE_FindWriteCursor(headpage))
     {
-      /* Erase both Page0 and Page1 and set Page0 as valid page */
-      flashstatus = EE_Format();
-      /* If erase/program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
-      }
+      ucTxnTorn = 1;
     }
-    else if (pagestatus1 == ERASED) /* Page0 valid, Page1 erased */
+    if (headchain < EE_NB_PAGES)
     {
-      s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-      s_eraseinit.PageAddress = PAGE1_ID;
-      s_eraseinit.NbPages = 1;
-      /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      eepromstatus = EE_TxnRecover();
+      if (eepromstatus != HAL_OK)
       {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-        /* If erase operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
+        return eepromstatus;
       }
     }
-    else /* Page0 valid, Page1 receive */
+#endif
+    if (headchain >= EE_NB_PAGES)
     {
-      /* Transfer data from Page0 to Page1 */
-      for (varidx = 0; varidx < NB_OF_VAR; varidx++)
-      {
-        uint16_t RData;
-        EE_FLASHRead(PAGE1_BASE_ADDRESS + 6, (uint8_t *)&RData, 2);
-        if (RData == varidx)
-        {
-          x = varidx;
-        }
-        if (varidx != x)
-        {
-          /* Read the last variables' updates */
-          readstatus = EE_ReadVariable(varidx, &DataVar);
-          /* In case variable corresponding to the virtual address was found */
-          if (readstatus != 0x1)
-          {
-            /* Transfer the variable to the Page1 */
-            eepromstatus = EE_VerifyPageFullWriteVariable(varidx, DataVar);
-            /* If program operation was failed, a Flash error code is returned */
-            if (eepromstatus != HAL_OK)
-            {
-              return eepromstatus;
-            }
-          }
-        }
-      }
-      /* Mark Page1 as valid */
-      uint16_t WData = VALID_PAGE;
-      flashstatus = EE_FLASHWrite(PAGE1_BASE_ADDRESS, (uint8_t *)&WData, 2);
+      /* A compaction was cut by a power loss: no page is left for the next one */
+      EE_GcStart(EE_FindTailPage());
+      eepromstatus = EE_GcStep(EE_GC_NO_BUDGET);
       /* If program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
+      if (eepromstatus != HAL_OK)
       {
-        return flashstatus;
-      }
-      s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-      s_eraseinit.PageAddress = PAGE0_ID;
-      s_eraseinit.NbPages = 1;
-      /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-      {
-        flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-        /* If erase operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
+        return eepromstatus;
       }
     }
-    break;
-
-  default: /* Any other state -> format eeprom */
-    /* Erase both Page0 and Page1 and set Page0 as valid page */
-    flashstatus = EE_Format();
-    /* If erase/program operation was failed, a Flash error code is returned */
-    if (flashstatus != HAL_OK)
+#if (EE_USE_TRANSACTION == 1)
+    eepromstatus = EE_TxnRecover();
+    if (eepromstatus != HAL_OK)
     {
-      return flashstatus;
+      return eepromstatus;
     }
-    break;
+#endif
+  }
+
+#if (EE_USE_RAM_INDEX == 1)
+  EE_IndexBuild();
+#endif
+#if (EE_USE_WRITE_CURSOR == 1)
+  usValidpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (usValidpage != NO_VALID_PAGE)
+  {
+    ulAddress = EE_FindWriteCursor(usValidpage);
   }
+#endif
 
   return HAL_OK;
 }
 
 /**
-  * @brief  Verify if specified page is fully erased.
+  * @brief  Verify if specified page is fully erased, both half-words of
+  *   every record included.
   * @param  Address: page address
-  *   This parameter can be one of the following values:
-  *     @arg PAGE0_BASE_ADDRESS: Page0 base address
-  *     @arg PAGE1_BASE_ADDRESS: Page1 base address
+  *   This parameter can be the base address of any page of the ring
   * @retval page fully erased status:
   *           - 0: if Page not erased
   *           - 1: if Page erased
   */
 uint16_t EE_VerifyPageFullyErased(uint32_t Address)
 {
-  uint32_t readstatus = 1;
-  uint16_t addressvalue = 0x5555;
+  uint32_t endaddress = Address + PAGE_SIZE;
+#if (EE_USE_ERASE_COUNT == 1)
+  uint16_t erasecount = 0;
+#endif
 
-  /* Check each active page address starting from end */
-  while (Address <= PAGE0_END_ADDRESS)
+  /* The header first: a page cut while it was erased holds what is left of
+     its data from its start, its Flash pages being erased header last */
+  if (!EE_FLASHBlank(Address, EE_HEADER_SIZE))
   {
-    /* Get the current location content to be compared with virtual address */
-    EE_FLASHRead(Address, (uint8_t *)&addressvalue, 2);
-
-    /* Compare the read address with the virtual address */
-    if (addressvalue != ERASED)
-    {
-
-      /* In case variable value is read, reset readstatus flag */
-      readstatus = 0;
-
-      break;
-    }
-    /* Next address location */
-    Address = Address + 4;
+    return 0;
+  }
+  Address = Address + EE_HEADER_SIZE;
+#if (EE_USE_ERASE_COUNT == 1)
+  /* The erase count programmed right after the erase is not data */
+  if (EE_ReadEraseCount((uint16_t)((Address - EE_HEADER_SIZE - EEPROM_START_ADDRESS) / PAGE_SIZE), &erasecount))
+  {
+    Address = Address + EE_RECORD_SIZE;
   }
+#endif
 
-  /* Return readstatus value: (0: Page not erased, 1: Page erased) */
-  return readstatus;
+  /* Then the records, whole words at a time */
+  return EE_FLASHBlank(Address, endaddress - Address);
 }
 
 /**
@@ -444,395 +771,2585 @@ uint16_t EE_VerifyPageFullyErased(uint32_t Address)
   */
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t *Data)
 {
-  uint16_t validpage = PAGE0;
-  uint16_t addressvalue = 0x5555, readstatus = 1;
-  uint32_t address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
-
-  /* Get active Page for read operation */
-  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+#if (EE_USE_WRITE_CACHE == 1)
+  uint16_t slot = 0;
+#endif
 
-  /* Check if there is no valid page */
-  if (validpage == NO_VALID_PAGE)
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write is newer than the queued writes and the Flash */
+  slot = EE_CacheFind(VirtAddress);
+  if (slot < usCacheCount)
   {
-    return NO_VALID_PAGE;
+    *Data = ausCacheData[slot];
+    return 0;
   }
+#endif
 
-  /* Get the valid Page start Address */
-  PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE));
-
-  /* Get the valid Page end Address */
-#if (USE_ADDR_OPTIMIZATION == 0)
-  address = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + validpage) * PAGE_SIZE));
-#else
-  if (ulAddress == 0xffffffff)
-  {
-    address = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + validpage) * PAGE_SIZE));
-  }
-  else
+#if (EE_USE_IT == 1)
+  /* A queued write is newer than the Flash */
+  if (EE_ITFindQueued(VirtAddress, Data) != 0)
   {
-    address = ulAddress - 2;
+    return 0;
   }
 #endif
-  /* Check each active page address starting from end */
-  while (address > (PageStartAddress + 2))
-  {
-    /* Get the current location content to be compared with virtual address */
-    EE_FLASHRead(address, (uint8_t *)&addressvalue, 2);
 
-    /* Compare the read address with the virtual address */
-    if (addressvalue == VirtAddress)
-    {
-      /* Get content of Address-2 which is variable value */
-      EE_FLASHRead(address - 2, (uint8_t *)Data, 2);
+  return EE_ReadStored(VirtAddress, Data);
+}
+
+/**
+  * @brief  Returns the data of the last record of a variable in Flash, leaving
+  *   aside the cached and the queued writes
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: Global variable contains the read variable value
+  * @retval Success or error status:
+  *           - 0: if variable was found
+  *           - 1: if the variable was not found
+  *           - NO_VALID_PAGE: if no valid page was found.
+  */
+static uint16_t EE_ReadStored(uint16_t VirtAddress, uint16_t *Data)
+{
+  uint16_t validpage = PAGE0, chain = 0, readstatus = 1;
+  uint32_t endaddress = EEPROM_START_ADDRESS, record = 0xFFFFFFFF;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+#if (EE_USE_RAM_INDEX == 1)
+  /* Variables covered by the index are looked up without scanning the page */
+  if ((ucVarIndexValid != 0) && (VirtAddress < NB_OF_VAR))
+  {
+    if (ausVarIndex[VirtAddress] != 0)
+    {
+      EE_FLASHRead(EE_RECORD_ADDRESS(ausVarIndex[VirtAddress]), (uint8_t *)Data, 2);
+      readstatus = 0;
+    }
+    EE_STATS_TIME(Read, statsstart);
+    return readstatus;
+  }
+#endif
+
+  /* Get active Page for read operation */
+  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+
+  /* Check if there is no valid page */
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  /* Walk the ring from the newest page to the oldest one */
+  for (chain = 0; (validpage != NO_VALID_PAGE) && (chain < EE_NB_PAGES) && (readstatus != 0); chain++)
+  {
+    /* Get the valid Page end Address */
+    endaddress = EE_PAGE_ADDRESS(validpage) + PAGE_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+    /* Records of a transaction not committed yet are not visible */
+    endaddress = EE_TxnCommittedEnd(validpage);
+#elif (EE_USE_WRITE_CURSOR == 1)
+    /* Nothing is written past the cursor of the page */
+    if ((usValidpage == validpage) && (ulAddress != 0xffffffff))
+    {
+      endaddress = ulAddress;
+    }
+#endif
+    /* Check each active page record starting from end */
+    if (EE_CoreFindRecord(EE_PAGE_ADDRESS(validpage), endaddress, VirtAddress, &record) != 0)
+    {
+      /* Get the variable value of the record */
+      *Data = EE_CORE_DATA(record);
 
       /* In case variable value is read, reset readstatus flag */
       readstatus = 0;
+    }
 
-      break;
+    validpage = EE_OlderPage(validpage);
+  }
+  EE_STATS_TIME(Read, statsstart);
+
+  /* Return readstatus value: (0: variable exist, 1: variable doesn't exist) */
+  return readstatus;
+}
+
+#if (EE_USE_SKIP_UNCHANGED == 1)
+/**
+  * @brief  Tells whether a record of a set leaves its variable as it is: the
+  *   variable holds the data in Flash and no earlier record of the set writes it.
+  * @param  VirtAddress: virtual addresses of the set, NULL for consecutive ones
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: data of the set
+  * @param  VarIdx: index of the record in the set
+  * @retval 1 if the record does not need to be programmed, 0 otherwise
+  */
+static uint8_t EE_IsUnchanged(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                              const uint16_t *Data, uint16_t VarIdx)
+{
+  uint16_t virtaddress = (VirtAddress != NULL) ? VirtAddress[VarIdx] : (uint16_t)(FirstVirtAddress + VarIdx);
+  uint16_t storeddata = 0;
+  uint16_t idx = 0;
+
+  if ((EE_ReadStored(virtaddress, &storeddata) != 0) || (storeddata != Data[VarIdx]))
+  {
+    return 0;
+  }
+  if (VirtAddress != NULL)
+  {
+    for (idx = 0; idx < VarIdx; idx++)
+    {
+      if (VirtAddress[idx] == virtaddress)
+      {
+        return 0;
+      }
     }
-    else
+  }
+  return 1;
+}
+#endif
+
+/**
+  * @brief  Reads the last stored data of all the variables in one pass over
+  *   the ring, from its oldest record to its newest one.
+  * @param  Image: RAM image of NB_OF_VAR variables, the entries of variables
+  *   that have no record are left unchanged
+  * @param  PresentBitmap: (NB_OF_VAR + 7) / 8 bytes, bit n set when variable n
+  *   was found, or NULL
+  * @retval Success or error status:
+  *           - 0: on success
+  *           - NO_VALID_PAGE: if no valid page was found.
+  */
+uint16_t EE_ReadAll(uint16_t *Image, uint8_t *PresentBitmap)
+{
+  uint16_t validpage = PAGE0, varidx = 0, chain = 0;
+#if (EE_USE_IT == 1) || (EE_USE_WRITE_CACHE == 1)
+  uint16_t addressvalue = 0x5555;
+#endif
+  uint32_t pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+
+  /* Get the oldest page of the ring */
+  validpage = EE_FindTailPage();
+
+  /* Check if there is no valid page */
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  if (PresentBitmap != NULL)
+  {
+    for (varidx = 0; varidx < (NB_OF_VAR + 7) / 8; varidx++)
     {
-      /* Next address location */
-      address = address - 4;
+      PresentBitmap[varidx] = 0;
+    }
+  }
+
+  for (chain = 0; (validpage != NO_VALID_PAGE) && (chain < EE_NB_PAGES); chain++)
+  {
+    pageendaddress = EE_PAGE_ADDRESS(validpage) + PAGE_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+    /* Records of a transaction not committed yet are not visible */
+    pageendaddress = EE_TxnCommittedEnd(validpage);
+#endif
+
+    /* Newer records overwrite older ones in the image */
+    EE_CoreReadRecords(EE_PAGE_ADDRESS(validpage), pageendaddress, Image, PresentBitmap);
+
+    validpage = EE_NewerPage(validpage);
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes are newer than the Flash */
+  EE_IT_LOCK();
+  for (varidx = 0; varidx < usItCount; varidx++)
+  {
+    addressvalue = ausItVirtAddress[(usItFirst + varidx) % EE_IT_QUEUE_SIZE];
+    if (addressvalue < NB_OF_VAR)
+    {
+      Image[addressvalue] = ausItData[(usItFirst + varidx) % EE_IT_QUEUE_SIZE];
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[addressvalue >> 3] |= (uint8_t)(1 << (addressvalue & 0x07));
+      }
+    }
+  }
+  EE_IT_UNLOCK();
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes are newer than the queued writes and the Flash */
+  for (varidx = 0; varidx < usCacheCount; varidx++)
+  {
+    addressvalue = ausCacheVirtAddress[varidx];
+    if (addressvalue < NB_OF_VAR)
+    {
+      Image[addressvalue] = ausCacheData[varidx];
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[addressvalue >> 3] |= (uint8_t)(1 << (addressvalue & 0x07));
+      }
+    }
+  }
+#endif
+
+  return 0;
+}
+
+/**
+  * @brief  Writes/upadtes variable data in EEPROM.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: 16 bit data to be written
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t Status = 0;
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Nothing to program if the variable already holds the data */
+  if (EE_IsUnchanged(&VirtAddress, 0, &Data, 0) != 0)
+  {
+    EE_STATS_COUNT(Skipped, 1);
+    return HAL_OK;
+  }
+#endif
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  Status = EE_TxnRecover();
+  if (Status != HAL_OK)
+  {
+    return Status;
+  }
+#endif
+
+  /* Keep room for the records a collection in progress still has to copy */
+  Status = EE_GcReserve(1, 0);
+  if (Status != HAL_OK)
+  {
+    return Status;
+  }
+
+  /* Write the variable virtual address and value in the EEPROM */
+  Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+
+  /* In case the EEPROM active page is full */
+  if (Status == PAGE_FULL)
+  {
+    /* Perform Page transfer */
+    Status = EE_PageTransfer(VirtAddress, Data);
+  }
+
+  /* Return last operation status */
+  return Status;
+}
+
+/**
+  * @brief  Writes/updates a set of variables in EEPROM with a single free space
+  *   check and a single Flash unlock.
+  * @param  VirtAddress: virtual addresses of the variables
+  * @param  Data: 16 bit data of the variables
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the variables do not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteBatch(const uint16_t *VirtAddress, const uint16_t *Data, uint16_t NbVar)
+{
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(VirtAddress, 0, NbVar);
+#endif
+  return EE_WriteRecords(VirtAddress, 0, Data, NbVar, 0);
+}
+
+#if (EE_USE_TRANSACTION == 1)
+/**
+  * @brief  Writes/updates a set of variables in EEPROM all at once: the records
+  *   are framed by a begin and a commit marker and are only read back once the
+  *   commit marker is in Flash.
+  * @param  VirtAddress: virtual addresses of the variables
+  * @param  Data: 16 bit data of the variables
+  * @param  NbVar: number of variables, up to EE_TXN_MAX_RECORDS
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the variables do not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteTransaction(const uint16_t *VirtAddress, const uint16_t *Data, uint16_t NbVar)
+{
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(VirtAddress, 0, NbVar);
+#endif
+  return EE_WriteRecords(VirtAddress, 0, Data, NbVar, 1);
+}
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/**
+  * @brief  Writes/updates a variable through the write cache. Only the RAM
+  *   cache is updated, a later write of the variable replaces this one, and
+  *   the cache is written to Flash by EE_Flush or EE_ProcessCache, or here
+  *   when it is full and the variable is not cached yet. A cached write is
+  *   lost if the power fails before: call EE_Flush on a supply drop. To be
+  *   called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: data to be written
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if the full cache could not be written
+  */
+uint16_t EE_WriteVariableCached(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t status = HAL_OK;
+  uint32_t primask = 0;
+  uint16_t slot = 0;
+
+  /* A variable not cached yet needs a free entry */
+  if ((usCacheCount >= EE_CACHE_SIZE) && (EE_CacheFind(VirtAddress) >= usCacheCount))
+  {
+    status = EE_Flush();
+    if (status != HAL_OK)
+    {
+      return status;
+    }
+  }
+
+  EE_CACHE_LOCK(primask);
+  slot = EE_CacheFind(VirtAddress);
+  if (slot >= usCacheCount)
+  {
+    if (usCacheCount == 0)
+    {
+      ulCacheStart = HAL_GetTick();
+    }
+    ausCacheVirtAddress[slot] = VirtAddress;
+    usCacheCount++;
+  }
+  ausCacheData[slot] = Data;
+  EE_CACHE_UNLOCK(primask);
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Writes the cached writes to Flash with a single free space check.
+  *   Also meant for the PVD interrupt (HAL_PWR_PVDCallback) to save the cache
+  *   on a supply drop, as long as that interrupt cannot preempt another EE
+  *   function.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if the cache is empty
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if an error occurs, the writes stay cached
+  */
+uint16_t EE_Flush(void)
+{
+  uint16_t status = HAL_OK;
+
+  if (usCacheCount == 0)
+  {
+    return HAL_OK;
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+  status = EE_WriteRecords(ausCacheVirtAddress, 0, ausCacheData, usCacheCount, 0);
+  if (status == HAL_OK)
+  {
+    usCacheCount = 0;
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Writes the cached writes to Flash once the oldest one is
+  *   EE_CACHE_FLUSH_PERIOD old. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if no write is due
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if an error occurs
+  */
+uint16_t EE_ProcessCache(void)
+{
+  if ((usCacheCount == 0) || ((HAL_GetTick() - ulCacheStart) < EE_CACHE_FLUSH_PERIOD))
+  {
+    return HAL_OK;
+  }
+
+  return EE_Flush();
+}
+#endif
+
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Writes/updates a blob. Its bytes go in consecutive records, followed
+  *   by a record holding their CRC and by the header record of the blob, all
+  *   in the newest page: the writes move to the next page first if they do
+  *   not fit.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: bytes of the blob
+  * @param  Size: number of bytes, up to EE_BLOB_MAX_SIZE
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - EE_INVALID_BLOB: if Blob or Size is out of range
+  *           - PAGE_FULL: if the blob does not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteBlob(uint16_t Blob, const uint8_t *Data, uint16_t Size)
+{
+  uint16_t validpage = PAGE0, idx = 0, crc = 0xFFFF, recorddata = 0, nbslot = 0;
+  uint16_t eepromstatus = HAL_OK;
+  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+
+  if ((Blob >= NB_OF_BLOB) || (Size > EE_BLOB_MAX_SIZE))
+  {
+    return EE_INVALID_BLOB;
+  }
+  nbslot = EE_BLOB_NB_SLOTS(Size);
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  eepromstatus = EE_TxnRecover();
+  if (eepromstatus != HAL_OK)
+  {
+    return eepromstatus;
+  }
+#endif
+
+  /* Keep room for the records a collection in progress still has to copy */
+  eepromstatus = EE_GcReserve(nbslot, 0);
+  if (eepromstatus != HAL_OK)
+  {
+    return eepromstatus;
+  }
+
+  /* Get valid Page for write operation */
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+  address = EE_GetWriteCursor(validpage);
+  pageendaddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)((validpage + 1) * PAGE_SIZE));
+
+  /* Move to the next page once if the blob does not fit in the page */
+  if (((pageendaddress - address) / EE_RECORD_SIZE) < nbslot)
+  {
+    eepromstatus = EE_PageTransfer(EE_NO_VIRTADDRESS, 0);
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
+    validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    if (validpage == NO_VALID_PAGE)
+    {
+      return NO_VALID_PAGE;
+    }
+    address = EE_GetWriteCursor(validpage);
+    pageendaddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)((validpage + 1) * PAGE_SIZE));
+    if (((pageendaddress - address) / EE_RECORD_SIZE) < nbslot)
+    {
+      return PAGE_FULL;
+    }
+  }
+
+  /* Program all the records in one unlocked session */
+  HAL_FLASH_Unlock();
+  ucFlashUnlocked = 1;
+  /* The copy read in place so far is no longer the last one */
+  EE_BLOB_INVALIDATE();
+  /* The CRC covers the blob number and size, then the bytes */
+  crc = EE_Crc16(crc, (uint8_t)Blob);
+  crc = EE_Crc16(crc, (uint8_t)Size);
+  crc = EE_Crc16(crc, (uint8_t)(Size >> 8));
+  for (idx = 0; (idx < Size) && (eepromstatus == HAL_OK); idx++)
+  {
+    crc = EE_Crc16(crc, Data[idx]);
+    recorddata |= (uint16_t)Data[idx] << (8 * (idx % EE_BLOB_BYTES_PER_RECORD));
+    if (((idx % EE_BLOB_BYTES_PER_RECORD) == (EE_BLOB_BYTES_PER_RECORD - 1)) || (idx == (Size - 1)))
+    {
+      eepromstatus = EE_ProgramRecord(address, EE_BLOB_DATA_VIRTADDRESS, recorddata);
+      address = address + EE_RECORD_SIZE;
+      recorddata = 0;
+    }
+  }
+
+  /* The header record goes last: the blob exists once it is in Flash */
+  if (eepromstatus == HAL_OK)
+  {
+    eepromstatus = EE_ProgramRecord(address, EE_BLOB_CRC_VIRTADDRESS, crc);
+    address = address + EE_RECORD_SIZE;
+  }
+  if (eepromstatus == HAL_OK)
+  {
+    eepromstatus = EE_ProgramRecord(address, (uint16_t)(EE_BLOB_VIRTADDRESS + Blob), Size);
+  }
+  ucFlashUnlocked = 0;
+  HAL_FLASH_Lock();
+
+  return eepromstatus;
+}
+
+/**
+  * @brief  Reads the last complete copy of a blob: its header record is taken
+  *   from the RAM index or found by walking the ring back, then its bytes are
+  *   checked against their CRC and copied in one pass over its records.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: buffer receiving the bytes
+  * @param  MaxSize: size of the buffer, the bytes of a longer blob past it are
+  *   not copied
+  * @param  Size: receives the size of the blob
+  * @retval Success or error status:
+  *           - 0: if the blob was found
+  *           - 1: if the blob has no complete copy
+  *           - EE_INVALID_BLOB: if Blob is out of range
+  *           - NO_VALID_PAGE: if no valid page was found
+  */
+uint16_t EE_ReadBlob(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  uint32_t header = 0;
+
+  return EE_BlobFind(Blob, Data, MaxSize, Size, &header);
+}
+
+/**
+  * @brief  Gives the last complete copy of a blob in place, without copying
+  *   it: the bytes are checked against their CRC once, then byte n is read
+  *   from Flash as EE_BLOB_BYTE(*Data, n). The pointer stays valid as long as
+  *   EE_GetGeneration returns the generation given with it. Only for the
+  *   internal Flash, which is memory mapped.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: receives the address of the first record of the blob
+  * @param  Size: receives the size of the blob
+  * @param  Generation: receives the generation of the pointer
+  * @retval Success or error status:
+  *           - 0: if the blob was found
+  *           - 1: if the blob has no complete copy
+  *           - EE_INVALID_BLOB: if Blob is out of range
+  *           - NO_VALID_PAGE: if no valid page was found
+  */
+uint16_t EE_GetBlob(uint16_t Blob, const uint8_t **Data, uint16_t *Size, uint32_t *Generation)
+{
+  uint16_t eepromstatus = 0;
+  uint32_t header = 0;
+
+  eepromstatus = EE_BlobFind(Blob, NULL, 0, Size, &header);
+  if (eepromstatus == 0)
+  {
+    /* The data records come first, the CRC and header records close them */
+    *Data = (const uint8_t *)(header - (uint32_t)(EE_BLOB_NB_SLOTS(*Size) - 1) * EE_RECORD_SIZE);
+    *Generation = ulBlobGeneration;
+  }
+
+  return eepromstatus;
+}
+
+/**
+  * @brief  Gets the generation of the pointers given by EE_GetBlob: it changes
+  *   when a blob is written, a page is erased or EE_Init is called.
+  * @param  None
+  * @retval Generation
+  */
+uint32_t EE_GetGeneration(void)
+{
+  return ulBlobGeneration;
+}
+
+/**
+  * @brief  Finds the last complete copy of a blob and checks it, copying its
+  *   bytes if Data is not NULL.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: buffer receiving the bytes, or NULL
+  * @param  MaxSize: size of the buffer
+  * @param  Size: receives the size of the blob
+  * @param  Header: receives the address of the header record of the blob
+  * @retval Same status as EE_ReadBlob
+  */
+static uint16_t EE_BlobFind(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size, uint32_t *Header)
+{
+  uint16_t validpage = PAGE0, chain = 0;
+  uint16_t addressvalue = 0x5555;
+  uint32_t address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
+
+  if (Blob >= NB_OF_BLOB)
+  {
+    return EE_INVALID_BLOB;
+  }
+
+#if (EE_USE_RAM_INDEX == 1)
+  /* The index holds the header record of the last complete copy */
+  if (ucVarIndexValid != 0)
+  {
+    if (ausBlobIndex[Blob] == 0)
+    {
+      return 1;
+    }
+    address = EE_RECORD_ADDRESS(ausBlobIndex[Blob]);
+    PageStartAddress = EE_PAGE_ADDRESS((address - EEPROM_START_ADDRESS) / PAGE_SIZE);
+    *Header = address;
+    return (EE_BlobCheck(PageStartAddress, address, Data, MaxSize, Size) != 0) ? 0 : 1;
+  }
+#endif
+
+  /* Get active Page for read operation */
+  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  /* Walk the ring from the newest page to the oldest one */
+  for (chain = 0; (validpage != NO_VALID_PAGE) && (chain < EE_NB_PAGES); chain++)
+  {
+    PageStartAddress = EE_PAGE_ADDRESS(validpage);
+    address = PageStartAddress + PAGE_SIZE - EE_RECORD_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+    /* Records of a transaction not committed yet are not visible */
+    address = EE_TxnCommittedEnd(validpage) - EE_RECORD_SIZE;
+#elif (EE_USE_WRITE_CURSOR == 1)
+    /* Nothing is written past the cursor of the page */
+    if ((usValidpage == validpage) && (ulAddress != 0xffffffff))
+    {
+      address = ulAddress - EE_RECORD_SIZE;
+    }
+#endif
+    while (address >= (PageStartAddress + EE_HEADER_SIZE))
+    {
+      EE_FLASHRead(address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&addressvalue, 2);
+      EE_STATS_COUNT(WordsScanned, 1);
+      /* A copy cut by a power loss is followed by an older one */
+      if ((addressvalue == (uint16_t)(EE_BLOB_VIRTADDRESS + Blob))
+          && (EE_BlobCheck(PageStartAddress, address, Data, MaxSize, Size) != 0))
+      {
+        *Header = address;
+        return 0;
+      }
+      address = address - EE_RECORD_SIZE;
+    }
+
+    validpage = EE_OlderPage(validpage);
+  }
+
+  return 1;
+}
+#endif
+
+#if (EE_USE_INCREMENTAL_GC == 1)
+/**
+  * @brief  Goes on with the collection of the oldest page of the ring, a few
+  *   records per call, and starts it once fewer than EE_GC_MIN_ERASED_PAGES
+  *   pages are left erased. To be called from the main loop or a low priority
+  *   task, never while another EE function runs.
+  * @param  Budget: number of records examined by this call, a call erases at
+  *   most one Flash page (FLASH_PAGE_SIZE)
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: if no collection is pending
+  *           - EE_GC_BUSY: if the collection goes on at next call
+  *           - PAGE_FULL: if the newest page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write or erase Flash error
+  */
+uint16_t EE_Poll(uint16_t Budget)
+{
+  uint16_t validpage = PAGE0, tailpage = PAGE0, page = PAGE0, erased = 0;
+  uint16_t pagestatus = 6, pageseq = 0, eepromstatus = 0;
+
+#if (EE_USE_IT == 1)
+  /* The collection programs the pages from thread mode */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before copying behind its records */
+  eepromstatus = EE_TxnRecover();
+  if (eepromstatus != HAL_OK)
+  {
+    return eepromstatus;
+  }
+#endif
+
+  if (ucGcState == EE_GC_IDLE)
+  {
+    validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    tailpage = EE_FindTailPage();
+    if ((validpage == NO_VALID_PAGE) || (tailpage == validpage))
+    {
+      return HAL_OK;
+    }
+
+    /* Count the pages ready for the next page transfer */
+    for (page = 0; page < EE_NB_PAGES; page++)
+    {
+      EE_FLASHRead(EE_PAGE_ADDRESS(page), (uint8_t *)&pagestatus, 2);
+      EE_FLASHRead(EE_PAGE_ADDRESS(page) + 2, (uint8_t *)&pageseq, 2);
+      if ((pagestatus == ERASED) && (pageseq == 0xFFFF))
+      {
+        erased++;
+      }
+    }
+
+    /* The copies go to the newest page: it must have room for all of them */
+    if ((erased >= EE_GC_MIN_ERASED_PAGES)
+        || (((EE_PAGE_ADDRESS(validpage) + PAGE_SIZE - EE_GetWriteCursor(validpage)) / EE_RECORD_SIZE) < EE_GC_COPY_SLOTS))
+    {
+      return HAL_OK;
+    }
+    EE_GcStart(tailpage);
+  }
+
+  eepromstatus = EE_GcStep((Budget != 0) ? Budget : 1);
+  if ((eepromstatus == HAL_OK) && (ucGcState != EE_GC_IDLE))
+  {
+    return EE_GC_BUSY;
+  }
+
+  return eepromstatus;
+}
+#endif
+
+#if (EE_USE_IT == 1)
+/**
+  * @brief  Queues a write of a variable. The record is programmed under the
+  *   Flash interrupt, only the Flash interrupt is masked meanwhile, and
+  *   EE_WriteCpltCallback is called once it is in Flash. A write that needs a
+  *   page transfer or room taken by a collection is left to EE_ProcessIT. To
+  *   be called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: 16 bit data to be written
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: if the write was queued
+  *           - EE_BUSY: if the queue is full
+  */
+uint16_t EE_WriteVariableIT(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t slot = 0;
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+
+  EE_IT_LOCK();
+  if (usItCount >= EE_IT_QUEUE_SIZE)
+  {
+    EE_IT_UNLOCK();
+    return EE_BUSY;
+  }
+  slot = (usItFirst + usItCount) % EE_IT_QUEUE_SIZE;
+  ausItVirtAddress[slot] = VirtAddress;
+  ausItData[slot] = Data;
+  usItCount++;
+  /* Start programming if the queue was empty */
+  if (ucItState == EE_IT_IDLE)
+  {
+    EE_ITStart();
+  }
+  EE_IT_UNLOCK();
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Writes from thread mode the queued write the Flash interrupt left,
+  *   with the page transfer it needs, and lets the interrupt go on with the
+  *   next ones. Locks the Flash back once the queue is empty if the queue
+  *   unlocked it. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if no write was left
+  *           - Flash error code: if an error occurs, also given to the callback
+  */
+uint16_t EE_ProcessIT(void)
+{
+  uint16_t status = HAL_OK;
+  uint16_t virtaddress = 0, data = 0;
+
+  if (ucItState != EE_IT_STALLED)
+  {
+    EE_ITLockFlash();
+    return HAL_OK;
+  }
+
+  /* The Flash interrupt does not touch a stalled queue */
+  virtaddress = ausItVirtAddress[usItFirst];
+  data = ausItData[usItFirst];
+  status = EE_WriteRecords(&virtaddress, 0, &data, 1, 0);
+
+  EE_IT_LOCK();
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  EE_IT_UNLOCK();
+
+  /* Called before the interrupt goes on, so that the callbacks keep the
+     order of the writes */
+  EE_WriteCpltCallback(virtaddress, status);
+
+  EE_IT_LOCK();
+  EE_ITStart();
+  EE_IT_UNLOCK();
+  EE_ITLockFlash();
+
+  return status;
+}
+
+/**
+  * @brief  Waits until all the queued writes are in Flash, polling the Flash
+  *   rather than waiting for its interrupt, so that it also returns with the
+  *   interrupts masked or from an interrupt handler. The other write functions
+  *   call it first so that the writes keep their order. The Flash is left
+  *   unlocked if it was.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: if a write left to thread mode failed
+  */
+uint16_t EE_FlushIT(void)
+{
+  uint16_t status = HAL_OK;
+  uint32_t locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+
+  while (usItCount != 0)
+  {
+    if (ucItState == EE_IT_STALLED)
+    {
+      status = EE_ProcessIT();
+    }
+    else
+    {
+      /* The Flash interrupt is not waited for: it is not taken under PRIMASK
+         or from a handler of its priority or higher. Its work is done here
+         with it masked, EE_IRQHandler returns at once until the program ends */
+      EE_IT_LOCK();
+      EE_IRQHandler();
+      EE_IT_UNLOCK();
+    }
+  }
+
+  /* EE_ProcessIT locks the Flash back once the queue is empty */
+  if ((locked == 0U) && (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U))
+  {
+    HAL_FLASH_Unlock();
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Handles the Flash interrupt for the queued writes. To be called
+  *   from FLASH_IRQHandler in place of HAL_FLASH_IRQHandler.
+  * @param  None
+  * @retval None
+  */
+void EE_IRQHandler(void)
+{
+  uint16_t virtaddress = 0;
+  uint16_t status = HAL_OK;
+
+  HAL_FLASH_IRQHandler();
+  if ((ucItState != EE_IT_BUSY) || (ucItResult == EE_IT_PENDING))
+  {
+    return;
+  }
+
+  virtaddress = ausItVirtAddress[usItFirst];
+  if (ucItResult == EE_IT_DONE)
+  {
+#if (EE_USE_RAM_INDEX == 1)
+    /* The record just written is the latest one of this variable */
+    if ((ucVarIndexValid != 0) && (virtaddress < NB_OF_VAR))
+    {
+      ausVarIndex[virtaddress] = EE_RECORD_INDEX(ulAddress);
+    }
+#endif
+    /* A collection in progress must not copy an older record of this variable */
+    if (virtaddress < NB_OF_VAR)
+    {
+      aulGcCopied[virtaddress >> 5] |= (uint32_t)1 << (virtaddress & 0x1F);
+    }
+    /* The slot is no longer erased: next write goes to the following one */
+    ulAddress = ulAddress + EE_RECORD_SIZE;
+  }
+  else
+  {
+    ulAddress = 0xffffffff;
+    status = HAL_ERROR;
+  }
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  /* The HAL is unlocked once HAL_FLASH_IRQHandler returns */
+  EE_ITStart();
+
+  EE_WriteCpltCallback(virtaddress, status);
+}
+
+/**
+  * @brief  Called once a queued write is in Flash, or failed, from the Flash
+  *   interrupt or from EE_ProcessIT.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Status: FLASH_COMPLETE or the error code of the write
+  * @retval None
+  */
+__weak void EE_WriteCpltCallback(uint16_t VirtAddress, uint16_t Status)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(VirtAddress);
+  UNUSED(Status);
+}
+
+/**
+  * @brief  End of Flash operation callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address programmed
+  * @retval None
+  */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_DONE;
+}
+
+/**
+  * @brief  Flash operation error callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address that failed
+  * @retval None
+  */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_FAILED;
+}
+
+/**
+  * @brief  Gets how long usEE_Read and usEE_Write kept the interrupts masked.
+  * @param  Last: time of the last call, in core clock cycles
+  * @param  Max: longest time since reset, in core clock cycles
+  * @retval None
+  */
+void EE_GetIrqMaskedTime(uint32_t *Last, uint32_t *Max)
+{
+  *Last = ulIrqMaskedLast;
+  *Max = ulIrqMaskedMax;
+}
+#endif
+
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Gets the statistics gathered since reset or EE_ResetStats.
+  * @param  Stats: filled in with the counters and the timings
+  * @retval None
+  */
+void EE_GetStats(EE_StatsTypeDef *Stats)
+{
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  *Stats = xStats;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+
+/**
+  * @brief  Clears the statistics.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetStats(void)
+{
+  static const EE_StatsTypeDef cleared = {0};
+
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  xStats = cleared;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Gets the erase counts of the pages and projects their remaining
+  *   life. The pages of the ring are erased in turn, so the most worn one
+  *   takes one erase out of EE_NB_PAGES: the projection assumes the records
+  *   keep being written at the rate and with the number of records per erase
+  *   measured since EE_Init or EE_ResetWear.
+  * @param  Wear: filled in with the erase counts and the projection
+  * @retval None
+  */
+void EE_GetWear(EE_WearTypeDef *Wear)
+{
+  uint16_t page = PAGE0;
+  uint64_t remaining;
+
+  Wear->MaxEraseCount = 0;
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    Wear->EraseCount[page] = EE_GetEraseCount(page);
+    if (Wear->EraseCount[page] > Wear->MaxEraseCount)
+    {
+      Wear->MaxEraseCount = Wear->EraseCount[page];
+    }
+  }
+  Wear->RemainingErases = (Wear->MaxEraseCount < EE_PAGE_ENDURANCE) ? (EE_PAGE_ENDURANCE - Wear->MaxEraseCount) : 0;
+
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  Wear->Records = ulWearRecords;
+  Wear->Erases = ulWearErases;
+  Wear->Elapsed = HAL_GetTick() - ulWearStart;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+
+  Wear->RecordsPerHour = 0;
+  if (Wear->Elapsed != 0)
+  {
+    remaining = ((uint64_t)Wear->Records * 3600000U) / Wear->Elapsed;
+    Wear->RecordsPerHour = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+  }
+
+  Wear->RemainingRecords = 0xFFFFFFFFU;
+  Wear->RemainingHours = 0xFFFFFFFFU;
+  if (Wear->Erases != 0)
+  {
+    /* Erases of the ring left before the most worn page wears out */
+    remaining = (uint64_t)Wear->RemainingErases * EE_NB_PAGES;
+    remaining = (remaining * Wear->Records) / Wear->Erases;
+    Wear->RemainingRecords = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+    remaining = (uint64_t)Wear->RemainingErases * EE_NB_PAGES;
+    remaining = (remaining * Wear->Elapsed) / Wear->Erases / 3600000U;
+    Wear->RemainingHours = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+  }
+}
+
+/**
+  * @brief  Restarts the measure of the write rate EE_GetWear projects from.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetWear(void)
+{
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  ulWearRecords = 0;
+  ulWearErases = 0;
+  ulWearStart = HAL_GetTick();
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+/**
+  * @brief  Erases all the pages of the ring and writes VALID_PAGE header with
+  *   the first sequence number to Page0
+  * @param  None
+  * @retval Status of the last operation (Flash write or erase) done during
+  *         EEPROM formating
+  */
+static HAL_StatusTypeDef EE_Format(void)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint16_t page = PAGE0, WData = 0;
+
+  EE_STATS_COUNT(Formats, 1);
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    /* Erase the page */
+    if (!EE_VerifyPageFullyErased(EE_PAGE_ADDRESS(page)))
+    {
+      flashstatus = EE_ErasePage(page);
+      /* If erase operation was failed, a Flash error code is returned */
+      if (flashstatus != HAL_OK)
+      {
+        return flashstatus;
+      }
+    }
+  }
+
+  /* Page0 is the first page of the ring */
+  WData = 1;
+  EE_PAGE_CACHE_RESET();
+  flashstatus = EE_FLASHWrite(PAGE0_BASE_ADDRESS + 2, (uint8_t *)&WData, 2);
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+  /* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
+  WData = VALID_PAGE;
+  EE_PAGE_CACHE_RESET();
+  flashstatus = EE_FLASHWrite(PAGE0_BASE_ADDRESS, (uint8_t *)&WData, 2);
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Page0 is empty: next write goes right after its header and erase count */
+  usValidpage = PAGE0;
+  ulAddress = EE_FindWriteCursor(PAGE0);
+#endif
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Find valid Page for write or read operation: the newest page of the
+  *   ring is both read from first and written to.
+  * @param  Operation: operation to achieve on the valid page.
+  *   This parameter can be one of the following values:
+  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
+  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
+  * @retval Valid page number or NO_VALID_PAGE in case of no valid page was found
+  */
+static uint16_t EE_FindValidPage(uint8_t Operation)
+{
+  (void)Operation;
+
+#if (EE_USE_PAGE_CACHE == 1)
+  /* The headers are only read again once one of them changed */
+  if (usHeadPage == EE_PAGE_CACHE_EMPTY)
+  {
+    usHeadPage = EE_ReadValidPage();
+  }
+
+  return usHeadPage;
+#else
+  return EE_ReadValidPage();
+#endif
+}
+
+/**
+  * @brief  Find the newest page of the ring from the page headers.
+  * @param  None
+  * @retval Valid page number or NO_VALID_PAGE in case of no valid page was found
+  */
+static uint16_t EE_ReadValidPage(void)
+{
+  uint16_t page = PAGE0, validpage = NO_VALID_PAGE;
+  uint16_t pageseq = 0, validseq = 0;
+
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    pageseq = EE_GetPageSeq(page);
+    if ((pageseq != 0) && ((validpage == NO_VALID_PAGE) || EE_SEQ_NEWER(pageseq, validseq)))
+    {
+      validpage = page;
+      validseq = pageseq;
+    }
+  }
+
+  return validpage;
+}
+
+/**
+  * @brief  Verify if active page is full and Writes variable in EEPROM.
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t validpage = PAGE0;
+  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+
+  /* Get valid Page for write operation */
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+
+  /* Check if there is no valid page */
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  /* Get the first free slot of the valid Page */
+  address = EE_GetWriteCursor(validpage);
+
+  /* Get the valid Page end address */
+  pageendaddress = (uint32_t)((EEPROM_START_ADDRESS - 1) + (uint32_t)((validpage + 1) * PAGE_SIZE));
+
+  /* Check each active page address starting from begining */
+  while (address < pageendaddress)
+  {
+    /* Verify if address and address+2 contents are 0xFFFFFFFF */
+    uint32_t RData;
+    EE_FLASHRead(address, (uint8_t *)&RData, 4);
+    EE_STATS_COUNT(WordsScanned, 1);
+    if (RData == 0xFFFFFFFF)
+    {
+      /* Set variable data and virtual address, return program operation status */
+      return EE_ProgramRecord(address, VirtAddress, Data);
+    }
+    else
+    {
+      /* Next address location */
+      address = address + EE_RECORD_SIZE;
+    }
+  }
+
+  /* Return PAGE_FULL in case the valid page is full */
+  return PAGE_FULL;
+}
+
+/**
+  * @brief  Program a record in an erased slot of the write page.
+  * @param  Address: address of the erased slot
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint32_t record = 0;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+  EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+  ulWearRecords++;
+#endif
+  /* Set variable data and virtual address in one write: the data half-word
+     is still programmed first, so the layout is the one of the half-word
+     writes of older pages */
+  record = EE_RECORD_VALUE(VirtAddress, Data);
+  flashstatus = EE_FLASHWrite(Address, (uint8_t *)&record, EE_RECORD_SIZE);
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+#if (EE_USE_WRITE_CURSOR == 1)
+    ulAddress = 0xffffffff;
+#endif
+    return flashstatus;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The slot is no longer erased: next write goes to the following one */
+  ulAddress = Address + EE_RECORD_SIZE;
+#endif
+#if (EE_USE_RAM_INDEX == 1)
+  /* The record just written is the latest one of this variable, records of a
+     transaction are indexed once it is committed */
+  if ((flashstatus == HAL_OK) && (ucVarIndexValid != 0) && (VirtAddress < NB_OF_VAR)
+#if (EE_USE_TRANSACTION == 1)
+      && (ucTxnOpen == 0)
+#endif
+     )
+  {
+    ausVarIndex[VirtAddress] = EE_RECORD_INDEX(Address);
+  }
+#endif
+  /* A collection in progress must not copy an older record of this variable */
+  if ((flashstatus == HAL_OK) && (VirtAddress < NB_OF_VAR)
+#if (EE_USE_TRANSACTION == 1)
+      && (ucTxnOpen == 0)
+#endif
+     )
+  {
+    aulGcCopied[VirtAddress >> 5] |= (uint32_t)1 << (VirtAddress & 0x1F);
+  }
+#if (EE_USE_BLOB == 1)
+  /* The header record closes a complete copy of its blob */
+  if ((flashstatus == HAL_OK) && EE_IS_BLOB_VIRTADDRESS(VirtAddress))
+  {
+#if (EE_USE_RAM_INDEX == 1)
+    if (ucVarIndexValid != 0)
+    {
+      ausBlobIndex[VirtAddress - EE_BLOB_VIRTADDRESS] = EE_RECORD_INDEX(Address);
+    }
+#endif
+    VirtAddress = NB_OF_VAR + VirtAddress - EE_BLOB_VIRTADDRESS;
+    aulGcCopied[VirtAddress >> 5] |= (uint32_t)1 << (VirtAddress & 0x1F);
+  }
+#endif
+  if (flashstatus == HAL_OK)
+  {
+    EE_STATS_TIME(Program, statsstart);
+  }
+
+  return flashstatus;
+}
+
+/**
+  * @brief  Writes a set of variables back to back in the write page. Free space
+  *   is checked for the whole set first and, if it does not fit, one page
+  *   transfer is done before any of the variables is written.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   consecutive virtual addresses starting at FirstVirtAddress
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: 16 bit data of the variables
+  * @param  NbVar: number of variables
+  * @param  Atomic: 1 to write the variables as one transaction
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the variables do not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_WriteRecords(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                                const uint16_t *Data, uint16_t NbVar, uint8_t Atomic)
+{
+  uint16_t validpage = PAGE0, varidx = 0, nbslot = NbVar;
+#if (EE_USE_TRANSACTION == 1) || (EE_USE_SKIP_UNCHANGED == 1)
+  uint16_t nbwrite = NbVar;
+#endif
+  uint16_t eepromstatus = HAL_OK;
+  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+
+  if (NbVar == 0)
+  {
+    return HAL_OK;
+  }
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  eepromstatus = EE_TxnRecover();
+  if (eepromstatus != HAL_OK)
+  {
+    return eepromstatus;
+  }
+  if (Atomic != 0)
+  {
+    if (NbVar > EE_TXN_MAX_RECORDS)
+    {
+      return PAGE_FULL;
+    }
+    /* The records are framed by the begin and commit markers */
+    nbslot = NbVar + 2;
+  }
+#endif
+
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Records that leave their variable as it is in Flash are not programmed */
+  for (varidx = 0; varidx < NbVar; varidx++)
+  {
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, varidx) != 0)
+    {
+      nbwrite--;
+      nbslot--;
+    }
+  }
+  EE_STATS_COUNT(Skipped, NbVar - nbwrite);
+  if (nbwrite == 0)
+  {
+    return HAL_OK;
+  }
+#endif
+
+  /* Keep room for the records a collection in progress still has to copy */
+  eepromstatus = EE_GcReserve(nbslot, Atomic);
+  if (eepromstatus != HAL_OK)
+  {
+    return eepromstatus;
+  }
+
+  /* Get valid Page for write operation */
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+  address = EE_GetWriteCursor(validpage);
+  pageendaddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)((validpage + 1) * PAGE_SIZE));
+
+  /* Compact the data once if the whole set does not fit in the page */
+  if (((pageendaddress - address) / EE_RECORD_SIZE) < nbslot)
+  {
+    eepromstatus = EE_PageTransfer(EE_NO_VIRTADDRESS, 0);
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
+    /* The transfer may have left a collection pending: finish it before an
+       atomic set so that no copy is appended behind its begin marker */
+    eepromstatus = EE_GcReserve(nbslot, Atomic);
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
+    validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    if (validpage == NO_VALID_PAGE)
+    {
+      return NO_VALID_PAGE;
+    }
+    address = EE_GetWriteCursor(validpage);
+    pageendaddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)((validpage + 1) * PAGE_SIZE));
+    if (((pageendaddress - address) / EE_RECORD_SIZE) < nbslot)
+    {
+      return PAGE_FULL;
+    }
+  }
+
+  /* Program all the records in one unlocked session */
+  HAL_FLASH_Unlock();
+  ucFlashUnlocked = 1;
+#if (EE_USE_TRANSACTION == 1)
+  if (Atomic != 0)
+  {
+    ucTxnOpen = 1;
+    eepromstatus = EE_ProgramRecord(address, EE_TXN_BEGIN_VIRTADDRESS, nbwrite);
+    address = address + EE_RECORD_SIZE;
+  }
+#endif
+  for (varidx = 0; (varidx < NbVar) && (eepromstatus == HAL_OK); varidx++)
+  {
+#if (EE_USE_SKIP_UNCHANGED == 1)
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, varidx) != 0)
+    {
+      continue;
+    }
+#endif
+    eepromstatus = EE_ProgramRecord(address,
+                                    (VirtAddress != NULL) ? VirtAddress[varidx] : (uint16_t)(FirstVirtAddress + varidx),
+                                    Data[varidx]);
+    address = address + EE_RECORD_SIZE;
+  }
+#if (EE_USE_TRANSACTION == 1)
+  if (Atomic != 0)
+  {
+    if (eepromstatus == HAL_OK)
+    {
+      eepromstatus = EE_ProgramRecord(address, EE_TXN_COMMIT_VIRTADDRESS, nbwrite);
+    }
+    ucTxnOpen = 0;
+    if (eepromstatus != HAL_OK)
+    {
+      /* The next write drops the records of this transaction first */
+      ucTxnTorn = 1;
+    }
+    else
+    {
+      /* The records of the transaction are visible from now on */
+      address = address - ((uint32_t)nbwrite * EE_RECORD_SIZE);
+      for (varidx = 0; varidx < nbwrite; varidx++)
+      {
+        uint16_t virtaddress = 0x5555;
+        EE_FLASHRead(address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&virtaddress, 2);
+        if (virtaddress < NB_OF_VAR)
+        {
+#if (EE_USE_RAM_INDEX == 1)
+          if (ucVarIndexValid != 0)
+          {
+            ausVarIndex[virtaddress] = EE_RECORD_INDEX(address);
+          }
+#endif
+          aulGcCopied[virtaddress >> 5] |= (uint32_t)1 << (virtaddress & 0x1F);
+        }
+        address = address + EE_RECORD_SIZE;
+      }
+    }
+  }
+#endif
+  ucFlashUnlocked = 0;
+  HAL_FLASH_Lock();
+
+  return eepromstatus;
+}
+
+/**
+  * @brief  Moves the writes to the next erased page of the ring. Once no erased
+  *   page is left for the next move, the last updated variables of the oldest
+  *   page are copied to the new page and the oldest page is erased, right away
+  *   or by EE_Poll when EE_USE_INCREMENTAL_GC is set.
+  * @param  VirtAddress: 16 bit virtual address of the variable,
+  *   EE_NO_VIRTADDRESS if only the existing variables are transferred
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint16_t validpage = PAGE0, newpage = PAGE0;
+  uint16_t eepromstatus = 0;
+  uint16_t WData = 0;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+  /* Get active Page for write operation */
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (validpage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE; /* No valid Page */
+  }
+
+#if (EE_USE_TRANSACTION == 1)
+  /* An open transaction is left behind before the collection goes on: copies
+     appended behind its records would hide its begin marker after a power
+     loss. The collection then copies to the new page. */
+  if ((ucTxnTorn == 0) || (EE_FindErasedPage(validpage) == NO_VALID_PAGE))
+#endif
+  {
+    /* The page being collected is the one the writes move to */
+    eepromstatus = EE_GcStep(EE_GC_NO_BUDGET);
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
+  }
+
+  /* New page where the writes go on */
+  newpage = EE_FindErasedPage(validpage);
+  if (newpage == NO_VALID_PAGE)
+  {
+    return PAGE_FULL;
+  }
+
+  /* Set the sequence number of the new page first: a page with a sequence
+     number and no VALID_PAGE status is erased by EE_Init */
+  WData = EE_SEQ_NEXT(EE_GetPageSeq(validpage));
+  EE_PAGE_CACHE_RESET();
+  flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(newpage) + 2, (uint8_t *)&WData, 2);
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+
+  /* Set new Page status to VALID_PAGE status */
+  WData = VALID_PAGE;
+  EE_PAGE_CACHE_RESET();
+  flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(newpage), (uint8_t *)&WData, 2);
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* New page is empty: next write goes right after its header and erase count */
+  usValidpage = newpage;
+  ulAddress = EE_FindWriteCursor(newpage);
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* A transaction left open in the old page stays behind its committed end */
+  ucTxnTorn = 0;
+#endif
+
+  /* Write the variable passed as parameter in the new active page */
+  if (VirtAddress != EE_NO_VIRTADDRESS)
+  {
+    eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+    /* If program operation was failed, a Flash error code is returned */
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
+  }
+
+  /* Free the oldest page once the ring has no erased page left */
+  if (EE_FindErasedPage(newpage) == NO_VALID_PAGE)
+  {
+    EE_GcStart(EE_FindTailPage());
+#if (EE_USE_INCREMENTAL_GC == 0)
+    eepromstatus = EE_GcStep(EE_GC_NO_BUDGET);
+#endif
+  }
+  if (eepromstatus == HAL_OK)
+  {
+    EE_STATS_COUNT(Transfers, 1);
+    EE_STATS_TIME(Transfer, statsstart);
+  }
+
+  /* Return last operation status */
+  return eepromstatus;
+}
+
+/**
+  * @brief  Start the collection of an old page of the ring: the last update of
+  *   each of its variables is copied to the newest page, then it is erased.
+  * @param  Page: page number of the page to collect, older than the newest one
+  * @retval None
+  */
+static void EE_GcStart(uint16_t Page)
+{
+  uint16_t varidx = 0;
+
+  for (varidx = 0; varidx < (EE_NB_OF_ITEMS + 31) / 32; varidx++)
+  {
+    aulGcCopied[varidx] = 0;
+  }
+
+  /* Newer pages are walked first to mark the variables they already hold */
+  usGcPage = Page;
+  usGcMarkPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if ((Page == NO_VALID_PAGE) || (usGcMarkPage == NO_VALID_PAGE) || (usGcMarkPage == Page))
+  {
+    ucGcState = EE_GC_IDLE;
+    return;
+  }
+  ulGcAddress = EE_PAGE_ADDRESS(usGcMarkPage) + EE_HEADER_SIZE;
+  ulGcEndAddress = EE_GcPageEnd(usGcMarkPage);
+  ucGcState = EE_GC_MARK;
+}
+
+/**
+  * @brief  Go on with the collection of the old page. The newer pages are
+  *   walked from their oldest record on and a bitmap keeps track of the
+  *   variables they hold, then the old page is walked from its newest record
+  *   to its oldest one and the variables not marked yet are copied to the
+  *   newest page. Variables written meanwhile are marked by EE_ProgramRecord.
+  *   Transaction markers and records of a transaction never committed are not
+  *   copied. The old page is dropped from the ring then erased Flash page by
+  *   Flash page, the page holding its header last.
+  * @param  Budget: number of records examined, a step erases at most one Flash
+  *   page unless Budget is EE_GC_NO_BUDGET
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the newest page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write or erase Flash error
+  */
+static uint16_t EE_GcStep(uint32_t Budget)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint16_t eepromstatus = 0, WData = 0;
+  uint32_t pageaddress = EE_PAGE_ADDRESS(usGcPage);
+
+  while ((ucGcState != EE_GC_IDLE) && (Budget > 0))
+  {
+    switch (ucGcState)
+    {
+    case EE_GC_MARK: /* ---- Mark the variables the newer pages hold ---- */
+      if (ulGcAddress < ulGcEndAddress)
+      {
+        /* Page is written in order: the first erased slot ends the records */
+        EE_CoreMarkRecords(EE_PAGE_ADDRESS(usGcMarkPage), &ulGcAddress, ulGcEndAddress, &Budget, aulGcCopied);
+        break;
+      }
+      usGcMarkPage = EE_OlderPage(usGcMarkPage);
+      if ((usGcMarkPage != usGcPage) && (usGcMarkPage != NO_VALID_PAGE))
+      {
+        ulGcAddress = EE_PAGE_ADDRESS(usGcMarkPage) + EE_HEADER_SIZE;
+        ulGcEndAddress = EE_GcPageEnd(usGcMarkPage);
+        break;
+      }
+      /* Walk the old page from its last record down to the first one */
+      ulGcAddress = EE_GcPageEnd(usGcPage) - EE_RECORD_SIZE;
+      ucGcState = EE_GC_COPY;
+      break;
+
+    case EE_GC_COPY: /* ---- Copy the variables no newer page holds ---- */
+      if (ulGcAddress >= (pageaddress + EE_HEADER_SIZE))
+      {
+        /* Erased slots and addresses out of range are skipped, a blob is
+           copied as a unit from its last complete copy */
+        eepromstatus = EE_CoreCopyRecords(pageaddress, &ulGcAddress, &Budget, aulGcCopied);
+        /* If program operation was failed, a Flash error code is returned */
+        if (eepromstatus != HAL_OK)
+        {
+          return eepromstatus;
+        }
+        break;
+      }
+      /* Clear the sequence number so that a page left half erased by a power
+         loss is not taken back in the ring */
+      EE_PAGE_CACHE_RESET();
+      flashstatus = EE_FLASHWrite(pageaddress + 2, (uint8_t *)&WData, 2);
+      /* If program operation was failed, a Flash error code is returned */
+      if (flashstatus != HAL_OK)
+      {
+        return flashstatus;
+      }
+      ulGcAddress = pageaddress + PAGE_SIZE;
+#if (EE_USE_ERASE_COUNT == 1)
+      usGcEraseCount = EE_GetEraseCount(usGcPage);
+#endif
+      ucGcState = EE_GC_ERASE;
+      break;
+
+    case EE_GC_ERASE: /* ---- Erase the old page ---- */
+      ulGcAddress = ulGcAddress - FLASH_PAGE_SIZE;
+      EE_PAGE_CACHE_RESET();
+      flashstatus = EE_FlashErase(ulGcAddress, FLASH_PAGE_SIZE);
+      /* If erase operation was failed, a Flash error code is returned */
+      if (flashstatus != HAL_OK)
+      {
+        ulGcAddress = ulGcAddress + FLASH_PAGE_SIZE;
+        return flashstatus;
+      }
+      if (ulGcAddress == pageaddress)
+      {
+        ucGcState = EE_GC_IDLE;
+#if (EE_USE_ERASE_COUNT == 1)
+        flashstatus = EE_WriteEraseCount(usGcPage, usGcEraseCount);
+        /* If program operation was failed, a Flash error code is returned */
+        if (flashstatus != HAL_OK)
+        {
+          return flashstatus;
+        }
+#endif
+      }
+      if (Budget != EE_GC_NO_BUDGET)
+      {
+        Budget = 0;
+      }
+      break;
+
+    default:
+      ucGcState = EE_GC_IDLE;
+      break;
+    }
+  }
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Get the end of the records of a page the collection reads.
+  * @param  Page: page number
+  * @retval Address following the last record, or its last committed record
+  */
+static uint32_t EE_GcPageEnd(uint16_t Page)
+{
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction never committed are left behind */
+  return EE_TxnCommittedEnd(Page);
+#else
+  return EE_PAGE_ADDRESS(Page) + PAGE_SIZE;
+#endif
+}
+
+/**
+  * @brief  Finish the collection in progress before the newest page runs out
+  *   of room for the records it still has to copy, or before a transaction
+  *   when no erased page is left: if a power loss cuts the transaction, its
+  *   records can only be dropped by moving to another page, and EE_Init would
+  *   append the copies behind them first.
+  * @param  NbSlot: number of slots the caller is about to write
+  * @param  Atomic: 1 if the slots are a transaction
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the newest page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write or erase Flash error
+  */
+static uint16_t EE_GcReserve(uint16_t NbSlot, uint8_t Atomic)
+{
+  uint16_t validpage = PAGE0;
+
+  if ((ucGcState != EE_GC_MARK) && (ucGcState != EE_GC_COPY))
+  {
+    return HAL_OK;
+  }
+
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if ((validpage != NO_VALID_PAGE)
+      && (((EE_PAGE_ADDRESS(validpage) + PAGE_SIZE - EE_GetWriteCursor(validpage)) / EE_RECORD_SIZE) >= ((uint32_t)NbSlot + EE_GC_COPY_SLOTS))
+      && ((Atomic == 0) || (EE_FindErasedPage(validpage) != NO_VALID_PAGE)))
+  {
+    return HAL_OK;
+  }
+
+  return EE_GcStep(EE_GC_NO_BUDGET);
+}
+
+/**
+  * @brief  Get the sequence number of a page of the ring.
+  * @param  Page: page number
+  * @retval Sequence number, 0 if the page is not part of the ring
+  */
+static uint16_t EE_GetPageSeq(uint16_t Page)
+{
+  uint16_t pagestatus = 6, pageseq = 0;
+
+  EE_FLASHRead(EE_PAGE_ADDRESS(Page), (uint8_t *)&pagestatus, 2);
+  EE_FLASHRead(EE_PAGE_ADDRESS(Page) + 2, (uint8_t *)&pageseq, 2);
+  if ((pagestatus != VALID_PAGE) || (pageseq == 0xFFFF))
+  {
+    return 0;
+  }
+
+  return pageseq;
+}
+
+/**
+  * @brief  Find the page of the ring holding a sequence number.
+  * @param  Seq: sequence number
+  * @retval Page number or NO_VALID_PAGE if no page holds this sequence number
+  */
+static uint16_t EE_FindSeqPage(uint16_t Seq)
+{
+  uint16_t page = PAGE0;
+
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    if (EE_GetPageSeq(page) == Seq)
+    {
+      return page;
+    }
+  }
+
+  return NO_VALID_PAGE;
+}
+
+/**
+  * @brief  Get the page written right before a page of the ring.
+  * @param  Page: page number
+  * @retval Page number or NO_VALID_PAGE if Page is the oldest one
+  */
+static uint16_t EE_OlderPage(uint16_t Page)
+{
+  return EE_FindSeqPage(EE_SEQ_PREV(EE_GetPageSeq(Page)));
+}
+
+/**
+  * @brief  Get the page written right after a page of the ring.
+  * @param  Page: page number
+  * @retval Page number or NO_VALID_PAGE if Page is the newest one
+  */
+static uint16_t EE_NewerPage(uint16_t Page)
+{
+  return EE_FindSeqPage(EE_SEQ_NEXT(EE_GetPageSeq(Page)));
+}
+
+/**
+  * @brief  Find the oldest page of the ring.
+  * @param  None
+  * @retval Page number or NO_VALID_PAGE if no valid page was found
+  */
+static uint16_t EE_FindTailPage(void)
+{
+  uint16_t page = PAGE0, olderpage = PAGE0, chain = 0;
+
+  page = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (page == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+  for (chain = 1; chain < EE_NB_PAGES; chain++)
+  {
+    olderpage = EE_OlderPage(page);
+    if (olderpage == NO_VALID_PAGE)
+    {
+      break;
+    }
+    page = olderpage;
+  }
+
+  return page;
+}
+
+/**
+  * @brief  Find the first erased page of the ring following a page.
+  * @param  Page: page number the search starts after
+  * @retval Page number or NO_VALID_PAGE if no page is erased
+  */
+static uint16_t EE_FindErasedPage(uint16_t Page)
+{
+  uint16_t page = PAGE0, count = 0;
+  uint16_t pagestatus = 6, pageseq = 0;
+
+  for (count = 1; count <= EE_NB_PAGES; count++)
+  {
+    page = (uint16_t)((Page + count) % EE_NB_PAGES);
+    EE_FLASHRead(EE_PAGE_ADDRESS(page), (uint8_t *)&pagestatus, 2);
+    EE_FLASHRead(EE_PAGE_ADDRESS(page) + 2, (uint8_t *)&pageseq, 2);
+    if ((pagestatus == ERASED) && (pageseq == 0xFFFF))
+    {
+      return page;
+    }
+  }
+
+  return NO_VALID_PAGE;
+}
+
+/**
+  * @brief  Erase a page of the ring at once and keep its erase count.
+  * @param  Page: page number
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: on write or erase Flash error
+  */
+static uint16_t EE_ErasePage(uint16_t Page)
+{
+  uint16_t flashstatus = HAL_OK;
+#if (EE_USE_ERASE_COUNT == 1)
+  uint16_t erasecount = EE_GetEraseCount(Page);
+#endif
+
+  EE_PAGE_CACHE_RESET();
+  flashstatus = EE_FlashErase(EE_PAGE_ADDRESS(Page), PAGE_SIZE);
+#if (EE_USE_ERASE_COUNT == 1)
+  if (flashstatus == HAL_OK)
+  {
+    flashstatus = EE_WriteEraseCount(Page, erasecount);
+  }
+#endif
+
+  return flashstatus;
+}
+
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Read the erase count record a page holds right after its header.
+  * @param  Page: page number
+  * @param  Count: erase count of the page, left unchanged if there is none
+  * @retval 1 if the page holds an erase count record, 0 otherwise
+  */
+static uint8_t EE_ReadEraseCount(uint16_t Page, uint16_t *Count)
+{
+  uint16_t addressvalue = 0x5555;
+
+  EE_FLASHRead(EE_PAGE_ADDRESS(Page) + EE_HEADER_SIZE + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&addressvalue, 2);
+  if (addressvalue != EE_ERASE_COUNT_VIRTADDRESS)
+  {
+    return 0;
+  }
+  EE_FLASHRead(EE_PAGE_ADDRESS(Page) + EE_HEADER_SIZE, (uint8_t *)Count, 2);
+  return 1;
+}
+
+/**
+  * @brief  Get the number of times a page was erased. A page without erase
+  *   count, last erased by a firmware that did not keep it or by an erase a
+  *   power loss cut, is given the highest count of the other pages: the pages
+  *   of the ring are erased in turn.
+  * @param  Page: page number
+  * @retval Erase count of the page, 0 if no page holds one
+  */
+static uint16_t EE_GetEraseCount(uint16_t Page)
+{
+  uint16_t page = PAGE0, count = 0, erasecount = 0;
+
+  if (EE_ReadEraseCount(Page, &erasecount))
+  {
+    return erasecount;
+  }
+  for (page = 0; page < EE_NB_PAGES; page++)
+  {
+    if ((page != Page) && EE_ReadEraseCount(page, &count) && (count > erasecount))
+    {
+      erasecount = count;
+    }
+  }
+
+  return erasecount;
+}
+
+/**
+  * @brief  Program the erase count record of a page just erased, after its
+  *   header, in one word write.
+  * @param  Page: page number
+  * @param  Count: erase count of the page before this erase
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_WriteEraseCount(uint16_t Page, uint16_t Count)
+{
+  uint16_t flashstatus = HAL_OK;
+  uint32_t record = 0;
+
+  ulWearErases++;
+  /* The count sticks at its highest value */
+  if (Count < 0xFFFF)
+  {
+    Count++;
+  }
+  record = EE_RECORD_VALUE(EE_ERASE_COUNT_VIRTADDRESS, Count);
+  flashstatus = EE_FLASHWrite(EE_PAGE_ADDRESS(Page) + EE_HEADER_SIZE, (uint8_t *)&record, EE_RECORD_SIZE);
+
+  return flashstatus;
+}
+#endif
+
+/**
+  * @brief  Get the first free slot of a page, from the RAM cursor when it is
+  *   kept for this page.
+  * @param  Page: page number
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_GetWriteCursor(uint16_t Page)
+{
+#if (EE_USE_WRITE_CURSOR == 1)
+  if ((usValidpage != Page) || (ulAddress == 0xffffffff))
+  {
+    usValidpage = Page;
+    ulAddress = EE_FindWriteCursor(Page);
+  }
+  return ulAddress;
+#else
+  return EE_FindWriteCursor(Page);
+#endif
+}
+
+/**
+  * @brief  Find the first free slot of a page by a binary search.
+  * @param  Page: page number
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_FindWriteCursor(uint16_t Page)
+{
+  return EE_CoreFindCursor(EE_PAGE_ADDRESS(Page), EE_PAGE_ADDRESS(Page) + PAGE_SIZE);
+}
+
+#if (EE_USE_TRANSACTION == 1)
+/**
+  * @brief  Find the end of the committed records of a page, walking back from
+  *   its write cursor.
+  * @param  Page: page number
+  * @retval Address following the last committed record
+  */
+static uint32_t EE_TxnCommittedEnd(uint16_t Page)
+{
+  uint32_t endaddress;
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  endaddress = ((usValidpage == Page) && (ulAddress != 0xffffffff)) ? ulAddress : EE_FindWriteCursor(Page);
+#else
+  endaddress = EE_FindWriteCursor(Page);
+#endif
+
+  return EE_CoreTxnCommittedEnd(EE_PAGE_ADDRESS(Page), endaddress);
+}
+
+/**
+  * @brief  Drop the records of a transaction that was never committed, if any,
+  *   by moving the writes to the next page of the ring.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_TxnRecover(void)
+{
+  if (ucTxnTorn == 0)
+  {
+    return HAL_OK;
+  }
+
+  return EE_PageTransfer(EE_NO_VIRTADDRESS, 0);
+}
+#endif
+
+#if (EE_USE_RAM_INDEX == 1)
+/**
+  * @brief  Rebuild the RAM index from the pages of the ring, oldest record
+  *   first so that the latest record of each variable wins.
+  * @param  None
+  * @retval None
+  */
+static void EE_IndexBuild(void)
+{
+  uint16_t validpage = PAGE0, varidx = 0, chain = 0;
+  uint16_t addressvalue = 0x5555;
+  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+#if (EE_USE_BLOB == 1)
+  uint16_t blobsize = 0;
+#endif
+
+  ucVarIndexValid = 0;
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+  {
+    ausVarIndex[varidx] = 0;
+  }
+#if (EE_USE_BLOB == 1)
+  for (varidx = 0; varidx < NB_OF_BLOB; varidx++)
+  {
+    ausBlobIndex[varidx] = 0;
+  }
+#endif
+
+  /* Get the oldest page of the ring */
+  validpage = EE_FindTailPage();
+  if (validpage == NO_VALID_PAGE)
+  {
+    return;
+  }
+
+  for (chain = 0; (validpage != NO_VALID_PAGE) && (chain < EE_NB_PAGES); chain++)
+  {
+    /* First record follows the page header */
+    address = EE_PAGE_ADDRESS(validpage) + EE_HEADER_SIZE;
+    pageendaddress = EE_PAGE_ADDRESS(validpage) + PAGE_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+    /* Records of a transaction not committed yet are not indexed */
+    pageendaddress = EE_TxnCommittedEnd(validpage);
+#endif
+
+    while (address < pageendaddress)
+    {
+      uint32_t RData;
+      EE_FLASHRead(address, (uint8_t *)&RData, 4);
+      /* Page is written in order: the first erased slot ends the records */
+      if (RData == 0xFFFFFFFF)
+      {
+        break;
+      }
+      EE_FLASHRead(address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&addressvalue, 2);
+      if (addressvalue < NB_OF_VAR)
+      {
+        ausVarIndex[addressvalue] = EE_RECORD_INDEX(address);
+      }
+#if (EE_USE_BLOB == 1)
+      else if (EE_IS_BLOB_VIRTADDRESS(addressvalue)
+               && (EE_BlobCheck(EE_PAGE_ADDRESS(validpage), address, NULL, 0, &blobsize) != 0))
+      {
+        ausBlobIndex[addressvalue - EE_BLOB_VIRTADDRESS] = EE_RECORD_INDEX(address);
+      }
+#endif
+      address = address + EE_RECORD_SIZE;
     }
+
+    validpage = EE_NewerPage(validpage);
   }
 
-  /* Return readstatus value: (0: variable exist, 1: variable doesn't exist) */
-  return readstatus;
+  ucVarIndexValid = 1;
 }
+#endif
 
+#if (EE_USE_IT == 1)
 /**
-  * @brief  Writes/upadtes variable data in EEPROM.
-  * @param  VirtAddress: Variable virtual address
-  * @param  Data: 16 bit data to be written
-  * @retval Success or error status:
-  *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
-  *           - Flash error code: on write Flash error
+  * @brief  Starts programming the first queued write under interrupt when it
+  *   fits at the write cursor, else leaves it to EE_ProcessIT. Called with the
+  *   Flash interrupt masked or from it.
+  * @param  None
+  * @retval None
   */
-uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
+static void EE_ITStart(void)
 {
-  uint16_t Status = 0;
+  uint16_t validpage = PAGE0;
+  uint32_t room = 1, rdata = 0;
 
-  /* Write the variable virtual address and value in the EEPROM */
-  Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+  if (usItCount == 0)
+  {
+    ucItState = EE_IT_IDLE;
+    return;
+  }
 
-  /* In case the EEPROM active page is full */
-  if (Status == PAGE_FULL)
+  ucItState = EE_IT_STALLED;
+#if (EE_USE_TRANSACTION == 1)
+  /* A transaction never committed is dropped first by a page transfer */
+  if (ucTxnTorn != 0)
   {
-    /* Perform Page transfer */
-    Status = EE_PageTransfer(VirtAddress, Data);
+    return;
+  }
+#endif
+  /* Keep room for the records a collection in progress still has to copy */
+  if ((ucGcState == EE_GC_MARK) || (ucGcState == EE_GC_COPY))
+  {
+    room = 1 + EE_GC_COPY_SLOTS;
+  }
+  /* A full page needs a page transfer */
+  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if ((validpage == NO_VALID_PAGE) || (usValidpage != validpage) || (ulAddress == 0xffffffff)
+      || (((EE_PAGE_ADDRESS(validpage) + PAGE_SIZE - ulAddress) / EE_RECORD_SIZE) < room))
+  {
+    return;
+  }
+  EE_FLASHRead(ulAddress, (uint8_t *)&rdata, 4);
+  if (rdata != 0xFFFFFFFF)
+  {
+    return;
   }
 
-  /* Return last operation status */
-  return Status;
+  EE_ITUnlockFlash();
+  ucItResult = EE_IT_PENDING;
+  /* The HAL programs the data half-word first, as EE_ProgramRecord does */
+  if (HAL_FLASH_Program_IT(FLASH_TYPEPROGRAM_WORD, ulAddress,
+                           EE_RECORD_VALUE(ausItVirtAddress[usItFirst], ausItData[usItFirst])) == HAL_OK)
+  {
+    ucItState = EE_IT_BUSY;
+    EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+    ulWearRecords++;
+#endif
+  }
 }
 
 /**
-  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
+  * @brief  Unlocks the Flash for the queued writes if it is locked.
   * @param  None
-  * @retval Status of the last operation (Flash write or erase) done during
-  *         EEPROM formating
+  * @retval None
   */
-static HAL_StatusTypeDef EE_Format(void)
+static void EE_ITUnlockFlash(void)
 {
-  HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint32_t page_error = 0;
-  FLASH_EraseInitTypeDef s_eraseinit;
-
-  s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = PAGE0_ID;
-  s_eraseinit.NbPages = 1;
-  /* Erase Page0 */
-  if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+  if (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U)
   {
-    flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-    /* If erase operation was failed, a Flash error code is returned */
-    if (flashstatus != HAL_OK)
-    {
-      return flashstatus;
-    }
+    HAL_FLASH_Unlock();
+    ucItUnlocked = 1;
   }
-  /* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
-  static uint16_t WData = VALID_PAGE;
-  flashstatus = EE_FLASHWrite(PAGE0_BASE_ADDRESS, (uint8_t *)&WData, 2);
-  /* If program operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
+}
+
+/**
+  * @brief  Locks the Flash back if the queue unlocked it and is empty. Left
+  *   to thread mode, so that the interrupt never locks the Flash under the
+  *   feet of a caller that unlocked it meanwhile.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITLockFlash(void)
+{
+  if ((ucItState == EE_IT_IDLE) && (ucItUnlocked != 0))
   {
-    return flashstatus;
+    HAL_FLASH_Lock();
+    ucItUnlocked = 0;
   }
+}
+
+/**
+  * @brief  Looks for the last queued write of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: receives the queued value
+  * @retval 1 if the variable has a queued write, 0 otherwise
+  */
+static uint8_t EE_ITFindQueued(uint16_t VirtAddress, uint16_t *Data)
+{
+  uint16_t idx = 0, slot = 0;
+  uint8_t found = 0;
 
-  s_eraseinit.PageAddress = PAGE1_ID;
-  /* Erase Page1 */
-  if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+  EE_IT_LOCK();
+  for (idx = 0; idx < usItCount; idx++)
   {
-    flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-    /* If erase operation was failed, a Flash error code is returned */
-    if (flashstatus != HAL_OK)
+    slot = (usItFirst + idx) % EE_IT_QUEUE_SIZE;
+    if (ausItVirtAddress[slot] == VirtAddress)
     {
-      return flashstatus;
+      *Data = ausItData[slot];
+      found = 1;
     }
   }
+  EE_IT_UNLOCK();
 
-  return HAL_OK;
+  return found;
 }
+#endif
 
+#if (EE_USE_WRITE_CACHE == 1)
 /**
-  * @brief  Find valid Page for write or read operation
-  * @param  Operation: operation to achieve on the valid page.
-  *   This parameter can be one of the following values:
-  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
-  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
-  * @retval Valid page number (PAGE or PAGE1) or NO_VALID_PAGE in case
-  *   of no valid page was found
+  * @brief  Looks for the cache entry of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @retval Index of the entry, number of entries if the variable is not cached
   */
-static uint16_t EE_FindValidPage(uint8_t Operation)
+static uint16_t EE_CacheFind(uint16_t VirtAddress)
 {
-  uint16_t pagestatus0 = 6, pagestatus1 = 6;
+  uint16_t slot = 0;
+
+  while ((slot < usCacheCount) && (ausCacheVirtAddress[slot] != VirtAddress))
+  {
+    slot++;
+  }
+
+  return slot;
+}
 
-  /* Get Page0 actual status */
-  EE_FLASHRead(PAGE0_BASE_ADDRESS, (uint8_t *)&pagestatus0, 2);
-  /* Get Page1 actual status */
-  EE_FLASHRead(PAGE1_BASE_ADDRESS, (uint8_t *)&pagestatus1, 2);
+/**
+  * @brief  Drops the cache entries of variables written to Flash by the other
+  *   write functions: their cached writes are older.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   NbVar variables from FirstVirtAddress on
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  NbVar: number of variables
+  * @retval None
+  */
+static void EE_CacheDrop(const uint16_t *VirtAddress, uint16_t FirstVirtAddress, uint16_t NbVar)
+{
+  uint32_t primask = 0;
+  uint16_t idx = 0, slot = 0;
 
-  /* Write or read operation */
-  switch (Operation)
+  EE_CACHE_LOCK(primask);
+  for (idx = 0; (idx < NbVar) && (usCacheCount != 0); idx++)
   {
-  case WRITE_IN_VALID_PAGE: /* ---- Write operation ---- */
-    if (pagestatus1 == VALID_PAGE)
+    slot = EE_CacheFind((VirtAddress != NULL) ? VirtAddress[idx] : (uint16_t)(FirstVirtAddress + idx));
+    if (slot < usCacheCount)
     {
-      /* Page0 receiving data */
-      if (pagestatus0 == RECEIVE_DATA)
-      {
-        return PAGE0; /* Page0 valid */
-      }
-      else
-      {
-        return PAGE1; /* Page1 valid */
-      }
+      /* The last entry takes the place of the dropped one */
+      usCacheCount--;
+      ausCacheVirtAddress[slot] = ausCacheVirtAddress[usCacheCount];
+      ausCacheData[slot] = ausCacheData[usCacheCount];
     }
-    else if (pagestatus0 == VALID_PAGE)
+  }
+  EE_CACHE_UNLOCK(primask);
+}
+#endif
+
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Checks the blob closed by a header record: the records before it
+  *   have to be its CRC record and its data records, and the CRC has to match
+  *   the bytes, which are copied to Data on the way.
+  * @param  PageAddress: address of the page holding the blob
+  * @param  Address: address of the header record
+  * @param  Data: buffer receiving the bytes, NULL to check the blob only
+  * @param  MaxSize: size of the buffer
+  * @param  Size: receives the size of the blob
+  * @retval 1 if the blob is complete, 0 otherwise
+  */
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  uint16_t blob = 0, blobsize = 0, idx = 0, crc = 0xFFFF;
+  uint16_t addressvalue = 0x5555, recorddata = 0;
+  uint8_t byte = 0;
+
+  EE_FLASHRead(Address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&blob, 2);
+  EE_FLASHRead(Address, (uint8_t *)&blobsize, 2);
+  blob = blob - EE_BLOB_VIRTADDRESS;
+
+  /* The records of the blob follow the page header */
+  if ((blobsize > EE_BLOB_MAX_SIZE) || (((Address - PageAddress) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(blobsize)))
+  {
+    return 0;
+  }
+  Address = Address - (uint32_t)(EE_BLOB_NB_SLOTS(blobsize) - 1) * EE_RECORD_SIZE;
+
+  crc = EE_Crc16(crc, (uint8_t)blob);
+  crc = EE_Crc16(crc, (uint8_t)blobsize);
+  crc = EE_Crc16(crc, (uint8_t)(blobsize >> 8));
+  for (idx = 0; idx < blobsize; idx++)
+  {
+    if ((idx % EE_BLOB_BYTES_PER_RECORD) == 0)
     {
-      /* Page1 receiving data */
-      if (pagestatus1 == RECEIVE_DATA)
-      {
-        return PAGE1; /* Page1 valid */
-      }
-      else
+      EE_FLASHRead(Address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&addressvalue, 2);
+      if (addressvalue != EE_BLOB_DATA_VIRTADDRESS)
       {
-        return PAGE0; /* Page0 valid */
+        return 0;
       }
+      EE_FLASHRead(Address, (uint8_t *)&recorddata, 2);
+      Address = Address + EE_RECORD_SIZE;
     }
-    else
-    {
-      return NO_VALID_PAGE; /* No valid Page */
-    }
-
-  case READ_FROM_VALID_PAGE: /* ---- Read operation ---- */
-    if (pagestatus0 == VALID_PAGE)
-    {
-      return PAGE0; /* Page0 valid */
-    }
-    else if (pagestatus1 == VALID_PAGE)
-    {
-      return PAGE1; /* Page1 valid */
-    }
-    else
+    byte = (uint8_t)(recorddata >> (8 * (idx % EE_BLOB_BYTES_PER_RECORD)));
+    crc = EE_Crc16(crc, byte);
+    if ((Data != NULL) && (idx < MaxSize))
     {
-      return NO_VALID_PAGE; /* No valid Page */
+      Data[idx] = byte;
     }
+  }
 
-  default:
-    return PAGE0; /* Page0 valid */
+  EE_FLASHRead(Address + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&addressvalue, 2);
+  EE_FLASHRead(Address, (uint8_t *)&recorddata, 2);
+  if ((addressvalue != EE_BLOB_CRC_VIRTADDRESS) || (recorddata != crc))
+  {
+    return 0;
   }
+  *Size = blobsize;
+  return 1;
 }
 
 /**
-  * @brief  Verify if active page is full and Writes variable in EEPROM.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @brief  Copies a checked blob as a unit behind the last record of the
+  *   newest page, its records in the same order.
+  * @param  Address: address of the header record of the blob
+  * @param  Size: size of the blob
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
+  *           - PAGE_FULL: if the blob does not fit in the newest page
   *           - NO_VALID_PAGE: if no valid page was found
   *           - Flash error code: on write Flash error
   */
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_BlobCopy(uint32_t Address, uint16_t Size)
 {
-  HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint16_t validpage = PAGE0;
-  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS + PAGE_SIZE;
+  uint16_t validpage = PAGE0, eepromstatus = HAL_OK;
+  uint16_t virtaddress = 0x5555, recorddata = 0;
+  uint32_t newaddress = EEPROM_START_ADDRESS;
+  uint32_t sourceaddress = Address - (uint32_t)(EE_BLOB_NB_SLOTS(Size) - 1) * EE_RECORD_SIZE;
 
-  /* Get valid Page for write operation */
   validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
-
-  /* Check if there is no valid page */
   if (validpage == NO_VALID_PAGE)
   {
     return NO_VALID_PAGE;
   }
-
-  /* Get the valid Page start address */
-#if (USE_ADDR_OPTIMIZATION == 0)
-  address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE));
-#else
-  if (usValidpage != validpage)
+  newaddress = EE_GetWriteCursor(validpage);
+  if (((EE_PAGE_ADDRESS(validpage) + PAGE_SIZE - newaddress) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(Size))
   {
-    usValidpage = validpage;
-    address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE));
+    return PAGE_FULL;
   }
-  else
+
+  while ((sourceaddress <= Address) && (eepromstatus == HAL_OK))
   {
-    address = ulAddress;
+    EE_FLASHRead(sourceaddress + EE_RECORD_VIRTADDRESS_OFFSET, (uint8_t *)&virtaddress, 2);
+    EE_FLASHRead(sourceaddress, (uint8_t *)&recorddata, 2);
+    eepromstatus = EE_ProgramRecord(newaddress, virtaddress, recorddata);
+    sourceaddress = sourceaddress + EE_RECORD_SIZE;
+    newaddress = newaddress + EE_RECORD_SIZE;
   }
-#endif
-  /* Get the valid Page end address */
-  pageendaddress = (uint32_t)((EEPROM_START_ADDRESS - 1) + (uint32_t)((validpage + 1) * PAGE_SIZE));
 
-  /* Check each active page address starting from begining */
-  while (address < pageendaddress)
+  return eepromstatus;
+}
+
+/**
+  * @brief  Gets the slots the last complete copies of the blobs take, which a
+  *   collection may have to copy. Counted again after a blob is written or a
+  *   page erased.
+  * @param  None
+  * @retval Number of slots
+  */
+static uint16_t EE_BlobSlots(void)
+{
+  uint16_t blob = 0, size = 0, nbslot = 0;
+  uint32_t header = 0;
+
+  if (usBlobSlots != EE_BLOB_SLOTS_UNKNOWN)
   {
-    /* Verify if address and address+2 contents are 0xFFFFFFFF */
-    uint32_t RData;
-    EE_FLASHRead(address, (uint8_t *)&RData, 4);
-    if (RData == 0xFFFFFFFF)
-    {
-      /* Set variable data */
-      flashstatus = EE_FLASHWrite(address, (uint8_t *)&Data, 2);
-      /* If program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
-      {
-        return flashstatus;
-      }
-      /* Set variable virtual address */
-      flashstatus = EE_FLASHWrite(address + 2, (uint8_t *)&VirtAddress, 2);
-#if (USE_ADDR_OPTIMIZATION == 0)
-      NULL;
-#else
-      ulAddress = address + 4;
-#endif
-      /* Return program operation status */
-      return flashstatus;
-    }
-    else
+    return usBlobSlots;
+  }
+  for (blob = 0; blob < NB_OF_BLOB; blob++)
+  {
+    switch (EE_BlobFind(blob, NULL, 0, &size, &header))
     {
-      /* Next address location */
-      address = address + 4;
+    case HAL_OK:
+      nbslot = nbslot + EE_BLOB_NB_SLOTS(size);
+      break;
+    case NO_VALID_PAGE:
+      /* Not known yet: count the largest blob */
+      return (uint16_t)(NB_OF_BLOB * EE_BLOB_NB_SLOTS(EE_BLOB_MAX_SIZE));
+    default:
+      break;
     }
   }
+  usBlobSlots = nbslot;
 
-  /* Return PAGE_FULL in case the valid page is full */
-  return PAGE_FULL;
+  return nbslot;
 }
 
 /**
-  * @brief  Transfers last updated variables data from the full Page to
-  *   an empty one.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
-  * @retval Success or error status:
-  *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
-  *           - Flash error code: on write Flash error
+  * @brief  Updates a CRC-16/CCITT (polynomial 0x1021) with one byte.
+  * @param  Crc: CRC of the previous bytes, 0xFFFF for the first one
+  * @param  Byte: next byte
+  * @retval Updated CRC
   */
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte)
 {
-  HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint32_t newpageaddress = EEPROM_START_ADDRESS;
-  uint32_t oldpageid = 0;
-  uint16_t validpage = PAGE0, varidx = 0;
-  uint16_t eepromstatus = 0, readstatus = 0;
-  uint32_t page_error = 0;
-  FLASH_EraseInitTypeDef s_eraseinit;
-
-  /* Get active Page for read operation */
-  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  uint8_t bit = 0;
 
-  if (validpage == PAGE1) /* Page1 valid */
+  Crc ^= (uint16_t)Byte << 8;
+  for (bit = 0; bit < 8; bit++)
   {
-    /* New page address where variable will be moved to */
-    newpageaddress = PAGE0_BASE_ADDRESS;
-
-    /* Old page ID where variable will be taken from */
-    oldpageid = PAGE1_ID;
+    Crc = ((Crc & 0x8000) != 0) ? (uint16_t)((Crc << 1) ^ 0x1021) : (uint16_t)(Crc << 1);
   }
-  else if (validpage == PAGE0) /* Page0 valid */
-  {
-    /* New page address  where variable will be moved to */
-    newpageaddress = PAGE1_BASE_ADDRESS;
+  return Crc;
+}
+#endif
 
-    /* Old page ID where variable will be taken from */
-    oldpageid = PAGE0_ID;
-  }
-  else
-  {
-    return NO_VALID_PAGE; /* No valid Page */
-  }
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+/**
+  * @brief  Masks the interrupts and starts timing how long they stay masked
+  *   with the DWT cycle counter.
+  * @param  None
+  * @retval Start time, to be given to EE_IrqMaskEnd
+  */
+static uint32_t EE_IrqMaskStart(void)
+{
+  __disable_irq();
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+}
 
-  /* Set the new Page status to RECEIVE_DATA status */
-  uint16_t WData = RECEIVE_DATA;
-  flashstatus = EE_FLASHWrite(newpageaddress, (uint8_t *)&WData, 2);
-  /* If program operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
-  {
-    return flashstatus;
-  }
+/**
+  * @brief  Unmasks the interrupts and records how long they were masked.
+  * @param  Start: start time returned by EE_IrqMaskStart
+  * @retval None
+  */
+static void EE_IrqMaskEnd(uint32_t Start)
+{
+  uint32_t elapsed = DWT->CYCCNT - Start;
 
-  /* Write the variable passed as parameter in the new active page */
-  eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-  /* If program operation was failed, a Flash error code is returned */
-  if (eepromstatus != HAL_OK)
+#if (EE_USE_IT == 1)
+  ulIrqMaskedLast = elapsed;
+  if (elapsed > ulIrqMaskedMax)
   {
-    return eepromstatus;
+    ulIrqMaskedMax = elapsed;
   }
+#endif
+#if (EE_USE_STATS == 1)
+  EE_StatsTime(&xStats.IrqMasked, elapsed);
+#endif
+  __enable_irq();
+}
+#endif
 
-  /* Transfer process: transfer variables from old to the new active page */
-  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
-  {
-    if (varidx != VirtAddress) /* Check each variable except the one passed as parameter */
-    {
-      /* Read the other last variable updates */
-      readstatus = EE_ReadVariable(varidx, &DataVar);
-      /* In case variable corresponding to the virtual address was found */
-      if (readstatus != 0x1)
-      {
-        /* Transfer the variable to the new active page */
-        eepromstatus = EE_VerifyPageFullWriteVariable(varidx, DataVar);
-        /* If program operation was failed, a Flash error code is returned */
-        if (eepromstatus != HAL_OK)
-        {
-          return eepromstatus;
-        }
-      }
-    }
-  }
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Reads the DWT cycle counter.
+  * @param  None
+  * @retval Count of core clock cycles
+  */
+static uint32_t EE_CycleCount(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+}
 
-  s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = oldpageid;
-  s_eraseinit.NbPages = 1;
+/**
+  * @brief  Adds a time to a timing of the statistics.
+  * @param  Timing: timing to update
+  * @param  Elapsed: time taken, in core clock cycles
+  * @retval None
+  */
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed)
+{
+  uint32_t bucket = 0;
+  uint32_t limit = EE_STATS_BUCKET_CYCLES;
 
-  /* Erase the old Page: Set old Page status to ERASED status */
-  flashstatus = EE_FlashErase(s_eraseinit.PageAddress, PAGE_SIZE);
-  /* If erase operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
+  if ((Timing->Count == 0U) || (Elapsed < Timing->Min))
   {
-    return flashstatus;
+    Timing->Min = Elapsed;
   }
-
-  /* Set new Page status to VALID_PAGE status */
-  WData = VALID_PAGE;
-  flashstatus = EE_FLASHWrite(newpageaddress, (uint8_t *)&WData, 2);
-  /* If program operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
+  if (Elapsed > Timing->Max)
   {
-    return flashstatus;
+    Timing->Max = Elapsed;
   }
+  Timing->Count++;
 
-  /* Return last operation flash status */
-  return flashstatus;
+  /* Bucket n holds the times below EE_STATS_BUCKET_CYCLES << n */
+  while ((bucket < (EE_STATS_NB_BUCKETS - 1U)) && (Elapsed >= limit))
+  {
+    limit <<= 1;
+    bucket++;
+  }
+  Timing->Histogram[bucket]++;
 }
+#endif
 
 /**
   * @}
@@ -844,28 +3361,74 @@ uint16_t usWriteRes;
 
 uint16_t usEE_Read(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 2 == 0);
   usLen /= 2;
   for (uint16_t i = 0; i < usLen; i++)
   {
     usReadRes = EE_ReadVariable(usAdd + i, pusDat + i);
   }
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
+#endif
   return 0;
 }
 uint16_t usEE_Write(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1)
+  uint32_t ulMaskStart;
+
+  /* Queued writes go to Flash first, with the interrupts running */
+  (void)EE_FlushIT();
+  ulMaskStart = EE_IrqMaskStart();
+#elif (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 2 == 0);
   usLen /= 2;
   HAL_FLASH_Unlock();
-  for (uint16_t i = 0; i < usLen; i++)
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(NULL, usAdd, usLen);
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* Blocks of up to EE_TXN_MAX_RECORDS variables are updated all at once */
+  usWriteRes = EE_WriteRecords(NULL, usAdd, pusDat, usLen, (usLen <= EE_TXN_MAX_RECORDS) ? 1 : 0);
+#else
+  usWriteRes = EE_WriteRecords(NULL, usAdd, pusDat, usLen, 0);
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* A block updated all at once is never split: it fails as a whole */
+  if ((usWriteRes == PAGE_FULL) && (usLen > EE_TXN_MAX_RECORDS))
+#else
+  if (usWriteRes == PAGE_FULL)
+#endif
   {
-    usWriteRes = EE_WriteVariable(usAdd + i, *(pusDat + i));
+    /* More than a compacted page can take: write the variables one by one,
+       up to the first that fails */
+    for (uint16_t i = 0; i < usLen; i++)
+    {
+      usWriteRes = EE_WriteVariable(usAdd + i, *(pusDat + i));
+      if (usWriteRes != 0)
+      {
+        break;
+      }
+    }
   }
   HAL_FLASH_Lock();
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
-  return 0;
+#endif
+  return usWriteRes;
 }
 /**************************************************************************************************/
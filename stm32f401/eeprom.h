@@ -76,6 +76,12 @@
    be done by word  */
 #define VOLTAGE_RANGE           (uint8_t)VOLTAGE_RANGE_3
 
+/* Program a record, data and virtual address, with one word program rather
+   than two half-word ones. Needs VOLTAGE_RANGE_3 or VOLTAGE_RANGE_4, set it
+   to 0 for a lower range. Records keep their layout, so pages written by
+   half-words are read as before */
+#define EE_USE_WORD_PROGRAM   1
+
 /* EEPROM start address in Flash */
 #define EEPROM_START_ADDRESS  ((uint32_t)0x0800C000) /* EEPROM emulation start address:
                                                   from sector2 : after 16KByte of used 
@@ -92,6 +98,21 @@
 #define PAGE0                 ((uint16_t)0x0000)
 #define PAGE1                 ((uint16_t)0x0001) /* Page nb between PAGE0_BASE_ADDRESS & PAGE1_BASE_ADDRESS*/
 
+/* Keep a third sector erased in advance: a page transfer moves the data into it
+   at once and the sector left behind is only erased later by EE_EraseSpare */
+#define EE_USE_SPARE_PAGE     0
+
+#if (EE_USE_SPARE_PAGE == 1)
+/* Page 2 base and end addresses: sector 5, right after Page1 */
+#define PAGE2_SIZE               (uint32_t)0x20000  /* Page size = 128KByte */
+#define PAGE2_BASE_ADDRESS    ((uint32_t)(EEPROM_START_ADDRESS + 0x14000))
+#define PAGE2_END_ADDRESS     ((uint32_t)(PAGE2_BASE_ADDRESS + (PAGE2_SIZE - 1)))
+#define PAGE2                 ((uint16_t)0x0002)
+#define EE_NB_PAGES           ((uint16_t)3)
+#else
+#define EE_NB_PAGES           ((uint16_t)2)
+#endif
+
 /* No valid page define */
 #define NO_VALID_PAGE         ((uint16_t)0x00AB)
 
@@ -107,15 +128,176 @@
 /* Page full define */
 #define PAGE_FULL             ((uint8_t)0x80)
 
+/* Blob number or size out of range define */
+#define EE_INVALID_BLOB       ((uint8_t)0x81)
+
 /* Variables' number */
 #define NB_OF_VAR             ((uint16_t)500)
 
+/* Keep the address of the first free slot of the write page in RAM so that a
+   write does not scan the page from its beginning */
+#define EE_USE_WRITE_CURSOR   1
+
+/* Keep the pages found from the page headers in RAM so that a read or a write
+   does not load the headers again, they are read again once one changed */
+#define EE_USE_PAGE_CACHE     1
+
+/* Keep a bitmap of the variables the valid page holds a record of in RAM so
+   that reading a variable that was never written does not scan the page */
+#define EE_USE_PRESENCE_BITMAP 1
+
+/* Let EE_WriteVariableIT queue writes that are programmed from the Flash
+   interrupt: FLASH_IRQHandler has to call EE_IRQHandler, and the HAL Flash
+   end of operation and error callbacks are taken by the EEPROM emulation */
+#define EE_USE_IT             0
+
+/* Number of writes EE_WriteVariableIT can queue */
+#define EE_IT_QUEUE_SIZE      ((uint16_t)16)
+
+/* Count the Flash words scanned, the records programmed, the erases and the
+   page transfers, and time the reads, programs, transfers and erases in core
+   clock cycles with the DWT cycle counter: see EE_GetStats */
+#define EE_USE_STATS          0
+
+/* Timing histograms: bucket n counts the calls that took less than
+   EE_STATS_BUCKET_CYCLES << n cycles, the last bucket the longer ones */
+#define EE_STATS_NB_BUCKETS   12
+#define EE_STATS_BUCKET_CYCLES ((uint32_t)256)
+
+/* Keep in each sector the number of times it was erased, in a record
+   programmed right after the erase, and project the remaining life of the
+   sectors from the measured write rate: see EE_GetWear */
+#define EE_USE_ERASE_COUNT    1
+
+/* Program/erase cycles a sector is specified for */
+#define EE_PAGE_ENDURANCE     ((uint32_t)10000)
+
+/* Virtual address reserved for the erase count record */
+#define EE_ERASE_COUNT_VIRTADDRESS ((uint16_t)0xFFFC)
+
+/* Let EE_WriteVariableCached keep the writes of often updated variables in a
+   RAM cache, where a new write of a cached variable replaces the previous
+   one: the cache is written to Flash by EE_Flush, by EE_ProcessCache once its
+   oldest write is EE_CACHE_FLUSH_PERIOD old, and when it is full */
+#define EE_USE_WRITE_CACHE    0
+
+/* Number of variables the write cache holds */
+#define EE_CACHE_SIZE         ((uint16_t)8)
+
+/* Longest time EE_ProcessCache keeps a write in the cache, in HAL ticks (ms) */
+#define EE_CACHE_FLUSH_PERIOD ((uint32_t)1000)
+
+/* Compare each write with the value the variable already has in Flash and
+   skip the records that would not change it. The value is looked up by a
+   scan of the page back from its last record, for each written variable */
+#define EE_USE_SKIP_UNCHANGED 0
+
+/* Let EE_WriteBlob and EE_ReadBlob keep blobs (strings, structures, arrays)
+   of up to EE_BLOB_MAX_SIZE bytes under one virtual address each. The bytes
+   go in consecutive records closed by a CRC record and a header record: a
+   blob cut by a power loss fails its CRC and its previous copy is read, and
+   a page transfer copies the last complete copy of each blob as a unit. A
+   page has to hold NB_OF_BLOB blobs of EE_BLOB_MAX_SIZE bytes on top of the
+   variables */
+#define EE_USE_BLOB           0
+
+/* Number of blobs */
+#define NB_OF_BLOB            ((uint16_t)4)
+
+/* Largest size of a blob, in bytes */
+#define EE_BLOB_MAX_SIZE      ((uint16_t)256)
+
+/* Virtual addresses reserved for the blobs: the header record of blob n is at
+   EE_BLOB_VIRTADDRESS + n, above NB_OF_VAR */
+#define EE_BLOB_VIRTADDRESS   ((uint16_t)0xFFE0)
+#define EE_BLOB_DATA_VIRTADDRESS ((uint16_t)0xFFFB)
+#define EE_BLOB_CRC_VIRTADDRESS ((uint16_t)0xFFFA)
+
+/* Byte Idx of a blob read in place through the pointer EE_GetBlob gives: a
+   record holds two bytes in its low half-word */
+#define EE_BLOB_BYTE(Data, Idx) ((Data)[(((Idx) / 2) * 4) + ((Idx) % 2)])
+
 /* Exported types ------------------------------------------------------------*/
+#if (EE_USE_STATS == 1)
+/* Timing of one kind of operation, in core clock cycles */
+typedef struct
+{
+  uint32_t Count;                          /* Operations timed */
+  uint32_t Min;                            /* Shortest one */
+  uint32_t Max;                            /* Longest one */
+  uint32_t Histogram[EE_STATS_NB_BUCKETS]; /* Operations per duration range */
+} EE_TimingTypeDef;
+
+/* Statistics gathered by the EEPROM emulation */
+typedef struct
+{
+  uint32_t WordsScanned;      /* Flash words read to find a variable or a free slot */
+  uint32_t Programs;          /* Records programmed, page headers excluded */
+  uint32_t Erases;            /* Sectors erased */
+  uint32_t Transfers;         /* Page transfers done */
+  uint32_t Formats;           /* Formats of the EEPROM */
+  uint32_t Skipped;           /* Records not programmed, the variable already had the value */
+  EE_TimingTypeDef Read;      /* EE_ReadVariable */
+  EE_TimingTypeDef Program;   /* Record programs done */
+  EE_TimingTypeDef Transfer;  /* Page transfers done */
+  EE_TimingTypeDef Erase;     /* Sector erases done */
+  EE_TimingTypeDef IrqMasked; /* usEE_Read and usEE_Write with the interrupts masked */
+} EE_StatsTypeDef;
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/* Wear of the sectors and projection of their remaining life: the measure of
+   the write rate starts at EE_Init or EE_ResetWear */
+typedef struct
+{
+  uint32_t EraseCount[EE_NB_PAGES]; /* Erases of each page */
+  uint32_t MaxEraseCount;    /* Erases of the most worn sector */
+  uint32_t RemainingErases;  /* Erases left to the most worn sector up to EE_PAGE_ENDURANCE */
+  uint32_t Records;          /* Records programmed during the measure, transfer copies included */
+  uint32_t Erases;           /* Sectors erased during the measure */
+  uint32_t Elapsed;          /* Duration of the measure, in HAL ticks (ms) */
+  uint32_t RecordsPerHour;   /* Write rate */
+  uint32_t RemainingRecords; /* Records left to write at the measured records per erase, 0xFFFFFFFF until a sector is erased */
+  uint32_t RemainingHours;   /* Life left at the measured write rate, 0xFFFFFFFF until a sector is erased */
+} EE_WearTypeDef;
+#endif
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
+uint16_t EE_ReadAll(uint16_t *Image, uint8_t *PresentBitmap);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_WriteBatch(const uint16_t *VirtAddress, const uint16_t *Data, uint16_t NbVar);
+#if (EE_USE_SPARE_PAGE == 1)
+uint16_t EE_EraseSpare(void);
+#endif
+#if (EE_USE_IT == 1)
+uint16_t EE_WriteVariableIT(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_ProcessIT(void);
+uint16_t EE_FlushIT(void);
+void EE_IRQHandler(void);
+void EE_WriteCpltCallback(uint16_t VirtAddress, uint16_t Status);
+void EE_GetIrqMaskedTime(uint32_t *Last, uint32_t *Max);
+#endif
+#if (EE_USE_STATS == 1)
+void EE_GetStats(EE_StatsTypeDef *Stats);
+void EE_ResetStats(void);
+#endif
+#if (EE_USE_ERASE_COUNT == 1)
+void EE_GetWear(EE_WearTypeDef *Wear);
+void EE_ResetWear(void);
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+uint16_t EE_WriteVariableCached(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_Flush(void);
+uint16_t EE_ProcessCache(void);
+#endif
+#if (EE_USE_BLOB == 1)
+uint16_t EE_WriteBlob(uint16_t Blob, const uint8_t *Data, uint16_t Size);
+uint16_t EE_ReadBlob(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size);
+uint16_t EE_GetBlob(uint16_t Blob, const uint8_t **Data, uint16_t *Size, uint32_t *Generation);
+uint32_t EE_GetGeneration(void);
+#endif
 
 extern uint16_t usEE_Read(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen);
 extern uint16_t usEE_Write(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen);
@@ -51,12 +51,209 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+/* Record geometry: a page starts with its status and mark half-words, then
+   holds word records, the data half-word followed by the virtual address. The
+   loops below only reach a record through these */
+#define EE_HEADER_SIZE        ((uint32_t)4)
+#define EE_RECORD_SIZE        ((uint32_t)4)
+#define EE_RECORD_DATA(Address) (*(__IO uint16_t *)(Address))
+#define EE_RECORD_VIRTADDRESS(Address) (*(__IO uint16_t *)((Address) + 2))
+#define EE_RECORD_ERASED(Address) ((*(__IO uint32_t *)(Address)) == 0xFFFFFFFF)
+#define EE_RECORD_VALUE(VirtAddress, Data) (((uint32_t)(VirtAddress) << 16) | (Data))
+
+/* Records as the shared engine of ee_core.h sees them: a whole record is read
+   at once, its fields are taken from the word */
+#define EE_CORE_STATUS        uint16_t
+#define EE_CORE_OK            HAL_OK
+#define EE_CORE_RECORD_TYPE   uint32_t
+#define EE_CORE_VIRTADDRESS_TYPE uint16_t
+#define EE_CORE_DATA_TYPE     uint16_t
+#define EE_CORE_HEADER_SIZE   EE_HEADER_SIZE
+#define EE_CORE_RECORD_SIZE   EE_RECORD_SIZE
+#define EE_CORE_READ(Address) (*(__IO uint32_t *)(Address))
+#define EE_CORE_READ_VIRTADDRESS(Address) EE_RECORD_VIRTADDRESS(Address)
+#define EE_CORE_ERASED(Record) ((Record) == 0xFFFFFFFF)
+#define EE_CORE_VIRTADDRESS(Record) ((uint16_t)((Record) >> 16))
+#define EE_CORE_DATA(Record)  ((uint16_t)(Record))
+#define EE_CORE_VALID(Record) 1
+#define EE_CORE_WRITE(VirtAddress, Data) EE_VerifyPageFullWriteVariable((VirtAddress), (Data))
+
+/* Virtual address given to EE_PageTransfer when no variable has to be written */
+#define EE_NO_VIRTADDRESS     ((uint16_t)0xFFFF)
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Page kept by EE_FindValidPage when the headers have to be read again */
+#define EE_PAGE_CACHE_EMPTY   ((uint16_t)0xFFFF)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Bytes of a blob a data record holds, and records a blob of Size bytes takes:
+   its data records, its CRC record and its header record */
+#define EE_BLOB_BYTES_PER_RECORD 2
+#define EE_BLOB_NB_SLOTS(Size) ((uint16_t)((((Size) + EE_BLOB_BYTES_PER_RECORD - 1) / EE_BLOB_BYTES_PER_RECORD) + 2))
+#define EE_IS_BLOB_VIRTADDRESS(VirtAddress) (((VirtAddress) >= EE_BLOB_VIRTADDRESS) && ((VirtAddress) < (EE_BLOB_VIRTADDRESS + NB_OF_BLOB)))
+
+/* Entries of the copy bitmap of a page transfer: the variables, then the blobs */
+#define EE_NB_OF_ITEMS        (NB_OF_VAR + NB_OF_BLOB)
+#else
+#define EE_NB_OF_ITEMS        NB_OF_VAR
+#endif
+
+#if (EE_USE_SPARE_PAGE == 1)
+/* Mark programmed after the status of a valid page once a newer page is valid:
+   the page only waits for EE_EraseSpare */
+#define EE_PAGE_OBSOLETE      ((uint16_t)0x0000)
+#endif
+
+#if (EE_USE_IT == 1)
+#if (EE_USE_WRITE_CURSOR == 0)
+#error "EE_USE_IT needs EE_USE_WRITE_CURSOR"
+#endif
+
+/* States of the queued writes */
+#define EE_IT_IDLE            ((uint8_t)0x00)    /* No write is queued */
+#define EE_IT_BUSY            ((uint8_t)0x01)    /* First queued write is programmed under interrupt */
+#define EE_IT_STALLED         ((uint8_t)0x02)    /* First queued write is left to EE_ProcessIT */
+
+/* Result of the Flash operation given by the HAL callbacks */
+#define EE_IT_PENDING         ((uint8_t)0x00)
+#define EE_IT_DONE            ((uint8_t)0x01)
+#define EE_IT_FAILED          ((uint8_t)0x02)
+#endif
+
 /* Private macro -------------------------------------------------------------*/
+#if (EE_USE_SPARE_PAGE == 1)
+/* Pages are used in turn: Page0, Page1, Page2 and Page0 again */
+#define EE_NEXT_PAGE(Page)    (((Page) == PAGE2) ? PAGE0 : (uint16_t)((Page) + 1))
+
+/* Status and mark of a page */
+#define EE_PAGE_STATUS(Page)  (*(__IO uint16_t *)EE_PageBaseAddress(Page))
+#define EE_PAGE_MARK(Page)    (*(__IO uint16_t *)(EE_PageBaseAddress(Page) + 2))
+#endif
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Drop the pages kept by EE_FindValidPage, done before a header is programmed
+   or a sector erased */
+#define EE_PAGE_CACHE_RESET() (usReadPage = EE_PAGE_CACHE_EMPTY)
+#else
+#define EE_PAGE_CACHE_RESET()
+#endif
+
+#if (EE_USE_PRESENCE_BITMAP == 1)
+/* Mark a variable as written, and have the bitmap rebuilt from the valid page
+   once its records changed other than by an append */
+#define EE_PRESENT_SET(VirtAddress) \
+  do { if ((VirtAddress) < NB_OF_VAR) { aulPresent[(VirtAddress) >> 5] |= (uint32_t)1 << ((VirtAddress) & 0x1F); } } while (0)
+#define EE_PRESENT_RESET()    (usPresentPage = NO_VALID_PAGE)
+#else
+#define EE_PRESENT_SET(VirtAddress)
+#define EE_PRESENT_RESET()
+#endif
+
+#if (EE_USE_IT == 1)
+/* Only the Flash interrupt is masked while the queue is updated */
+#define EE_IT_LOCK()          HAL_NVIC_DisableIRQ(FLASH_IRQn)
+#define EE_IT_UNLOCK()        HAL_NVIC_EnableIRQ(FLASH_IRQn)
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* The cache is updated with the interrupts masked, EE_Flush may be called from
+   the PVD interrupt */
+#define EE_CACHE_LOCK(Primask)   do { (Primask) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define EE_CACHE_UNLOCK(Primask) __set_PRIMASK(Primask)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Move the blobs read in place by EE_GetBlob to a new generation, done before
+   a blob is written, the blobs are transferred or a sector is erased */
+#define EE_BLOB_INVALIDATE()  (ulBlobGeneration++)
+#else
+#define EE_BLOB_INVALIDATE()
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Statistics updates, compiled out without EE_USE_STATS */
+#define EE_STATS_COUNT(Counter, Nb) (xStats.Counter += (uint32_t)(Nb))
+#define EE_STATS_TIME(Timing, Start) EE_StatsTime(&xStats.Timing, EE_CycleCount() - (Start))
+#else
+#define EE_STATS_COUNT(Counter, Nb)
+#define EE_STATS_TIME(Timing, Start)
+#endif
+
 /* Private variables ---------------------------------------------------------*/
 
 /* Global variable used to store variable value in read sequence */
 uint16_t DataVar = 0;
 
+#if (EE_USE_WRITE_CURSOR == 1)
+/* Page the write cursor belongs to and address of its first free slot,
+   0xFFFFFFFF when the cursor has to be searched again */
+static uint16_t usValidpage = 0xFFFF;
+static uint32_t ulAddress = 0xFFFFFFFF;
+#endif
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Pages EE_FindValidPage returns for a read and for a write, as found from the
+   headers after the last header change */
+static uint16_t usReadPage = EE_PAGE_CACHE_EMPTY;
+static uint16_t usWritePage = EE_PAGE_CACHE_EMPTY;
+#endif
+
+#if (EE_USE_PRESENCE_BITMAP == 1)
+/* Bit n is set when variable n may have a record in the valid page or a
+   queued write, page the bitmap was built from, NO_VALID_PAGE when it has to
+   be built again */
+static uint32_t aulPresent[(NB_OF_VAR + 31) / 32];
+static uint16_t usPresentPage = NO_VALID_PAGE;
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Generation of the pointers given by EE_GetBlob */
+static uint32_t ulBlobGeneration = 0;
+#endif
+
+#if (EE_USE_IT == 1)
+/* Writes queued by EE_WriteVariableIT, the first one is the one programmed */
+static uint16_t ausItVirtAddress[EE_IT_QUEUE_SIZE];
+static uint16_t ausItData[EE_IT_QUEUE_SIZE];
+static volatile uint16_t usItFirst = 0;
+static volatile uint16_t usItCount = 0;
+static volatile uint8_t ucItState = EE_IT_IDLE;
+static volatile uint8_t ucItResult = EE_IT_PENDING;
+/* Set once the data half-word of a record is programmed, or at once when the
+   record is programmed as one word */
+static volatile uint8_t ucItDataDone = 0;
+/* Set when the queue unlocked the Flash, EE_ProcessIT locks it back once empty */
+static uint8_t ucItUnlocked = 0;
+
+/* Time usEE_Read and usEE_Write kept the interrupts masked, in core clock
+   cycles: last call and longest call */
+static uint32_t ulIrqMaskedLast = 0;
+static uint32_t ulIrqMaskedMax = 0;
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Counters and timings returned by EE_GetStats */
+static EE_StatsTypeDef xStats;
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/* Records programmed and sectors erased since the measure of the write rate
+   started, and HAL tick it started at */
+static uint32_t ulWearRecords = 0;
+static uint32_t ulWearErases = 0;
+static uint32_t ulWearStart = 0;
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* Writes kept by EE_WriteVariableCached, one entry per variable, and HAL tick
+   of the oldest one */
+static uint16_t ausCacheVirtAddress[EE_CACHE_SIZE];
+static uint16_t ausCacheData[EE_CACHE_SIZE];
+static volatile uint16_t usCacheCount = 0;
+static uint32_t ulCacheStart = 0;
+#endif
+
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 // extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
@@ -64,13 +261,70 @@ uint16_t DataVar = 0;
 /* Private functions ---------------------------------------------------------*/
 static HAL_StatusTypeDef EE_Format(void);
 static uint16_t EE_FindValidPage(uint8_t Operation);
+static uint16_t EE_ReadValidPage(uint8_t Operation);
 static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
-static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
+static uint16_t EE_VerifyPageFullyErased(uint16_t Page);
+static uint16_t EE_CopyValidRecords(uint32_t OldPageAddress, uint32_t OldPageEndAddress,
+                                    uint32_t NewPageAddress, uint32_t NewPageEndAddress);
+static uint16_t EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data);
+static uint16_t EE_WriteRecords(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                                const uint16_t *Data, uint16_t NbVar);
 static uint32_t GetSector(uint32_t Address);
+static uint32_t EE_GetWriteCursor(uint16_t Page);
+static uint32_t EE_FindWriteCursor(uint16_t Page);
+static uint32_t EE_PageBaseAddress(uint16_t Page);
+static uint32_t EE_PageEndAddress(uint16_t Page);
+static uint16_t EE_EraseSector(uint16_t Page);
+#if (EE_USE_ERASE_COUNT == 1)
+static uint8_t EE_ReadEraseCount(uint16_t Page, uint16_t *Count);
+static uint16_t EE_GetEraseCount(uint16_t Page);
+#endif
+#if (EE_USE_SPARE_PAGE == 1)
+static uint16_t EE_RestorePages(void);
+#else
+static uint16_t EE_RecoverPageStatus(uint16_t PageStatus, uint16_t OtherPageStatus);
+#endif
+#if (EE_USE_IT == 1)
+static void EE_ITStart(void);
+static void EE_ITUnlockFlash(void);
+static void EE_ITLockFlash(void);
+static uint8_t EE_ITFindQueued(uint16_t VirtAddress, uint16_t *Data);
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+static uint16_t EE_CacheFind(uint16_t VirtAddress);
+static void EE_CacheDrop(const uint16_t *VirtAddress, uint16_t FirstVirtAddress, uint16_t NbVar);
+#endif
+static uint16_t EE_ReadStored(uint16_t VirtAddress, uint16_t *Data);
+#if (EE_USE_PRESENCE_BITMAP == 1)
+static void EE_PresentBuild(uint16_t Page);
+#endif
+#if (EE_USE_BLOB == 1)
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size);
+static uint16_t EE_BlobCopy(uint32_t Address, uint16_t Size);
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+static uint8_t EE_IsUnchanged(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                              const uint16_t *Data, uint16_t VarIdx);
+#endif
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+static uint32_t EE_IrqMaskStart(void);
+static void EE_IrqMaskEnd(uint32_t Start);
+#endif
+#if (EE_USE_STATS == 1)
+static uint32_t EE_CycleCount(void);
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed);
+#endif
+
+/* Record engine shared by the ports */
+#include "ee_core.h"
 
 #define PAGE0_ID GetSector(PAGE0_BASE_ADDRESS)
 #define PAGE1_ID GetSector(PAGE1_BASE_ADDRESS)
+#if (EE_USE_SPARE_PAGE == 1)
+#define PAGE2_ID GetSector(PAGE2_BASE_ADDRESS)
+#endif
 
 /**
   * @brief  Restore the pages to a known good state in case of page's status
@@ -81,23 +335,45 @@ static uint32_t GetSector(uint32_t Address);
   */
 uint16_t EE_Init(void)
 {
+  uint16_t EepromStatus = 0;
+#if (EE_USE_SPARE_PAGE == 0)
   uint16_t PageStatus0 = 6, PageStatus1 = 6;
-  uint16_t VarIdx = 0;
-  uint16_t EepromStatus = 0, ReadStatus = 0;
-  int16_t x = -1;
   HAL_StatusTypeDef FlashStatus;
-  uint32_t SectorError = 0;
-  FLASH_EraseInitTypeDef pEraseInit;
-
+#endif
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The cursor is searched again once the pages are repaired */
+  ulAddress = 0xFFFFFFFF;
+#endif
+  /* So are the valid pages and the variables they hold */
+  EE_PAGE_CACHE_RESET();
+  EE_PRESENT_RESET();
+  EE_BLOB_INVALIDATE();
+#if (EE_USE_ERASE_COUNT == 1)
+  EE_ResetWear();
+#endif
+
+#if (EE_USE_SPARE_PAGE == 1)
+  /* Repair the pages, the sectors left behind are erased by EE_EraseSpare */
+  EepromStatus = EE_RestorePages();
+  if (EepromStatus != HAL_OK)
+  {
+    return EepromStatus;
+  }
+#else
   /* Get Page0 status */
   PageStatus0 = (*(__IO uint16_t *)PAGE0_BASE_ADDRESS);
   /* Get Page1 status */
   PageStatus1 = (*(__IO uint16_t *)PAGE1_BASE_ADDRESS);
 
-  pEraseInit.TypeErase = TYPEERASE_SECTORS;
-  pEraseInit.Sector = PAGE0_ID;
-  pEraseInit.NbSectors = 1;
-  pEraseInit.VoltageRange = VOLTAGE_RANGE;
+  /* A header left damaged by a power loss is mapped back to a known state */
+  PageStatus0 = EE_RecoverPageStatus(PageStatus0, PageStatus1);
+  PageStatus1 = EE_RecoverPageStatus(PageStatus1, PageStatus0);
 
   /* Check for invalid header states and repair if necessary */
   switch (PageStatus0)
@@ -106,9 +382,9 @@ uint16_t EE_Init(void)
     if (PageStatus1 == VALID_PAGE) /* Page0 erased, Page1 valid */
     {
       /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE0))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE0);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -119,9 +395,9 @@ uint16_t EE_Init(void)
     else if (PageStatus1 == RECEIVE_DATA) /* Page0 erased, Page1 receive */
     {
       /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE0))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE0);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -129,6 +405,7 @@ uint16_t EE_Init(void)
         }
       }
       /* Mark Page1 as valid */
+      EE_PAGE_CACHE_RESET();
       FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE1_BASE_ADDRESS, VALID_PAGE);
       /* If program operation was failed, a Flash error code is returned */
       if (FlashStatus != HAL_OK)
@@ -152,43 +429,25 @@ uint16_t EE_Init(void)
     if (PageStatus1 == VALID_PAGE) /* Page0 receive, Page1 valid */
     {
       /* Transfer data from Page1 to Page0 */
-      for (VarIdx = 0; VarIdx < NB_OF_VAR; VarIdx++)
+      EepromStatus = EE_CopyValidRecords(PAGE1_BASE_ADDRESS, PAGE1_END_ADDRESS,
+                                         PAGE0_BASE_ADDRESS, PAGE0_END_ADDRESS);
+      /* If program operation was failed, a Flash error code is returned */
+      if (EepromStatus != HAL_OK)
       {
-        if ((*(__IO uint16_t *)(PAGE0_BASE_ADDRESS + 6)) == VarIdx)
-        {
-          x = VarIdx;
-        }
-        if (VarIdx != x)
-        {
-          /* Read the last variables' updates */
-          ReadStatus = EE_ReadVariable(VarIdx, &DataVar);
-          /* In case variable corresponding to the virtual address was found */
-          if (ReadStatus != 0x1)
-          {
-            /* Transfer the variable to the Page0 */
-            EepromStatus = EE_VerifyPageFullWriteVariable(VarIdx, DataVar);
-            /* If program operation was failed, a Flash error code is returned */
-            if (EepromStatus != HAL_OK)
-            {
-              return EepromStatus;
-            }
-          }
-        }
+        return EepromStatus;
       }
       /* Mark Page0 as valid */
+      EE_PAGE_CACHE_RESET();
       FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
       /* If program operation was failed, a Flash error code is returned */
       if (FlashStatus != HAL_OK)
       {
         return FlashStatus;
       }
-      pEraseInit.Sector = PAGE1_ID;
-      pEraseInit.NbSectors = 1;
-      pEraseInit.VoltageRange = VOLTAGE_RANGE;
       /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE1))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE1);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -198,13 +457,10 @@ uint16_t EE_Init(void)
     }
     else if (PageStatus1 == ERASED) /* Page0 receive, Page1 erased */
     {
-      pEraseInit.Sector = PAGE1_ID;
-      pEraseInit.NbSectors = 1;
-      pEraseInit.VoltageRange = VOLTAGE_RANGE;
       /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE1))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE1);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -212,6 +468,7 @@ uint16_t EE_Init(void)
         }
       }
       /* Mark Page0 as valid */
+      EE_PAGE_CACHE_RESET();
       FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
       /* If program operation was failed, a Flash error code is returned */
       if (FlashStatus != HAL_OK)
@@ -244,13 +501,10 @@ uint16_t EE_Init(void)
     }
     else if (PageStatus1 == ERASED) /* Page0 valid, Page1 erased */
     {
-      pEraseInit.Sector = PAGE1_ID;
-      pEraseInit.NbSectors = 1;
-      pEraseInit.VoltageRange = VOLTAGE_RANGE;
       /* Erase Page1 */
-      if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE1))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE1);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -261,43 +515,25 @@ uint16_t EE_Init(void)
     else /* Page0 valid, Page1 receive */
     {
       /* Transfer data from Page0 to Page1 */
-      for (VarIdx = 0; VarIdx < NB_OF_VAR; VarIdx++)
+      EepromStatus = EE_CopyValidRecords(PAGE0_BASE_ADDRESS, PAGE0_END_ADDRESS,
+                                         PAGE1_BASE_ADDRESS, PAGE1_END_ADDRESS);
+      /* If program operation was failed, a Flash error code is returned */
+      if (EepromStatus != HAL_OK)
       {
-        if ((*(__IO uint16_t *)(PAGE1_BASE_ADDRESS + 6)) == VarIdx)
-        {
-          x = VarIdx;
-        }
-        if (VarIdx != x)
-        {
-          /* Read the last variables' updates */
-          ReadStatus = EE_ReadVariable(VarIdx, &DataVar);
-          /* In case variable corresponding to the virtual address was found */
-          if (ReadStatus != 0x1)
-          {
-            /* Transfer the variable to the Page1 */
-            EepromStatus = EE_VerifyPageFullWriteVariable(VarIdx, DataVar);
-            /* If program operation was failed, a Flash error code is returned */
-            if (EepromStatus != HAL_OK)
-            {
-              return EepromStatus;
-            }
-          }
-        }
+        return EepromStatus;
       }
       /* Mark Page1 as valid */
+      EE_PAGE_CACHE_RESET();
       FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE1_BASE_ADDRESS, VALID_PAGE);
       /* If program operation was failed, a Flash error code is returned */
       if (FlashStatus != HAL_OK)
       {
         return FlashStatus;
       }
-      pEraseInit.Sector = PAGE0_ID;
-      pEraseInit.NbSectors = 1;
-      pEraseInit.VoltageRange = VOLTAGE_RANGE;
       /* Erase Page0 */
-      if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+      if (!EE_VerifyPageFullyErased(PAGE0))
       {
-        FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+        FlashStatus = EE_EraseSector(PAGE0);
         /* If erase operation was failed, a Flash error code is returned */
         if (FlashStatus != HAL_OK)
         {
@@ -317,46 +553,200 @@ uint16_t EE_Init(void)
     }
     break;
   }
+#endif
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  usValidpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (usValidpage != NO_VALID_PAGE)
+  {
+    ulAddress = EE_FindWriteCursor(usValidpage);
+  }
+#endif
+
+  return HAL_OK;
+}
+
+#if (EE_USE_SPARE_PAGE == 0)
+/**
+  * @brief  Map a page header damaged by a power loss to the state the page
+  *   must be recovered from, using the header of the other page.
+  *   A header is only programmed as RECEIVE_DATA over an erased page, then as
+  *   VALID_PAGE over RECEIVE_DATA, and the old page is erased while the new
+  *   one is still RECEIVE_DATA:
+  *   - other page valid: the header was cut while being marked RECEIVE_DATA,
+  *     so the page holds no data yet and is erased again.
+  *   - other page receive: the page was cut while being erased after the
+  *     copy, so it is erased again and the other page is marked valid.
+  *   - other page erased and only RECEIVE_DATA bits cleared: the header was
+  *     cut while being marked valid, so the page holds all the data and is
+  *     marked valid again.
+  *   Any other combination is left as is and formats the EEPROM.
+  * @param  PageStatus: header read from the page
+  * @param  OtherPageStatus: header read from the other page
+  * @retval Page status to recover from
+  */
+static uint16_t EE_RecoverPageStatus(uint16_t PageStatus, uint16_t OtherPageStatus)
+{
+  if ((PageStatus == ERASED) || (PageStatus == RECEIVE_DATA) || (PageStatus == VALID_PAGE))
+  {
+    return PageStatus;
+  }
+
+  if ((OtherPageStatus == VALID_PAGE) || (OtherPageStatus == RECEIVE_DATA))
+  {
+    return ERASED;
+  }
+
+  if ((OtherPageStatus == ERASED) && ((PageStatus & (uint16_t)~RECEIVE_DATA) == 0))
+  {
+    return RECEIVE_DATA;
+  }
+
+  return PageStatus;
+}
+#endif
+
+#if (EE_USE_SPARE_PAGE == 1)
+/**
+  * @brief  Restore the three pages to a known good state after a power loss.
+  *   A transfer that was cut is completed, and all the pages but the valid one
+  *   are left obsolete or erased: a page whose erase was cut is marked as
+  *   obsolete so that EE_EraseSpare erases it again. No sector is erased here.
+  * @param  None.
+  * @retval - Flash error code: on write Flash error
+  *         - FLASH_COMPLETE: on success
+  */
+static uint16_t EE_RestorePages(void)
+{
+  uint16_t Page = PAGE0, ValidPage = NO_VALID_PAGE, ReceivePage = NO_VALID_PAGE;
+  uint16_t NbValid = 0, NbReceive = 0;
+  uint16_t EepromStatus = 0;
+  HAL_StatusTypeDef FlashStatus = HAL_OK;
+
+  /* Look for the valid pages not marked as obsolete and the receiving page */
+  for (Page = PAGE0; Page <= PAGE2; Page++)
+  {
+    if ((EE_PAGE_STATUS(Page) == VALID_PAGE) && (EE_PAGE_MARK(Page) == ERASED))
+    {
+      NbValid++;
+    }
+    else if (EE_PAGE_STATUS(Page) == RECEIVE_DATA)
+    {
+      ReceivePage = Page;
+      NbReceive++;
+    }
+  }
+
+  /* First EEPROM access (no valid page) or invalid state -> format EEPROM */
+  if ((NbReceive > 1) || ((NbValid + NbReceive) == 0) || ((NbValid + NbReceive) > 2))
+  {
+    /* Erase the pages and set Page0 as valid page */
+    return EE_Format();
+  }
+
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (ReceivePage != NO_VALID_PAGE)
+  {
+    if (ValidPage != NO_VALID_PAGE)
+    {
+      /* Transfer data from the valid page to the receiving page */
+      EepromStatus = EE_CopyValidRecords(EE_PageBaseAddress(ValidPage), EE_PageEndAddress(ValidPage),
+                                         EE_PageBaseAddress(ReceivePage), EE_PageEndAddress(ReceivePage));
+      /* If program operation was failed, a Flash error code is returned */
+      if (EepromStatus != HAL_OK)
+      {
+        return EepromStatus;
+      }
+    }
+    /* Mark the receiving page as valid */
+    EE_PAGE_CACHE_RESET();
+    FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, EE_PageBaseAddress(ReceivePage), VALID_PAGE);
+    /* If program operation was failed, a Flash error code is returned */
+    if (FlashStatus != HAL_OK)
+    {
+      return FlashStatus;
+    }
+    ValidPage = ReceivePage;
+  }
+
+  /* Mark as obsolete the page a transfer left valid and a page whose erase
+     was cut before its end */
+  for (Page = PAGE0; Page <= PAGE2; Page++)
+  {
+    if ((Page != ValidPage) && (EE_PAGE_MARK(Page) == ERASED) &&
+        ((EE_PAGE_STATUS(Page) == VALID_PAGE) ||
+         ((EE_PAGE_STATUS(Page) == ERASED) && !EE_VerifyPageFullyErased(Page))))
+    {
+      EE_PAGE_CACHE_RESET();
+      FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, EE_PageBaseAddress(Page) + 2, EE_PAGE_OBSOLETE);
+      /* If program operation was failed, a Flash error code is returned */
+      if (FlashStatus != HAL_OK)
+      {
+        return FlashStatus;
+      }
+    }
+  }
 
   return HAL_OK;
 }
+#endif
 
 /**
-  * @brief  Verify if specified page is fully erased.
-  * @param  Address: page address
+  * @brief  Verify if specified page is fully erased, both half-words of
+  *   every record included.
+  * @param  Page: page number
   *   This parameter can be one of the following values:
-  *     @arg PAGE0_BASE_ADDRESS: Page0 base address
-  *     @arg PAGE1_BASE_ADDRESS: Page1 base address
+  *     @arg PAGE0: Page0
+  *     @arg PAGE1: Page1
+  *     @arg PAGE2: Page2, with EE_USE_SPARE_PAGE
   * @retval page fully erased status:
   *           - 0: if Page not erased
   *           - 1: if Page erased
   */
-uint16_t EE_VerifyPageFullyErased(uint32_t Address)
+uint16_t EE_VerifyPageFullyErased(uint16_t Page)
 {
-  uint32_t ReadStatus = 1;
-  uint16_t AddressValue = 0x5555;
-
-  /* Check each active page address starting from end */
-  while (Address <= PAGE0_END_ADDRESS)
+  const __IO uint32_t *pWord = (const __IO uint32_t *)EE_PageBaseAddress(Page);
+  uint32_t NbWord = 0;
+#if (EE_USE_ERASE_COUNT == 1)
+  uint16_t EraseCount = 0;
+#endif
+
+  /* The header first */
+  if (!EE_RECORD_ERASED(EE_PageBaseAddress(Page)))
+  {
+    return 0;
+  }
+  pWord = pWord + (EE_HEADER_SIZE / 4);
+#if (EE_USE_ERASE_COUNT == 1)
+  /* The erase count programmed right after the erase is not data */
+  if (EE_ReadEraseCount(Page, &EraseCount))
   {
-    /* Get the current location content to be compared with virtual address */
-    AddressValue = (*(__IO uint16_t *)Address);
+    pWord = pWord + (EE_RECORD_SIZE / 4);
+  }
+#endif
+  NbWord = (EE_PageEndAddress(Page) + 1 - (uint32_t)pWord) / 4;
 
-    /* Compare the read address with the virtual address */
-    if (AddressValue != ERASED)
+  /* Then the records, four words per test: an erased area ANDs to all ones */
+  while (NbWord >= 4)
+  {
+    if ((pWord[0] & pWord[1] & pWord[2] & pWord[3]) != 0xFFFFFFFF)
     {
-
-      /* In case variable value is read, reset ReadStatus flag */
-      ReadStatus = 0;
-
-      break;
+      return 0;
+    }
+    pWord = pWord + 4;
+    NbWord = NbWord - 4;
+  }
+  while (NbWord > 0)
+  {
+    if (*pWord != 0xFFFFFFFF)
+    {
+      return 0;
     }
-    /* Next address location */
-    Address = Address + 4;
+    pWord++;
+    NbWord--;
   }
 
-  /* Return ReadStatus value: (0: Page not erased, 1: Sector erased) */
-  return ReadStatus;
+  return 1;
 }
 
 /**
@@ -372,9 +762,48 @@ uint16_t EE_VerifyPageFullyErased(uint32_t Address)
 
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t *Data)
 {
-  uint16_t ValidPage = PAGE0;
-  uint16_t AddressValue = 0x5555, ReadStatus = 1;
-  uint32_t Address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
+#if (EE_USE_WRITE_CACHE == 1)
+  uint16_t Slot = 0;
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write is newer than the queued writes and the Flash */
+  Slot = EE_CacheFind(VirtAddress);
+  if (Slot < usCacheCount)
+  {
+    *Data = ausCacheData[Slot];
+    return 0;
+  }
+#endif
+
+#if (EE_USE_IT == 1)
+  /* A queued write is newer than the Flash */
+  if (EE_ITFindQueued(VirtAddress, Data) != 0)
+  {
+    return 0;
+  }
+#endif
+
+  return EE_ReadStored(VirtAddress, Data);
+}
+
+/**
+  * @brief  Returns the data of the last record of a variable in Flash, leaving
+  *   aside the cached and the queued writes
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: Global variable contains the read variable value
+  * @retval Success or error status:
+  *           - 0: if variable was found
+  *           - 1: if the variable was not found
+  *           - NO_VALID_PAGE: if no valid page was found.
+  */
+static uint16_t EE_ReadStored(uint16_t VirtAddress, uint16_t *Data)
+{
+  uint16_t ValidPage = PAGE0, ReadStatus = 1;
+  uint32_t EndAddress = EEPROM_START_ADDRESS, Record = 0xFFFFFFFF;
+#if (EE_USE_STATS == 1)
+  uint32_t StatsStart = EE_CycleCount();
+#endif
 
   /* Get active Page for read operation */
   ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
@@ -385,42 +814,199 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t *Data)
     return NO_VALID_PAGE;
   }
 
-  if (ValidPage == PAGE0)
+#if (EE_USE_PRESENCE_BITMAP == 1)
+  if (usPresentPage != ValidPage)
   {
-    PageStartAddress = PAGE0_BASE_ADDRESS;
-    Address = PAGE0_END_ADDRESS - 1;
+    EE_PresentBuild(ValidPage);
   }
-  else
+  /* A variable that was never written is not looked for in the page */
+  if ((VirtAddress < NB_OF_VAR) && ((aulPresent[VirtAddress >> 5] & ((uint32_t)1 << (VirtAddress & 0x1F))) == 0))
+  {
+    EE_STATS_TIME(Read, StatsStart);
+    return ReadStatus;
+  }
+#endif
+
+  EndAddress = EE_PageEndAddress(ValidPage) + 1;
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((usValidpage == ValidPage) && (ulAddress != 0xFFFFFFFF))
+  {
+    EndAddress = ulAddress;
+  }
+#endif
+
+  /* Check each active page record starting from end */
+  if (EE_CoreFindRecord(EE_PageBaseAddress(ValidPage), EndAddress, VirtAddress, &Record) != 0)
+  {
+    /* Get the variable value of the record */
+    *Data = EE_CORE_DATA(Record);
+
+    /* In case variable value is read, reset ReadStatus flag */
+    ReadStatus = 0;
+  }
+  EE_STATS_TIME(Read, StatsStart);
+
+  /* Return ReadStatus value: (0: variable exist, 1: variable doesn't exist) */
+  return ReadStatus;
+}
+
+#if (EE_USE_PRESENCE_BITMAP == 1)
+/**
+  * @brief  Rebuilds the bitmap of the variables written from the records of a
+  *   page and from the queued writes.
+  * @param  Page: page the variables are read from
+  * @retval None
+  */
+static void EE_PresentBuild(uint16_t Page)
+{
+  uint16_t VarIdx = 0;
+  uint32_t Address = EEPROM_START_ADDRESS, EndAddress = EEPROM_START_ADDRESS;
+
+  for (VarIdx = 0; VarIdx < (NB_OF_VAR + 31) / 32; VarIdx++)
+  {
+    aulPresent[VarIdx] = 0;
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes are taken first: the ones the interrupt programs meanwhile
+     are below the end taken next */
+  EE_IT_LOCK();
+  for (VarIdx = 0; VarIdx < usItCount; VarIdx++)
+  {
+    EE_PRESENT_SET(ausItVirtAddress[(usItFirst + VarIdx) % EE_IT_QUEUE_SIZE]);
+  }
+  EE_IT_UNLOCK();
+#endif
+
+  /* Same records as the ones EE_ReadStored looks at */
+  Address = EE_PageBaseAddress(Page) + EE_HEADER_SIZE;
+  EndAddress = EE_PageEndAddress(Page) + 1;
+#if (EE_USE_WRITE_CURSOR == 1)
+  if ((usValidpage == Page) && (ulAddress != 0xFFFFFFFF))
+  {
+    EndAddress = ulAddress;
+  }
+#endif
+  while (Address < EndAddress)
   {
-    PageStartAddress = PAGE1_BASE_ADDRESS;
-    Address = PAGE1_END_ADDRESS - 1;
+    /* Erased slots and the erase count are out of the variables' range */
+    EE_PRESENT_SET(EE_RECORD_VIRTADDRESS(Address));
+    EE_STATS_COUNT(WordsScanned, 1);
+    Address = Address + EE_RECORD_SIZE;
   }
+  usPresentPage = Page;
+}
+#endif
+
+#if (EE_USE_SKIP_UNCHANGED == 1)
+/**
+  * @brief  Tells whether a record of a set leaves its variable as it is: the
+  *   variable holds the data in Flash and no earlier record of the set writes it.
+  * @param  VirtAddress: virtual addresses of the set, NULL for consecutive ones
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: data of the set
+  * @param  VarIdx: index of the record in the set
+  * @retval 1 if the record does not need to be programmed, 0 otherwise
+  */
+static uint8_t EE_IsUnchanged(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                              const uint16_t *Data, uint16_t VarIdx)
+{
+  uint16_t Address = (VirtAddress != NULL) ? VirtAddress[VarIdx] : (uint16_t)(FirstVirtAddress + VarIdx);
+  uint16_t StoredData = 0;
+  uint16_t Idx = 0;
 
-  /* Check each active page address starting from end */
-  while (Address > (PageStartAddress + 2))
+  if ((EE_ReadStored(Address, &StoredData) != 0) || (StoredData != Data[VarIdx]))
+  {
+    return 0;
+  }
+  if (VirtAddress != NULL)
   {
-    /* Get the current location content to be compared with virtual address */
-    AddressValue = (*(__IO uint16_t *)Address);
-    /* Compare the read address with the virtual address */
-    if (AddressValue == VirtAddress)
+    for (Idx = 0; Idx < VarIdx; Idx++)
     {
-      /* Get content of Address-2 which is variable value */
-      *Data = (*(__IO uint16_t *)(Address - 2));
+      if (VirtAddress[Idx] == Address)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+#endif
+
+/**
+  * @brief  Reads the last stored data of all the variables in one pass over
+  *   the valid page, from its oldest record to its newest one.
+  * @param  Image: RAM image of NB_OF_VAR variables, the entries of variables
+  *   that have no record are left unchanged
+  * @param  PresentBitmap: (NB_OF_VAR + 7) / 8 bytes, bit n set when variable n
+  *   was found, or NULL
+  * @retval Success or error status:
+  *           - 0: on success
+  *           - NO_VALID_PAGE: if no valid page was found.
+  */
+uint16_t EE_ReadAll(uint16_t *Image, uint8_t *PresentBitmap)
+{
+  uint16_t ValidPage = PAGE0, VarIdx = 0;
+#if (EE_USE_IT == 1) || (EE_USE_WRITE_CACHE == 1)
+  uint16_t AddressValue = 0x5555;
+#endif
 
-      /* In case variable value is read, reset ReadStatus flag */
-      ReadStatus = 0;
+  /* Get active Page for read operation */
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
 
-      break;
+  /* Check if there is no valid page */
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  if (PresentBitmap != NULL)
+  {
+    for (VarIdx = 0; VarIdx < (NB_OF_VAR + 7) / 8; VarIdx++)
+    {
+      PresentBitmap[VarIdx] = 0;
     }
-    else
+  }
+
+  /* Newer records overwrite older ones in the image */
+  EE_CoreReadRecords(EE_PageBaseAddress(ValidPage), EE_PageEndAddress(ValidPage) + 1, Image, PresentBitmap);
+
+#if (EE_USE_IT == 1)
+  /* Queued writes are newer than the Flash */
+  EE_IT_LOCK();
+  for (VarIdx = 0; VarIdx < usItCount; VarIdx++)
+  {
+    AddressValue = ausItVirtAddress[(usItFirst + VarIdx) % EE_IT_QUEUE_SIZE];
+    if (AddressValue < NB_OF_VAR)
     {
-      /* Next address location */
-      Address = Address - 4;
+      Image[AddressValue] = ausItData[(usItFirst + VarIdx) % EE_IT_QUEUE_SIZE];
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[AddressValue >> 3] |= (uint8_t)(1 << (AddressValue & 0x07));
+      }
     }
   }
+  EE_IT_UNLOCK();
+#endif
 
-  /* Return ReadStatus value: (0: variable exist, 1: variable doesn't exist) */
-  return ReadStatus;
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes are newer than the queued writes and the Flash */
+  for (VarIdx = 0; VarIdx < usCacheCount; VarIdx++)
+  {
+    AddressValue = ausCacheVirtAddress[VarIdx];
+    if (AddressValue < NB_OF_VAR)
+    {
+      Image[AddressValue] = ausCacheData[VarIdx];
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[AddressValue >> 3] |= (uint8_t)(1 << (AddressValue & 0x07));
+      }
+    }
+  }
+#endif
+
+  return 0;
 }
 
 /**
@@ -437,6 +1023,23 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 {
   uint16_t Status = 0;
 
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Nothing to program if the variable already holds the data */
+  if (EE_IsUnchanged(&VirtAddress, 0, &Data, 0) != 0)
+  {
+    EE_STATS_COUNT(Skipped, 1);
+    return HAL_OK;
+  }
+#endif
+
   /* Write the variable virtual address and value in the EEPROM */
   Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
 
@@ -452,77 +1055,883 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 }
 
 /**
-  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
-  * @param  None
-  * @retval Status of the last operation (Flash write or erase) done during
-  *         EEPROM formating
+  * @brief  Writes/updates a set of variables in EEPROM with a single free space
+  *   check. As for EE_WriteVariable, the Flash has to be unlocked by the caller.
+  * @param  VirtAddress: virtual addresses of the variables
+  * @param  Data: 16 bit data of the variables
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the variables do not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
   */
-static HAL_StatusTypeDef EE_Format(void)
+uint16_t EE_WriteBatch(const uint16_t *VirtAddress, const uint16_t *Data, uint16_t NbVar)
 {
-  HAL_StatusTypeDef FlashStatus = HAL_OK;
-  uint32_t SectorError = 0;
-  FLASH_EraseInitTypeDef pEraseInit;
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(VirtAddress, 0, NbVar);
+#endif
+  return EE_WriteRecords(VirtAddress, 0, Data, NbVar);
+}
 
-  pEraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-  pEraseInit.Sector = PAGE0_ID;
-  pEraseInit.NbSectors = 1;
-  pEraseInit.VoltageRange = VOLTAGE_RANGE;
-  /* Erase Page0 */
-  if (!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+#if (EE_USE_WRITE_CACHE == 1)
+/**
+  * @brief  Writes/updates a variable through the write cache. Only the RAM
+  *   cache is updated, a later write of the variable replaces this one, and
+  *   the cache is written to Flash by EE_Flush or EE_ProcessCache, or here
+  *   when it is full and the variable is not cached yet. A cached write is
+  *   lost if the power fails before: call EE_Flush on a supply drop. To be
+  *   called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: data to be written
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if the full cache could not be written
+  */
+uint16_t EE_WriteVariableCached(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t Status = HAL_OK;
+  uint32_t Primask = 0;
+  uint16_t Slot = 0;
+
+  /* A variable not cached yet needs a free entry */
+  if ((usCacheCount >= EE_CACHE_SIZE) && (EE_CacheFind(VirtAddress) >= usCacheCount))
   {
-    FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
-    /* If erase operation was failed, a Flash error code is returned */
-    if (FlashStatus != HAL_OK)
+    Status = EE_Flush();
+    if (Status != HAL_OK)
     {
-      return FlashStatus;
+      return Status;
     }
   }
-  /* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
-  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
-  /* If program operation was failed, a Flash error code is returned */
-  if (FlashStatus != HAL_OK)
-  {
-    return FlashStatus;
-  }
 
-  pEraseInit.Sector = PAGE1_ID;
-  /* Erase Page1 */
-  if (!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+  EE_CACHE_LOCK(Primask);
+  Slot = EE_CacheFind(VirtAddress);
+  if (Slot >= usCacheCount)
   {
-    FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
-    /* If erase operation was failed, a Flash error code is returned */
-    if (FlashStatus != HAL_OK)
+    if (usCacheCount == 0)
     {
-      return FlashStatus;
+      ulCacheStart = HAL_GetTick();
     }
+    ausCacheVirtAddress[Slot] = VirtAddress;
+    usCacheCount++;
   }
+  ausCacheData[Slot] = Data;
+  EE_CACHE_UNLOCK(Primask);
 
   return HAL_OK;
 }
 
 /**
-  * @brief  Find valid Page for write or read operation
-  * @param  Operation: operation to achieve on the valid page.
-  *   This parameter can be one of the following values:
-  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
-  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
-  * @retval Valid page number (PAGE or PAGE1) or NO_VALID_PAGE in case
-  *   of no valid page was found
+  * @brief  Writes the cached writes to Flash with a single free space check.
+  *   The Flash is unlocked for the writes and left as it was. Also meant for
+  *   the PVD interrupt (HAL_PWR_PVDCallback) to save the cache on a supply
+  *   drop, as long as that interrupt cannot preempt another EE function.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if the cache is empty
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if an error occurs, the writes stay cached
   */
-static uint16_t EE_FindValidPage(uint8_t Operation)
+uint16_t EE_Flush(void)
 {
-  uint16_t PageStatus0 = 6, PageStatus1 = 6;
+  uint16_t Status = HAL_OK;
+  uint32_t Locked = 0;
 
-  /* Get Page0 actual status */
-  PageStatus0 = (*(__IO uint16_t *)PAGE0_BASE_ADDRESS);
+  if (usCacheCount == 0)
+  {
+    return HAL_OK;
+  }
 
-  /* Get Page1 actual status */
-  PageStatus1 = (*(__IO uint16_t *)PAGE1_BASE_ADDRESS);
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
 
-  /* Write or read operation */
-  switch (Operation)
+  /* The Flash is unlocked for the writes and left as it was */
+  Locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+  if (Locked != 0U)
   {
-  case WRITE_IN_VALID_PAGE: /* ---- Write operation ---- */
+    HAL_FLASH_Unlock();
+  }
+  Status = EE_WriteRecords(ausCacheVirtAddress, 0, ausCacheData, usCacheCount);
+  if (Locked != 0U)
+  {
+    HAL_FLASH_Lock();
+  }
+  if (Status == HAL_OK)
+  {
+    usCacheCount = 0;
+  }
+
+  return Status;
+}
+
+/**
+  * @brief  Writes the cached writes to Flash once the oldest one is
+  *   EE_CACHE_FLUSH_PERIOD old. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if no write is due
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: if an error occurs
+  */
+uint16_t EE_ProcessCache(void)
+{
+  if ((usCacheCount == 0) || ((HAL_GetTick() - ulCacheStart) < EE_CACHE_FLUSH_PERIOD))
+  {
+    return HAL_OK;
+  }
+
+  return EE_Flush();
+}
+#endif
+
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Writes/updates a blob. Its bytes go in consecutive records, followed
+  *   by a record holding their CRC and by the header record of the blob, all
+  *   in the valid page: a transfer is done first if they do not fit. As for
+  *   EE_WriteVariable, the Flash has to be unlocked by the caller.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: bytes of the blob
+  * @param  Size: number of bytes, up to EE_BLOB_MAX_SIZE
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - EE_INVALID_BLOB: if Blob or Size is out of range
+  *           - PAGE_FULL: if the blob does not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteBlob(uint16_t Blob, const uint8_t *Data, uint16_t Size)
+{
+  uint16_t ValidPage = PAGE0, Idx = 0, Crc = 0xFFFF, RecordData = 0;
+  uint16_t EepromStatus = HAL_OK;
+  uint32_t Address = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS + PAGE0_SIZE;
+
+  if ((Blob >= NB_OF_BLOB) || (Size > EE_BLOB_MAX_SIZE))
+  {
+    return EE_INVALID_BLOB;
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+
+  /* Get valid Page for write operation */
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+  Address = EE_GetWriteCursor(ValidPage);
+  PageEndAddress = EE_PageEndAddress(ValidPage) + 1;
+
+  /* Compact the data once if the blob does not fit in the page */
+  if (((PageEndAddress - Address) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(Size))
+  {
+    EepromStatus = EE_PageTransfer(EE_NO_VIRTADDRESS, 0);
+    if (EepromStatus != HAL_OK)
+    {
+      return EepromStatus;
+    }
+    ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    if (ValidPage == NO_VALID_PAGE)
+    {
+      return NO_VALID_PAGE;
+    }
+    Address = EE_GetWriteCursor(ValidPage);
+    PageEndAddress = EE_PageEndAddress(ValidPage) + 1;
+    if (((PageEndAddress - Address) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(Size))
+    {
+      return PAGE_FULL;
+    }
+  }
+
+  /* The copy read in place so far is no longer the last one */
+  EE_BLOB_INVALIDATE();
+
+  /* The CRC covers the blob number and size, then the bytes */
+  Crc = EE_Crc16(Crc, (uint8_t)Blob);
+  Crc = EE_Crc16(Crc, (uint8_t)Size);
+  Crc = EE_Crc16(Crc, (uint8_t)(Size >> 8));
+  for (Idx = 0; (Idx < Size) && (EepromStatus == HAL_OK); Idx++)
+  {
+    Crc = EE_Crc16(Crc, Data[Idx]);
+    RecordData |= (uint16_t)Data[Idx] << (8 * (Idx % EE_BLOB_BYTES_PER_RECORD));
+    if (((Idx % EE_BLOB_BYTES_PER_RECORD) == (EE_BLOB_BYTES_PER_RECORD - 1)) || (Idx == (Size - 1)))
+    {
+      EepromStatus = EE_ProgramRecord(Address, EE_BLOB_DATA_VIRTADDRESS, RecordData);
+      Address = Address + EE_RECORD_SIZE;
+      RecordData = 0;
+    }
+  }
+
+  /* The header record goes last: the blob exists once it is in Flash */
+  if (EepromStatus == HAL_OK)
+  {
+    EepromStatus = EE_ProgramRecord(Address, EE_BLOB_CRC_VIRTADDRESS, Crc);
+    Address = Address + EE_RECORD_SIZE;
+  }
+  if (EepromStatus == HAL_OK)
+  {
+    EepromStatus = EE_ProgramRecord(Address, (uint16_t)(EE_BLOB_VIRTADDRESS + Blob), Size);
+  }
+
+  return EepromStatus;
+}
+
+/**
+  * @brief  Reads the last complete copy of a blob: the page is walked back to
+  *   the header record of the blob, then its bytes are checked against their
+  *   CRC and copied in one pass over its records.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: buffer receiving the bytes
+  * @param  MaxSize: size of the buffer, the bytes of a longer blob past it are
+  *   not copied
+  * @param  Size: receives the size of the blob
+  * @retval Success or error status:
+  *           - 0: if the blob was found
+  *           - 1: if the blob has no complete copy
+  *           - EE_INVALID_BLOB: if Blob is out of range
+  *           - NO_VALID_PAGE: if no valid page was found
+  */
+uint16_t EE_ReadBlob(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  uint16_t ValidPage = PAGE0;
+  uint32_t Address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
+
+  if (Blob >= NB_OF_BLOB)
+  {
+    return EE_INVALID_BLOB;
+  }
+
+  /* Get active Page for read operation */
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  PageStartAddress = EE_PageBaseAddress(ValidPage);
+  Address = EE_PageEndAddress(ValidPage) + 1 - EE_RECORD_SIZE;
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((usValidpage == ValidPage) && (ulAddress != 0xFFFFFFFF))
+  {
+    Address = ulAddress - EE_RECORD_SIZE;
+  }
+#endif
+
+  /* Check each active page record starting from end */
+  while (Address >= (PageStartAddress + EE_HEADER_SIZE))
+  {
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* A copy cut by a power loss is followed by an older one */
+    if ((EE_RECORD_VIRTADDRESS(Address) == (uint16_t)(EE_BLOB_VIRTADDRESS + Blob))
+        && (EE_BlobCheck(PageStartAddress, Address, Data, MaxSize, Size) != 0))
+    {
+      return 0;
+    }
+    Address = Address - EE_RECORD_SIZE;
+  }
+
+  return 1;
+}
+
+/**
+  * @brief  Gives the last complete copy of a blob in place, without copying
+  *   it: the bytes are checked against their CRC once, then byte n is read
+  *   from Flash as EE_BLOB_BYTE(*Data, n). The pointer stays valid as long as
+  *   EE_GetGeneration returns the generation given with it.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: receives the address of the first record of the blob
+  * @param  Size: receives the size of the blob
+  * @param  Generation: receives the generation of the pointer
+  * @retval Success or error status:
+  *           - 0: if the blob was found
+  *           - 1: if the blob has no complete copy
+  *           - EE_INVALID_BLOB: if Blob is out of range
+  *           - NO_VALID_PAGE: if no valid page was found
+  */
+uint16_t EE_GetBlob(uint16_t Blob, const uint8_t **Data, uint16_t *Size, uint32_t *Generation)
+{
+  uint16_t ValidPage = PAGE0;
+  uint32_t Address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
+
+  if (Blob >= NB_OF_BLOB)
+  {
+    return EE_INVALID_BLOB;
+  }
+
+  /* Get active Page for read operation */
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  PageStartAddress = EE_PageBaseAddress(ValidPage);
+  Address = EE_PageEndAddress(ValidPage) + 1 - EE_RECORD_SIZE;
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((usValidpage == ValidPage) && (ulAddress != 0xFFFFFFFF))
+  {
+    Address = ulAddress - EE_RECORD_SIZE;
+  }
+#endif
+
+  /* Check each active page record starting from end */
+  while (Address >= (PageStartAddress + EE_HEADER_SIZE))
+  {
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* A copy cut by a power loss is followed by an older one */
+    if ((EE_RECORD_VIRTADDRESS(Address) == (uint16_t)(EE_BLOB_VIRTADDRESS + Blob))
+        && (EE_BlobCheck(PageStartAddress, Address, NULL, 0, Size) != 0))
+    {
+      /* The data records come first, the CRC and header records close them */
+      *Data = (const uint8_t *)(Address - (uint32_t)(EE_BLOB_NB_SLOTS(*Size) - 1) * EE_RECORD_SIZE);
+      *Generation = ulBlobGeneration;
+      return 0;
+    }
+    Address = Address - EE_RECORD_SIZE;
+  }
+
+  return 1;
+}
+
+/**
+  * @brief  Gets the generation of the pointers given by EE_GetBlob: it changes
+  *   when a blob is written, the blobs are transferred to another page, a
+  *   sector is erased or EE_Init is called.
+  * @param  None
+  * @retval Generation
+  */
+uint32_t EE_GetGeneration(void)
+{
+  return ulBlobGeneration;
+}
+#endif
+
+#if (EE_USE_SPARE_PAGE == 1)
+/**
+  * @brief  Erases the spare page, the one following the valid page, if a page
+  *   transfer left it to be erased. The sector erase is taken out of the write
+  *   path: call it from the main loop once a write may have transferred the
+  *   data, it returns at once when the spare page is already erased. As for
+  *   EE_WriteVariable, the Flash has to be unlocked by the caller.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if the spare page is erased
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on erase Flash error
+  */
+uint16_t EE_EraseSpare(void)
+{
+  uint16_t ValidPage = PAGE0, SparePage = PAGE0;
+
+#if (EE_USE_IT == 1)
+  /* The erase would stall the queued writes */
+  (void)EE_FlushIT();
+#endif
+
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  /* Status and mark of an erased page are left erased until the next transfer */
+  SparePage = EE_NEXT_PAGE(ValidPage);
+  if ((EE_PAGE_STATUS(SparePage) == ERASED) && (EE_PAGE_MARK(SparePage) == ERASED))
+  {
+    return HAL_OK;
+  }
+
+  return EE_EraseSector(SparePage);
+}
+#endif
+
+#if (EE_USE_IT == 1)
+/**
+  * @brief  Queues a write of a variable. The record is programmed under the
+  *   Flash interrupt, only the Flash interrupt is masked meanwhile, and
+  *   EE_WriteCpltCallback is called once it is in Flash. A write that needs a
+  *   page transfer is left to EE_ProcessIT. To be called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: 16 bit data to be written
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: if the write was queued
+  *           - EE_BUSY: if the queue is full
+  */
+uint16_t EE_WriteVariableIT(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t Slot = 0;
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+
+  EE_IT_LOCK();
+  if (usItCount >= EE_IT_QUEUE_SIZE)
+  {
+    EE_IT_UNLOCK();
+    return EE_BUSY;
+  }
+  Slot = (usItFirst + usItCount) % EE_IT_QUEUE_SIZE;
+  ausItVirtAddress[Slot] = VirtAddress;
+  ausItData[Slot] = Data;
+  usItCount++;
+  EE_PRESENT_SET(VirtAddress);
+  /* Start programming if the queue was empty */
+  if (ucItState == EE_IT_IDLE)
+  {
+    EE_ITStart();
+  }
+  EE_IT_UNLOCK();
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Writes from thread mode the queued write the Flash interrupt left,
+  *   with the page transfer it needs, and lets the interrupt go on with the
+  *   next ones. Locks the Flash back once the queue is empty if the queue
+  *   unlocked it. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if no write was left
+  *           - Flash error code: if an error occurs, also given to the callback
+  */
+uint16_t EE_ProcessIT(void)
+{
+  uint16_t Status = HAL_OK;
+  uint16_t VirtAddress = 0, Data = 0;
+
+  if (ucItState != EE_IT_STALLED)
+  {
+    EE_ITLockFlash();
+    return HAL_OK;
+  }
+
+  /* The Flash interrupt does not touch a stalled queue */
+  VirtAddress = ausItVirtAddress[usItFirst];
+  Data = ausItData[usItFirst];
+  EE_ITUnlockFlash();
+  Status = EE_WriteRecords(&VirtAddress, 0, &Data, 1);
+
+  EE_IT_LOCK();
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  EE_IT_UNLOCK();
+
+  /* Called before the interrupt goes on, so that the callbacks keep the
+     order of the writes */
+  EE_WriteCpltCallback(VirtAddress, Status);
+
+  EE_IT_LOCK();
+  EE_ITStart();
+  EE_IT_UNLOCK();
+  EE_ITLockFlash();
+
+  return Status;
+}
+
+/**
+  * @brief  Waits until all the queued writes are in Flash, polling the Flash
+  *   rather than waiting for its interrupt, so that it also returns with the
+  *   interrupts masked or from an interrupt handler. The other write functions
+  *   call it first so that the writes keep their order. The Flash is left
+  *   unlocked if it was.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: if a write left to thread mode failed
+  */
+uint16_t EE_FlushIT(void)
+{
+  uint16_t Status = HAL_OK;
+  uint32_t Locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+
+  while (usItCount != 0)
+  {
+    if (ucItState == EE_IT_STALLED)
+    {
+      Status = EE_ProcessIT();
+    }
+    else
+    {
+      /* The Flash interrupt is not waited for: it is not taken under PRIMASK
+         or from a handler of its priority or higher. Its work is done here
+         with it masked, EE_IRQHandler returns at once until the program ends */
+      EE_IT_LOCK();
+      EE_IRQHandler();
+      EE_IT_UNLOCK();
+    }
+  }
+
+  /* EE_ProcessIT locks the Flash back once the queue is empty */
+  if ((Locked == 0U) && (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U))
+  {
+    HAL_FLASH_Unlock();
+  }
+
+  return Status;
+}
+
+/**
+  * @brief  Handles the Flash interrupt for the queued writes. To be called
+  *   from FLASH_IRQHandler in place of HAL_FLASH_IRQHandler.
+  * @param  None
+  * @retval None
+  */
+void EE_IRQHandler(void)
+{
+  uint16_t VirtAddress = 0;
+  uint16_t Status = HAL_OK;
+
+  HAL_FLASH_IRQHandler();
+  if ((ucItState != EE_IT_BUSY) || (ucItResult == EE_IT_PENDING))
+  {
+    return;
+  }
+
+  VirtAddress = ausItVirtAddress[usItFirst];
+  if ((ucItResult == EE_IT_DONE) && (ucItDataDone == 0))
+  {
+    /* Data is in Flash: the virtual address follows, the HAL is unlocked
+       once HAL_FLASH_IRQHandler returns */
+    ucItDataDone = 1;
+    ucItResult = EE_IT_PENDING;
+    if (HAL_FLASH_Program_IT(TYPEPROGRAM_HALFWORD, ulAddress + 2, VirtAddress) == HAL_OK)
+    {
+      return;
+    }
+    ucItResult = EE_IT_FAILED;
+  }
+
+  if (ucItResult == EE_IT_DONE)
+  {
+    /* The slot is no longer erased: next write goes to the following one */
+    ulAddress = ulAddress + EE_RECORD_SIZE;
+  }
+  else
+  {
+    ulAddress = 0xFFFFFFFF;
+    Status = HAL_ERROR;
+  }
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  EE_ITStart();
+
+  EE_WriteCpltCallback(VirtAddress, Status);
+}
+
+/**
+  * @brief  Called once a queued write is in Flash, or failed, from the Flash
+  *   interrupt or from EE_ProcessIT.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Status: FLASH_COMPLETE or the error code of the write
+  * @retval None
+  */
+__weak void EE_WriteCpltCallback(uint16_t VirtAddress, uint16_t Status)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(VirtAddress);
+  UNUSED(Status);
+}
+
+/**
+  * @brief  End of Flash operation callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address programmed
+  * @retval None
+  */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_DONE;
+}
+
+/**
+  * @brief  Flash operation error callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address that failed
+  * @retval None
+  */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_FAILED;
+}
+
+/**
+  * @brief  Gets how long usEE_Read and usEE_Write kept the interrupts masked.
+  * @param  Last: time of the last call, in core clock cycles
+  * @param  Max: longest time since reset, in core clock cycles
+  * @retval None
+  */
+void EE_GetIrqMaskedTime(uint32_t *Last, uint32_t *Max)
+{
+  *Last = ulIrqMaskedLast;
+  *Max = ulIrqMaskedMax;
+}
+#endif
+
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Gets the statistics gathered since reset or EE_ResetStats.
+  * @param  Stats: filled in with the counters and the timings
+  * @retval None
+  */
+void EE_GetStats(EE_StatsTypeDef *Stats)
+{
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  *Stats = xStats;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+
+/**
+  * @brief  Clears the statistics.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetStats(void)
+{
+  static const EE_StatsTypeDef Cleared = {0};
+
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  xStats = Cleared;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Gets the erase counts of the sectors and projects their remaining
+  *   life. The sectors are erased in turn, so the most worn one takes one
+  *   erase out of EE_NB_PAGES: the projection assumes the records keep being
+  *   written at the rate and with the number of records per erase measured
+  *   since EE_Init or EE_ResetWear.
+  * @param  Wear: filled in with the erase counts and the projection
+  * @retval None
+  */
+void EE_GetWear(EE_WearTypeDef *Wear)
+{
+  uint16_t Page = PAGE0;
+  uint64_t Remaining;
+
+  Wear->MaxEraseCount = 0;
+  for (Page = PAGE0; Page < EE_NB_PAGES; Page++)
+  {
+    Wear->EraseCount[Page] = EE_GetEraseCount(Page);
+    if (Wear->EraseCount[Page] > Wear->MaxEraseCount)
+    {
+      Wear->MaxEraseCount = Wear->EraseCount[Page];
+    }
+  }
+  Wear->RemainingErases = (Wear->MaxEraseCount < EE_PAGE_ENDURANCE) ? (EE_PAGE_ENDURANCE - Wear->MaxEraseCount) : 0;
+
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  Wear->Records = ulWearRecords;
+  Wear->Erases = ulWearErases;
+  Wear->Elapsed = HAL_GetTick() - ulWearStart;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+
+  Wear->RecordsPerHour = 0;
+  if (Wear->Elapsed != 0)
+  {
+    Remaining = ((uint64_t)Wear->Records * 3600000U) / Wear->Elapsed;
+    Wear->RecordsPerHour = (Remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)Remaining;
+  }
+
+  Wear->RemainingRecords = 0xFFFFFFFFU;
+  Wear->RemainingHours = 0xFFFFFFFFU;
+  if (Wear->Erases != 0)
+  {
+    /* Erases left before the most worn sector wears out */
+    Remaining = (uint64_t)Wear->RemainingErases * EE_NB_PAGES;
+    Remaining = (Remaining * Wear->Records) / Wear->Erases;
+    Wear->RemainingRecords = (Remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)Remaining;
+    Remaining = (uint64_t)Wear->RemainingErases * EE_NB_PAGES;
+    Remaining = (Remaining * Wear->Elapsed) / Wear->Erases / 3600000U;
+    Wear->RemainingHours = (Remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)Remaining;
+  }
+}
+
+/**
+  * @brief  Restarts the measure of the write rate EE_GetWear projects from.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetWear(void)
+{
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  ulWearRecords = 0;
+  ulWearErases = 0;
+  ulWearStart = HAL_GetTick();
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+/**
+  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
+  * @param  None
+  * @retval Status of the last operation (Flash write or erase) done during
+  *         EEPROM formating
+  */
+static HAL_StatusTypeDef EE_Format(void)
+{
+  HAL_StatusTypeDef FlashStatus = HAL_OK;
+
+  EE_STATS_COUNT(Formats, 1);
+
+  /* Erase Page0 */
+  if (!EE_VerifyPageFullyErased(PAGE0))
+  {
+    FlashStatus = EE_EraseSector(PAGE0);
+    /* If erase operation was failed, a Flash error code is returned */
+    if (FlashStatus != HAL_OK)
+    {
+      return FlashStatus;
+    }
+  }
+  /* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
+  EE_PAGE_CACHE_RESET();
+  EE_PRESENT_RESET();
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
+  /* If program operation was failed, a Flash error code is returned */
+  if (FlashStatus != HAL_OK)
+  {
+    return FlashStatus;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Page0 is empty: next write goes right after its header and erase count */
+  usValidpage = PAGE0;
+  ulAddress = EE_FindWriteCursor(PAGE0);
+#endif
+
+  /* Erase Page1 */
+  if (!EE_VerifyPageFullyErased(PAGE1))
+  {
+    FlashStatus = EE_EraseSector(PAGE1);
+    /* If erase operation was failed, a Flash error code is returned */
+    if (FlashStatus != HAL_OK)
+    {
+      return FlashStatus;
+    }
+  }
+#if (EE_USE_SPARE_PAGE == 1)
+
+  /* Erase Page2 */
+  if (!EE_VerifyPageFullyErased(PAGE2))
+  {
+    FlashStatus = EE_EraseSector(PAGE2);
+    /* If erase operation was failed, a Flash error code is returned */
+    if (FlashStatus != HAL_OK)
+    {
+      return FlashStatus;
+    }
+  }
+#endif
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Find valid Page for write or read operation
+  * @param  Operation: operation to achieve on the valid page.
+  *   This parameter can be one of the following values:
+  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
+  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
+  * @retval Valid page number (PAGE or PAGE1) or NO_VALID_PAGE in case
+  *   of no valid page was found
+  */
+static uint16_t EE_FindValidPage(uint8_t Operation)
+{
+#if (EE_USE_PAGE_CACHE == 1)
+  /* The headers are only read again once one of them changed */
+  if (usReadPage == EE_PAGE_CACHE_EMPTY)
+  {
+    usWritePage = EE_ReadValidPage(WRITE_IN_VALID_PAGE);
+    usReadPage = EE_ReadValidPage(READ_FROM_VALID_PAGE);
+  }
+
+  return (Operation == WRITE_IN_VALID_PAGE) ? usWritePage : usReadPage;
+#else
+  return EE_ReadValidPage(Operation);
+#endif
+}
+
+/**
+  * @brief  Find valid Page for write or read operation from the page headers
+  * @param  Operation: operation to achieve on the valid page.
+  *   This parameter can be one of the following values:
+  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
+  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
+  * @retval Valid page number (PAGE or PAGE1) or NO_VALID_PAGE in case
+  *   of no valid page was found
+  */
+static uint16_t EE_ReadValidPage(uint8_t Operation)
+{
+#if (EE_USE_SPARE_PAGE == 1)
+  uint16_t Page = PAGE0, ValidPage = NO_VALID_PAGE;
+
+  for (Page = PAGE0; Page <= PAGE2; Page++)
+  {
+    /* Page receiving data */
+    if ((Operation == WRITE_IN_VALID_PAGE) && (EE_PAGE_STATUS(Page) == RECEIVE_DATA))
+    {
+      return Page;
+    }
+    /* Obsolete pages are skipped, of two valid pages the newer one follows
+       the other */
+    if ((EE_PAGE_STATUS(Page) == VALID_PAGE) && (EE_PAGE_MARK(Page) == ERASED) &&
+        ((ValidPage == NO_VALID_PAGE) || (EE_NEXT_PAGE(ValidPage) == Page)))
+    {
+      ValidPage = Page;
+    }
+  }
+
+  return ValidPage;
+#else
+  uint16_t PageStatus0 = 6, PageStatus1 = 6;
+
+  /* Get Page0 actual status */
+  PageStatus0 = (*(__IO uint16_t *)PAGE0_BASE_ADDRESS);
+
+  /* Get Page1 actual status */
+  PageStatus1 = (*(__IO uint16_t *)PAGE1_BASE_ADDRESS);
+
+  /* Write or read operation */
+  switch (Operation)
+  {
+  case WRITE_IN_VALID_PAGE: /* ---- Write operation ---- */
     if (PageStatus1 == VALID_PAGE)
     {
       /* Page0 receiving data */
@@ -552,196 +1961,902 @@ static uint16_t EE_FindValidPage(uint8_t Operation)
       return NO_VALID_PAGE; /* No valid Page */
     }
 
-  case READ_FROM_VALID_PAGE: /* ---- Read operation ---- */
-    if (PageStatus0 == VALID_PAGE)
-    {
-      return PAGE0; /* Page0 valid */
-    }
-    else if (PageStatus1 == VALID_PAGE)
-    {
-      return PAGE1; /* Page1 valid */
-    }
-    else
-    {
-      return NO_VALID_PAGE; /* No valid Page */
-    }
+  case READ_FROM_VALID_PAGE: /* ---- Read operation ---- */
+    if (PageStatus0 == VALID_PAGE)
+    {
+      return PAGE0; /* Page0 valid */
+    }
+    else if (PageStatus1 == VALID_PAGE)
+    {
+      return PAGE1; /* Page1 valid */
+    }
+    else
+    {
+      return NO_VALID_PAGE; /* No valid Page */
+    }
+
+  default:
+    return PAGE0; /* Page0 valid */
+  }
+#endif
+}
+
+/**
+  * @brief  Verify if active page is full and Writes variable in EEPROM.
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data)
+{
+  uint16_t ValidPage = PAGE0;
+  uint32_t Address = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS + PAGE0_SIZE;
+
+  /* Get valid Page for write operation */
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+
+  /* Check if there is no valid page */
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  PageEndAddress = EE_PageEndAddress(ValidPage) - 1;
+  /* Get the first free slot of the valid Page */
+  Address = EE_GetWriteCursor(ValidPage);
+
+  /* Check each active page address starting from begining */
+  while (Address < PageEndAddress)
+  {
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* Verify if the record is erased */
+    if (EE_RECORD_ERASED(Address))
+    {
+      /* Set variable data and virtual address, return program operation status */
+      return EE_ProgramRecord(Address, VirtAddress, Data);
+    }
+    else
+    {
+      /* Next address location */
+      Address = Address + EE_RECORD_SIZE;
+    }
+  }
+
+  /* Return PAGE_FULL in case the valid page is full */
+  return PAGE_FULL;
+}
+
+/**
+  * @brief  Program a record in an erased slot of the write page.
+  * @param  Address: address of the erased slot
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data)
+{
+  HAL_StatusTypeDef FlashStatus = HAL_OK;
+#if (EE_USE_STATS == 1)
+  uint32_t StatsStart = EE_CycleCount();
+#endif
+
+  EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+  ulWearRecords++;
+#endif
+  /* Set before programming: a record cut by a reset is still looked for */
+  EE_PRESENT_SET(VirtAddress);
+#if (EE_USE_WORD_PROGRAM == 1)
+  /* Set variable data and virtual address at once, data in the low half-word */
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_WORD, Address, EE_RECORD_VALUE(VirtAddress, Data));
+#else
+  /* Set variable data */
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, Address, Data);
+  /* If program operation was failed, a Flash error code is returned */
+  if (FlashStatus != HAL_OK)
+  {
+#if (EE_USE_WRITE_CURSOR == 1)
+    ulAddress = 0xFFFFFFFF;
+#endif
+    return FlashStatus;
+  }
+  /* Set variable virtual address */
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, Address + 2, VirtAddress);
+#endif
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The slot is no longer erased: next write goes to the following one */
+  ulAddress = Address + EE_RECORD_SIZE;
+#endif
+  if (FlashStatus == HAL_OK)
+  {
+    EE_STATS_TIME(Program, StatsStart);
+  }
+
+  return FlashStatus;
+}
+
+/**
+  * @brief  Writes a set of variables back to back in the write page. Free space
+  *   is checked for the whole set first and, if it does not fit, one page
+  *   transfer is done before any of the variables is written.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   consecutive virtual addresses starting at FirstVirtAddress
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: 16 bit data of the variables
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the variables do not fit even after a transfer
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_WriteRecords(const uint16_t *VirtAddress, uint16_t FirstVirtAddress,
+                                const uint16_t *Data, uint16_t NbVar)
+{
+  uint16_t ValidPage = PAGE0, VarIdx = 0, NbWrite = NbVar;
+  uint16_t EepromStatus = HAL_OK;
+  uint32_t Address = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS + PAGE0_SIZE;
+
+  if (NbVar == 0)
+  {
+    return HAL_OK;
+  }
+
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Records that leave their variable as it is in Flash are not programmed */
+  for (VarIdx = 0; VarIdx < NbVar; VarIdx++)
+  {
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, VarIdx) != 0)
+    {
+      NbWrite--;
+    }
+  }
+  EE_STATS_COUNT(Skipped, NbVar - NbWrite);
+  if (NbWrite == 0)
+  {
+    return HAL_OK;
+  }
+#endif
+
+  /* Get valid Page for write operation */
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+  Address = EE_GetWriteCursor(ValidPage);
+  PageEndAddress = EE_PageEndAddress(ValidPage) + 1;
+
+  /* Compact the data once if the whole set does not fit in the page */
+  if (((PageEndAddress - Address) / EE_RECORD_SIZE) < NbWrite)
+  {
+    EepromStatus = EE_PageTransfer(EE_NO_VIRTADDRESS, 0);
+    if (EepromStatus != HAL_OK)
+    {
+      return EepromStatus;
+    }
+    ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+    if (ValidPage == NO_VALID_PAGE)
+    {
+      return NO_VALID_PAGE;
+    }
+    Address = EE_GetWriteCursor(ValidPage);
+    PageEndAddress = EE_PageEndAddress(ValidPage) + 1;
+    if (((PageEndAddress - Address) / EE_RECORD_SIZE) < NbWrite)
+    {
+      return PAGE_FULL;
+    }
+  }
+
+  /* Program all the records back to back */
+  for (VarIdx = 0; VarIdx < NbVar; VarIdx++)
+  {
+#if (EE_USE_SKIP_UNCHANGED == 1)
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, VarIdx) != 0)
+    {
+      continue;
+    }
+#endif
+    EepromStatus = EE_ProgramRecord(Address,
+                                    (VirtAddress != NULL) ? VirtAddress[VarIdx] : (uint16_t)(FirstVirtAddress + VarIdx),
+                                    Data[VarIdx]);
+    if (EepromStatus != HAL_OK)
+    {
+      break;
+    }
+    Address = Address + EE_RECORD_SIZE;
+  }
+
+  return EepromStatus;
+}
+
+/**
+  * @brief  Transfers last updated variables data from the full Page to
+  *   an empty one. With EE_USE_SPARE_PAGE, the data goes to the spare page and
+  *   the full page is only marked as obsolete, EE_EraseSpare erases it later.
+  * @param  VirtAddress: 16 bit virtual address of the variable,
+  *   EE_NO_VIRTADDRESS if only the existing variables are transferred
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+{
+  HAL_StatusTypeDef FlashStatus = HAL_OK;
+  uint32_t NewPageAddress = EEPROM_START_ADDRESS, NewPageEndAddress = EEPROM_START_ADDRESS;
+  uint32_t OldPageAddress = EEPROM_START_ADDRESS, OldPageEndAddress = EEPROM_START_ADDRESS;
+  uint16_t NewPage = PAGE0, ValidPage = PAGE0;
+  uint16_t EepromStatus = 0;
+#if (EE_USE_STATS == 1)
+  uint32_t StatsStart = EE_CycleCount();
+#endif
+
+  /* Get active Page for read operation */
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+
+  /* Check if there is no valid page */
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE; /* No valid Page */
+  }
+
+#if (EE_USE_SPARE_PAGE == 1)
+  /* Variables are moved to the spare page, which follows the valid one */
+  NewPage = EE_NEXT_PAGE(ValidPage);
+#else
+  /* Variables are moved to the other page */
+  NewPage = (ValidPage == PAGE0) ? PAGE1 : PAGE0;
+#endif
+  NewPageAddress = EE_PageBaseAddress(NewPage);
+  NewPageEndAddress = EE_PageEndAddress(NewPage);
+  OldPageAddress = EE_PageBaseAddress(ValidPage);
+  OldPageEndAddress = EE_PageEndAddress(ValidPage);
+
+#if (EE_USE_SPARE_PAGE == 1)
+  /* EE_EraseSpare was not called since the last transfer: erase it now */
+  if ((EE_PAGE_STATUS(NewPage) != ERASED) || (EE_PAGE_MARK(NewPage) != ERASED))
+  {
+    EepromStatus = EE_EraseSector(NewPage);
+    /* If erase operation was failed, a Flash error code is returned */
+    if (EepromStatus != HAL_OK)
+    {
+      return EepromStatus;
+    }
+  }
+#endif
+
+  /* The blobs read in place are left in the old page */
+  EE_BLOB_INVALIDATE();
+
+  /* Set the new Page status to RECEIVE_DATA status */
+  EE_PAGE_CACHE_RESET();
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, NewPageAddress, RECEIVE_DATA);
+  /* If program operation was failed, a Flash error code is returned */
+  if (FlashStatus != HAL_OK)
+  {
+    return FlashStatus;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* New page is empty: next write goes right after its header and erase count */
+  usValidpage = NewPage;
+  ulAddress = EE_FindWriteCursor(NewPage);
+#endif
+
+  /* Write the variable passed as parameter in the new active page */
+  if (VirtAddress != EE_NO_VIRTADDRESS)
+  {
+    EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+    /* If program operation was failed, a Flash error code is returned */
+    if (EepromStatus != HAL_OK)
+    {
+      return EepromStatus;
+    }
+  }
+
+  /* Transfer process: transfer variables from old to the new active page */
+  EepromStatus = EE_CopyValidRecords(OldPageAddress, OldPageEndAddress, NewPageAddress, NewPageEndAddress);
+  /* If program operation was failed, a Flash error code is returned */
+  if (EepromStatus != HAL_OK)
+  {
+    return EepromStatus;
+  }
+
+#if (EE_USE_SPARE_PAGE == 1)
+  /* Set new Page status to VALID_PAGE status */
+  EE_PAGE_CACHE_RESET();
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, NewPageAddress, VALID_PAGE);
+  /* If program operation was failed, a Flash error code is returned */
+  if (FlashStatus != HAL_OK)
+  {
+    return FlashStatus;
+  }
+
+  /* The old Page is left to EE_EraseSpare: mark it as obsolete */
+  EE_PAGE_CACHE_RESET();
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, OldPageAddress + 2, EE_PAGE_OBSOLETE);
+#else
+  /* Erase the old Page: Set old Page status to ERASED status */
+  EepromStatus = EE_EraseSector(ValidPage);
+  /* If erase operation was failed, a Flash error code is returned */
+  if (EepromStatus != HAL_OK)
+  {
+    return EepromStatus;
+  }
+
+  /* Set new Page status to VALID_PAGE status */
+  EE_PAGE_CACHE_RESET();
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, NewPageAddress, VALID_PAGE);
+#endif
+  /* Only the variables copied are left: rebuild the bitmap from the new page */
+  EE_PRESENT_RESET();
+  if (FlashStatus == HAL_OK)
+  {
+    EE_STATS_COUNT(Transfers, 1);
+    EE_STATS_TIME(Transfer, StatsStart);
+  }
+
+  /* Return last operation flash status */
+  return FlashStatus;
+}
+
+/**
+  * @brief  Copy the last update of each variable from the old page to the page
+  *   receiving data. The old page is walked once from its newest record to its
+  *   oldest one and a bitmap keeps track of the variables already copied.
+  *   Variables the receiving page already holds (the one written by
+  *   EE_PageTransfer, or records copied before a power loss) are not copied.
+  * @param  OldPageAddress: base address of the page the data is taken from
+  * @param  OldPageEndAddress: end address of the page the data is taken from
+  * @param  NewPageAddress: base address of the page receiving the data
+  * @param  NewPageEndAddress: end address of the page receiving the data
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the receiving page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_CopyValidRecords(uint32_t OldPageAddress, uint32_t OldPageEndAddress,
+                                    uint32_t NewPageAddress, uint32_t NewPageEndAddress)
+{
+  uint32_t Copied[(EE_NB_OF_ITEMS + 31) / 32];
+  uint32_t Address = NewPageAddress + EE_HEADER_SIZE;
+  uint16_t VarIdx = 0;
+
+  for (VarIdx = 0; VarIdx < (EE_NB_OF_ITEMS + 31) / 32; VarIdx++)
+  {
+    Copied[VarIdx] = 0;
+  }
+
+  /* Mark the variables the receiving page already holds */
+  EE_CoreMarkRecords(NewPageAddress, &Address, NewPageEndAddress + 1, NULL, Copied);
+
+  /* Walk the old page from its last slot down to the first record */
+  Address = OldPageEndAddress + 1 - EE_RECORD_SIZE;
+  return EE_CoreCopyRecords(OldPageAddress, &Address, NULL, Copied);
+}
 
-  default:
-    return PAGE0; /* Page0 valid */
+/**
+  * @brief  Get the first free slot of a page, from the RAM cursor when it is
+  *   kept for this page.
+  * @param  Page: page number (PAGE0 or PAGE1)
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_GetWriteCursor(uint16_t Page)
+{
+#if (EE_USE_WRITE_CURSOR == 1)
+  if ((usValidpage != Page) || (ulAddress == 0xFFFFFFFF))
+  {
+    usValidpage = Page;
+    ulAddress = EE_FindWriteCursor(Page);
   }
+  return ulAddress;
+#else
+  return EE_FindWriteCursor(Page);
+#endif
 }
 
 /**
-  * @brief  Verify if active page is full and Writes variable in EEPROM.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @brief  Find the first free slot of a page by a binary search.
+  * @param  Page: page number (PAGE0 or PAGE1)
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_FindWriteCursor(uint16_t Page)
+{
+  return EE_CoreFindCursor(EE_PageBaseAddress(Page), EE_PageEndAddress(Page) + 1);
+}
+
+/**
+  * @brief  Get the base address of a page, where its status is written.
+  * @param  Page: page number (PAGE0, PAGE1 or PAGE2)
+  * @retval Base address of the page
+  */
+static uint32_t EE_PageBaseAddress(uint16_t Page)
+{
+#if (EE_USE_SPARE_PAGE == 1)
+  if (Page == PAGE2)
+  {
+    return PAGE2_BASE_ADDRESS;
+  }
+#endif
+  return (Page == PAGE0) ? PAGE0_BASE_ADDRESS : PAGE1_BASE_ADDRESS;
+}
+
+/**
+  * @brief  Get the end address of a page, its last byte.
+  * @param  Page: page number (PAGE0, PAGE1 or PAGE2)
+  * @retval End address of the page
+  */
+static uint32_t EE_PageEndAddress(uint16_t Page)
+{
+#if (EE_USE_SPARE_PAGE == 1)
+  if (Page == PAGE2)
+  {
+    return PAGE2_END_ADDRESS;
+  }
+#endif
+  return (Page == PAGE0) ? PAGE0_END_ADDRESS : PAGE1_END_ADDRESS;
+}
+
+/**
+  * @brief  Erase the sector of a page.
+  * @param  Page: page number (PAGE0, PAGE1 or PAGE2)
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
-  *           - Flash error code: on write Flash error
+  *           - Flash error code: on erase Flash error
   */
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_EraseSector(uint16_t Page)
 {
   HAL_StatusTypeDef FlashStatus = HAL_OK;
-  uint16_t ValidPage = PAGE0;
-  uint32_t Address = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS + PAGE0_SIZE;
+  uint32_t SectorError = 0;
+  FLASH_EraseInitTypeDef pEraseInit;
+#if (EE_USE_STATS == 1)
+  uint32_t StatsStart = EE_CycleCount();
+#endif
+#if (EE_USE_ERASE_COUNT == 1)
+  uint16_t EraseCount = EE_GetEraseCount(Page);
+#endif
 
-  /* Get valid Page for write operation */
-  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  pEraseInit.TypeErase = TYPEERASE_SECTORS;
+  pEraseInit.Sector = GetSector(EE_PageBaseAddress(Page));
+  pEraseInit.NbSectors = 1;
+  pEraseInit.VoltageRange = VOLTAGE_RANGE;
 
-  /* Check if there is no valid page */
-  if (ValidPage == NO_VALID_PAGE)
+  EE_STATS_COUNT(Erases, 1);
+  EE_PAGE_CACHE_RESET();
+  EE_BLOB_INVALIDATE();
+  FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
+  if (FlashStatus != HAL_OK)
   {
-    return NO_VALID_PAGE;
+    return FlashStatus;
   }
+  EE_STATS_TIME(Erase, StatsStart);
 
-  if (ValidPage == PAGE0)
+#if (EE_USE_ERASE_COUNT == 1)
+  /* Keep the erase count right after the header, as a record. The count
+     sticks at its highest value */
+  ulWearErases++;
+  if (EraseCount < 0xFFFF)
   {
-    Address = PAGE0_BASE_ADDRESS;
-    PageEndAddress = PAGE0_END_ADDRESS - 1;
+    EraseCount++;
   }
-  else
+#if (EE_USE_WORD_PROGRAM == 1)
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_WORD, EE_PageBaseAddress(Page) + EE_HEADER_SIZE,
+                                  EE_RECORD_VALUE(EE_ERASE_COUNT_VIRTADDRESS, EraseCount));
+#else
+  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, EE_PageBaseAddress(Page) + EE_HEADER_SIZE, EraseCount);
+  if (FlashStatus == HAL_OK)
   {
-    Address = PAGE1_BASE_ADDRESS;
-    PageEndAddress = PAGE1_END_ADDRESS - 1;
+    FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, EE_PageBaseAddress(Page) + EE_HEADER_SIZE + 2, EE_ERASE_COUNT_VIRTADDRESS);
   }
+#endif
+#endif
 
-  /* Check each active page address starting from begining */
-  while (Address < PageEndAddress)
+  return FlashStatus;
+}
+
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Read the erase count record a sector holds right after its header.
+  * @param  Page: page number (PAGE0, PAGE1 or PAGE2)
+  * @param  Count: erase count of the sector, left unchanged if there is none
+  * @retval 1 if the sector holds an erase count record, 0 otherwise
+  */
+static uint8_t EE_ReadEraseCount(uint16_t Page, uint16_t *Count)
+{
+  if (EE_RECORD_VIRTADDRESS(EE_PageBaseAddress(Page) + EE_HEADER_SIZE) != EE_ERASE_COUNT_VIRTADDRESS)
   {
-    /* Verify if Address and Address+2 contents are 0xFFFFFFFF */
-    if ((*(__IO uint32_t *)Address) == 0xFFFFFFFF)
-    {
-      /* Set variable data */
-      FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, Address, Data);
-      /* If program operation was failed, a Flash error code is returned */
-      if (FlashStatus != HAL_OK)
-      {
-        return FlashStatus;
-      }
-      /* Set variable virtual address */
-      FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, Address + 2, VirtAddress);
-      /* Return program operation status */
-      return FlashStatus;
-    }
-    else
+    return 0;
+  }
+  *Count = EE_RECORD_DATA(EE_PageBaseAddress(Page) + EE_HEADER_SIZE);
+  return 1;
+}
+
+/**
+  * @brief  Get the number of times a sector was erased. A sector without erase
+  *   count, last erased by a firmware that did not keep it or by an erase a
+  *   power loss cut, is given the highest count of the other sectors: the
+  *   sectors are erased in turn.
+  * @param  Page: page number (PAGE0, PAGE1 or PAGE2)
+  * @retval Erase count of the sector, 0 if no sector holds one
+  */
+static uint16_t EE_GetEraseCount(uint16_t Page)
+{
+  uint16_t Other = PAGE0, Count = 0, EraseCount = 0;
+
+  if (EE_ReadEraseCount(Page, &EraseCount))
+  {
+    return EraseCount;
+  }
+  for (Other = PAGE0; Other < EE_NB_PAGES; Other++)
+  {
+    if ((Other != Page) && EE_ReadEraseCount(Other, &Count) && (Count > EraseCount))
     {
-      /* Next address location */
-      Address = Address + 4;
+      EraseCount = Count;
     }
   }
 
-  /* Return PAGE_FULL in case the valid page is full */
-  return PAGE_FULL;
+  return EraseCount;
 }
+#endif
 
+#if (EE_USE_IT == 1)
 /**
-  * @brief  Transfers last updated variables data from the full Page to
-  *   an empty one.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
-  * @retval Success or error status:
-  *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
-  *           - Flash error code: on write Flash error
+  * @brief  Starts programming the first queued write under interrupt when it
+  *   fits at the write cursor, else leaves it to EE_ProcessIT. Called with the
+  *   Flash interrupt masked or from it.
+  * @param  None
+  * @retval None
   */
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+static void EE_ITStart(void)
 {
-  HAL_StatusTypeDef FlashStatus = HAL_OK;
-  uint32_t NewPageAddress = EEPROM_START_ADDRESS;
-  uint16_t OldPageId = 0;
-  uint16_t ValidPage = PAGE0, VarIdx = 0;
-  uint16_t EepromStatus = 0, ReadStatus = 0;
-  uint32_t SectorError = 0;
-  FLASH_EraseInitTypeDef pEraseInit;
+  uint16_t ValidPage = PAGE0;
 
-  /* Get active Page for read operation */
-  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (usItCount == 0)
+  {
+    ucItState = EE_IT_IDLE;
+    return;
+  }
 
-  if (ValidPage == PAGE1) /* Page1 valid */
+  ucItState = EE_IT_STALLED;
+  /* A full page needs a page transfer */
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if ((ValidPage == NO_VALID_PAGE) || (usValidpage != ValidPage) || (ulAddress == 0xFFFFFFFF)
+      || (ulAddress >= EE_PageEndAddress(ValidPage)) || !EE_RECORD_ERASED(ulAddress))
   {
-    /* New page address where variable will be moved to */
-    NewPageAddress = PAGE0_BASE_ADDRESS;
+    return;
+  }
 
-    /* Old page ID where variable will be taken from */
-    OldPageId = PAGE1_ID;
+  EE_ITUnlockFlash();
+  ucItResult = EE_IT_PENDING;
+#if (EE_USE_WORD_PROGRAM == 1)
+  /* The whole record at once: EE_IRQHandler has nothing left to program */
+  ucItDataDone = 1;
+  if (HAL_FLASH_Program_IT(TYPEPROGRAM_WORD, ulAddress,
+                           EE_RECORD_VALUE(ausItVirtAddress[usItFirst], ausItData[usItFirst])) == HAL_OK)
+#else
+  ucItDataDone = 0;
+  /* Data first, as EE_ProgramRecord does */
+  if (HAL_FLASH_Program_IT(TYPEPROGRAM_HALFWORD, ulAddress, ausItData[usItFirst]) == HAL_OK)
+#endif
+  {
+    ucItState = EE_IT_BUSY;
+    EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+    ulWearRecords++;
+#endif
   }
-  else if (ValidPage == PAGE0) /* Page0 valid */
+}
+
+/**
+  * @brief  Unlocks the Flash for the queued writes if it is locked.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITUnlockFlash(void)
+{
+  if (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U)
   {
-    /* New page address  where variable will be moved to */
-    NewPageAddress = PAGE1_BASE_ADDRESS;
+    HAL_FLASH_Unlock();
+    ucItUnlocked = 1;
+  }
+}
 
-    /* Old page ID where variable will be taken from */
-    OldPageId = PAGE0_ID;
+/**
+  * @brief  Locks the Flash back if the queue unlocked it and is empty. Left
+  *   to thread mode, so that the interrupt never locks the Flash under the
+  *   feet of a caller that unlocked it meanwhile.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITLockFlash(void)
+{
+  if ((ucItState == EE_IT_IDLE) && (ucItUnlocked != 0))
+  {
+    HAL_FLASH_Lock();
+    ucItUnlocked = 0;
   }
-  else
+}
+
+/**
+  * @brief  Looks for the last queued write of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: receives the queued value
+  * @retval 1 if the variable has a queued write, 0 otherwise
+  */
+static uint8_t EE_ITFindQueued(uint16_t VirtAddress, uint16_t *Data)
+{
+  uint16_t Idx = 0, Slot = 0;
+  uint8_t Found = 0;
+
+  EE_IT_LOCK();
+  for (Idx = 0; Idx < usItCount; Idx++)
   {
-    return NO_VALID_PAGE; /* No valid Page */
+    Slot = (usItFirst + Idx) % EE_IT_QUEUE_SIZE;
+    if (ausItVirtAddress[Slot] == VirtAddress)
+    {
+      *Data = ausItData[Slot];
+      Found = 1;
+    }
   }
+  EE_IT_UNLOCK();
 
-  /* Set the new Page status to RECEIVE_DATA status */
-  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, NewPageAddress, RECEIVE_DATA);
-  /* If program operation was failed, a Flash error code is returned */
-  if (FlashStatus != HAL_OK)
+  return Found;
+}
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/**
+  * @brief  Looks for the cache entry of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @retval Index of the entry, number of entries if the variable is not cached
+  */
+static uint16_t EE_CacheFind(uint16_t VirtAddress)
+{
+  uint16_t Slot = 0;
+
+  while ((Slot < usCacheCount) && (ausCacheVirtAddress[Slot] != VirtAddress))
   {
-    return FlashStatus;
+    Slot++;
   }
 
-  /* Write the variable passed as parameter in the new active page */
-  EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-  /* If program operation was failed, a Flash error code is returned */
-  if (EepromStatus != HAL_OK)
+  return Slot;
+}
+
+/**
+  * @brief  Drops the cache entries of variables written to Flash by the other
+  *   write functions: their cached writes are older.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   NbVar variables from FirstVirtAddress on
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  NbVar: number of variables
+  * @retval None
+  */
+static void EE_CacheDrop(const uint16_t *VirtAddress, uint16_t FirstVirtAddress, uint16_t NbVar)
+{
+  uint32_t Primask = 0;
+  uint16_t Idx = 0, Slot = 0;
+
+  EE_CACHE_LOCK(Primask);
+  for (Idx = 0; (Idx < NbVar) && (usCacheCount != 0); Idx++)
   {
-    return EepromStatus;
+    Slot = EE_CacheFind((VirtAddress != NULL) ? VirtAddress[Idx] : (uint16_t)(FirstVirtAddress + Idx));
+    if (Slot < usCacheCount)
+    {
+      /* The last entry takes the place of the dropped one */
+      usCacheCount--;
+      ausCacheVirtAddress[Slot] = ausCacheVirtAddress[usCacheCount];
+      ausCacheData[Slot] = ausCacheData[usCacheCount];
+    }
   }
+  EE_CACHE_UNLOCK(Primask);
+}
+#endif
 
-  /* Transfer process: transfer variables from old to the new active page */
-  for (VarIdx = 0; VarIdx < NB_OF_VAR; VarIdx++)
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Checks the blob closed by a header record: the records before it
+  *   have to be its CRC record and its data records, and the CRC has to match
+  *   the bytes, which are copied to Data on the way.
+  * @param  PageAddress: base address of the page holding the blob
+  * @param  Address: address of the header record
+  * @param  Data: buffer receiving the bytes, NULL to check the blob only
+  * @param  MaxSize: size of the buffer
+  * @param  Size: receives the size of the blob
+  * @retval 1 if the blob is complete, 0 otherwise
+  */
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  uint16_t Blob = (uint16_t)(EE_RECORD_VIRTADDRESS(Address) - EE_BLOB_VIRTADDRESS);
+  uint16_t BlobSize = EE_RECORD_DATA(Address);
+  uint16_t Idx = 0, Crc = 0xFFFF, RecordData = 0;
+  uint8_t Byte = 0;
+
+  /* The records of the blob follow the page header */
+  if ((BlobSize > EE_BLOB_MAX_SIZE) || (((Address - PageAddress) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(BlobSize)))
   {
-    if (VarIdx != VirtAddress) /* Check each variable except the one passed as parameter */
+    return 0;
+  }
+  Address = Address - (uint32_t)(EE_BLOB_NB_SLOTS(BlobSize) - 1) * EE_RECORD_SIZE;
+
+  Crc = EE_Crc16(Crc, (uint8_t)Blob);
+  Crc = EE_Crc16(Crc, (uint8_t)BlobSize);
+  Crc = EE_Crc16(Crc, (uint8_t)(BlobSize >> 8));
+  for (Idx = 0; Idx < BlobSize; Idx++)
+  {
+    if ((Idx % EE_BLOB_BYTES_PER_RECORD) == 0)
     {
-      /* Read the other last variable updates */
-      ReadStatus = EE_ReadVariable(VarIdx, &DataVar);
-      /* In case variable corresponding to the virtual address was found */
-      if (ReadStatus != 0x1)
+      if (EE_RECORD_VIRTADDRESS(Address) != EE_BLOB_DATA_VIRTADDRESS)
       {
-        /* Transfer the variable to the new active page */
-        EepromStatus = EE_VerifyPageFullWriteVariable(VarIdx, DataVar);
-        /* If program operation was failed, a Flash error code is returned */
-        if (EepromStatus != HAL_OK)
-        {
-          return EepromStatus;
-        }
+        return 0;
       }
+      RecordData = EE_RECORD_DATA(Address);
+      Address = Address + EE_RECORD_SIZE;
+    }
+    Byte = (uint8_t)(RecordData >> (8 * (Idx % EE_BLOB_BYTES_PER_RECORD)));
+    Crc = EE_Crc16(Crc, Byte);
+    if ((Data != NULL) && (Idx < MaxSize))
+    {
+      Data[Idx] = Byte;
     }
   }
 
-  pEraseInit.TypeErase = TYPEERASE_SECTORS;
-  pEraseInit.Sector = OldPageId;
-  pEraseInit.NbSectors = 1;
-  pEraseInit.VoltageRange = VOLTAGE_RANGE;
+  if ((EE_RECORD_VIRTADDRESS(Address) != EE_BLOB_CRC_VIRTADDRESS) || (EE_RECORD_DATA(Address) != Crc))
+  {
+    return 0;
+  }
+  *Size = BlobSize;
+  return 1;
+}
 
-  /* Erase the old Page: Set old Page status to ERASED status */
-  FlashStatus = HAL_FLASHEx_Erase(&pEraseInit, &SectorError);
-  /* If erase operation was failed, a Flash error code is returned */
-  if (FlashStatus != HAL_OK)
+/**
+  * @brief  Copies a checked blob as a unit behind the last record of the valid
+  *   page, its records in the same order.
+  * @param  Address: address of the header record of the blob
+  * @param  Size: size of the blob
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the blob does not fit in the valid page
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+static uint16_t EE_BlobCopy(uint32_t Address, uint16_t Size)
+{
+  uint16_t ValidPage = PAGE0;
+  uint16_t EepromStatus = HAL_OK;
+  uint32_t NewAddress = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS + PAGE0_SIZE;
+  uint32_t SourceAddress = Address - (uint32_t)(EE_BLOB_NB_SLOTS(Size) - 1) * EE_RECORD_SIZE;
+
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
   {
-    return FlashStatus;
+    return NO_VALID_PAGE;
+  }
+  NewAddress = EE_GetWriteCursor(ValidPage);
+  PageEndAddress = EE_PageEndAddress(ValidPage) + 1;
+  if (((PageEndAddress - NewAddress) / EE_RECORD_SIZE) < EE_BLOB_NB_SLOTS(Size))
+  {
+    return PAGE_FULL;
   }
 
-  /* Set new Page status to VALID_PAGE status */
-  FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, NewPageAddress, VALID_PAGE);
-  /* If program operation was failed, a Flash error code is returned */
-  if (FlashStatus != HAL_OK)
+  while ((SourceAddress <= Address) && (EepromStatus == HAL_OK))
   {
-    return FlashStatus;
+    EepromStatus = EE_ProgramRecord(NewAddress, EE_RECORD_VIRTADDRESS(SourceAddress), EE_RECORD_DATA(SourceAddress));
+    SourceAddress = SourceAddress + EE_RECORD_SIZE;
+    NewAddress = NewAddress + EE_RECORD_SIZE;
   }
 
-  /* Return last operation flash status */
-  return FlashStatus;
+  return EepromStatus;
+}
+
+/**
+  * @brief  Updates a CRC-16/CCITT (polynomial 0x1021) with one byte.
+  * @param  Crc: CRC of the previous bytes, 0xFFFF for the first one
+  * @param  Byte: next byte
+  * @retval Updated CRC
+  */
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte)
+{
+  uint8_t Bit = 0;
+
+  Crc ^= (uint16_t)Byte << 8;
+  for (Bit = 0; Bit < 8; Bit++)
+  {
+    Crc = ((Crc & 0x8000) != 0) ? (uint16_t)((Crc << 1) ^ 0x1021) : (uint16_t)(Crc << 1);
+  }
+  return Crc;
+}
+#endif
+
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+/**
+  * @brief  Masks the interrupts and starts timing how long they stay masked
+  *   with the DWT cycle counter.
+  * @param  None
+  * @retval Start time, to be given to EE_IrqMaskEnd
+  */
+static uint32_t EE_IrqMaskStart(void)
+{
+  __disable_irq();
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+}
+
+/**
+  * @brief  Unmasks the interrupts and records how long they were masked.
+  * @param  Start: start time returned by EE_IrqMaskStart
+  * @retval None
+  */
+static void EE_IrqMaskEnd(uint32_t Start)
+{
+  uint32_t Elapsed = DWT->CYCCNT - Start;
+
+#if (EE_USE_IT == 1)
+  ulIrqMaskedLast = Elapsed;
+  if (Elapsed > ulIrqMaskedMax)
+  {
+    ulIrqMaskedMax = Elapsed;
+  }
+#endif
+#if (EE_USE_STATS == 1)
+  EE_StatsTime(&xStats.IrqMasked, Elapsed);
+#endif
+  __enable_irq();
+}
+#endif
+
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Reads the DWT cycle counter.
+  * @param  None
+  * @retval Count of core clock cycles
+  */
+static uint32_t EE_CycleCount(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+}
+
+/**
+  * @brief  Adds a time to a timing of the statistics.
+  * @param  Timing: timing to update
+  * @param  Elapsed: time taken, in core clock cycles
+  * @retval None
+  */
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed)
+{
+  uint32_t Bucket = 0;
+  uint32_t Limit = EE_STATS_BUCKET_CYCLES;
+
+  if ((Timing->Count == 0U) || (Elapsed < Timing->Min))
+  {
+    Timing->Min = Elapsed;
+  }
+  if (Elapsed > Timing->Max)
+  {
+    Timing->Max = Elapsed;
+  }
+  Timing->Count++;
+
+  /* Bucket n holds the times below EE_STATS_BUCKET_CYCLES << n */
+  while ((Bucket < (EE_STATS_NB_BUCKETS - 1U)) && (Elapsed >= Limit))
+  {
+    Limit <<= 1;
+    Bucket++;
+  }
+  Timing->Histogram[Bucket]++;
 }
+#endif
 
 /* Get sector number by address */
 static uint32_t GetSector(uint32_t Address)
@@ -789,29 +2904,65 @@ uint16_t usWriteRes;
 
 uint16_t usEE_Read(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 2 == 0);
   usLen /= 2;
   for (uint16_t i = 0; i < usLen; i++)
   {
     usReadRes = EE_ReadVariable(usAdd + i, pusDat + i);
   }
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
+#endif
   return 0;
 }
 uint16_t usEE_Write(uint16_t usAdd, uint16_t *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1)
+  uint32_t ulMaskStart;
+
+  /* Queued writes go to Flash first, with the interrupts running */
+  (void)EE_FlushIT();
+  ulMaskStart = EE_IrqMaskStart();
+#elif (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 2 == 0);
   usLen /= 2;
   HAL_FLASH_Unlock();
-  for (uint16_t i = 0; i < usLen; i++)
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(NULL, usAdd, usLen);
+#endif
+  usWriteRes = EE_WriteRecords(NULL, usAdd, pusDat, usLen);
+  if (usWriteRes == PAGE_FULL)
   {
-    usWriteRes = EE_WriteVariable(usAdd + i, *(pusDat + i));
+    /* More than a compacted page can take: write the variables one by one,
+       up to the first that fails */
+    for (uint16_t i = 0; i < usLen; i++)
+    {
+      usWriteRes = EE_WriteVariable(usAdd + i, *(pusDat + i));
+      if (usWriteRes != 0)
+      {
+        break;
+      }
+    }
   }
   HAL_FLASH_Lock();
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
-  return 0;
+#endif
+  return usWriteRes;
 }
 
 /**
@@ -70,6 +70,8 @@
 #define PAGE1_NUMBER ((uint32_t)PAGE0_NUMBER + PAGE_NUM)
 #define PAGE1_BANKNUMBER 0
 
+/* The variables are kept in a pair of pages: a transfer copies all of them in
+   order to the other page (see README.md) */
 /* Pages 0 and 1 base and end addresses */
 #define PAGE0_BASE_ADDRESS (uint32_t)(FLASH_BASE + PAGE0_NUMBER * FLASH_PAGE_SIZE)
 
@@ -91,6 +93,34 @@
 #define EE_MASK_VIRTUALADRESS (uint64_t)0x00000000FFFF0000
 #define EE_MASK_DATA (uint64_t)0xFFFFFFFF00000000
 #define EE_MASK_FULL (uint64_t)0xFFFFFFFFFFFFFFFF
+#define EE_MASK_CRC (uint64_t)0x000000000000FFFF
+
+/* Record layout: the data in the high word, the virtual address above the CRC
+   half-word. The loops below only build and split a record with these */
+#define EE_RECORD_VALUE(VirtAddress, Data) (((((EE_DATA_TYPE)(Data)) << 16) | (VirtAddress)) << EE_DATA_SHIFT)
+#define EE_RECORD_VIRTADDRESS(Element) ((EE_VIRTUALADDRESS_TYPE)(((Element) & EE_MASK_VIRTUALADRESS) >> EE_DATA_SHIFT))
+#define EE_RECORD_DATA(Element) ((EE_DATA_STORED_TYPE)(((Element) & EE_MASK_DATA) >> (EE_DATA_SHIFT + 16)))
+
+/* Records as the shared engine of ee_core.h sees them: the page header takes
+   one element, then each record takes one */
+#define EE_CORE_STATUS EE_Status
+#define EE_CORE_OK EE_OK
+#define EE_CORE_RECORD_TYPE EE_DATA_TYPE
+#define EE_CORE_VIRTADDRESS_TYPE EE_VIRTUALADDRESS_TYPE
+#define EE_CORE_DATA_TYPE EE_DATA_STORED_TYPE
+#define EE_CORE_HEADER_SIZE EE_DATA_SIZE
+#define EE_CORE_RECORD_SIZE EE_DATA_SIZE
+#define EE_CORE_READ(Address) (*(__IO EE_DATA_TYPE *)(Address))
+#define EE_CORE_READ_VIRTADDRESS(Address) EE_RECORD_VIRTADDRESS(EE_CORE_READ(Address))
+#define EE_CORE_ERASED(Record) ((Record) == EE_PAGESTAT_ERASED)
+#define EE_CORE_VIRTADDRESS(Record) EE_RECORD_VIRTADDRESS(Record)
+#define EE_CORE_DATA(Record) EE_RECORD_DATA(Record)
+#if (EE_USE_CRC == 1)
+#define EE_CORE_VALID(Record) (EE_RecordValid(Record) != 0)
+#else
+#define EE_CORE_VALID(Record) 1
+#endif
+#define EE_CORE_WRITE(VirtAddress, Data) EE_VerifyPageFullWriteVariable((VirtAddress), (Data))
 
 /* Type of find requested : 
        READ -> page in valid state 
@@ -106,6 +136,28 @@ typedef enum
 /* No valid page define */
 #define EE_NO_VALID_PAGE ((uint32_t)0xFFFFFFFF)
 
+/* Virtual address given to EE_PageTransfer when no variable has to be written */
+#define EE_NO_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFF)
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Page kept by EE_FindPage when the headers have to be read again: no page
+   starts at address 0 */
+#define EE_PAGE_CACHE_EMPTY ((uint32_t)0x00000000)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Bytes of a blob a data record holds, and records a blob of Size bytes takes:
+   its data records, its CRC record and its header record */
+#define EE_BLOB_BYTES_PER_RECORD 4
+#define EE_BLOB_NB_SLOTS(Size) ((uint16_t)((((Size) + EE_BLOB_BYTES_PER_RECORD - 1) / EE_BLOB_BYTES_PER_RECORD) + 2))
+#define EE_IS_BLOB_VIRTADDRESS(VirtAddress) (((VirtAddress) >= EE_BLOB_VIRTADDRESS) && ((VirtAddress) < (EE_BLOB_VIRTADDRESS + NB_OF_BLOB)))
+
+/* Entries of the copy bitmap of a page transfer: the variables, then the blobs */
+#define EE_NB_OF_ITEMS (NB_OF_VAR + NB_OF_BLOB)
+#else
+#define EE_NB_OF_ITEMS NB_OF_VAR
+#endif
+
 /* defintion of the different type of page transfer 
         NORMAL  -> copie data pag source to page destination 
         RECOVER -> resolve confict when one page reception and a second is valid */
@@ -115,23 +167,221 @@ typedef enum
   EE_TRANSFER_RECOVER
 } EE_Transfer_type;
 
+#if (EE_USE_IT == 1)
+#if (EE_USE_WRITE_CURSOR == 0)
+#error "EE_USE_IT needs EE_USE_WRITE_CURSOR"
+#endif
+
+/* States of the queued writes */
+#define EE_IT_IDLE ((uint8_t)0x00)    /* No write is queued */
+#define EE_IT_BUSY ((uint8_t)0x01)    /* First queued write is programmed under interrupt */
+#define EE_IT_STALLED ((uint8_t)0x02) /* First queued write is left to EE_ProcessIT */
+
+/* Result of the Flash operation given by the HAL callbacks */
+#define EE_IT_PENDING ((uint8_t)0x00)
+#define EE_IT_DONE ((uint8_t)0x01)
+#define EE_IT_FAILED ((uint8_t)0x02)
+#endif
+
 /* Private macro -------------------------------------------------------------*/
+#if (EE_USE_PAGE_CACHE == 1)
+/* Drop the pages kept by EE_FindPage, done before a header is programmed or a
+   page erased */
+#define EE_PAGE_CACHE_RESET() (ulReadPage = EE_PAGE_CACHE_EMPTY)
+#else
+#define EE_PAGE_CACHE_RESET()
+#endif
+
+#if (EE_USE_PRESENCE_BITMAP == 1)
+/* Mark a variable as written, and have the bitmap rebuilt from the valid page
+   once its records changed other than by an append */
+#define EE_PRESENT_SET(VirtAddress) \
+  do { if ((VirtAddress) < NB_OF_VAR) { aulPresent[(VirtAddress) >> 5] |= (uint32_t)1 << ((VirtAddress) & 0x1F); } } while (0)
+#define EE_PRESENT_RESET() (ulPresentPage = EE_NO_VALID_PAGE)
+#else
+#define EE_PRESENT_SET(VirtAddress)
+#define EE_PRESENT_RESET()
+#endif
+
+#if (EE_USE_IT == 1)
+/* Only the Flash interrupt is masked while the queue is updated */
+#define EE_IT_LOCK() HAL_NVIC_DisableIRQ(FLASH_IRQn)
+#define EE_IT_UNLOCK() HAL_NVIC_EnableIRQ(FLASH_IRQn)
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* The cache is updated with the interrupts masked, EE_Flush may be called from
+   the PVD interrupt */
+#define EE_CACHE_LOCK(Primask) do { (Primask) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define EE_CACHE_UNLOCK(Primask) __set_PRIMASK(Primask)
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Move the blobs read in place by EE_GetBlob to a new generation, done before
+   a blob is written, the blobs are transferred or a page is erased */
+#define EE_BLOB_INVALIDATE() (ulBlobGeneration++)
+#else
+#define EE_BLOB_INVALIDATE()
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Statistics updates, compiled out without EE_USE_STATS */
+#define EE_STATS_COUNT(Counter, Nb) (xStats.Counter += (uint32_t)(Nb))
+#define EE_STATS_TIME(Timing, Start) EE_StatsTime(&xStats.Timing, EE_CycleCount() - (Start))
+#else
+#define EE_STATS_COUNT(Counter, Nb)
+#define EE_STATS_TIME(Timing, Start)
+#endif
+
 /* Private variables ---------------------------------------------------------*/
 /* Global variable used to store variable value in read sequence */
 
+#if (EE_USE_WRITE_CURSOR == 1)
+/* Page the write cursor belongs to and address of its first free slot,
+   0xFFFFFFFF when the cursor has to be searched again */
+static uint32_t ulValidpage = EE_NO_VALID_PAGE;
+static uint32_t ulAddress = 0xFFFFFFFF;
+#endif
+
+#if (EE_USE_PAGE_CACHE == 1)
+/* Pages EE_FindPage returns for a read and for a write, as found from the
+   headers after the last header change */
+static uint32_t ulReadPage = EE_PAGE_CACHE_EMPTY;
+static uint32_t ulWritePage = EE_PAGE_CACHE_EMPTY;
+#endif
+
+#if (EE_USE_PRESENCE_BITMAP == 1)
+/* Bit n is set when variable n may have a record in the valid page or a
+   queued write, page the bitmap was built from, EE_NO_VALID_PAGE when it has
+   to be built again */
+static uint32_t aulPresent[(NB_OF_VAR + 31) / 32];
+static uint32_t ulPresentPage = EE_NO_VALID_PAGE;
+#endif
+
+#if (EE_USE_BLOB == 1)
+/* Generation of the pointers given by EE_GetBlob */
+static uint32_t ulBlobGeneration = 0;
+#endif
+
+#if (EE_USE_TRANSACTION == 1)
+/* Set while the write page ends with a transaction never committed */
+static uint8_t ucTxnTorn = 0;
+#endif
+
+#if (EE_USE_IT == 1)
+/* Writes queued by EE_WriteVariableIT, the first one is the one programmed */
+static EE_VIRTUALADDRESS_TYPE ausItVirtAddress[EE_IT_QUEUE_SIZE];
+static EE_DATA_STORED_TYPE aulItData[EE_IT_QUEUE_SIZE];
+static volatile uint16_t usItFirst = 0;
+static volatile uint16_t usItCount = 0;
+static volatile uint8_t ucItState = EE_IT_IDLE;
+static volatile uint8_t ucItResult = EE_IT_PENDING;
+/* Set when the queue unlocked the Flash, EE_ProcessIT locks it back once empty */
+static uint8_t ucItUnlocked = 0;
+
+/* Time usEE_Read and usEE_Write kept the interrupts masked, in core clock
+   cycles: last call and longest call */
+static uint32_t ulIrqMaskedLast = 0;
+static uint32_t ulIrqMaskedMax = 0;
+#endif
+
+#if (EE_USE_STATS == 1)
+/* Counters and timings returned by EE_GetStats */
+static EE_StatsTypeDef xStats;
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/* Records programmed and pages erased since the measure of the write rate
+   started, and HAL tick it started at */
+static uint32_t ulWearRecords = 0;
+static uint32_t ulWearErases = 0;
+static uint32_t ulWearStart = 0;
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/* Writes kept by EE_WriteVariableCached, one entry per variable, and HAL tick
+   of the oldest one */
+static EE_VIRTUALADDRESS_TYPE ausCacheVirtAddress[EE_CACHE_SIZE];
+static EE_DATA_STORED_TYPE aulCacheData[EE_CACHE_SIZE];
+static volatile uint16_t usCacheCount = 0;
+static uint32_t ulCacheStart = 0;
+#endif
+
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 // extern EE_VIRTUALADDRESS_TYPE VirtAddVarTab[];
 
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 static EE_Status EE_Format(void);
+static EE_DATA_TYPE EE_RecoverPageStatus(EE_DATA_TYPE PageStatus, EE_DATA_TYPE OtherPageStatus);
 static uint32_t EE_FindPage(EE_Find_type Operation);
+static uint32_t EE_ReadPage(EE_Find_type Operation);
 static EE_Status EE_VerifyPageFullWriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
 static EE_Status EE_PageTransfer(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data, EE_Transfer_type type);
+static EE_Status EE_CopyValidRecords(uint32_t OldPageAddress, uint32_t NewPageAddress,
+                                     EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+#if (EE_USE_SORTED_PAGE == 1)
+static EE_Status EE_CopySortedRecords(uint32_t OldPageAddress, uint32_t OldEndAddress, uint32_t NewPageAddress,
+                                      uint32_t *Copied, EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+#endif
+static EE_Status EE_ProgramRecord(uint32_t Address, EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+static EE_Status EE_WriteRecords(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress,
+                                 const EE_DATA_STORED_TYPE *Data, uint16_t NbVar, uint8_t Atomic);
 static EE_Status EE_VerifyPageFullyErased(uint32_t Address, uint32_t PageSize);
 static EE_Status EE_PageErase(uint32_t Page, uint16_t BankNb);
 static uint32_t EE_GetPageNumber(uint32_t Address);
 static uint32_t EE_GetBankNumber(uint32_t Address);
+#if (EE_USE_ERASE_COUNT == 1)
+static uint8_t EE_ReadEraseCount(uint32_t PageAddress, uint32_t *Count);
+static uint32_t EE_GetEraseCount(uint32_t PageAddress);
+#endif
+static uint32_t EE_GetWriteCursor(uint32_t PageAddress);
+static uint32_t EE_FindWriteCursor(uint32_t PageAddress);
+#if (EE_USE_TRANSACTION == 1)
+static uint32_t EE_TxnCommittedEnd(uint32_t PageAddress);
+static EE_Status EE_TxnRecover(void);
+#endif
+#if (EE_USE_IT == 1)
+static void EE_ITStart(void);
+static void EE_ITUnlockFlash(void);
+static void EE_ITLockFlash(void);
+static uint8_t EE_ITFindQueued(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data);
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+static uint16_t EE_CacheFind(EE_VIRTUALADDRESS_TYPE VirtAddress);
+static void EE_CacheDrop(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress, uint16_t NbVar);
+#endif
+static EE_Status EE_ReadStored(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data);
+#if (EE_USE_PRESENCE_BITMAP == 1)
+static void EE_PresentBuild(uint32_t PageAddress);
+#endif
+#if (EE_USE_BLOB == 1)
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size);
+static EE_Status EE_BlobCopy(uint32_t Address, uint16_t Size);
+#endif
+#if (EE_USE_CRC == 1)
+static uint16_t EE_RecordCrc(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+static uint8_t EE_RecordValid(EE_DATA_TYPE AddressValue);
+#endif
+#if (EE_USE_BLOB == 1) || ((EE_USE_CRC == 1) && (EE_USE_HW_CRC == 0))
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+static uint8_t EE_IsUnchanged(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress,
+                              const EE_DATA_STORED_TYPE *Data, uint16_t VarIdx);
+#endif
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+static uint32_t EE_IrqMaskStart(void);
+static void EE_IrqMaskEnd(uint32_t Start);
+#endif
+#if (EE_USE_STATS == 1)
+static uint32_t EE_CycleCount(void);
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed);
+#endif
+
+/* Record engine shared by the ports */
+#include "ee_core.h"
+
 /**
   * @brief  Restore the pages to a known good state in case of page's status
   *   corruption after a power loss.
@@ -142,6 +392,9 @@ static uint32_t EE_GetBankNumber(uint32_t Address);
 EE_Status EE_Init(void)
 {
   EE_DATA_TYPE pagestatus0, pagestatus1, addressvalue;
+#if (EE_USE_TRANSACTION == 1)
+  uint32_t validpage;
+#endif
 
   /* check the variable definition */
   for (uint32_t varidx = 0; varidx < NB_OF_VAR; varidx++)
@@ -152,11 +405,36 @@ EE_Status EE_Init(void)
     }
   }
 
+#if (EE_USE_CRC == 1) && (EE_USE_HW_CRC == 1)
+  /* The CRC unit checks the records */
+  __HAL_RCC_CRC_CLK_ENABLE();
+#endif
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The cursor is searched again once the pages are repaired */
+  ulAddress = 0xFFFFFFFF;
+#endif
+  /* So are the valid pages and the variables they hold */
+  EE_PAGE_CACHE_RESET();
+  EE_PRESENT_RESET();
+  EE_BLOB_INVALIDATE();
+#if (EE_USE_ERASE_COUNT == 1)
+  EE_ResetWear();
+#endif
+
   /* Get Page0 status */
   pagestatus0 = (*(__IO EE_DATA_TYPE *)PAGE0_BASE_ADDRESS);
   /* Get Page1 status */
   pagestatus1 = (*(__IO EE_DATA_TYPE *)PAGE1_BASE_ADDRESS);
 
+  /* A header left damaged by a power loss is mapped back to a known state */
+  pagestatus0 = EE_RecoverPageStatus(pagestatus0, pagestatus1);
+  pagestatus1 = EE_RecoverPageStatus(pagestatus1, pagestatus0);
+
   /* Check for invalid header states and repair if necessary */
   switch (pagestatus0)
   {
@@ -186,6 +464,7 @@ EE_Status EE_Init(void)
 
       /* Mark Page1 as valid */
       /* If program operation was failed, a Flash error code is returned */
+      EE_PAGE_CACHE_RESET();
       if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, PAGE1_BASE_ADDRESS, EE_PAGESTAT_VALID) != HAL_OK)
       {
         return EE_WRITE_ERROR;
@@ -210,7 +489,7 @@ EE_Status EE_Init(void)
       /* Get the first udpated value from the reception page */
       addressvalue = (*(__IO EE_DATA_TYPE *)(PAGE0_BASE_ADDRESS + EE_DATA_SIZE));
       /* Restart the interrupted page transfer */
-      if (EE_PageTransfer((addressvalue & EE_MASK_VIRTUALADRESS) >> EE_DATA_SHIFT, (EE_DATA_STORED_TYPE)((addressvalue & EE_MASK_DATA) >> (EE_DATA_SHIFT + 16)), EE_TRANSFER_RECOVER) != EE_OK)
+      if (EE_PageTransfer(EE_RECORD_VIRTADDRESS(addressvalue), EE_RECORD_DATA(addressvalue), EE_TRANSFER_RECOVER) != EE_OK)
       {
         return EE_TRANSFER_ERROR;
       }
@@ -228,6 +507,7 @@ EE_Status EE_Init(void)
       }
       /* Mark Page0 as valid */
       /* If program operation was failed, a Flash error code is returned */
+      EE_PAGE_CACHE_RESET();
       if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, PAGE0_BASE_ADDRESS, EE_PAGESTAT_VALID) != HAL_OK)
       {
         return EE_WRITE_ERROR;
@@ -273,7 +553,7 @@ EE_Status EE_Init(void)
       /* Get the first udpated value from the reception page */
       addressvalue = (*(__IO EE_DATA_TYPE *)(PAGE1_BASE_ADDRESS + EE_DATA_SIZE));
       /* Restart the interrupted page transfer */
-      if (EE_PageTransfer((addressvalue & EE_MASK_VIRTUALADRESS) >> EE_DATA_SHIFT, (EE_DATA_STORED_TYPE)((addressvalue & EE_MASK_DATA) >> (EE_DATA_SHIFT + 16)), EE_TRANSFER_RECOVER) != EE_OK)
+      if (EE_PageTransfer(EE_RECORD_VIRTADDRESS(addressvalue), EE_RECORD_DATA(addressvalue), EE_TRANSFER_RECOVER) != EE_OK)
       {
         return EE_TRANSFER_ERROR;
       }
@@ -293,9 +573,68 @@ EE_Status EE_Init(void)
   break;
   }
 
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop the records of a transaction a power loss did not let commit */
+  validpage = EE_FindPage(FIND_READ_PAGE);
+  if ((validpage != EE_NO_VALID_PAGE) && (EE_TxnCommittedEnd(validpage) != EE_FindWriteCursor(validpage)))
+  {
+    ucTxnTorn = 1;
+  }
+  if (EE_TxnRecover() != EE_OK)
+  {
+    return EE_TRANSFER_ERROR;
+  }
+#endif
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  ulValidpage = EE_FindPage(FIND_WRITE_PAGE);
+  if (ulValidpage != EE_NO_VALID_PAGE)
+  {
+    ulAddress = EE_FindWriteCursor(ulValidpage);
+  }
+#endif
+
   return EE_OK;
 }
 
+/**
+  * @brief  Map a page header damaged by a power loss to the state the page
+  *   must be recovered from, using the header of the other page.
+  *   A header is only programmed as RECEIVE over an erased page, then as
+  *   VALID over RECEIVE, and the old page is erased while the new one is
+  *   still RECEIVE:
+  *   - other page valid: the header was cut while being marked RECEIVE, so
+  *     the page holds no data yet and is erased again.
+  *   - other page receive: the page was cut while being erased after the
+  *     copy, so it is erased again and the other page is marked VALID.
+  *   - other page erased and only RECEIVE bits cleared: the header was cut
+  *     while being marked VALID, so the page holds all the data and is
+  *     marked VALID again.
+  *   Any other combination is left as is and formats the EEPROM.
+  * @param  PageStatus: header read from the page
+  * @param  OtherPageStatus: header read from the other page
+  * @retval Page status to recover from
+  */
+static EE_DATA_TYPE EE_RecoverPageStatus(EE_DATA_TYPE PageStatus, EE_DATA_TYPE OtherPageStatus)
+{
+  if ((PageStatus == EE_PAGESTAT_ERASED) || (PageStatus == EE_PAGESTAT_RECEIVE) || (PageStatus == EE_PAGESTAT_VALID))
+  {
+    return PageStatus;
+  }
+
+  if ((OtherPageStatus == EE_PAGESTAT_VALID) || (OtherPageStatus == EE_PAGESTAT_RECEIVE))
+  {
+    return EE_PAGESTAT_ERASED;
+  }
+
+  if ((OtherPageStatus == EE_PAGESTAT_ERASED) && ((PageStatus & ~EE_PAGESTAT_RECEIVE) == 0))
+  {
+    return EE_PAGESTAT_RECEIVE;
+  }
+
+  return PageStatus;
+}
+
 /**
   * @brief  Verify if specified page is fully erased.
   * @param  Address: page address
@@ -311,6 +650,9 @@ EE_Status EE_VerifyPageFullyErased(uint32_t Address, uint32_t PageSize)
 {
   EE_Status readstatus = EE_PAGE_ERASED;
   uint32_t counter = 0;
+#if (EE_USE_ERASE_COUNT == 1)
+  uint32_t erasecount;
+#endif
 
   /* Check each active page address starting from end */
   while (counter < PageSize)
@@ -318,6 +660,14 @@ EE_Status EE_VerifyPageFullyErased(uint32_t Address, uint32_t PageSize)
     /* Compare the read address with the virtual address */
     if ((*(__IO EE_DATA_TYPE *)(Address + counter)) != EE_PAGESTAT_ERASED)
     {
+#if (EE_USE_ERASE_COUNT == 1)
+      /* The erase count programmed right after the erase is not data */
+      if ((counter == EE_DATA_SIZE) && (EE_ReadEraseCount(Address, &erasecount) != 0))
+      {
+        counter = counter + EE_DATA_SIZE;
+        continue;
+      }
+#endif
       /* In case variable value is read, reset readstatus flag */
       readstatus = EE_PAGE_NOTERASED;
       break;
@@ -342,319 +692,2318 @@ EE_Status EE_VerifyPageFullyErased(uint32_t Address, uint32_t PageSize)
   */
 EE_Status EE_ReadVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data)
 {
-  EE_DATA_TYPE addressvalue;
-  uint32_t counter = PAGE_SIZE - EE_DATA_SIZE;
-
-  /* Get active Page for read operation */
-  uint32_t validpageadresse = EE_FindPage(FIND_READ_PAGE);
-
-  /* Check if there is no valid page */
-  if (validpageadresse == EE_NO_VALID_PAGE)
+#if (EE_USE_WRITE_CACHE == 1)
+  uint16_t slot = 0;
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write is newer than the queued writes and the Flash */
+  slot = EE_CacheFind(VirtAddress);
+  if (slot < usCacheCount)
   {
-    return EE_ERROR_NOVALID_PAGE;
+    *Data = aulCacheData[slot];
+    return EE_OK;
   }
+#endif
 
-  /* Check each active page address starting from end */
-  while (counter >= EE_DATA_SIZE)
+#if (EE_USE_IT == 1)
+  /* A queued write is newer than the Flash */
+  if (EE_ITFindQueued(VirtAddress, Data) != 0)
   {
-    /* Get the current location content to be compared with virtual address */
-    addressvalue = (*(__IO EE_DATA_TYPE *)(validpageadresse + counter));
-    if (addressvalue != EE_PAGESTAT_ERASED)
-    {
-      /* Compare the read address with the virtual address */
-      if ((addressvalue & EE_MASK_VIRTUALADRESS) == ((EE_DATA_TYPE)VirtAddress << EE_DATA_SHIFT))
-      {
-        /* Get content of Address-2 which is variable value */
-        *Data = (EE_DATA_STORED_TYPE)((addressvalue & EE_MASK_DATA) >> (EE_DATA_SHIFT + 16));
-        /* In case variable value is read, reset readstatus flag */
-        return EE_OK;
-      }
-    }
-    /* Next address location */
-    counter -= EE_DATA_SIZE;
+    return EE_OK;
   }
+#endif
 
-  /* Return readstatus value: (EE_OK: variable exist, EE_ERROR: variable doesn't exist) */
-  return EE_NO_DATA;
+  return EE_ReadStored(VirtAddress, Data);
 }
 
 /**
-  * @brief  Writes/upadtes variable data in EEPROM.
+  * @brief  Returns the data of the last record of a variable in Flash, leaving
+  *   aside the cached and the queued writes
   * @param  VirtAddress: Variable virtual address
-  * @param  Data: 16 bit data to be written
+  * @param  Data: Global variable contains the read variable value
   * @retval Success or error status:
-  *           - EE_OK: on success
-  *           - EE error code: if an error occurs
+  *           - EE_OK: if variable was found
+  *           - EE_NO_DATA: if the variable was not found
+  *           - EE_ERROR_NOVALID_PAGE: if no valid page was found.
   */
-EE_Status EE_WriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+static EE_Status EE_ReadStored(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data)
 {
-  EE_Status status;
+  EE_DATA_TYPE addressvalue;
+  uint32_t endaddress;
+  uint32_t validpageadresse;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
 
-  /* Write the variable virtual address and value in the EEPROM */
-  status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-  if (status == EE_PAGE_FULL)
+  /* Get active Page for read operation */
+  validpageadresse = EE_FindPage(FIND_READ_PAGE);
+
+  /* Check if there is no valid page */
+  if (validpageadresse == EE_NO_VALID_PAGE)
   {
-    /* In case the EEPROM active page is full */
-    /* Perform Page transfer */
-    return EE_PageTransfer(VirtAddress, Data, EE_TRANSFER_NORMAL);
+    return EE_ERROR_NOVALID_PAGE;
   }
 
-  /* Return last operation status */
-  return status;
-}
-
-/**
-  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
-  * @param  None
-  * @retval Success or error status:
-  *           - EE_OK: on success
-  *           - EE error code: if an error occurs
-  */
-static EE_Status EE_Format(void)
-{
-  /* Erase Page0 */
-  if (EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS, PAGE_SIZE) == EE_PAGE_NOTERASED)
+  endaddress = validpageadresse + PAGE_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction not committed yet are not visible */
+  endaddress = EE_TxnCommittedEnd(validpageadresse);
+#elif (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((ulValidpage == validpageadresse) && (ulAddress != 0xFFFFFFFF))
   {
-    if (EE_PageErase(PAGE0_NUMBER, PAGE0_BANKNUMBER) != EE_OK)
-    {
-      return EE_ERASE_ERROR;
-    }
+    endaddress = ulAddress;
   }
+#endif
 
-  /* If program operation was failed, a Flash error code is returned */
-  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, PAGE0_BASE_ADDRESS, EE_PAGESTAT_VALID) != HAL_OK)
+#if (EE_USE_PRESENCE_BITMAP == 1)
+  if (ulPresentPage != validpageadresse)
   {
-    return EE_WRITE_ERROR;
+    EE_PresentBuild(validpageadresse);
   }
+  /* A variable that was never written is not looked for in the page */
+  if ((VirtAddress < NB_OF_VAR) && ((aulPresent[VirtAddress >> 5] & ((uint32_t)1 << (VirtAddress & 0x1F))) == 0))
+  {
+    EE_STATS_TIME(Read, statsstart);
+    return EE_NO_DATA;
+  }
+#endif
 
-  /* Erase Page1 */
-  if (EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS, PAGE_SIZE) == EE_PAGE_NOTERASED)
+  if (EE_CoreFindRecord(validpageadresse, endaddress, VirtAddress, &addressvalue) != 0)
   {
-    if (EE_PageErase(PAGE1_NUMBER, PAGE1_BANKNUMBER) != EE_OK)
-    {
-      return EE_ERASE_ERROR;
-    }
+    /* Get content of Address-2 which is variable value */
+    *Data = EE_RECORD_DATA(addressvalue);
+    EE_STATS_TIME(Read, statsstart);
+    /* In case variable value is read, reset readstatus flag */
+    return EE_OK;
   }
+  EE_STATS_TIME(Read, statsstart);
 
-  return EE_OK;
+  /* Return readstatus value: (EE_OK: variable exist, EE_ERROR: variable doesn't exist) */
+  return EE_NO_DATA;
 }
 
+#if (EE_USE_PRESENCE_BITMAP == 1)
 /**
-  * @brief  Find Page 
-  * @param  type: type of page to requested.
-  *   This parameter can be one of the following values:
-  *     @arg FIND_READ_PAGE: return the read page address
-  *     @arg FIND_WRITE_PAGE: return the write page address
-  *     @arg FIND_ERASE_PAGE: return the erase page address
-  * @retval :
-  *           - Page @: on success
-  *           - EE_NO_VALID_PAGE : if an error occurs
+  * @brief  Rebuilds the bitmap of the variables written from the records of a
+  *   page and from the queued writes.
+  * @param  PageAddress: page address
+  * @retval None
   */
-static uint32_t EE_FindPage(EE_Find_type Operation)
+static void EE_PresentBuild(uint32_t PageAddress)
 {
-  EE_DATA_TYPE pagestatus0, pagestatus1;
-
-  /* Get Page0 actual status */
-  pagestatus0 = (*(__IO EE_DATA_TYPE *)PAGE0_BASE_ADDRESS);
-
-  /* Get Page1 actual status */
-  pagestatus1 = (*(__IO EE_DATA_TYPE *)PAGE1_BASE_ADDRESS);
+  uint32_t address;
+  uint32_t endaddress;
+  uint16_t idx;
 
-  /* Write or read operation */
-  if (Operation == FIND_WRITE_PAGE)
+  for (idx = 0; idx < (NB_OF_VAR + 31) / 32; idx++)
   {
-    /* ---- Write operation ---- */
-    if (pagestatus1 == EE_PAGESTAT_VALID)
-    {
-      /* Page0 receiving data */
-      if (pagestatus0 == EE_PAGESTAT_RECEIVE)
-      {
-        return PAGE0_BASE_ADDRESS; /* Page0 valid */
-      }
-      else
-      {
-        return PAGE1_BASE_ADDRESS; /* Page1 valid */
-      }
-    }
-    else if (pagestatus0 == EE_PAGESTAT_VALID)
-    {
-      /* Page1 receiving data */
-      if (pagestatus1 == EE_PAGESTAT_RECEIVE)
-      {
-        return PAGE1_BASE_ADDRESS; /* Page1 valid */
-      }
-      else
-      {
-        return PAGE0_BASE_ADDRESS; /* Page0 valid */
-      }
-    }
-    else
-    {
-      return EE_NO_VALID_PAGE; /* No valid Page */
-    }
+    aulPresent[idx] = 0;
   }
-  else if (Operation == FIND_READ_PAGE)
+
+#if (EE_USE_IT == 1)
+  /* Queued writes are taken first: the ones the interrupt programs meanwhile
+     are below the end taken next */
+  EE_IT_LOCK();
+  for (idx = 0; idx < usItCount; idx++)
   {
-    /* ---- Read operation ---- */
-    if (pagestatus0 == EE_PAGESTAT_VALID)
-    {
-      return PAGE0_BASE_ADDRESS; /* Page0 valid */
-    }
-    else if (pagestatus1 == EE_PAGESTAT_VALID)
-    {
-      return PAGE1_BASE_ADDRESS; /* Page1 valid */
-    }
-    else
-    {
-      return EE_NO_VALID_PAGE; /* No valid Page */
-    }
+    EE_PRESENT_SET(ausItVirtAddress[(usItFirst + idx) % EE_IT_QUEUE_SIZE]);
   }
-  else if (Operation == FIND_ERASE_PAGE)
+  EE_IT_UNLOCK();
+#endif
+
+  /* Records of a transaction not committed yet are taken too, and so are the
+     damaged ones: the bitmap may only tell too much */
+  endaddress = PageAddress + PAGE_SIZE;
+#if (EE_USE_WRITE_CURSOR == 1)
+  if ((ulValidpage == PageAddress) && (ulAddress != 0xFFFFFFFF))
   {
-    /* ---- Return the erased page */
-    if (pagestatus0 == EE_PAGESTAT_ERASED)
-    {
-      return PAGE0_BASE_ADDRESS;
-    }
-    if (pagestatus1 == EE_PAGESTAT_ERASED)
-    {
-      return PAGE1_BASE_ADDRESS;
-    }
+    endaddress = ulAddress;
   }
-  else
+#endif
+  for (address = PageAddress + EE_DATA_SIZE; address < endaddress; address += EE_DATA_SIZE)
   {
-    return EE_NO_VALID_PAGE;
+    EE_PRESENT_SET(EE_RECORD_VIRTADDRESS(*(__IO EE_DATA_TYPE *)address));
+    EE_STATS_COUNT(WordsScanned, 1);
   }
-
-  return EE_NO_VALID_PAGE;
+  ulPresentPage = PageAddress;
 }
+#endif
 
+#if (EE_USE_SKIP_UNCHANGED == 1)
 /**
-  * @brief  Verify if active page is full and Writes variable in EEPROM.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
-  * @retval Success or error status:
-  *           - EE_OK: on success
-  *           - EE_FULL: if the page is full
-  *           - EE error code: if an error occurs
+  * @brief  Tells whether a record of a set leaves its variable as it is: the
+  *   variable holds the data in Flash and no earlier record of the set writes it.
+  * @param  VirtAddress: virtual addresses of the set, NULL for consecutive ones
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: data of the set
+  * @param  VarIdx: index of the record in the set
+  * @retval 1 if the record does not need to be programmed, 0 otherwise
   */
-static EE_Status EE_VerifyPageFullWriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+static uint8_t EE_IsUnchanged(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress,
+                              const EE_DATA_STORED_TYPE *Data, uint16_t VarIdx)
 {
-  uint32_t count = EE_DATA_SIZE; /* start the check after the header */
+  EE_VIRTUALADDRESS_TYPE virtaddress = (VirtAddress != NULL) ? VirtAddress[VarIdx] : (EE_VIRTUALADDRESS_TYPE)(FirstVirtAddress + VarIdx);
+  EE_DATA_STORED_TYPE storeddata = 0;
+  uint16_t idx = 0;
 
-  /* Get valid Page for write operation */
-  uint32_t validpage = EE_FindPage(FIND_WRITE_PAGE);
-  /* Check if there is no valid page */
-  if (validpage == EE_NO_VALID_PAGE)
+  if ((EE_ReadStored(virtaddress, &storeddata) != EE_OK) || (storeddata != Data[VarIdx]))
   {
-    return EE_ERROR_NOVALID_PAGE;
+    return 0;
   }
-
-  /* Check each active page address starting from begining */
-  while (count < PAGE_SIZE)
+  if (VirtAddress != NULL)
   {
-    /* Verify if address contents is erased */
-    if ((*(__IO EE_DATA_TYPE *)(validpage + count)) == EE_MASK_FULL)
+    for (idx = 0; idx < VarIdx; idx++)
     {
-      /* Set variable data + virtual adress */
-      /* If program operation was failed, a Flash error code is returned */
-      if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, validpage + count,
-                            ((((EE_DATA_TYPE)Data) << 16) | VirtAddress) << EE_DATA_SHIFT) != HAL_OK)
+      if (VirtAddress[idx] == virtaddress)
       {
-        return EE_WRITE_ERROR;
+        return 0;
       }
-      return EE_OK;
-    }
-    else
-    {
-      /* Next address location */
-      count += EE_DATA_SIZE;
     }
   }
-  /* Return PAGE_FULL in case the valid page is full */
-  return EE_PAGE_FULL;
+  return 1;
 }
+#endif
 
 /**
-  * @brief  Transfers last updated variables data from the full Page to
-  *   an empty one.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @brief  Reads the last stored data of all the variables in one pass over
+  *   the valid page, from its oldest record to its newest one.
+  * @param  Image: RAM image of NB_OF_VAR variables, the entries of variables
+  *   that have no record are left unchanged
+  * @param  PresentBitmap: (NB_OF_VAR + 7) / 8 bytes, bit n set when variable n
+  *   was found, or NULL
   * @retval Success or error status:
   *           - EE_OK: on success
-  *           - EE error code: if an error occurs
+  *           - EE_ERROR_NOVALID_PAGE: if no valid page was found.
   */
-static EE_Status EE_PageTransfer(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data, EE_Transfer_type type)
+EE_Status EE_ReadAll(EE_DATA_STORED_TYPE *Image, uint8_t *PresentBitmap)
 {
-  uint32_t activepageaddress, newpageaddress;
-  uint32_t varidx = 0;
-  EE_DATA_STORED_TYPE DataValue;
+  uint32_t endaddress;
+#if (EE_USE_IT == 1) || (EE_USE_WRITE_CACHE == 1)
+  uint32_t counter;
+#endif
+  uint32_t varidx;
 
   /* Get active Page for read operation */
-  activepageaddress = EE_FindPage(FIND_READ_PAGE);
-  if (activepageaddress == EE_NO_VALID_PAGE)
-  {
-    return EE_ERROR_NOVALID_PAGE;
-  }
+  uint32_t validpageadresse = EE_FindPage(FIND_READ_PAGE);
 
-  /* Get active Page for read operation */
-  newpageaddress = EE_FindPage((type == EE_TRANSFER_NORMAL ? FIND_ERASE_PAGE : FIND_WRITE_PAGE));
-  if (newpageaddress == EE_NO_VALID_PAGE)
+  /* Check if there is no valid page */
+  if (validpageadresse == EE_NO_VALID_PAGE)
   {
     return EE_ERROR_NOVALID_PAGE;
   }
 
-  /* Mark the ativepage at receive state */
-  /* If program operation was failed, a Flash error code is returned */
-  if (type == EE_TRANSFER_NORMAL)
+  if (PresentBitmap != NULL)
   {
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, newpageaddress, EE_PAGESTAT_RECEIVE) != HAL_OK)
+    for (varidx = 0; varidx < (NB_OF_VAR + 7) / 8; varidx++)
     {
-      return EE_WRITE_ERROR;
+      PresentBitmap[varidx] = 0;
     }
   }
 
-  /* Write the variable passed as parameter in the new active page */
-  /* If program operation was failed, a Flash error code is returned */
-  if (EE_VerifyPageFullWriteVariable(VirtAddress, Data) != EE_OK)
+  endaddress = validpageadresse + PAGE_SIZE;
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction not committed yet are not visible */
+  endaddress = EE_TxnCommittedEnd(validpageadresse);
+#endif
+
+  /* Newer records overwrite older ones in the image */
+  EE_CoreReadRecords(validpageadresse, endaddress, Image, PresentBitmap);
+
+#if (EE_USE_IT == 1)
+  /* Queued writes are newer than the Flash */
+  EE_IT_LOCK();
+  for (counter = 0; counter < usItCount; counter++)
   {
-    return EE_WRITE_ERROR;
+    varidx = ausItVirtAddress[(usItFirst + counter) % EE_IT_QUEUE_SIZE];
+    if (varidx < NB_OF_VAR)
+    {
+      Image[varidx] = aulItData[(usItFirst + counter) % EE_IT_QUEUE_SIZE];
+      if (PresentBitmap != NULL)
+      {
+        PresentBitmap[varidx >> 3] |= (uint8_t)(1 << (varidx & 0x07));
+      }
+    }
   }
+  EE_IT_UNLOCK();
+#endif
 
-  /* Transfer process: transfer variables from old to the new active page */
-  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes are newer than the queued writes and the Flash */
+  for (counter = 0; counter < usCacheCount; counter++)
   {
-    if (varidx != VirtAddress) /* Check each variable except the one passed as parameter */
+    varidx = ausCacheVirtAddress[counter];
+    if (varidx < NB_OF_VAR)
     {
-      /* Read the other last variable updates */
-      if (EE_ReadVariable(varidx, &DataValue) == EE_OK)
+      Image[varidx] = aulCacheData[counter];
+      if (PresentBitmap != NULL)
       {
-        /* In case variable corresponding to the virtual address was found */
-        /* Transfer the variable to the new active page */
-        /* If program operation was failed, a Flash error code is returned */
-        if (EE_VerifyPageFullWriteVariable(varidx, DataValue) != EE_OK)
-        {
-          return EE_WRITE_ERROR;
-        }
+        PresentBitmap[varidx >> 3] |= (uint8_t)(1 << (varidx & 0x07));
       }
     }
   }
+#endif
 
-  /* Erase the current VALID_PAGE */
+  return EE_OK;
+}
+
+/**
+  * @brief  Writes/upadtes variable data in EEPROM.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: 16 bit data to be written
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_WriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  EE_Status status;
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Nothing to program if the variable already holds the data */
+  if (EE_IsUnchanged(&VirtAddress, 0, &Data, 0) != 0)
+  {
+    EE_STATS_COUNT(Skipped, 1);
+    return EE_OK;
+  }
+#endif
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  status = EE_TxnRecover();
+  if (status != EE_OK)
+  {
+    return status;
+  }
+#endif
+
+  /* Write the variable virtual address and value in the EEPROM */
+  status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+  if (status == EE_PAGE_FULL)
+  {
+    /* In case the EEPROM active page is full */
+    /* Perform Page transfer */
+    return EE_PageTransfer(VirtAddress, Data, EE_TRANSFER_NORMAL);
+  }
+
+  /* Return last operation status */
+  return status;
+}
+
+/**
+  * @brief  Writes/updates a set of variables in EEPROM with a single free space
+  *   check. As for EE_WriteVariable, the Flash has to be unlocked by the caller.
+  * @param  VirtAddress: virtual addresses of the variables
+  * @param  Data: data of the variables
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_PAGE_FULL: if the variables do not fit even after a transfer
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_WriteBatch(const EE_VIRTUALADDRESS_TYPE *VirtAddress, const EE_DATA_STORED_TYPE *Data, uint16_t NbVar)
+{
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(VirtAddress, 0, NbVar);
+#endif
+  return EE_WriteRecords(VirtAddress, 0, Data, NbVar, 0);
+}
+
+#if (EE_USE_TRANSACTION == 1)
+/**
+  * @brief  Writes/updates a set of variables in EEPROM all at once: the records
+  *   are framed by a begin and a commit marker and are only read back once the
+  *   commit marker is in Flash.
+  * @param  VirtAddress: virtual addresses of the variables
+  * @param  Data: data of the variables
+  * @param  NbVar: number of variables, up to EE_TXN_MAX_RECORDS
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_PAGE_FULL: if the variables do not fit even after a transfer
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_WriteTransaction(const EE_VIRTUALADDRESS_TYPE *VirtAddress, const EE_DATA_STORED_TYPE *Data, uint16_t NbVar)
+{
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(VirtAddress, 0, NbVar);
+#endif
+  return EE_WriteRecords(VirtAddress, 0, Data, NbVar, 1);
+}
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/**
+  * @brief  Writes/updates a variable through the write cache. Only the RAM
+  *   cache is updated, a later write of the variable replaces this one, and
+  *   the cache is written to Flash by EE_Flush or EE_ProcessCache, or here
+  *   when it is full and the variable is not cached yet. A cached write is
+  *   lost if the power fails before: call EE_Flush on a supply drop. To be
+  *   called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: data to be written
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if the full cache could not be written
+  */
+EE_Status EE_WriteVariableCached(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  EE_Status status = EE_OK;
+  uint32_t primask = 0;
+  uint16_t slot = 0;
+
+  /* A variable not cached yet needs a free entry */
+  if ((usCacheCount >= EE_CACHE_SIZE) && (EE_CacheFind(VirtAddress) >= usCacheCount))
+  {
+    status = EE_Flush();
+    if (status != EE_OK)
+    {
+      return status;
+    }
+  }
+
+  EE_CACHE_LOCK(primask);
+  slot = EE_CacheFind(VirtAddress);
+  if (slot >= usCacheCount)
+  {
+    if (usCacheCount == 0)
+    {
+      ulCacheStart = HAL_GetTick();
+    }
+    ausCacheVirtAddress[slot] = VirtAddress;
+    usCacheCount++;
+  }
+  aulCacheData[slot] = Data;
+  EE_CACHE_UNLOCK(primask);
+
+  return EE_OK;
+}
+
+/**
+  * @brief  Writes the cached writes to Flash with a single free space check.
+  *   The Flash is unlocked for the writes and left as it was. Also meant for
+  *   the PVD interrupt (HAL_PWR_PVDCallback) to save the cache on a supply
+  *   drop, as long as that interrupt cannot preempt another EE function.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success or if the cache is empty
+  *           - EE error code: if an error occurs, the writes stay cached
+  */
+EE_Status EE_Flush(void)
+{
+  EE_Status status = EE_OK;
+  uint32_t locked = 0;
+
+  if (usCacheCount == 0)
+  {
+    return EE_OK;
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+
+  /* The Flash is unlocked for the writes and left as it was */
+  locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+  if (locked != 0U)
+  {
+    HAL_FLASH_Unlock();
+  }
+  status = EE_WriteRecords(ausCacheVirtAddress, 0, aulCacheData, usCacheCount, 0);
+  if (locked != 0U)
+  {
+    HAL_FLASH_Lock();
+  }
+  if (status == EE_OK)
+  {
+    usCacheCount = 0;
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Writes the cached writes to Flash once the oldest one is
+  *   EE_CACHE_FLUSH_PERIOD old. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success or if no write is due
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_ProcessCache(void)
+{
+  if ((usCacheCount == 0) || ((HAL_GetTick() - ulCacheStart) < EE_CACHE_FLUSH_PERIOD))
+  {
+    return EE_OK;
+  }
+
+  return EE_Flush();
+}
+#endif
+
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Writes/updates a blob. Its bytes go in consecutive records, followed
+  *   by a record holding their CRC and by the header record of the blob, all
+  *   in the write page: a transfer is done first if they do not fit. As for
+  *   EE_WriteVariable, the Flash has to be unlocked by the caller.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: bytes of the blob
+  * @param  Size: number of bytes, up to EE_BLOB_MAX_SIZE
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_INVALID_VIRTUALADRESS: if Blob or Size is out of range
+  *           - EE_PAGE_FULL: if the blob does not fit even after a transfer
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_WriteBlob(uint16_t Blob, const uint8_t *Data, uint16_t Size)
+{
+  EE_Status status = EE_OK;
+  EE_DATA_STORED_TYPE data = 0;
+  uint32_t validpage, address;
+  uint16_t idx = 0, crc = 0xFFFF;
+
+  if ((Blob >= NB_OF_BLOB) || (Size > EE_BLOB_MAX_SIZE))
+  {
+    return EE_INVALID_VIRTUALADRESS;
+  }
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  status = EE_TxnRecover();
+  if (status != EE_OK)
+  {
+    return status;
+  }
+#endif
+
+  /* Get valid Page for write operation */
+  validpage = EE_FindPage(FIND_WRITE_PAGE);
+  if (validpage == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+  address = EE_GetWriteCursor(validpage);
+
+  /* Compact the data once if the blob does not fit in the page */
+  if (((validpage + PAGE_SIZE - address) / EE_DATA_SIZE) < EE_BLOB_NB_SLOTS(Size))
+  {
+    status = EE_PageTransfer(EE_NO_VIRTADDRESS, 0, EE_TRANSFER_NORMAL);
+    if (status != EE_OK)
+    {
+      return status;
+    }
+    validpage = EE_FindPage(FIND_WRITE_PAGE);
+    if (validpage == EE_NO_VALID_PAGE)
+    {
+      return EE_ERROR_NOVALID_PAGE;
+    }
+    address = EE_GetWriteCursor(validpage);
+    if (((validpage + PAGE_SIZE - address) / EE_DATA_SIZE) < EE_BLOB_NB_SLOTS(Size))
+    {
+      return EE_PAGE_FULL;
+    }
+  }
+
+  /* The copy read in place so far is no longer the last one */
+  EE_BLOB_INVALIDATE();
+
+  /* The CRC covers the blob number and size, then the bytes */
+  crc = EE_Crc16(crc, (uint8_t)Blob);
+  crc = EE_Crc16(crc, (uint8_t)Size);
+  crc = EE_Crc16(crc, (uint8_t)(Size >> 8));
+  for (idx = 0; (idx < Size) && (status == EE_OK); idx++)
+  {
+    crc = EE_Crc16(crc, Data[idx]);
+    data |= (EE_DATA_STORED_TYPE)Data[idx] << (8 * (idx % EE_BLOB_BYTES_PER_RECORD));
+    if (((idx % EE_BLOB_BYTES_PER_RECORD) == (EE_BLOB_BYTES_PER_RECORD - 1)) || (idx == (Size - 1)))
+    {
+      status = EE_ProgramRecord(address, EE_BLOB_DATA_VIRTADDRESS, data);
+      address += EE_DATA_SIZE;
+      data = 0;
+    }
+  }
+
+  /* The header record goes last: the blob exists once it is in Flash */
+  if (status == EE_OK)
+  {
+    status = EE_ProgramRecord(address, EE_BLOB_CRC_VIRTADDRESS, crc);
+    address += EE_DATA_SIZE;
+  }
+  if (status == EE_OK)
+  {
+    status = EE_ProgramRecord(address, (EE_VIRTUALADDRESS_TYPE)(EE_BLOB_VIRTADDRESS + Blob), Size);
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Reads the last complete copy of a blob: the page is walked back to
+  *   the header record of the blob, then its bytes are checked against their
+  *   CRC and copied in one pass over its records.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: buffer receiving the bytes
+  * @param  MaxSize: size of the buffer, the bytes of a longer blob past it are
+  *   not copied
+  * @param  Size: receives the size of the blob
+  * @retval Success or error status:
+  *           - EE_OK: if the blob was found
+  *           - EE_NO_DATA: if the blob has no complete copy
+  *           - EE_INVALID_VIRTUALADRESS: if Blob is out of range
+  *           - EE_ERROR_NOVALID_PAGE: if no valid page was found.
+  */
+EE_Status EE_ReadBlob(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  EE_DATA_TYPE addressvalue;
+  uint32_t counter = PAGE_SIZE - EE_DATA_SIZE;
+  uint32_t validpageadresse;
+
+  if (Blob >= NB_OF_BLOB)
+  {
+    return EE_INVALID_VIRTUALADRESS;
+  }
+
+  /* Get active Page for read operation */
+  validpageadresse = EE_FindPage(FIND_READ_PAGE);
+  if (validpageadresse == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction not committed yet are not visible */
+  counter = EE_TxnCommittedEnd(validpageadresse) - validpageadresse - EE_DATA_SIZE;
+#elif (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((ulValidpage == validpageadresse) && (ulAddress != 0xFFFFFFFF))
+  {
+    counter = ulAddress - validpageadresse - EE_DATA_SIZE;
+  }
+#endif
+
+  /* Check each active page address starting from end */
+  while (counter >= EE_DATA_SIZE)
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)(validpageadresse + counter));
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* A copy cut by a power loss is followed by an older one */
+    if (((addressvalue & EE_MASK_VIRTUALADRESS) == EE_RECORD_VALUE(EE_BLOB_VIRTADDRESS + Blob, 0))
+        && (EE_BlobCheck(validpageadresse, validpageadresse + counter, Data, MaxSize, Size) != 0))
+    {
+      return EE_OK;
+    }
+    counter -= EE_DATA_SIZE;
+  }
+
+  return EE_NO_DATA;
+}
+
+/**
+  * @brief  Gives the last complete copy of a blob in place, without copying
+  *   it: the bytes are checked against their CRC once, then byte n is read
+  *   from Flash as EE_BLOB_BYTE(*Data, n). The pointer stays valid as long as
+  *   EE_GetGeneration returns the generation given with it.
+  * @param  Blob: blob number, lower than NB_OF_BLOB
+  * @param  Data: receives the address of the data of the first record of the
+  *   blob
+  * @param  Size: receives the size of the blob
+  * @param  Generation: receives the generation of the pointer
+  * @retval Success or error status:
+  *           - EE_OK: if the blob was found
+  *           - EE_NO_DATA: if the blob has no complete copy
+  *           - EE_INVALID_VIRTUALADRESS: if Blob is out of range
+  *           - EE_ERROR_NOVALID_PAGE: if no valid page was found.
+  */
+EE_Status EE_GetBlob(uint16_t Blob, const uint8_t **Data, uint16_t *Size, uint32_t *Generation)
+{
+  EE_DATA_TYPE addressvalue;
+  uint32_t counter = PAGE_SIZE - EE_DATA_SIZE;
+  uint32_t validpageadresse;
+
+  if (Blob >= NB_OF_BLOB)
+  {
+    return EE_INVALID_VIRTUALADRESS;
+  }
+
+  /* Get active Page for read operation */
+  validpageadresse = EE_FindPage(FIND_READ_PAGE);
+  if (validpageadresse == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction not committed yet are not visible */
+  counter = EE_TxnCommittedEnd(validpageadresse) - validpageadresse - EE_DATA_SIZE;
+#elif (EE_USE_WRITE_CURSOR == 1)
+  /* Nothing is written past the cursor of the page */
+  if ((ulValidpage == validpageadresse) && (ulAddress != 0xFFFFFFFF))
+  {
+    counter = ulAddress - validpageadresse - EE_DATA_SIZE;
+  }
+#endif
+
+  /* Check each active page address starting from end */
+  while (counter >= EE_DATA_SIZE)
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)(validpageadresse + counter));
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* A copy cut by a power loss is followed by an older one */
+    if (((addressvalue & EE_MASK_VIRTUALADRESS) == EE_RECORD_VALUE(EE_BLOB_VIRTADDRESS + Blob, 0))
+        && (EE_BlobCheck(validpageadresse, validpageadresse + counter, NULL, 0, Size) != 0))
+    {
+      /* The data records come first, the CRC and header records close them,
+         the bytes are in the data word of each record */
+      *Data = (const uint8_t *)(validpageadresse + counter - ((uint32_t)(EE_BLOB_NB_SLOTS(*Size) - 1) * EE_DATA_SIZE)
+                                + ((EE_DATA_SHIFT + 16) / 8));
+      *Generation = ulBlobGeneration;
+      return EE_OK;
+    }
+    counter -= EE_DATA_SIZE;
+  }
+
+  return EE_NO_DATA;
+}
+
+/**
+  * @brief  Gets the generation of the pointers given by EE_GetBlob: it changes
+  *   when a blob is written, the blobs are transferred to another page, a
+  *   page is erased or EE_Init is called.
+  * @param  None
+  * @retval Generation
+  */
+uint32_t EE_GetGeneration(void)
+{
+  return ulBlobGeneration;
+}
+#endif
+
+#if (EE_USE_CRC == 1)
+/**
+  * @brief  Checks the CRC of the variable records of the active page and, if
+  *   one of them is damaged, drops it with a page transfer, which copies the
+  *   last sound record of each variable. To be called from the main loop or a
+  *   low priority task; as for EE_WriteVariable, the Flash has to be unlocked
+  *   by the caller.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: if no record is damaged or on success of the transfer
+  *           - EE_ERROR_NOVALID_PAGE: if no valid page was found
+  *           - EE error code: if an error occurs
+  */
+EE_Status EE_Scrub(void)
+{
+  EE_DATA_TYPE addressvalue;
+  uint32_t counter = EE_DATA_SIZE, endcounter = PAGE_SIZE;
+  uint32_t validpageadresse;
+  uint8_t damaged = 0;
+
+#if (EE_USE_IT == 1)
+  /* Queued writes go to Flash first */
+  (void)EE_FlushIT();
+#endif
+
+  /* Get active Page for read operation */
+  validpageadresse = EE_FindPage(FIND_READ_PAGE);
+  if (validpageadresse == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction never committed are dropped by the transfer */
+  endcounter = EE_TxnCommittedEnd(validpageadresse) - validpageadresse;
+#endif
+
+  while ((counter < endcounter) && (damaged == 0))
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)(validpageadresse + counter));
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* Page is written in order: the first erased slot ends the records */
+    if (addressvalue == EE_PAGESTAT_ERASED)
+    {
+      break;
+    }
+    damaged = (EE_RecordValid(addressvalue) == 0);
+    counter += EE_DATA_SIZE;
+  }
+
+  if (damaged == 0)
+  {
+    return EE_OK;
+  }
+  return EE_PageTransfer(EE_NO_VIRTADDRESS, 0, EE_TRANSFER_NORMAL);
+}
+#endif
+
+#if (EE_USE_IT == 1)
+/**
+  * @brief  Queues a write of a variable. The record is programmed under the
+  *   Flash interrupt, only the Flash interrupt is masked meanwhile, and
+  *   EE_WriteCpltCallback is called once it is in Flash. A write that needs a
+  *   page transfer is left to EE_ProcessIT. To be called from thread mode.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: data to be written
+  * @retval Success or error status:
+  *           - EE_OK: if the write was queued
+  *           - EE_BUSY: if the queue is full
+  */
+EE_Status EE_WriteVariableIT(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  uint16_t slot;
+
+#if (EE_USE_WRITE_CACHE == 1)
+  /* A cached write of the variable is older */
+  EE_CacheDrop(&VirtAddress, 0, 1);
+#endif
+
+  EE_IT_LOCK();
+  if (usItCount >= EE_IT_QUEUE_SIZE)
+  {
+    EE_IT_UNLOCK();
+    return EE_BUSY;
+  }
+  slot = (usItFirst + usItCount) % EE_IT_QUEUE_SIZE;
+  ausItVirtAddress[slot] = VirtAddress;
+  aulItData[slot] = Data;
+  usItCount++;
+  EE_PRESENT_SET(VirtAddress);
+  /* Start programming if the queue was empty */
+  if (ucItState == EE_IT_IDLE)
+  {
+    EE_ITStart();
+  }
+  EE_IT_UNLOCK();
+
+  return EE_OK;
+}
+
+/**
+  * @brief  Writes from thread mode the queued write the Flash interrupt left,
+  *   with the page transfer it needs, and lets the interrupt go on with the
+  *   next ones. Locks the Flash back once the queue is empty if the queue
+  *   unlocked it. To be called from the main loop.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success or if no write was left
+  *           - EE error code: if an error occurs, also given to the callback
+  */
+EE_Status EE_ProcessIT(void)
+{
+  EE_Status status;
+  EE_VIRTUALADDRESS_TYPE virtaddress;
+  EE_DATA_STORED_TYPE data;
+
+  if (ucItState != EE_IT_STALLED)
+  {
+    EE_ITLockFlash();
+    return EE_OK;
+  }
+
+  /* The Flash interrupt does not touch a stalled queue */
+  virtaddress = ausItVirtAddress[usItFirst];
+  data = aulItData[usItFirst];
+  EE_ITUnlockFlash();
+  status = EE_WriteRecords(&virtaddress, 0, &data, 1, 0);
+
+  EE_IT_LOCK();
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  EE_IT_UNLOCK();
+
+  /* Called before the interrupt goes on, so that the callbacks keep the
+     order of the writes */
+  EE_WriteCpltCallback(virtaddress, status);
+
+  EE_IT_LOCK();
+  EE_ITStart();
+  EE_IT_UNLOCK();
+  EE_ITLockFlash();
+
+  return status;
+}
+
+/**
+  * @brief  Waits until all the queued writes are in Flash, polling the Flash
+  *   rather than waiting for its interrupt, so that it also returns with the
+  *   interrupts masked or from an interrupt handler. The other write functions
+  *   call it first so that the writes keep their order. The Flash is left
+  *   unlocked if it was.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if a write left to thread mode failed
+  */
+EE_Status EE_FlushIT(void)
+{
+  EE_Status status = EE_OK;
+  uint32_t locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+
+  while (usItCount != 0)
+  {
+    if (ucItState == EE_IT_STALLED)
+    {
+      status = EE_ProcessIT();
+    }
+    else
+    {
+      /* The Flash interrupt is not waited for: it is not taken under PRIMASK
+         or from a handler of its priority or higher. Its work is done here
+         with it masked, EE_IRQHandler returns at once until the program ends */
+      EE_IT_LOCK();
+      EE_IRQHandler();
+      EE_IT_UNLOCK();
+    }
+  }
+
+  /* EE_ProcessIT locks the Flash back once the queue is empty */
+  if ((locked == 0U) && (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U))
+  {
+    HAL_FLASH_Unlock();
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Handles the Flash interrupt for the queued writes. To be called
+  *   from FLASH_IRQHandler in place of HAL_FLASH_IRQHandler.
+  * @param  None
+  * @retval None
+  */
+void EE_IRQHandler(void)
+{
+  EE_VIRTUALADDRESS_TYPE virtaddress;
+  EE_Status status = EE_OK;
+
+  HAL_FLASH_IRQHandler();
+  if ((ucItState != EE_IT_BUSY) || (ucItResult == EE_IT_PENDING))
+  {
+    return;
+  }
+
+  virtaddress = ausItVirtAddress[usItFirst];
+  if (ucItResult == EE_IT_DONE)
+  {
+    /* The slot is no longer erased: next write goes to the following one */
+    ulAddress += EE_DATA_SIZE;
+  }
+  else
+  {
+    ulAddress = 0xFFFFFFFF;
+    status = EE_WRITE_ERROR;
+  }
+  usItFirst = (usItFirst + 1) % EE_IT_QUEUE_SIZE;
+  usItCount--;
+  /* The HAL is unlocked once HAL_FLASH_IRQHandler returns */
+  EE_ITStart();
+
+  EE_WriteCpltCallback(virtaddress, status);
+}
+
+/**
+  * @brief  Called once a queued write is in Flash, or failed, from the Flash
+  *   interrupt or from EE_ProcessIT.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Status: EE_OK or the error code of the write
+  * @retval None
+  */
+__weak void EE_WriteCpltCallback(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_Status Status)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(VirtAddress);
+  UNUSED(Status);
+}
+
+/**
+  * @brief  End of Flash operation callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address programmed
+  * @retval None
+  */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_DONE;
+}
+
+/**
+  * @brief  Flash operation error callback of the HAL, taken by the queued
+  *   writes.
+  * @param  ReturnValue: address that failed
+  * @retval None
+  */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+  UNUSED(ReturnValue);
+  ucItResult = EE_IT_FAILED;
+}
+
+/**
+  * @brief  Gets how long usEE_Read and usEE_Write kept the interrupts masked.
+  * @param  Last: time of the last call, in core clock cycles
+  * @param  Max: longest time since reset, in core clock cycles
+  * @retval None
+  */
+void EE_GetIrqMaskedTime(uint32_t *Last, uint32_t *Max)
+{
+  *Last = ulIrqMaskedLast;
+  *Max = ulIrqMaskedMax;
+}
+#endif
+
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Gets the statistics gathered since reset or EE_ResetStats.
+  * @param  Stats: filled in with the counters and the timings
+  * @retval None
+  */
+void EE_GetStats(EE_StatsTypeDef *Stats)
+{
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  *Stats = xStats;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+
+/**
+  * @brief  Clears the statistics.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetStats(void)
+{
+  static const EE_StatsTypeDef cleared = {0};
+
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  xStats = cleared;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Gets the erase counts of the pages and projects their remaining
+  *   life. The pages are erased in turn, so the most worn one takes one erase
+  *   out of two: the projection assumes the records keep being written at the
+  *   rate and with the number of records per erase measured since EE_Init or
+  *   EE_ResetWear.
+  * @param  Wear: filled in with the erase counts and the projection
+  * @retval None
+  */
+void EE_GetWear(EE_WearTypeDef *Wear)
+{
+  uint64_t remaining;
+
+  Wear->EraseCount[0] = EE_GetEraseCount(PAGE0_BASE_ADDRESS);
+  Wear->EraseCount[1] = EE_GetEraseCount(PAGE1_BASE_ADDRESS);
+  Wear->MaxEraseCount = (Wear->EraseCount[0] > Wear->EraseCount[1]) ? Wear->EraseCount[0] : Wear->EraseCount[1];
+  Wear->RemainingErases = (Wear->MaxEraseCount < EE_PAGE_ENDURANCE) ? (EE_PAGE_ENDURANCE - Wear->MaxEraseCount) : 0;
+
+#if (EE_USE_IT == 1)
+  /* The Flash interrupt counts the queued writes it programs */
+  EE_IT_LOCK();
+#endif
+  Wear->Records = ulWearRecords;
+  Wear->Erases = ulWearErases;
+  Wear->Elapsed = HAL_GetTick() - ulWearStart;
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+
+  Wear->RecordsPerHour = 0;
+  if (Wear->Elapsed != 0)
+  {
+    remaining = ((uint64_t)Wear->Records * 3600000U) / Wear->Elapsed;
+    Wear->RecordsPerHour = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+  }
+
+  Wear->RemainingRecords = 0xFFFFFFFFU;
+  Wear->RemainingHours = 0xFFFFFFFFU;
+  if (Wear->Erases != 0)
+  {
+    /* Erases of the two pages left before the most worn one wears out */
+    remaining = (uint64_t)Wear->RemainingErases * 2U;
+    remaining = (remaining * Wear->Records) / Wear->Erases;
+    Wear->RemainingRecords = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+    remaining = (uint64_t)Wear->RemainingErases * 2U;
+    remaining = (remaining * Wear->Elapsed) / Wear->Erases / 3600000U;
+    Wear->RemainingHours = (remaining > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)remaining;
+  }
+}
+
+/**
+  * @brief  Restarts the measure of the write rate EE_GetWear projects from.
+  * @param  None
+  * @retval None
+  */
+void EE_ResetWear(void)
+{
+#if (EE_USE_IT == 1)
+  EE_IT_LOCK();
+#endif
+  ulWearRecords = 0;
+  ulWearErases = 0;
+  ulWearStart = HAL_GetTick();
+#if (EE_USE_IT == 1)
+  EE_IT_UNLOCK();
+#endif
+}
+#endif
+
+/**
+  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_Format(void)
+{
+  EE_STATS_COUNT(Formats, 1);
+
+  /* Erase Page0 */
+  if (EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS, PAGE_SIZE) == EE_PAGE_NOTERASED)
+  {
+    if (EE_PageErase(PAGE0_NUMBER, PAGE0_BANKNUMBER) != EE_OK)
+    {
+      return EE_ERASE_ERROR;
+    }
+  }
+
+  /* If program operation was failed, a Flash error code is returned */
+  EE_PAGE_CACHE_RESET();
+  EE_PRESENT_RESET();
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, PAGE0_BASE_ADDRESS, EE_PAGESTAT_VALID) != HAL_OK)
+  {
+    return EE_WRITE_ERROR;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* Page0 is empty: next write goes right after its header and erase count */
+  ulValidpage = PAGE0_BASE_ADDRESS;
+  ulAddress = EE_FindWriteCursor(PAGE0_BASE_ADDRESS);
+#endif
+
+  /* Erase Page1 */
+  if (EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS, PAGE_SIZE) == EE_PAGE_NOTERASED)
+  {
+    if (EE_PageErase(PAGE1_NUMBER, PAGE1_BANKNUMBER) != EE_OK)
+    {
+      return EE_ERASE_ERROR;
+    }
+  }
+
+  return EE_OK;
+}
+
+/**
+  * @brief  Find Page 
+  * @param  type: type of page to requested.
+  *   This parameter can be one of the following values:
+  *     @arg FIND_READ_PAGE: return the read page address
+  *     @arg FIND_WRITE_PAGE: return the write page address
+  *     @arg FIND_ERASE_PAGE: return the erase page address
+  * @retval :
+  *           - Page @: on success
+  *           - EE_NO_VALID_PAGE : if an error occurs
+  */
+static uint32_t EE_FindPage(EE_Find_type Operation)
+{
+#if (EE_USE_PAGE_CACHE == 1)
+  /* The erased page is only looked for by a transfer */
+  if (Operation == FIND_ERASE_PAGE)
+  {
+    return EE_ReadPage(Operation);
+  }
+
+  /* The headers are only read again once one of them changed */
+  if (ulReadPage == EE_PAGE_CACHE_EMPTY)
+  {
+    ulWritePage = EE_ReadPage(FIND_WRITE_PAGE);
+    ulReadPage = EE_ReadPage(FIND_READ_PAGE);
+  }
+
+  return (Operation == FIND_WRITE_PAGE) ? ulWritePage : ulReadPage;
+#else
+  return EE_ReadPage(Operation);
+#endif
+}
+
+/**
+  * @brief  Find Page from the page headers
+  * @param  type: type of page to requested.
+  *   This parameter can be one of the following values:
+  *     @arg FIND_READ_PAGE: return the read page address
+  *     @arg FIND_WRITE_PAGE: return the write page address
+  *     @arg FIND_ERASE_PAGE: return the erase page address
+  * @retval :
+  *           - Page @: on success
+  *           - EE_NO_VALID_PAGE : if an error occurs
+  */
+static uint32_t EE_ReadPage(EE_Find_type Operation)
+{
+  EE_DATA_TYPE pagestatus0, pagestatus1;
+
+  /* Get Page0 actual status */
+  pagestatus0 = (*(__IO EE_DATA_TYPE *)PAGE0_BASE_ADDRESS);
+
+  /* Get Page1 actual status */
+  pagestatus1 = (*(__IO EE_DATA_TYPE *)PAGE1_BASE_ADDRESS);
+
+  /* Write or read operation */
+  if (Operation == FIND_WRITE_PAGE)
+  {
+    /* ---- Write operation ---- */
+    if (pagestatus1 == EE_PAGESTAT_VALID)
+    {
+      /* Page0 receiving data */
+      if (pagestatus0 == EE_PAGESTAT_RECEIVE)
+      {
+        return PAGE0_BASE_ADDRESS; /* Page0 valid */
+      }
+      else
+      {
+        return PAGE1_BASE_ADDRESS; /* Page1 valid */
+      }
+    }
+    else if (pagestatus0 == EE_PAGESTAT_VALID)
+    {
+      /* Page1 receiving data */
+      if (pagestatus1 == EE_PAGESTAT_RECEIVE)
+      {
+        return PAGE1_BASE_ADDRESS; /* Page1 valid */
+      }
+      else
+      {
+        return PAGE0_BASE_ADDRESS; /* Page0 valid */
+      }
+    }
+    else
+    {
+      return EE_NO_VALID_PAGE; /* No valid Page */
+    }
+  }
+  else if (Operation == FIND_READ_PAGE)
+  {
+    /* ---- Read operation ---- */
+    if (pagestatus0 == EE_PAGESTAT_VALID)
+    {
+      return PAGE0_BASE_ADDRESS; /* Page0 valid */
+    }
+    else if (pagestatus1 == EE_PAGESTAT_VALID)
+    {
+      return PAGE1_BASE_ADDRESS; /* Page1 valid */
+    }
+    else
+    {
+      return EE_NO_VALID_PAGE; /* No valid Page */
+    }
+  }
+  else if (Operation == FIND_ERASE_PAGE)
+  {
+    /* ---- Return the erased page */
+    if (pagestatus0 == EE_PAGESTAT_ERASED)
+    {
+      return PAGE0_BASE_ADDRESS;
+    }
+    if (pagestatus1 == EE_PAGESTAT_ERASED)
+    {
+      return PAGE1_BASE_ADDRESS;
+    }
+  }
+  else
+  {
+    return EE_NO_VALID_PAGE;
+  }
+
+  return EE_NO_VALID_PAGE;
+}
+
+/**
+  * @brief  Verify if active page is full and Writes variable in EEPROM.
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_FULL: if the page is full
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_VerifyPageFullWriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  uint32_t count = EE_DATA_SIZE; /* start the check after the header */
+
+  /* Get valid Page for write operation */
+  uint32_t validpage = EE_FindPage(FIND_WRITE_PAGE);
+  /* Check if there is no valid page */
+  if (validpage == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+
+  /* Start from the first free slot of the valid page */
+  count = EE_GetWriteCursor(validpage) - validpage;
+
+  /* Check each active page address starting from begining */
+  while (count < PAGE_SIZE)
+  {
+    EE_STATS_COUNT(WordsScanned, 1);
+    /* Verify if address contents is erased */
+    if ((*(__IO EE_DATA_TYPE *)(validpage + count)) == EE_MASK_FULL)
+    {
+      /* Set variable data + virtual adress */
+      return EE_ProgramRecord(validpage + count, VirtAddress, Data);
+    }
+    else
+    {
+      /* Next address location */
+      count += EE_DATA_SIZE;
+    }
+  }
+  /* Return PAGE_FULL in case the valid page is full */
+  return EE_PAGE_FULL;
+}
+
+/**
+  * @brief  Program a record in an erased slot of the write page.
+  * @param  Address: address of the erased slot
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: data to be written as variable value
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_WRITE_ERROR: if the program operation failed
+  */
+static EE_Status EE_ProgramRecord(uint32_t Address, EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  EE_DATA_TYPE value = EE_RECORD_VALUE(VirtAddress, Data);
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+#if (EE_USE_CRC == 1)
+  /* Records of the variables carry their CRC in the low bits */
+  if (VirtAddress < NB_OF_VAR)
+  {
+    value |= EE_RecordCrc(VirtAddress, Data);
+  }
+#endif
+
+  EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+  ulWearRecords++;
+#endif
+  /* Set before programming: a record cut by a reset is still looked for */
+  EE_PRESENT_SET(VirtAddress);
+  /* If program operation was failed, a Flash error code is returned */
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, Address, value) != HAL_OK)
+  {
+#if (EE_USE_WRITE_CURSOR == 1)
+    ulAddress = 0xFFFFFFFF;
+#endif
+    return EE_WRITE_ERROR;
+  }
+#if (EE_USE_WRITE_CURSOR == 1)
+  /* The slot is no longer erased: next write goes to the following one */
+  ulAddress = Address + EE_DATA_SIZE;
+#endif
+  EE_STATS_TIME(Program, statsstart);
+  return EE_OK;
+}
+
+/**
+  * @brief  Writes a set of variables back to back in the write page. Free space
+  *   is checked for the whole set first and, if it does not fit, one page
+  *   transfer is done before any of the variables is written.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   consecutive virtual addresses starting at FirstVirtAddress
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  Data: data of the variables
+  * @param  NbVar: number of variables
+  * @param  Atomic: 1 to write the variables as one transaction
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_PAGE_FULL: if the variables do not fit even after a transfer
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_WriteRecords(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress,
+                                 const EE_DATA_STORED_TYPE *Data, uint16_t NbVar, uint8_t Atomic)
+{
+  EE_Status status = EE_OK;
+  uint32_t validpage, address;
+  uint16_t varidx, nbslot = NbVar;
+#if (EE_USE_TRANSACTION == 1) || (EE_USE_SKIP_UNCHANGED == 1)
+  uint16_t nbwrite = NbVar;
+#endif
+
+  if (NbVar == 0)
+  {
+    return EE_OK;
+  }
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Drop a transaction left open before appending to the page */
+  status = EE_TxnRecover();
+  if (status != EE_OK)
+  {
+    return status;
+  }
+  if (Atomic != 0)
+  {
+    if (NbVar > EE_TXN_MAX_RECORDS)
+    {
+      return EE_PAGE_FULL;
+    }
+    /* The records are framed by the begin and commit markers */
+    nbslot = NbVar + 2;
+  }
+#endif
+
+#if (EE_USE_SKIP_UNCHANGED == 1)
+  /* Records that leave their variable as it is in Flash are not programmed */
+  for (varidx = 0; varidx < NbVar; varidx++)
+  {
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, varidx) != 0)
+    {
+      nbwrite--;
+      nbslot--;
+    }
+  }
+  EE_STATS_COUNT(Skipped, NbVar - nbwrite);
+  if (nbwrite == 0)
+  {
+    return EE_OK;
+  }
+#endif
+
+  /* Get valid Page for write operation */
+  validpage = EE_FindPage(FIND_WRITE_PAGE);
+  if (validpage == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+  address = EE_GetWriteCursor(validpage);
+
+  /* Compact the data once if the whole set does not fit in the page */
+  if (((validpage + PAGE_SIZE - address) / EE_DATA_SIZE) < nbslot)
+  {
+    status = EE_PageTransfer(EE_NO_VIRTADDRESS, 0, EE_TRANSFER_NORMAL);
+    if (status != EE_OK)
+    {
+      return status;
+    }
+    validpage = EE_FindPage(FIND_WRITE_PAGE);
+    if (validpage == EE_NO_VALID_PAGE)
+    {
+      return EE_ERROR_NOVALID_PAGE;
+    }
+    address = EE_GetWriteCursor(validpage);
+    if (((validpage + PAGE_SIZE - address) / EE_DATA_SIZE) < nbslot)
+    {
+      return EE_PAGE_FULL;
+    }
+  }
+
+  /* Program all the records back to back */
+#if (EE_USE_TRANSACTION == 1)
+  if (Atomic != 0)
+  {
+    status = EE_ProgramRecord(address, EE_TXN_BEGIN_VIRTADDRESS, nbwrite);
+    address += EE_DATA_SIZE;
+  }
+#endif
+  for (varidx = 0; (varidx < NbVar) && (status == EE_OK); varidx++)
+  {
+#if (EE_USE_SKIP_UNCHANGED == 1)
+    if (EE_IsUnchanged(VirtAddress, FirstVirtAddress, Data, varidx) != 0)
+    {
+      continue;
+    }
+#endif
+    status = EE_ProgramRecord(address,
+                              (VirtAddress != NULL) ? VirtAddress[varidx] : (EE_VIRTUALADDRESS_TYPE)(FirstVirtAddress + varidx),
+                              Data[varidx]);
+    address += EE_DATA_SIZE;
+  }
+#if (EE_USE_TRANSACTION == 1)
+  if (Atomic != 0)
+  {
+    if (status == EE_OK)
+    {
+      status = EE_ProgramRecord(address, EE_TXN_COMMIT_VIRTADDRESS, nbwrite);
+    }
+    if (status != EE_OK)
+    {
+      /* The next write drops the records of this transaction first */
+      ucTxnTorn = 1;
+    }
+  }
+#endif
+
+  return status;
+}
+
+/**
+  * @brief  Transfers last updated variables data from the full Page to
+  *   an empty one.
+  * @param  VirtAddress: 16 bit virtual address of the variable,
+  *   EE_NO_VIRTADDRESS if only the existing variables are transferred
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_PageTransfer(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data, EE_Transfer_type type)
+{
+  uint32_t activepageaddress, newpageaddress;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+
+  /* Get active Page for read operation */
+  activepageaddress = EE_FindPage(FIND_READ_PAGE);
+  if (activepageaddress == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+
+  /* Get active Page for read operation */
+  newpageaddress = EE_FindPage((type == EE_TRANSFER_NORMAL ? FIND_ERASE_PAGE : FIND_WRITE_PAGE));
+  if (newpageaddress == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+
+  /* The blobs read in place are left in the old page */
+  EE_BLOB_INVALIDATE();
+
+  /* Mark the ativepage at receive state */
+  /* If program operation was failed, a Flash error code is returned */
+  if (type == EE_TRANSFER_NORMAL)
+  {
+    EE_PAGE_CACHE_RESET();
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, newpageaddress, EE_PAGESTAT_RECEIVE) != HAL_OK)
+    {
+      return EE_WRITE_ERROR;
+    }
+#if (EE_USE_WRITE_CURSOR == 1)
+    /* New page is empty: next write goes right after its header and erase count */
+    ulValidpage = newpageaddress;
+    ulAddress = EE_FindWriteCursor(newpageaddress);
+#endif
+  }
+
+  /* Write the variable passed as parameter in the new active page */
+  /* On recovery it is already the first record of the reception page */
+  /* If program operation was failed, a Flash error code is returned */
+  if ((type == EE_TRANSFER_NORMAL) && (VirtAddress != EE_NO_VIRTADDRESS)
+#if (EE_USE_SORTED_PAGE == 1)
+      /* A variable takes its place among the sorted ones instead */
+      && (VirtAddress >= NB_OF_VAR)
+#endif
+     )
+  {
+    if (EE_VerifyPageFullWriteVariable(VirtAddress, Data) != EE_OK)
+    {
+      return EE_WRITE_ERROR;
+    }
+  }
+
+  /* Transfer process: transfer variables from old to the new active page */
+  if (EE_CopyValidRecords(activepageaddress, newpageaddress,
+                          (type == EE_TRANSFER_NORMAL) ? VirtAddress : EE_NO_VIRTADDRESS, Data) != EE_OK)
+  {
+    return EE_WRITE_ERROR;
+  }
+#if (EE_USE_TRANSACTION == 1)
+  /* A transaction left open in the old page has not been copied */
+  ucTxnTorn = 0;
+#endif
+
+  /* Erase the current VALID_PAGE */
   if (EE_PageErase(EE_GetPageNumber(activepageaddress), EE_GetBankNumber(activepageaddress)) != EE_OK)
   {
-    return EE_ERASE_ERROR;
+    return EE_ERASE_ERROR;
+  }
+
+  /* Set new Page status to VALID_PAGE status */
+  EE_PAGE_CACHE_RESET();
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, newpageaddress, EE_PAGESTAT_VALID) != HAL_OK)
+  {
+    return EE_WRITE_ERROR;
+  }
+  /* Only the variables copied are left: rebuild the bitmap from the new page */
+  EE_PRESENT_RESET();
+  EE_STATS_COUNT(Transfers, 1);
+  EE_STATS_TIME(Transfer, statsstart);
+
+  /* Return last operation flash status */
+  return EE_OK;
+}
+
+/**
+  * @brief  Copy the last update of each variable from the old page to the page
+  *   receiving data. The old page is walked once from its newest record to its
+  *   oldest one and a bitmap keeps track of the variables already copied.
+  *   Variables the reception page already holds (the one written by
+  *   EE_PageTransfer, or records copied before a power loss) are not copied,
+  *   neither are the transaction markers. With EE_USE_SORTED_PAGE the
+  *   variables are first copied in the order of their virtual addresses.
+  * @param  OldPageAddress: address of the page the data is taken from
+  * @param  NewPageAddress: address of the page receiving the data
+  * @param  VirtAddress: variable written with the transfer, copied with Data
+  *   rather than with its value in the old page, or EE_NO_VIRTADDRESS
+  * @param  Data: data of the variable written with the transfer
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_CopyValidRecords(uint32_t OldPageAddress, uint32_t NewPageAddress,
+                                     EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  uint32_t copied[(EE_NB_OF_ITEMS + 31) / 32];
+  uint32_t address = NewPageAddress + EE_DATA_SIZE;
+  uint32_t endaddress = OldPageAddress + PAGE_SIZE;
+  uint32_t varidx;
+#if (EE_USE_SORTED_PAGE == 1)
+  EE_DATA_TYPE addressvalue;
+#else
+  (void)VirtAddress;
+  (void)Data;
+#endif
+
+  for (varidx = 0; varidx < (EE_NB_OF_ITEMS + 31) / 32; varidx++)
+  {
+    copied[varidx] = 0;
+  }
+
+  /* Mark the variables the reception page already holds */
+  EE_CoreMarkRecords(NewPageAddress, &address, NewPageAddress + PAGE_SIZE, NULL, copied);
+
+#if (EE_USE_TRANSACTION == 1)
+  /* Records of a transaction never committed are left behind */
+  endaddress = EE_TxnCommittedEnd(OldPageAddress);
+#endif
+#if (EE_USE_SORTED_PAGE == 1)
+  /* The walk only copies the blobs, and the variables left out of order. The
+     sorted variables were copied before a power loss if the reception page
+     holds their closing record */
+  if ((EE_CoreFindRecord(NewPageAddress, NewPageAddress + PAGE_SIZE, EE_SORTED_VIRTADDRESS, &addressvalue) == 0) &&
+      (EE_CopySortedRecords(OldPageAddress, endaddress, NewPageAddress, copied, VirtAddress, Data) != EE_OK))
+  {
+    return EE_WRITE_ERROR;
+  }
+#endif
+
+  /* Walk the old page from its last slot down to the first record */
+  address = endaddress - EE_DATA_SIZE;
+  if (EE_CoreCopyRecords(OldPageAddress, &address, NULL, copied) != EE_OK)
+  {
+    return EE_WRITE_ERROR;
+  }
+
+  return EE_OK;
+}
+
+#if (EE_USE_SORTED_PAGE == 1)
+/**
+  * @brief  Copy the last update of each variable from the old page to the page
+  *   receiving data in the order of the virtual addresses, and close them with
+  *   a record giving their number once they are checked to be sorted.
+  * @param  OldPageAddress: address of the page the data is taken from
+  * @param  OldEndAddress: address right after the last record to copy
+  * @param  NewPageAddress: address of the page receiving the data
+  * @param  Copied: bitmap of the variables the reception page holds, updated
+  * @param  VirtAddress: variable written with the transfer, or EE_NO_VIRTADDRESS
+  * @param  Data: data of the variable written with the transfer
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_CopySortedRecords(uint32_t OldPageAddress, uint32_t OldEndAddress, uint32_t NewPageAddress,
+                                      uint32_t *Copied, EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  uint32_t intail[(NB_OF_VAR + 31) / 32];
+  uint32_t address, sortedaddress, tailaddress, firstaddress, endaddress;
+  uint32_t varidx, nbsorted, previous = 0;
+  EE_DATA_TYPE addressvalue;
+  EE_DATA_STORED_TYPE data;
+  EE_Status status;
+#if (EE_USE_ERASE_COUNT == 1)
+  uint32_t erasecount;
+#endif
+
+  /* Variables of the old page written after its sorted records, all of them
+     if it has none: they are looked up from the end of the page, the sorted
+     records are read along with the virtual addresses */
+  for (varidx = 0; varidx < (NB_OF_VAR + 31) / 32; varidx++)
+  {
+    intail[varidx] = 0;
+  }
+  sortedaddress = OldPageAddress + EE_DATA_SIZE;
+  tailaddress = sortedaddress;
+  for (address = OldPageAddress + EE_DATA_SIZE; address < OldEndAddress; address += EE_DATA_SIZE)
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)address);
+    varidx = (uint32_t)EE_RECORD_VIRTADDRESS(addressvalue);
+    nbsorted = (uint32_t)EE_RECORD_DATA(addressvalue);
+    if ((addressvalue == EE_PAGESTAT_ERASED)
+#if (EE_USE_CRC == 1)
+        || (EE_RecordValid(addressvalue) == 0)
+#endif
+       )
+    {
+      continue;
+    }
+    if (varidx < NB_OF_VAR)
+    {
+      intail[varidx >> 5] |= (uint32_t)1 << (varidx & 0x1F);
+    }
+    else if ((varidx == EE_SORTED_VIRTADDRESS) && (nbsorted <= (((address - OldPageAddress) / EE_DATA_SIZE) - 1)))
+    {
+      for (varidx = 0; varidx < (NB_OF_VAR + 31) / 32; varidx++)
+      {
+        intail[varidx] = 0;
+      }
+      sortedaddress = address - (nbsorted * EE_DATA_SIZE);
+      tailaddress = address;
+    }
+  }
+
+  /* Copy the variables in order, those the reception page holds are passed
+     over */
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+  {
+    if ((Copied[varidx >> 5] & ((uint32_t)1 << (varidx & 0x1F))) != 0)
+    {
+      continue;
+    }
+    if (varidx == VirtAddress)
+    {
+      data = Data;
+    }
+    else if ((intail[varidx >> 5] & ((uint32_t)1 << (varidx & 0x1F))) != 0)
+    {
+      if (EE_CoreFindRecord(OldPageAddress, OldEndAddress, (EE_VIRTUALADDRESS_TYPE)varidx, &addressvalue) == 0)
+      {
+        continue;
+      }
+      data = EE_RECORD_DATA(addressvalue);
+    }
+    else
+    {
+      while ((sortedaddress < tailaddress) &&
+             (EE_RECORD_VIRTADDRESS(*(__IO EE_DATA_TYPE *)sortedaddress) < varidx))
+      {
+        sortedaddress += EE_DATA_SIZE;
+      }
+      if (sortedaddress >= tailaddress)
+      {
+        continue;
+      }
+      addressvalue = (*(__IO EE_DATA_TYPE *)sortedaddress);
+      if (EE_RECORD_VIRTADDRESS(addressvalue) != varidx)
+      {
+        continue;
+      }
+      data = EE_RECORD_DATA(addressvalue);
+    }
+    Copied[varidx >> 5] |= (uint32_t)1 << (varidx & 0x1F);
+    if (EE_VerifyPageFullWriteVariable((EE_VIRTUALADDRESS_TYPE)varidx, data) != EE_OK)
+    {
+      return EE_WRITE_ERROR;
+    }
+  }
+
+  /* The variables follow the header and the erase count. A transfer resumed
+     after a power loss may have left them out of order or damaged: the page
+     is then read as a log */
+  firstaddress = NewPageAddress + EE_DATA_SIZE;
+#if (EE_USE_ERASE_COUNT == 1)
+  if (EE_ReadEraseCount(NewPageAddress, &erasecount) != 0)
+  {
+    firstaddress += EE_DATA_SIZE;
+  }
+#endif
+  endaddress = EE_GetWriteCursor(NewPageAddress);
+  for (address = firstaddress; address < endaddress; address += EE_DATA_SIZE)
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)address);
+    varidx = (uint32_t)EE_RECORD_VIRTADDRESS(addressvalue);
+    if ((varidx >= NB_OF_VAR) || ((address != firstaddress) && (varidx <= previous))
+#if (EE_USE_CRC == 1)
+        || (EE_RecordValid(addressvalue) == 0)
+#endif
+       )
+    {
+      return EE_OK;
+    }
+    previous = varidx;
   }
 
-  /* Set new Page status to VALID_PAGE status */
-  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, newpageaddress, EE_PAGESTAT_VALID) != HAL_OK)
+  /* A full page is left without the closing record */
+  status = EE_VerifyPageFullWriteVariable(EE_SORTED_VIRTADDRESS,
+                                          (EE_DATA_STORED_TYPE)((endaddress - firstaddress) / EE_DATA_SIZE));
+  return (status == EE_PAGE_FULL) ? EE_OK : status;
+}
+
+#endif
+
+/**
+  * @brief  Get the first free slot of a page, from the RAM cursor when it is
+  *   kept for this page.
+  * @param  PageAddress: page address
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_GetWriteCursor(uint32_t PageAddress)
+{
+#if (EE_USE_WRITE_CURSOR == 1)
+  if ((ulValidpage != PageAddress) || (ulAddress == 0xFFFFFFFF))
   {
-    return EE_WRITE_ERROR;
+    ulValidpage = PageAddress;
+    ulAddress = EE_FindWriteCursor(PageAddress);
   }
+  return ulAddress;
+#else
+  return EE_FindWriteCursor(PageAddress);
+#endif
+}
 
-  /* Return last operation flash status */
-  return EE_OK;
+/**
+  * @brief  Find the first free slot of a page by a binary search.
+  * @param  PageAddress: page address
+  * @retval Address of the first erased slot, end of the page if it is full
+  */
+static uint32_t EE_FindWriteCursor(uint32_t PageAddress)
+{
+  return EE_CoreFindCursor(PageAddress, PageAddress + PAGE_SIZE);
+}
+
+#if (EE_USE_TRANSACTION == 1)
+/**
+  * @brief  Find the end of the committed records of a page, walking back from
+  *   its write cursor.
+  * @param  PageAddress: page address
+  * @retval Address following the last committed record
+  */
+static uint32_t EE_TxnCommittedEnd(uint32_t PageAddress)
+{
+  uint32_t endaddress;
+
+#if (EE_USE_WRITE_CURSOR == 1)
+  endaddress = ((ulValidpage == PageAddress) && (ulAddress != 0xFFFFFFFF)) ? ulAddress : EE_FindWriteCursor(PageAddress);
+#else
+  endaddress = EE_FindWriteCursor(PageAddress);
+#endif
+
+  return EE_CoreTxnCommittedEnd(PageAddress, endaddress);
+}
+
+/**
+  * @brief  Drop the records of a transaction that was never committed, if any,
+  *   by transferring the committed records to the other page.
+  * @param  None
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_TxnRecover(void)
+{
+  if (ucTxnTorn == 0)
+  {
+    return EE_OK;
+  }
+
+  return EE_PageTransfer(EE_NO_VIRTADDRESS, 0, EE_TRANSFER_NORMAL);
+}
+#endif
+
+#if (EE_USE_IT == 1)
+/**
+  * @brief  Starts programming the first queued write under interrupt when it
+  *   fits at the write cursor, else leaves it to EE_ProcessIT. Called with the
+  *   Flash interrupt masked or from it.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITStart(void)
+{
+  uint32_t validpage;
+  EE_DATA_TYPE value;
+
+  if (usItCount == 0)
+  {
+    ucItState = EE_IT_IDLE;
+    return;
+  }
+
+  ucItState = EE_IT_STALLED;
+#if (EE_USE_TRANSACTION == 1)
+  /* A transaction never committed is dropped first by a page transfer */
+  if (ucTxnTorn != 0)
+  {
+    return;
+  }
+#endif
+  /* A full page needs a page transfer */
+  validpage = EE_FindPage(FIND_WRITE_PAGE);
+  if ((validpage == EE_NO_VALID_PAGE) || (ulValidpage != validpage) || (ulAddress >= (validpage + PAGE_SIZE))
+      || ((*(__IO EE_DATA_TYPE *)ulAddress) != EE_PAGESTAT_ERASED))
+  {
+    return;
+  }
+
+  value = EE_RECORD_VALUE(ausItVirtAddress[usItFirst], aulItData[usItFirst]);
+#if (EE_USE_CRC == 1)
+  if (ausItVirtAddress[usItFirst] < NB_OF_VAR)
+  {
+    value |= EE_RecordCrc(ausItVirtAddress[usItFirst], aulItData[usItFirst]);
+  }
+#endif
+
+  EE_ITUnlockFlash();
+  ucItResult = EE_IT_PENDING;
+  if (HAL_FLASH_Program_IT(FLASH_TYPEPROGRAM_DOUBLEWORD, ulAddress, value) == HAL_OK)
+  {
+    ucItState = EE_IT_BUSY;
+    EE_STATS_COUNT(Programs, 1);
+#if (EE_USE_ERASE_COUNT == 1)
+    ulWearRecords++;
+#endif
+  }
+}
+
+/**
+  * @brief  Unlocks the Flash for the queued writes if it is locked.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITUnlockFlash(void)
+{
+  if (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U)
+  {
+    HAL_FLASH_Unlock();
+    ucItUnlocked = 1;
+  }
+}
+
+/**
+  * @brief  Locks the Flash back if the queue unlocked it and is empty. Left
+  *   to thread mode, so that the interrupt never locks the Flash under the
+  *   feet of a caller that unlocked it meanwhile.
+  * @param  None
+  * @retval None
+  */
+static void EE_ITLockFlash(void)
+{
+  if ((ucItState == EE_IT_IDLE) && (ucItUnlocked != 0))
+  {
+    HAL_FLASH_Lock();
+    ucItUnlocked = 0;
+  }
+}
+
+/**
+  * @brief  Looks for the last queued write of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: receives the queued value
+  * @retval 1 if the variable has a queued write, 0 otherwise
+  */
+static uint8_t EE_ITFindQueued(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data)
+{
+  uint16_t idx, slot;
+  uint8_t found = 0;
+
+  EE_IT_LOCK();
+  for (idx = 0; idx < usItCount; idx++)
+  {
+    slot = (usItFirst + idx) % EE_IT_QUEUE_SIZE;
+    if (ausItVirtAddress[slot] == VirtAddress)
+    {
+      *Data = aulItData[slot];
+      found = 1;
+    }
+  }
+  EE_IT_UNLOCK();
+
+  return found;
+}
+#endif
+
+#if (EE_USE_WRITE_CACHE == 1)
+/**
+  * @brief  Looks for the cache entry of a variable.
+  * @param  VirtAddress: Variable virtual address
+  * @retval Index of the entry, number of entries if the variable is not cached
+  */
+static uint16_t EE_CacheFind(EE_VIRTUALADDRESS_TYPE VirtAddress)
+{
+  uint16_t slot = 0;
+
+  while ((slot < usCacheCount) && (ausCacheVirtAddress[slot] != VirtAddress))
+  {
+    slot++;
+  }
+
+  return slot;
+}
+
+/**
+  * @brief  Drops the cache entries of variables written to Flash by the other
+  *   write functions: their cached writes are older.
+  * @param  VirtAddress: virtual addresses of the variables, or NULL for
+  *   NbVar variables from FirstVirtAddress on
+  * @param  FirstVirtAddress: first virtual address when VirtAddress is NULL
+  * @param  NbVar: number of variables
+  * @retval None
+  */
+static void EE_CacheDrop(const EE_VIRTUALADDRESS_TYPE *VirtAddress, EE_VIRTUALADDRESS_TYPE FirstVirtAddress, uint16_t NbVar)
+{
+  uint32_t primask = 0;
+  uint16_t idx = 0, slot = 0;
+
+  EE_CACHE_LOCK(primask);
+  for (idx = 0; (idx < NbVar) && (usCacheCount != 0); idx++)
+  {
+    slot = EE_CacheFind((VirtAddress != NULL) ? VirtAddress[idx] : (EE_VIRTUALADDRESS_TYPE)(FirstVirtAddress + idx));
+    if (slot < usCacheCount)
+    {
+      /* The last entry takes the place of the dropped one */
+      usCacheCount--;
+      ausCacheVirtAddress[slot] = ausCacheVirtAddress[usCacheCount];
+      aulCacheData[slot] = aulCacheData[usCacheCount];
+    }
+  }
+  EE_CACHE_UNLOCK(primask);
+}
+#endif
+
+#if (EE_USE_BLOB == 1)
+/**
+  * @brief  Checks the blob closed by a header record: the records before it
+  *   have to be its CRC record and its data records, and the CRC has to match
+  *   the bytes, which are copied to Data on the way.
+  * @param  PageAddress: address of the page holding the blob
+  * @param  Address: address of the header record
+  * @param  Data: buffer receiving the bytes, NULL to check the blob only
+  * @param  MaxSize: size of the buffer
+  * @param  Size: receives the size of the blob
+  * @retval 1 if the blob is complete, 0 otherwise
+  */
+static uint8_t EE_BlobCheck(uint32_t PageAddress, uint32_t Address, uint8_t *Data, uint16_t MaxSize, uint16_t *Size)
+{
+  EE_DATA_TYPE addressvalue = (*(__IO EE_DATA_TYPE *)Address);
+  uint16_t blob = (uint16_t)(EE_RECORD_VIRTADDRESS(addressvalue) - EE_BLOB_VIRTADDRESS);
+  uint32_t size = (uint32_t)EE_RECORD_DATA(addressvalue);
+  uint32_t address;
+  uint16_t idx = 0, crc = 0xFFFF;
+  uint8_t byte = 0;
+
+  /* The records of the blob follow the page header */
+  if ((size > EE_BLOB_MAX_SIZE) || (((Address - PageAddress) / EE_DATA_SIZE) < EE_BLOB_NB_SLOTS(size)))
+  {
+    return 0;
+  }
+  address = Address - ((uint32_t)(EE_BLOB_NB_SLOTS(size) - 1) * EE_DATA_SIZE);
+
+  crc = EE_Crc16(crc, (uint8_t)blob);
+  crc = EE_Crc16(crc, (uint8_t)size);
+  crc = EE_Crc16(crc, (uint8_t)(size >> 8));
+  for (idx = 0; idx < size; idx++)
+  {
+    if ((idx % EE_BLOB_BYTES_PER_RECORD) == 0)
+    {
+      addressvalue = (*(__IO EE_DATA_TYPE *)address);
+      if ((addressvalue & ~EE_MASK_DATA) != EE_RECORD_VALUE(EE_BLOB_DATA_VIRTADDRESS, 0))
+      {
+        return 0;
+      }
+      address += EE_DATA_SIZE;
+    }
+    byte = (uint8_t)(addressvalue >> (EE_DATA_SHIFT + 16 + (8 * (idx % EE_BLOB_BYTES_PER_RECORD))));
+    crc = EE_Crc16(crc, byte);
+    if ((Data != NULL) && (idx < MaxSize))
+    {
+      Data[idx] = byte;
+    }
+  }
+
+  if ((*(__IO EE_DATA_TYPE *)address) != EE_RECORD_VALUE(EE_BLOB_CRC_VIRTADDRESS, crc))
+  {
+    return 0;
+  }
+  *Size = (uint16_t)size;
+  return 1;
+}
+
+/**
+  * @brief  Copies a checked blob as a unit behind the last record of the write
+  *   page, its records in the same order.
+  * @param  Address: address of the header record of the blob
+  * @param  Size: size of the blob
+  * @retval Success or error status:
+  *           - EE_OK: on success
+  *           - EE_PAGE_FULL: if the blob does not fit in the write page
+  *           - EE error code: if an error occurs
+  */
+static EE_Status EE_BlobCopy(uint32_t Address, uint16_t Size)
+{
+  EE_Status status = EE_OK;
+  EE_DATA_TYPE addressvalue;
+  uint32_t validpage, address, source;
+
+  validpage = EE_FindPage(FIND_WRITE_PAGE);
+  if (validpage == EE_NO_VALID_PAGE)
+  {
+    return EE_ERROR_NOVALID_PAGE;
+  }
+  address = EE_GetWriteCursor(validpage);
+  if (((validpage + PAGE_SIZE - address) / EE_DATA_SIZE) < EE_BLOB_NB_SLOTS(Size))
+  {
+    return EE_PAGE_FULL;
+  }
+
+  source = Address - ((uint32_t)(EE_BLOB_NB_SLOTS(Size) - 1) * EE_DATA_SIZE);
+  while ((source <= Address) && (status == EE_OK))
+  {
+    addressvalue = (*(__IO EE_DATA_TYPE *)source);
+    status = EE_ProgramRecord(address, EE_RECORD_VIRTADDRESS(addressvalue), EE_RECORD_DATA(addressvalue));
+    source += EE_DATA_SIZE;
+    address += EE_DATA_SIZE;
+  }
+
+  return status;
+}
+#endif
+
+#if (EE_USE_CRC == 1)
+/**
+  * @brief  Computes the CRC-16/CCITT of a variable record: its virtual address
+  *   then its data, least significant byte first.
+  * @param  VirtAddress: variable virtual address
+  * @param  Data: variable data
+  * @retval CRC of the record
+  */
+static uint16_t EE_RecordCrc(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data)
+{
+  uint16_t crc = 0xFFFF;
+#if (EE_USE_HW_CRC == 1)
+  uint32_t primask = __get_PRIMASK();
+
+  /* The unit is set up again for each record: it can be used elsewhere */
+  __disable_irq();
+  CRC->POL = 0x1021;
+  CRC->INIT = 0xFFFF;
+  CRC->CR = CRC_CR_POLYSIZE_0 | CRC_CR_RESET;
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)VirtAddress;
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)(VirtAddress >> 8);
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)Data;
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)(Data >> 8);
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)(Data >> 16);
+  *(__IO uint8_t *)&CRC->DR = (uint8_t)(Data >> 24);
+  crc = (uint16_t)CRC->DR;
+  __set_PRIMASK(primask);
+#else
+  crc = EE_Crc16(crc, (uint8_t)VirtAddress);
+  crc = EE_Crc16(crc, (uint8_t)(VirtAddress >> 8));
+  crc = EE_Crc16(crc, (uint8_t)Data);
+  crc = EE_Crc16(crc, (uint8_t)(Data >> 8));
+  crc = EE_Crc16(crc, (uint8_t)(Data >> 16));
+  crc = EE_Crc16(crc, (uint8_t)(Data >> 24));
+#endif
+  return crc;
+}
+
+/**
+  * @brief  Checks the CRC of a record. Records of the reserved virtual
+  *   addresses carry none: the markers and the erase count are checked by
+  *   value, the blobs by their own CRC.
+  * @param  AddressValue: record read from Flash
+  * @retval 1 if the record is sound or carries no CRC, 0 if it is damaged
+  */
+static uint8_t EE_RecordValid(EE_DATA_TYPE AddressValue)
+{
+  EE_VIRTUALADDRESS_TYPE virtaddress = EE_RECORD_VIRTADDRESS(AddressValue);
+
+  if ((virtaddress >= NB_OF_VAR)
+      || ((AddressValue & EE_MASK_CRC) == EE_RecordCrc(virtaddress, EE_RECORD_DATA(AddressValue))))
+  {
+    return 1;
+  }
+  EE_STATS_COUNT(CrcErrors, 1);
+  return 0;
+}
+#endif
+
+#if (EE_USE_BLOB == 1) || ((EE_USE_CRC == 1) && (EE_USE_HW_CRC == 0))
+/**
+  * @brief  Updates a CRC-16/CCITT (polynomial 0x1021) with one byte.
+  * @param  Crc: CRC of the previous bytes, 0xFFFF for the first one
+  * @param  Byte: next byte
+  * @retval Updated CRC
+  */
+static uint16_t EE_Crc16(uint16_t Crc, uint8_t Byte)
+{
+  uint8_t bit = 0;
+
+  Crc ^= (uint16_t)Byte << 8;
+  for (bit = 0; bit < 8; bit++)
+  {
+    Crc = ((Crc & 0x8000) != 0) ? (uint16_t)((Crc << 1) ^ 0x1021) : (uint16_t)(Crc << 1);
+  }
+  return Crc;
+}
+#endif
+
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+/**
+  * @brief  Masks the interrupts and starts timing how long they stay masked,
+  *   with the DWT cycle counter on Cortex-M3/M4 and SysTick on Cortex-M0+.
+  * @param  None
+  * @retval Start time, to be given to EE_IrqMaskEnd
+  */
+static uint32_t EE_IrqMaskStart(void)
+{
+  __disable_irq();
+#if (__CORTEX_M >= 3U)
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+#else
+  /* Reading the control register clears the count flag */
+  (void)SysTick->CTRL;
+  return SysTick->VAL;
+#endif
+}
+
+/**
+  * @brief  Unmasks the interrupts and records how long they were masked. With
+  *   SysTick, a time over one SysTick period is only counted as one period.
+  * @param  Start: start time returned by EE_IrqMaskStart
+  * @retval None
+  */
+static void EE_IrqMaskEnd(uint32_t Start)
+{
+  uint32_t elapsed;
+#if (__CORTEX_M >= 3U)
+  elapsed = DWT->CYCCNT - Start;
+#else
+  uint32_t now = SysTick->VAL;
+  uint32_t period = (SysTick->LOAD & SysTick_LOAD_RELOAD_Msk) + 1U;
+
+  /* SysTick counts down and reloads at zero */
+  elapsed = (Start >= now) ? (Start - now) : (Start + period - now);
+  if (((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) != 0U) && (Start >= now))
+  {
+    elapsed += period;
+  }
+#endif
+#if (EE_USE_IT == 1)
+  ulIrqMaskedLast = elapsed;
+  if (elapsed > ulIrqMaskedMax)
+  {
+    ulIrqMaskedMax = elapsed;
+  }
+#endif
+#if (EE_USE_STATS == 1)
+  EE_StatsTime(&xStats.IrqMasked, elapsed);
+#endif
+  __enable_irq();
+}
+#endif
+
+#if (EE_USE_STATS == 1)
+/**
+  * @brief  Reads a free running count of core clock cycles: the DWT cycle
+  *   counter on Cortex-M3/M4. On Cortex-M0+ SysTick is extended by the HAL
+  *   tick, at its default of one tick per SysTick period, and a period not
+  *   counted yet because the interrupts are masked is added: with the
+  *   interrupts masked for more than one period, time is lost.
+  * @param  None
+  * @retval Count of core clock cycles
+  */
+static uint32_t EE_CycleCount(void)
+{
+#if (__CORTEX_M >= 3U)
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  return DWT->CYCCNT;
+#else
+  uint32_t tick, value, pending;
+  uint32_t period = (SysTick->LOAD & SysTick_LOAD_RELOAD_Msk) + 1U;
+
+  /* Read again if the tick moved or SysTick reloaded meanwhile */
+  do
+  {
+    tick = HAL_GetTick();
+    value = SysTick->VAL;
+    pending = ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) != 0U) ? 1U : 0U;
+  } while ((tick != HAL_GetTick()) || (SysTick->VAL > value));
+
+  /* SysTick counts down and reloads at zero */
+  return ((tick + pending) * period) + (period - 1U - value);
+#endif
+}
+
+/**
+  * @brief  Adds a time to a timing of the statistics.
+  * @param  Timing: timing to update
+  * @param  Elapsed: time taken, in core clock cycles
+  * @retval None
+  */
+static void EE_StatsTime(EE_TimingTypeDef *Timing, uint32_t Elapsed)
+{
+  uint32_t bucket = 0;
+  uint32_t limit = EE_STATS_BUCKET_CYCLES;
+
+  if ((Timing->Count == 0U) || (Elapsed < Timing->Min))
+  {
+    Timing->Min = Elapsed;
+  }
+  if (Elapsed > Timing->Max)
+  {
+    Timing->Max = Elapsed;
+  }
+  Timing->Count++;
+
+  /* Bucket n holds the times below EE_STATS_BUCKET_CYCLES << n */
+  while ((bucket < (EE_STATS_NB_BUCKETS - 1U)) && (Elapsed >= limit))
+  {
+    limit <<= 1;
+    bucket++;
+  }
+  Timing->Histogram[bucket]++;
 }
+#endif
 
 /**
   * @brief  Erase a page.
@@ -669,20 +3018,80 @@ static EE_Status EE_PageErase(uint32_t Page, uint16_t BankNb)
 {
   FLASH_EraseInitTypeDef s_eraseinit;
   uint32_t page_error;
+#if (EE_USE_STATS == 1)
+  uint32_t statsstart = EE_CycleCount();
+#endif
+#if (EE_USE_ERASE_COUNT == 1)
+  uint32_t pageaddress = FLASH_BASE + (Page * FLASH_PAGE_SIZE);
+  uint32_t erasecount = EE_GetEraseCount(pageaddress) + 1;
+#endif
 
   s_eraseinit.TypeErase = FLASH_TYPEERASE_PAGES;
   s_eraseinit.NbPages = PAGE_NUM;
   s_eraseinit.Page = Page;
 //  s_eraseinit.Banks = BankNb;
 
+  EE_STATS_COUNT(Erases, 1);
+  EE_PAGE_CACHE_RESET();
+  EE_BLOB_INVALIDATE();
   /* Erase the old Page: Set old Page status to ERASED status */
   if (HAL_FLASHEx_Erase(&s_eraseinit, &page_error) != HAL_OK)
   {
     return EE_ERASE_ERROR;
   }
+  EE_STATS_TIME(Erase, statsstart);
+#if (EE_USE_ERASE_COUNT == 1)
+  ulWearErases++;
+  /* Keep the count in the page, right after its header */
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, pageaddress + EE_DATA_SIZE,
+                        EE_RECORD_VALUE(EE_ERASE_COUNT_VIRTADDRESS, erasecount)) != HAL_OK)
+  {
+    return EE_WRITE_ERROR;
+  }
+#endif
   return EE_OK;
 }
 
+#if (EE_USE_ERASE_COUNT == 1)
+/**
+  * @brief  Reads the erase count record a page holds right after its header.
+  * @param  PageAddress: page address
+  * @param  Count: erase count of the page, left unchanged if there is none
+  * @retval 1 if the page holds an erase count record, 0 otherwise
+  */
+static uint8_t EE_ReadEraseCount(uint32_t PageAddress, uint32_t *Count)
+{
+  EE_DATA_TYPE addressvalue = (*(__IO EE_DATA_TYPE *)(PageAddress + EE_DATA_SIZE));
+
+  if ((addressvalue & ~EE_MASK_DATA) != EE_RECORD_VALUE(EE_ERASE_COUNT_VIRTADDRESS, 0))
+  {
+    return 0;
+  }
+  *Count = (uint32_t)EE_RECORD_DATA(addressvalue);
+  return 1;
+}
+
+/**
+  * @brief  Gets the number of times a page was erased. A page without erase
+  *   count, last erased by a firmware that did not keep it or by an erase a
+  *   power loss cut, is given the count of the other page: the pages are
+  *   erased in turn.
+  * @param  PageAddress: page address
+  * @retval Erase count of the page, 0 if neither page holds one
+  */
+static uint32_t EE_GetEraseCount(uint32_t PageAddress)
+{
+  uint32_t count = 0;
+
+  if (EE_ReadEraseCount(PageAddress, &count) == 0)
+  {
+    (void)EE_ReadEraseCount((PageAddress == PAGE0_BASE_ADDRESS) ? PAGE1_BASE_ADDRESS : PAGE0_BASE_ADDRESS, &count);
+  }
+
+  return count;
+}
+#endif
+
 /**
   * @brief  Gets the page of a given address
   * @param  Address: Address of the FLASH Memory
@@ -717,14 +3126,22 @@ uint16_t usWriteRes;
 
 uint16_t usEE_Read(EE_DATA_STORED_TYPE usAdd, EE_DATA_STORED_TYPE *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 4 == 0);
   usLen /= 4;
   for (uint16_t i = 0; i < usLen; i++)
   {
     usReadRes = EE_ReadVariable(usAdd + i, pusDat + i);
   }
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
+#endif
   return 0;
 }
 
@@ -732,16 +3149,54 @@ EE_DATA_STORED_TYPE Num;
 
 uint16_t usEE_Write(EE_DATA_STORED_TYPE usAdd, EE_DATA_STORED_TYPE *pusDat, uint16_t usLen)
 {
+#if (EE_USE_IT == 1)
+  uint32_t ulMaskStart;
+
+  /* Queued writes go to Flash first, with the interrupts running */
+  (void)EE_FlushIT();
+  ulMaskStart = EE_IrqMaskStart();
+#elif (EE_USE_STATS == 1)
+  uint32_t ulMaskStart = EE_IrqMaskStart();
+#else
   __disable_irq();
+#endif
   assert_param(usLen % 4 == 0);
   usLen /= 4;
   HAL_FLASH_Unlock();
-  for (uint16_t i = 0; i < usLen; i++)
+#if (EE_USE_WRITE_CACHE == 1)
+  /* Cached writes of the variables are older */
+  EE_CacheDrop(NULL, usAdd, usLen);
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* Blocks of up to EE_TXN_MAX_RECORDS variables are updated all at once */
+  usWriteRes = EE_WriteRecords(NULL, usAdd, pusDat, usLen, (usLen <= EE_TXN_MAX_RECORDS) ? 1 : 0);
+#else
+  usWriteRes = EE_WriteRecords(NULL, usAdd, pusDat, usLen, 0);
+#endif
+#if (EE_USE_TRANSACTION == 1)
+  /* A block updated all at once is never split: it fails as a whole */
+  if ((usWriteRes == EE_PAGE_FULL) && (usLen > EE_TXN_MAX_RECORDS))
+#else
+  if (usWriteRes == EE_PAGE_FULL)
+#endif
   {
-    EE_DATA_STORED_TYPE Num = *(pusDat + i);
-    usWriteRes = EE_WriteVariable(usAdd + i, Num);
+    /* More than a compacted page can take: write the variables one by one,
+       up to the first that fails */
+    for (uint16_t i = 0; i < usLen; i++)
+    {
+      EE_DATA_STORED_TYPE Num = *(pusDat + i);
+      usWriteRes = EE_WriteVariable(usAdd + i, Num);
+      if (usWriteRes != EE_OK)
+      {
+        break;
+      }
+    }
   }
   HAL_FLASH_Lock();
+#if (EE_USE_IT == 1) || (EE_USE_STATS == 1)
+  EE_IrqMaskEnd(ulMaskStart);
+#else
   __enable_irq();
-  return 0;
+#endif
+  return usWriteRes;
 }
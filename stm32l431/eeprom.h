@@ -75,6 +75,9 @@ typedef enum
   EE_PAGE_NOTERASED,
   EE_PAGE_ERASED,
   EE_PAGE_FULL,
+
+  /* Appended so that the codes above keep their values */
+  EE_BUSY,
 } EE_Status;
 
 #define EE_DATA_STORED_TYPE uint32_t
@@ -82,12 +85,206 @@ typedef enum
 /* Variables' number */
 #define NB_OF_VAR ((uint16_t)500)
 
+/* Keep the address of the first free slot of the write page in RAM so that a
+   write does not scan the page from its beginning */
+#define EE_USE_WRITE_CURSOR 1
+
+/* Keep the pages found from the page headers in RAM so that a read or a write
+   does not load the headers again, they are read again once one changed */
+#define EE_USE_PAGE_CACHE 1
+
+/* Keep a bitmap of the variables the valid page holds a record of in RAM so
+   that reading a variable that was never written does not scan the page */
+#define EE_USE_PRESENCE_BITMAP 1
+
+/* Let a page transfer copy the variables in the order of their virtual
+   addresses and close them with a record giving their number: a read scans
+   the records written since the transfer, then searches the sorted ones by
+   bisection instead of scanning the rest of the page */
+#define EE_USE_SORTED_PAGE 1
+
+/* Virtual address reserved for the record closing the sorted variables */
+#define EE_SORTED_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFF9)
+
+/* Frame the records of usEE_Write and EE_WriteTransaction with a begin and a
+   commit marker: records of a transaction cut by a power loss are ignored */
+#define EE_USE_TRANSACTION 1
+
+/* Largest number of variables written by one transaction */
+#define EE_TXN_MAX_RECORDS ((uint16_t)64)
+
+/* Virtual addresses reserved for the transaction markers */
+#define EE_TXN_BEGIN_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFD)
+#define EE_TXN_COMMIT_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFE)
+
+/* Let EE_WriteVariableIT queue writes that are programmed from the Flash
+   interrupt: FLASH_IRQHandler has to call EE_IRQHandler, and the HAL Flash
+   end of operation and error callbacks are taken by the EEPROM emulation */
+#define EE_USE_IT 0
+
+/* Number of writes EE_WriteVariableIT can queue */
+#define EE_IT_QUEUE_SIZE ((uint16_t)16)
+
+/* Count the Flash words scanned, the records programmed, the erases and the
+   page transfers, and time the reads, programs, transfers and erases in core
+   clock cycles (DWT cycle counter, SysTick on Cortex-M0+): see EE_GetStats */
+#define EE_USE_STATS 0
+
+/* Timing histograms: bucket n counts the calls that took less than
+   EE_STATS_BUCKET_CYCLES << n cycles, the last bucket the longer ones */
+#define EE_STATS_NB_BUCKETS 12
+#define EE_STATS_BUCKET_CYCLES ((uint32_t)256)
+
+/* Keep in each page the number of times it was erased, in a record programmed
+   right after the erase, and project the remaining life of the pages from the
+   measured write rate: see EE_GetWear */
+#define EE_USE_ERASE_COUNT 1
+
+/* Program/erase cycles a page is specified for */
+#define EE_PAGE_ENDURANCE ((uint32_t)10000)
+
+/* Virtual address reserved for the erase count record */
+#define EE_ERASE_COUNT_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFC)
+
+/* Let EE_WriteVariableCached keep the writes of often updated variables in a
+   RAM cache, where a new write of a cached variable replaces the previous
+   one: the cache is written to Flash by EE_Flush, by EE_ProcessCache once its
+   oldest write is EE_CACHE_FLUSH_PERIOD old, and when it is full */
+#define EE_USE_WRITE_CACHE 0
+
+/* Number of variables the write cache holds */
+#define EE_CACHE_SIZE ((uint16_t)8)
+
+/* Longest time EE_ProcessCache keeps a write in the cache, in HAL ticks (ms) */
+#define EE_CACHE_FLUSH_PERIOD ((uint32_t)1000)
+
+/* Compare each write with the value the variable already has in Flash and
+   skip the records that would not change it. The value is looked up by a
+   scan of the page back from its last record, for each written variable */
+#define EE_USE_SKIP_UNCHANGED 0
+
+/* Let EE_WriteBlob and EE_ReadBlob keep blobs (strings, structures, arrays)
+   of up to EE_BLOB_MAX_SIZE bytes under one virtual address each. The bytes
+   go in consecutive records closed by a CRC record and a header record: a
+   blob cut by a power loss fails its CRC and its previous copy is read, and
+   a page transfer copies the last complete copy of each blob as a unit. A
+   page has to hold NB_OF_BLOB blobs of EE_BLOB_MAX_SIZE bytes on top of the
+   variables */
+#define EE_USE_BLOB 0
+
+/* Number of blobs */
+#define NB_OF_BLOB ((uint16_t)4)
+
+/* Largest size of a blob, in bytes */
+#define EE_BLOB_MAX_SIZE ((uint16_t)256)
+
+/* Virtual addresses reserved for the blobs: the header record of blob n is at
+   EE_BLOB_VIRTADDRESS + n, above NB_OF_VAR */
+#define EE_BLOB_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFE0)
+#define EE_BLOB_DATA_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFB)
+#define EE_BLOB_CRC_VIRTADDRESS ((EE_VIRTUALADDRESS_TYPE)0xFFFA)
+
+/* Byte Idx of a blob read in place through the pointer EE_GetBlob gives: a
+   record holds four bytes in the high word of its double word */
+#define EE_BLOB_BYTE(Data, Idx) ((Data)[(((Idx) / 4) * 8) + ((Idx) % 4)])
+
+/* Protect the record of each variable with a CRC-16 held in the low 16 bits
+   of its double word, which are 0 otherwise: a record damaged by a power loss
+   fails its CRC, reads skip it and return the previous value of the variable,
+   and EE_Scrub drops it with a page transfer. Pages written without the CRC
+   have to be formatted when it is turned on */
+#define EE_USE_CRC 0
+
+/* Compute the record CRC with the CRC unit rather than in software. The unit
+   is set up for each record with the interrupts masked, so it can be shared */
+#define EE_USE_HW_CRC 0
+
 /* Exported types ------------------------------------------------------------*/
+#if (EE_USE_STATS == 1)
+/* Timing of one kind of operation, in core clock cycles */
+typedef struct
+{
+  uint32_t Count;                          /* Operations timed */
+  uint32_t Min;                            /* Shortest one */
+  uint32_t Max;                            /* Longest one */
+  uint32_t Histogram[EE_STATS_NB_BUCKETS]; /* Operations per duration range */
+} EE_TimingTypeDef;
+
+/* Statistics gathered by the EEPROM emulation */
+typedef struct
+{
+  uint32_t WordsScanned;      /* Flash words read to find a variable or a free slot */
+  uint32_t Programs;          /* Records programmed, page headers excluded */
+  uint32_t Erases;            /* Pages erased */
+  uint32_t Transfers;         /* Page transfers done */
+  uint32_t Formats;           /* Formats of the EEPROM */
+  uint32_t Skipped;           /* Records not programmed, the variable already had the value */
+  uint32_t CrcErrors;         /* Records found failing their CRC */
+  EE_TimingTypeDef Read;      /* EE_ReadVariable */
+  EE_TimingTypeDef Program;   /* Record programs done */
+  EE_TimingTypeDef Transfer;  /* Page transfers done */
+  EE_TimingTypeDef Erase;     /* Page erases done */
+  EE_TimingTypeDef IrqMasked; /* usEE_Read and usEE_Write with the interrupts masked */
+} EE_StatsTypeDef;
+#endif
+
+#if (EE_USE_ERASE_COUNT == 1)
+/* Wear of the pages and projection of their remaining life: the measure of
+   the write rate starts at EE_Init or EE_ResetWear */
+typedef struct
+{
+  uint32_t EraseCount[2];    /* Erases of Page0 and Page1 */
+  uint32_t MaxEraseCount;    /* Erases of the most worn page */
+  uint32_t RemainingErases;  /* Erases left to the most worn page up to EE_PAGE_ENDURANCE */
+  uint32_t Records;          /* Records programmed during the measure, page transfer copies included */
+  uint32_t Erases;           /* Pages erased during the measure */
+  uint32_t Elapsed;          /* Duration of the measure, in HAL ticks (ms) */
+  uint32_t RecordsPerHour;   /* Write rate */
+  uint32_t RemainingRecords; /* Records left to write at the measured records per erase, 0xFFFFFFFF until a page is erased */
+  uint32_t RemainingHours;   /* Life left at the measured write rate, 0xFFFFFFFF until a page is erased */
+} EE_WearTypeDef;
+#endif
+
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 EE_Status EE_Init(void);
 EE_Status EE_ReadVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE *Data);
+EE_Status EE_ReadAll(EE_DATA_STORED_TYPE *Image, uint8_t *PresentBitmap);
 EE_Status EE_WriteVariable(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+EE_Status EE_WriteBatch(const EE_VIRTUALADDRESS_TYPE *VirtAddress, const EE_DATA_STORED_TYPE *Data, uint16_t NbVar);
+#if (EE_USE_TRANSACTION == 1)
+EE_Status EE_WriteTransaction(const EE_VIRTUALADDRESS_TYPE *VirtAddress, const EE_DATA_STORED_TYPE *Data, uint16_t NbVar);
+#endif
+#if (EE_USE_IT == 1)
+EE_Status EE_WriteVariableIT(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+EE_Status EE_ProcessIT(void);
+EE_Status EE_FlushIT(void);
+void EE_IRQHandler(void);
+void EE_WriteCpltCallback(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_Status Status);
+void EE_GetIrqMaskedTime(uint32_t *Last, uint32_t *Max);
+#endif
+#if (EE_USE_STATS == 1)
+void EE_GetStats(EE_StatsTypeDef *Stats);
+void EE_ResetStats(void);
+#endif
+#if (EE_USE_ERASE_COUNT == 1)
+void EE_GetWear(EE_WearTypeDef *Wear);
+void EE_ResetWear(void);
+#endif
+#if (EE_USE_WRITE_CACHE == 1)
+EE_Status EE_WriteVariableCached(EE_VIRTUALADDRESS_TYPE VirtAddress, EE_DATA_STORED_TYPE Data);
+EE_Status EE_Flush(void);
+EE_Status EE_ProcessCache(void);
+#endif
+#if (EE_USE_BLOB == 1)
+EE_Status EE_WriteBlob(uint16_t Blob, const uint8_t *Data, uint16_t Size);
+EE_Status EE_ReadBlob(uint16_t Blob, uint8_t *Data, uint16_t MaxSize, uint16_t *Size);
+EE_Status EE_GetBlob(uint16_t Blob, const uint8_t **Data, uint16_t *Size, uint32_t *Generation);
+uint32_t EE_GetGeneration(void);
+#endif
+#if (EE_USE_CRC == 1)
+EE_Status EE_Scrub(void);
+#endif
 
 extern uint16_t usEE_Read(EE_DATA_STORED_TYPE usAdd, EE_DATA_STORED_TYPE *pusDat, uint16_t usLen);
 extern uint16_t usEE_Write(EE_DATA_STORED_TYPE usAdd, EE_DATA_STORED_TYPE *pusDat, uint16_t usLen);